@@ -0,0 +1,762 @@
+/* 2A03 APU */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "apu.h"
+#include "blip.h"
+#include "cpu.h"
+#include "emu.h"
+#include "state.h"
+
+/* CPU cycles per second, NTSC */
+#define APU_CLOCK_RATE (21477272.0 / MASTER_CPU_DIVIDER)
+
+/* Output of the mixer at full scale */
+#define APU_VOLUME 30000.0f
+
+/* Frame counter steps */
+#define APU_QUARTER 0x01
+#define APU_HALF    0x02
+#define APU_IRQ     0x04
+
+/* Bits of $4015 */
+#define APU_PULSE1   0x01
+#define APU_PULSE2   0x02
+#define APU_TRIANGLE 0x04
+#define APU_NOISE    0x08
+#define APU_DMC      0x10
+
+/* A timer that is not scheduled */
+#define APU_NEVER UINT64_MAX
+
+/* CPU cycles the DMC steals for a sample fetch */
+#define APU_DMC_STALL 4
+
+typedef struct {
+  bool start;
+  /* Also halts the length counter */
+  bool loop;
+  bool constant;
+  uint8_t volume;
+  uint8_t divider;
+  uint8_t decay;
+} apu_envelope_t;
+
+typedef struct {
+  apu_envelope_t envelope;
+  uint8_t length;
+  uint8_t duty;
+  uint8_t step;
+  uint16_t period;
+  bool sweep_enabled;
+  bool sweep_negate;
+  bool sweep_reload;
+  uint8_t sweep_period;
+  uint8_t sweep_shift;
+  uint8_t sweep_divider;
+  /* CPU cycle of the next timer clock */
+  uint64_t next;
+} apu_pulse_t;
+
+typedef struct {
+  uint8_t length;
+  /* Halts the length counter and keeps the linear counter reloading */
+  bool control;
+  bool linear_reload;
+  uint8_t linear_period;
+  uint8_t linear;
+  uint8_t step;
+  uint16_t period;
+  uint64_t next;
+} apu_triangle_t;
+
+typedef struct {
+  apu_envelope_t envelope;
+  uint8_t length;
+  bool mode;
+  uint16_t period;
+  uint16_t shift;
+  uint64_t next;
+} apu_noise_t;
+
+typedef struct {
+  bool irq_enabled;
+  bool loop;
+  bool irq;
+  uint16_t rate;
+  uint8_t level;
+  /* Sample as written to $4012 and $4013, and the reader's progress */
+  uint16_t sample_addr;
+  uint16_t sample_length;
+  uint16_t addr;
+  uint16_t bytes;
+  /* Sample buffer and output shift register */
+  uint8_t buffer;
+  bool buffer_full;
+  uint8_t shift;
+  uint8_t bits;
+  bool silence;
+  uint64_t next;
+} apu_dmc_t;
+
+typedef struct {
+  bool five_step;
+  bool irq_inhibit;
+  bool irq;
+  uint8_t step;
+  /* CPU cycle the sequence started at and of its next step */
+  uint64_t start;
+  uint64_t next;
+} apu_frame_t;
+
+struct apu_t {
+  emu_t *emu;
+  /* CPU cycle the APU has been run up to */
+  uint64_t cycles;
+  uint8_t enabled;
+  apu_pulse_t pulse[2];
+  apu_triangle_t triangle;
+  apu_noise_t noise;
+  apu_dmc_t dmc;
+  apu_frame_t frame;
+
+  /* Synthesis, NULL until a sample rate is set. The mixer output last
+   * added to the buffer, and the cycle the audio frame started at. */
+  blip_t *blip;
+  /* Synthesis is held while set, for frames that are thrown away */
+  bool quiet;
+  float amplitude;
+  uint64_t frame_cycles;
+  float pulse_table[31];
+  float tnd_table[203];
+};
+
+static const uint8_t apu_length_table[32] = {
+  10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
+  12, 16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30,
+};
+
+static const uint8_t apu_duty_table[4][8] = {
+  { 0, 1, 0, 0, 0, 0, 0, 0 },
+  { 0, 1, 1, 0, 0, 0, 0, 0 },
+  { 0, 1, 1, 1, 1, 0, 0, 0 },
+  { 1, 0, 0, 1, 1, 1, 1, 1 },
+};
+
+static const uint8_t apu_triangle_table[32] = {
+  15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+  0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+};
+
+/* Periods in CPU cycles, NTSC */
+static const uint16_t apu_noise_table[16] = {
+  4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068,
+};
+
+static const uint16_t apu_dmc_table[16] = {
+  428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54,
+};
+
+/* Steps of the frame counter in CPU cycles from the start of the
+ * sequence, four and five step mode */
+static const struct {
+  uint16_t cycle;
+  uint8_t clocks;
+} apu_frame_steps[2][4] = {
+  { { 7457, APU_QUARTER }, { 14913, APU_QUARTER | APU_HALF },
+    { 22371, APU_QUARTER }, { 29829, APU_QUARTER | APU_HALF | APU_IRQ } },
+  { { 7457, APU_QUARTER }, { 14913, APU_QUARTER | APU_HALF },
+    { 22371, APU_QUARTER }, { 37281, APU_QUARTER | APU_HALF } },
+};
+static const uint16_t apu_frame_periods[2] = { 29830, 37282 };
+
+apu_t*
+apu_create(emu_t *emu)
+{
+  apu_t *apu = (apu_t*)calloc(sizeof(apu_t), 1);
+
+  apu->emu = emu;
+  /* The non-linear DAC of the 2A03 */
+  for (int i = 1; i < 31; i++)
+    apu->pulse_table[i] = 95.52f / (8128.0f / i + 100);
+  for (int i = 1; i < 203; i++)
+    apu->tnd_table[i] = 163.67f / (24329.0f / i + 100);
+  apu_reset(apu, 0);
+  return apu;
+}
+
+void
+apu_destroy(apu_t *apu)
+{
+  if (apu->blip)
+    blip_destroy(apu->blip);
+  free(apu);
+}
+
+static void
+apu_update_irq(apu_t *apu)
+{
+  cpu_t *cpu = apu->emu->cpu;
+
+  cpu->irq = (cpu->irq & ~(CPU_IRQ_FRAME | CPU_IRQ_DMC)) |
+    (apu->frame.irq ? CPU_IRQ_FRAME : 0) | (apu->dmc.irq ? CPU_IRQ_DMC : 0);
+}
+
+static bool
+apu_synth(const apu_t *apu)
+{
+  return apu->blip != NULL && !apu->quiet;
+}
+
+/* Timers of the tone channels only run while synthesizing, ones left
+ * behind restart from now */
+static void
+apu_sync_timer(uint64_t *next, uint64_t now)
+{
+  if (*next < now)
+    *next = now;
+}
+
+static void
+apu_sync_timers(apu_t *apu)
+{
+  apu_sync_timer(&apu->pulse[0].next, apu->cycles);
+  apu_sync_timer(&apu->pulse[1].next, apu->cycles);
+  apu_sync_timer(&apu->triangle.next, apu->cycles);
+  apu_sync_timer(&apu->noise.next, apu->cycles);
+}
+
+static void
+apu_frame_restart(apu_t *apu, uint64_t start)
+{
+  apu->frame.start = start;
+  apu->frame.step = 0;
+  apu->frame.next = start + apu_frame_steps[apu->frame.five_step][0].cycle;
+}
+
+void
+apu_reset(apu_t   *apu,
+          uint64_t cycles)
+{
+  apu->cycles = cycles;
+  apu->enabled = 0;
+  memset(apu->pulse, 0, sizeof(apu->pulse));
+  memset(&apu->triangle, 0, sizeof(apu->triangle));
+  memset(&apu->noise, 0, sizeof(apu->noise));
+  memset(&apu->dmc, 0, sizeof(apu->dmc));
+  memset(&apu->frame, 0, sizeof(apu->frame));
+  apu->noise.shift = 1;
+  apu->noise.period = apu_noise_table[0];
+  apu->dmc.rate = apu_dmc_table[0];
+  apu->dmc.bits = 8;
+  apu->dmc.silence = true;
+  apu->dmc.next = cycles + apu->dmc.rate;
+  apu_frame_restart(apu, cycles);
+  apu_sync_timers(apu);
+  apu->frame_cycles = cycles;
+  if (apu->blip)
+    blip_clear(apu->blip);
+  apu_update_irq(apu);
+}
+
+/* Frame counter clocks */
+
+static void
+apu_envelope_clock(apu_envelope_t *e)
+{
+  if (e->start) {
+    e->start = false;
+    e->decay = 15;
+    e->divider = e->volume;
+  } else if (e->divider == 0) {
+    e->divider = e->volume;
+    if (e->decay > 0)
+      e->decay--;
+    else if (e->loop)
+      e->decay = 15;
+  } else {
+    e->divider--;
+  }
+}
+
+static uint8_t
+apu_envelope_volume(const apu_envelope_t *e)
+{
+  return e->constant ? e->volume : e->decay;
+}
+
+/* Period the sweep unit moves to, pulse 1 negates in ones' complement */
+static int
+apu_sweep_target(const apu_pulse_t *p, int channel)
+{
+  int change = p->period >> p->sweep_shift;
+
+  if (p->sweep_negate)
+    return p->period - change - (channel == 0 ? 1 : 0);
+  return p->period + change;
+}
+
+static bool
+apu_pulse_muted(const apu_pulse_t *p, int channel)
+{
+  return p->period < 8 || apu_sweep_target(p, channel) > 0x7ff;
+}
+
+static void
+apu_sweep_clock(apu_pulse_t *p, int channel)
+{
+  if (p->sweep_divider == 0 && p->sweep_enabled && p->sweep_shift > 0 &&
+      !apu_pulse_muted(p, channel))
+    p->period = apu_sweep_target(p, channel);
+  if (p->sweep_divider == 0 || p->sweep_reload) {
+    p->sweep_divider = p->sweep_period;
+    p->sweep_reload = false;
+  } else {
+    p->sweep_divider--;
+  }
+}
+
+static void
+apu_quarter_frame(apu_t *apu)
+{
+  apu_triangle_t *t = &apu->triangle;
+
+  apu_envelope_clock(&apu->pulse[0].envelope);
+  apu_envelope_clock(&apu->pulse[1].envelope);
+  apu_envelope_clock(&apu->noise.envelope);
+  if (t->linear_reload)
+    t->linear = t->linear_period;
+  else if (t->linear > 0)
+    t->linear--;
+  if (!t->control)
+    t->linear_reload = false;
+}
+
+static void
+apu_half_frame(apu_t *apu)
+{
+  for (int i = 0; i < 2; i++) {
+    apu_pulse_t *p = &apu->pulse[i];
+    if (!p->envelope.loop && p->length > 0)
+      p->length--;
+    apu_sweep_clock(p, i);
+  }
+  if (!apu->triangle.control && apu->triangle.length > 0)
+    apu->triangle.length--;
+  if (!apu->noise.envelope.loop && apu->noise.length > 0)
+    apu->noise.length--;
+}
+
+static void
+apu_frame_step(apu_t *apu)
+{
+  apu_frame_t *f = &apu->frame;
+  uint8_t clocks = apu_frame_steps[f->five_step][f->step].clocks;
+
+  if (clocks & APU_QUARTER)
+    apu_quarter_frame(apu);
+  if (clocks & APU_HALF)
+    apu_half_frame(apu);
+  if ((clocks & APU_IRQ) && !f->irq_inhibit) {
+    f->irq = true;
+    apu_update_irq(apu);
+  }
+  if (++f->step == 4)
+    apu_frame_restart(apu, f->start + apu_frame_periods[f->five_step]);
+  else
+    f->next = f->start + apu_frame_steps[f->five_step][f->step].cycle;
+}
+
+/* DMC */
+
+static void
+apu_dmc_restart(apu_dmc_t *d)
+{
+  d->addr = d->sample_addr;
+  d->bytes = d->sample_length;
+}
+
+/* Fills the sample buffer from memory, the CPU is stalled meanwhile */
+static void
+apu_dmc_fetch(apu_t *apu)
+{
+  apu_dmc_t *d = &apu->dmc;
+  cpu_t *cpu = apu->emu->cpu;
+
+  if (d->buffer_full || d->bytes == 0)
+    return;
+  d->buffer = cpu_read(cpu, d->addr);
+  d->buffer_full = true;
+  cpu->cycles += APU_DMC_STALL;
+  d->addr = d->addr == 0xffff ? 0x8000 : d->addr + 1;
+  if (--d->bytes == 0) {
+    if (d->loop) {
+      apu_dmc_restart(d);
+    } else if (d->irq_enabled) {
+      d->irq = true;
+      apu_update_irq(apu);
+    }
+  }
+}
+
+static void
+apu_dmc_clock(apu_t *apu)
+{
+  apu_dmc_t *d = &apu->dmc;
+
+  d->next += d->rate;
+  if (!d->silence) {
+    if (d->shift & 1) {
+      if (d->level <= 125)
+        d->level += 2;
+    } else if (d->level >= 2) {
+      d->level -= 2;
+    }
+  }
+  d->shift >>= 1;
+  if (--d->bits == 0) {
+    d->bits = 8;
+    d->silence = !d->buffer_full;
+    if (d->buffer_full) {
+      d->shift = d->buffer;
+      d->buffer_full = false;
+      apu_dmc_fetch(apu);
+    }
+  }
+}
+
+/* Tone channel timers */
+
+static void
+apu_pulse_clock(apu_pulse_t *p)
+{
+  p->next += (p->period + 1) * 2;
+  p->step = (p->step + 1) & 7;
+}
+
+static void
+apu_triangle_clock(apu_triangle_t *t)
+{
+  t->next += t->period + 1;
+  t->step = (t->step + 1) & 31;
+}
+
+static void
+apu_noise_clock(apu_noise_t *n)
+{
+  uint16_t feedback = (n->shift ^ (n->shift >> (n->mode ? 6 : 1))) & 1;
+
+  n->next += n->period;
+  n->shift = (n->shift >> 1) | (feedback << 14);
+}
+
+/* Adds the change of the mixer output at the current cycle */
+static void
+apu_mix(apu_t *apu)
+{
+  int pulse = 0, tnd;
+  float amplitude;
+
+  for (int i = 0; i < 2; i++) {
+    const apu_pulse_t *p = &apu->pulse[i];
+    if (p->length > 0 && !apu_pulse_muted(p, i) &&
+        apu_duty_table[p->duty][p->step])
+      pulse += apu_envelope_volume(&p->envelope);
+  }
+  tnd = 3 * apu_triangle_table[apu->triangle.step] + apu->dmc.level;
+  if (apu->noise.length > 0 && !(apu->noise.shift & 1))
+    tnd += 2 * apu_envelope_volume(&apu->noise.envelope);
+
+  amplitude = (apu->pulse_table[pulse] + apu->tnd_table[tnd]) * APU_VOLUME;
+  if (amplitude != apu->amplitude) {
+    blip_add_delta(apu->blip, apu->cycles - apu->frame_cycles,
+                   amplitude - apu->amplitude);
+    apu->amplitude = amplitude;
+  }
+}
+
+/* Stops the timer of a channel that cannot be heard, its output does
+ * not change then, and restarts it at now once it can */
+static void
+apu_timer_gate(uint64_t *next, bool active, uint64_t now)
+{
+  if (!active)
+    *next = APU_NEVER;
+  else if (*next == APU_NEVER)
+    *next = now;
+}
+
+void
+apu_catch_up(apu_t   *apu,
+             uint64_t cycles)
+{
+  bool synth = apu_synth(apu);
+
+  while (apu->cycles < cycles) {
+    uint64_t next = cycles;
+
+    if (synth) {
+      const apu_triangle_t *t = &apu->triangle;
+      apu_timer_gate(&apu->pulse[0].next, apu->pulse[0].length > 0 &&
+                     !apu_pulse_muted(&apu->pulse[0], 0), apu->cycles);
+      apu_timer_gate(&apu->pulse[1].next, apu->pulse[1].length > 0 &&
+                     !apu_pulse_muted(&apu->pulse[1], 1), apu->cycles);
+      apu_timer_gate(&apu->triangle.next, t->length > 0 && t->linear > 0 &&
+                     t->period >= 2, apu->cycles);
+      apu_timer_gate(&apu->noise.next, apu->noise.length > 0, apu->cycles);
+    }
+    if (apu->frame.next < next)
+      next = apu->frame.next;
+    if (apu->dmc.next < next)
+      next = apu->dmc.next;
+    if (synth) {
+      if (apu->pulse[0].next < next)
+        next = apu->pulse[0].next;
+      if (apu->pulse[1].next < next)
+        next = apu->pulse[1].next;
+      if (apu->triangle.next < next)
+        next = apu->triangle.next;
+      if (apu->noise.next < next)
+        next = apu->noise.next;
+    }
+    apu->cycles = next;
+
+    if (apu->frame.next == next)
+      apu_frame_step(apu);
+    if (apu->dmc.next == next)
+      apu_dmc_clock(apu);
+    if (synth) {
+      if (apu->pulse[0].next == next)
+        apu_pulse_clock(&apu->pulse[0]);
+      if (apu->pulse[1].next == next)
+        apu_pulse_clock(&apu->pulse[1]);
+      if (apu->triangle.next == next)
+        apu_triangle_clock(&apu->triangle);
+      if (apu->noise.next == next)
+        apu_noise_clock(&apu->noise);
+      apu_mix(apu);
+    }
+  }
+}
+
+uint64_t
+apu_next_event(apu_t *apu)
+{
+  const apu_dmc_t *d = &apu->dmc;
+  uint64_t next = APU_NEVER;
+
+  if (!apu->frame.five_step && !apu->frame.irq_inhibit && !apu->frame.irq)
+    next = apu->frame.start + apu_frame_steps[0][3].cycle;
+  /* The buffer is refilled as the shift register takes it */
+  if (d->bytes > 0) {
+    uint64_t fetch = d->next + (uint64_t)(d->bits - 1) * d->rate;
+    if (fetch < next)
+      next = fetch;
+  }
+  return next == APU_NEVER ? APU_NEVER : next * MASTER_CPU_DIVIDER;
+}
+
+uint8_t
+apu_read(apu_t   *apu,
+         uint16_t addr)
+{
+  uint8_t value = 0;
+
+  if (addr != 0x4015)
+    return 0;
+  value |= apu->pulse[0].length > 0 ? APU_PULSE1 : 0;
+  value |= apu->pulse[1].length > 0 ? APU_PULSE2 : 0;
+  value |= apu->triangle.length > 0 ? APU_TRIANGLE : 0;
+  value |= apu->noise.length > 0 ? APU_NOISE : 0;
+  value |= apu->dmc.bytes > 0 ? APU_DMC : 0;
+  value |= apu->frame.irq ? 0x40 : 0;
+  value |= apu->dmc.irq ? 0x80 : 0;
+  apu->frame.irq = false;
+  apu_update_irq(apu);
+  return value;
+}
+
+static void
+apu_write_envelope(apu_envelope_t *e, uint8_t value)
+{
+  e->loop = value & 0x20;
+  e->constant = value & 0x10;
+  e->volume = value & 0x0f;
+}
+
+static void
+apu_write_pulse(apu_t *apu, int channel, uint8_t reg, uint8_t value)
+{
+  apu_pulse_t *p = &apu->pulse[channel];
+
+  switch (reg) {
+  case 0:
+    p->duty = value >> 6;
+    apu_write_envelope(&p->envelope, value);
+    break;
+  case 1:
+    p->sweep_enabled = value & 0x80;
+    p->sweep_period = (value >> 4) & 7;
+    p->sweep_negate = value & 0x08;
+    p->sweep_shift = value & 7;
+    p->sweep_reload = true;
+    break;
+  case 2:
+    p->period = (p->period & 0x700) | value;
+    break;
+  case 3:
+    p->period = (p->period & 0xff) | (value & 7) << 8;
+    if (apu->enabled & (APU_PULSE1 << channel))
+      p->length = apu_length_table[value >> 3];
+    p->step = 0;
+    p->envelope.start = true;
+    break;
+  }
+}
+
+void
+apu_write(apu_t   *apu,
+          uint16_t addr,
+          uint8_t  value)
+{
+  apu_triangle_t *t = &apu->triangle;
+  apu_noise_t *n = &apu->noise;
+  apu_dmc_t *d = &apu->dmc;
+
+  switch (addr) {
+  case 0x4000: case 0x4001: case 0x4002: case 0x4003:
+  case 0x4004: case 0x4005: case 0x4006: case 0x4007:
+    apu_write_pulse(apu, (addr >> 2) & 1, addr & 3, value);
+    break;
+  case 0x4008:
+    t->control = value & 0x80;
+    t->linear_period = value & 0x7f;
+    break;
+  case 0x400a:
+    t->period = (t->period & 0x700) | value;
+    break;
+  case 0x400b:
+    t->period = (t->period & 0xff) | (value & 7) << 8;
+    if (apu->enabled & APU_TRIANGLE)
+      t->length = apu_length_table[value >> 3];
+    t->linear_reload = true;
+    break;
+  case 0x400c:
+    apu_write_envelope(&n->envelope, value);
+    break;
+  case 0x400e:
+    n->mode = value & 0x80;
+    n->period = apu_noise_table[value & 0x0f];
+    break;
+  case 0x400f:
+    if (apu->enabled & APU_NOISE)
+      n->length = apu_length_table[value >> 3];
+    n->envelope.start = true;
+    break;
+  case 0x4010:
+    d->irq_enabled = value & 0x80;
+    d->loop = value & 0x40;
+    d->rate = apu_dmc_table[value & 0x0f];
+    if (!d->irq_enabled)
+      d->irq = false;
+    break;
+  case 0x4011:
+    d->level = value & 0x7f;
+    break;
+  case 0x4012:
+    d->sample_addr = 0xc000 | value << 6;
+    break;
+  case 0x4013:
+    d->sample_length = (value << 4) + 1;
+    break;
+  case 0x4015:
+    apu->enabled = value & 0x1f;
+    if (!(value & APU_PULSE1))
+      apu->pulse[0].length = 0;
+    if (!(value & APU_PULSE2))
+      apu->pulse[1].length = 0;
+    if (!(value & APU_TRIANGLE))
+      t->length = 0;
+    if (!(value & APU_NOISE))
+      n->length = 0;
+    d->irq = false;
+    if (!(value & APU_DMC)) {
+      d->bytes = 0;
+    } else if (d->bytes == 0) {
+      apu_dmc_restart(d);
+      apu_dmc_fetch(apu);
+    }
+    break;
+  case 0x4017:
+    apu->frame.five_step = value & 0x80;
+    apu->frame.irq_inhibit = value & 0x40;
+    if (apu->frame.irq_inhibit)
+      apu->frame.irq = false;
+    /* The sequence restarts a few cycles later, five step mode clocks
+     * everything right away */
+    apu_frame_restart(apu, apu->cycles + 3);
+    if (apu->frame.five_step) {
+      apu_quarter_frame(apu);
+      apu_half_frame(apu);
+    }
+    break;
+  }
+  apu_update_irq(apu);
+  if (apu_synth(apu))
+    apu_mix(apu);
+}
+
+void
+apu_set_rate(apu_t *apu,
+             double sample_rate)
+{
+  if (apu->blip == NULL) {
+    apu->blip = blip_create(APU_MAX_SAMPLES);
+    apu->frame_cycles = apu->cycles;
+    apu_sync_timers(apu);
+  }
+  blip_set_rates(apu->blip, APU_CLOCK_RATE, sample_rate);
+}
+
+void
+apu_set_quiet(apu_t *apu,
+              bool   quiet)
+{
+  apu->quiet = quiet;
+  if (apu_synth(apu))
+    apu_sync_timers(apu);
+}
+
+size_t
+apu_end_frame(apu_t   *apu,
+              int16_t *out,
+              size_t   size)
+{
+  if (apu->blip == NULL)
+    return 0;
+  blip_end_frame(apu->blip, apu->cycles - apu->frame_cycles);
+  apu->frame_cycles = apu->cycles;
+  return blip_read_samples(apu->blip, out, size);
+}
+
+void
+apu_state(apu_t   *apu,
+          state_t *s)
+{
+  STATE_FIELD(s, apu->cycles);
+  STATE_FIELD(s, apu->enabled);
+  STATE_FIELD(s, apu->pulse);
+  STATE_FIELD(s, apu->triangle);
+  STATE_FIELD(s, apu->noise);
+  STATE_FIELD(s, apu->dmc);
+  STATE_FIELD(s, apu->frame);
+  if (s->loading) {
+    /* The audio frame restarts at the loaded time */
+    apu->frame_cycles = apu->cycles;
+    if (apu_synth(apu)) {
+      blip_clear(apu->blip);
+      apu_sync_timers(apu);
+    }
+  }
+}
@@ -0,0 +1,53 @@
+#ifndef __APU_H__
+#define __APU_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+
+/* The 2A03 APU: two pulse channels, triangle, noise, DMC and the frame
+ * counter. Like the PPU it is run in bursts when its registers are
+ * accessed and at its next event, the frame IRQ or a DMC fetch.
+ *
+ * Sound is only synthesized once a sample rate is set. Channel timers
+ * then run from one output change to the next and every change goes
+ * into a band-limited step buffer, otherwise only what the CPU can see
+ * is emulated: length counters, IRQs and DMC fetches. */
+
+/* Most samples apu_end_frame() returns */
+#define APU_MAX_SAMPLES 4096
+
+apu_t* apu_create(emu_t *emu);
+void apu_destroy(apu_t *apu);
+/* Power on state, at CPU cycle cycles */
+void apu_reset(apu_t   *apu,
+	       uint64_t cycles);
+void apu_catch_up(apu_t   *apu,
+		  uint64_t cycles);
+/* Master clock time of the next event, UINT64_MAX if none */
+uint64_t apu_next_event(apu_t *apu);
+/* $4015 */
+uint8_t apu_read(apu_t   *apu,
+		 uint16_t addr);
+/* $4000-$4013, $4015 and $4017 */
+void apu_write(apu_t   *apu,
+	       uint16_t addr,
+	       uint8_t  value);
+/* Starts synthesis at sample_rate, also used for rate control */
+void apu_set_rate(apu_t *apu,
+		  double sample_rate);
+/* Holds synthesis while quiet, frames run then are not heard. Loading a
+ * state taken before keeps the sound exactly as it was, for frames that
+ * are run and thrown away again. */
+void apu_set_quiet(apu_t *apu,
+		   bool   quiet);
+/* Ends the audio frame at the time caught up to and returns its
+ * samples, none until a rate is set */
+size_t apu_end_frame(apu_t   *apu,
+		     int16_t *out,
+		     size_t   size);
+void apu_state(apu_t   *apu,
+	       state_t *s);
+
+#endif /* __APU_H__ */
@@ -0,0 +1,92 @@
+/* Audio output, dispatches to the selected backend */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "audio.h"
+
+/* Largest deviation from the device rate of the rate control */
+#define AUDIO_MAX_SKEW 0.005
+
+/* The first one is the default */
+static const audio_backend_t *backends[] = {
+#ifdef HAVE_SDL
+  &audio_sdl_backend,
+#endif
+  &audio_null_backend,
+  NULL,
+};
+
+audio_t*
+audio_create(const char *name)
+{
+    const audio_backend_t *backend = NULL;
+    audio_t *audio;
+
+    for (int i = 0; backends[i] != NULL; i++) {
+      if (name == NULL || strcmp(backends[i]->name, name) == 0) {
+        backend = backends[i];
+        break;
+      }
+    }
+    if (backend == NULL) {
+      printf("Unknown audio backend: %s\n", name);
+      return NULL;
+    }
+
+    audio = (audio_t*)calloc(sizeof(audio_t), 1);
+    audio->backend = backend;
+    if (backend->init(audio))
+      return audio;
+
+    /* Without a sound device the emulator still runs, silently */
+    if (backend != &audio_null_backend) {
+      printf("No sound, falling back to the null audio backend\n");
+      memset(audio, 0, sizeof(audio_t));
+      audio->backend = &audio_null_backend;
+      if (audio->backend->init(audio))
+        return audio;
+    }
+    free(audio);
+    return NULL;
+}
+
+void
+audio_write(audio_t       *audio,
+            const int16_t *samples,
+            size_t         count)
+{
+    audio->backend->write(audio, samples, count);
+}
+
+double
+audio_rate(audio_t *audio)
+{
+    double skew;
+
+    if (audio->latency == 0)
+      return audio->rate;
+    skew = AUDIO_MAX_SKEW *
+      (1.0 - (double)audio->backend->queued(audio) / audio->latency);
+    if (skew > AUDIO_MAX_SKEW)
+      skew = AUDIO_MAX_SKEW;
+    else if (skew < -AUDIO_MAX_SKEW)
+      skew = -AUDIO_MAX_SKEW;
+    return audio->rate * (1.0 + skew);
+}
+
+void
+audio_destroy(audio_t *audio)
+{
+    audio->backend->destroy(audio);
+    free(audio);
+}
+
+void
+audio_list_backends(void)
+{
+    for (int i = 0; backends[i] != NULL; i++) {
+      printf("                       %s%s\n", backends[i]->name, i == 0 ? " (default)" : "");
+    }
+}
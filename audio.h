@@ -0,0 +1,52 @@
+#ifndef __AUDIO_H__
+#define __AUDIO_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct audio_t audio_t;
+
+/* A sound output backend, mono 16 bit samples are written once per
+ * frame by the emulator thread */
+typedef struct {
+  const char *name;
+  bool (*init)(audio_t *audio);
+  /* Queues samples, may wait while the queue is above the latency */
+  void (*write)(audio_t *audio, const int16_t *samples, size_t count);
+  /* Samples queued and not played yet */
+  size_t (*queued)(audio_t *audio);
+  void (*destroy)(audio_t *audio);
+} audio_backend_t;
+
+struct audio_t {
+  const audio_backend_t *backend;
+  /* Backend private data */
+  void *priv;
+  /* Samples per second of the device */
+  int rate;
+  /* Samples the backend keeps queued, 0 if it plays nothing */
+  size_t latency;
+  /* Times the device ran out of samples */
+  uint64_t underruns;
+};
+
+extern const audio_backend_t audio_null_backend;
+#ifdef HAVE_SDL
+extern const audio_backend_t audio_sdl_backend;
+#endif
+
+/* The backend called name, the default if NULL. One that cannot open
+ * its device gives way to the null backend, with a warning. */
+audio_t* audio_create(const char *name);
+void audio_write(audio_t       *audio,
+		 const int16_t *samples,
+		 size_t         count);
+/* Sample rate to produce the next frame at. Slightly above or below
+ * the device rate as the queue is under or over the latency, so the
+ * emulator and the sound card clocks never drift apart. */
+double audio_rate(audio_t *audio);
+void audio_destroy(audio_t *audio);
+void audio_list_backends(void);
+
+#endif /* __AUDIO_H__ */
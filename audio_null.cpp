@@ -0,0 +1,37 @@
+/* Silent audio backend, samples are synthesized at the usual rate and
+ * dropped, which keeps the cost of sound in benchmarks */
+
+#include "audio.h"
+
+static bool
+audio_null_init(audio_t *audio)
+{
+    audio->rate = 48000;
+    return true;
+}
+
+static void
+audio_null_write(audio_t       *audio __attribute__((unused)),
+                 const int16_t *samples __attribute__((unused)),
+                 size_t         count __attribute__((unused)))
+{
+}
+
+static size_t
+audio_null_queued(audio_t *audio __attribute__((unused)))
+{
+    return 0;
+}
+
+static void
+audio_null_destroy(audio_t *audio __attribute__((unused)))
+{
+}
+
+const audio_backend_t audio_null_backend = {
+  "null",
+  audio_null_init,
+  audio_null_write,
+  audio_null_queued,
+  audio_null_destroy,
+};
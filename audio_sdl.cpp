@@ -0,0 +1,127 @@
+/* SDL2 audio backend. The emulator thread queues samples in a lock-free
+ * ring and the SDL callback thread drains it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+
+#include "audio.h"
+#include "ring.h"
+
+/* Samples per callback, and queued in the ring on top of that. With
+ * writes in chunks the output lags the emulator by under 20ms. */
+#define AUDIO_SDL_BUFFER 256
+#define AUDIO_SDL_LATENCY_MS 8
+#define AUDIO_SDL_CHUNK 128
+
+typedef struct {
+  SDL_AudioDeviceID dev;
+  ring_t ring;
+  /* Only touched by the callback */
+  int16_t last;
+  bool started;
+} audio_sdl_t;
+
+static void
+audio_sdl_callback(void *opaque, Uint8 *stream, int len)
+{
+    audio_t *audio = (audio_t*)opaque;
+    audio_sdl_t *sdl = (audio_sdl_t*)audio->priv;
+    int16_t *out = (int16_t*)stream;
+    uint32_t count = len / sizeof(int16_t);
+    uint32_t n = ring_read(&sdl->ring, out, count);
+
+    if (n > 0) {
+      sdl->last = out[n - 1];
+      sdl->started = true;
+    }
+    if (n < count) {
+      /* Holding the last sample avoids a click */
+      for (uint32_t i = n; i < count; i++)
+        out[i] = sdl->last;
+      if (sdl->started)
+        __atomic_add_fetch(&audio->underruns, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+audio_sdl_destroy(audio_t *audio)
+{
+    audio_sdl_t *sdl = (audio_sdl_t*)audio->priv;
+
+    if (sdl->dev != 0)
+      SDL_CloseAudioDevice(sdl->dev);
+    ring_free(&sdl->ring);
+    SDL_QuitSubSystem(SDL_INIT_AUDIO);
+    free(sdl);
+}
+
+static bool
+audio_sdl_init(audio_t *audio)
+{
+    audio_sdl_t *sdl;
+    SDL_AudioSpec want, have;
+
+    if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+      printf("Unable to initialize SDL audio: %s\n", SDL_GetError());
+      return false;
+    }
+
+    sdl = (audio_sdl_t*)calloc(sizeof(audio_sdl_t), 1);
+    audio->priv = sdl;
+
+    SDL_zero(want);
+    want.freq = 48000;
+    want.format = AUDIO_S16SYS;
+    want.channels = 1;
+    want.samples = AUDIO_SDL_BUFFER;
+    want.callback = audio_sdl_callback;
+    want.userdata = audio;
+    sdl->dev = SDL_OpenAudioDevice(NULL, 0, &want, &have,
+                                   SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (sdl->dev == 0) {
+      printf("Unable to open SDL audio: %s\n", SDL_GetError());
+      audio_sdl_destroy(audio);
+      return false;
+    }
+
+    audio->rate = have.freq;
+    audio->latency = have.freq * AUDIO_SDL_LATENCY_MS / 1000;
+    ring_init(&sdl->ring, audio->latency + have.freq / 10);
+    SDL_PauseAudioDevice(sdl->dev, 0);
+    return true;
+}
+
+/* Waits for room below the latency before each chunk, this is also what
+ * paces the emulator to real time */
+static void
+audio_sdl_write(audio_t       *audio,
+                const int16_t *samples,
+                size_t         count)
+{
+    audio_sdl_t *sdl = (audio_sdl_t*)audio->priv;
+
+    while (count > 0) {
+      uint32_t n = count < AUDIO_SDL_CHUNK ? count : AUDIO_SDL_CHUNK;
+      while (ring_count(&sdl->ring) > audio->latency)
+        SDL_Delay(1);
+      n = ring_write(&sdl->ring, samples, n);
+      samples += n;
+      count -= n;
+    }
+}
+
+static size_t
+audio_sdl_queued(audio_t *audio)
+{
+    audio_sdl_t *sdl = (audio_sdl_t*)audio->priv;
+    return ring_count(&sdl->ring);
+}
+
+const audio_backend_t audio_sdl_backend = {
+  "sdl",
+  audio_sdl_init,
+  audio_sdl_write,
+  audio_sdl_queued,
+  audio_sdl_destroy,
+};
@@ -0,0 +1,145 @@
+/* Band-limited step synthesis */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blip.h"
+
+/* Fractional positions of a step, and samples a step is spread over */
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES (1 << BLIP_PHASE_BITS)
+#define BLIP_WIDTH 16
+
+/* Sample positions are fixed point with this many fraction bits */
+#define BLIP_FRAC 32
+
+/* Gain of the DC blocker feedback, about 15Hz at 48kHz */
+#define BLIP_HIGH_PASS (1.0f / 512)
+
+struct blip_t {
+  /* Samples per clock */
+  uint64_t factor;
+  /* Position of the start of the frame from buf[0] */
+  uint64_t offset;
+  /* size samples plus room for the tail of the last step */
+  float *buf;
+  size_t size;
+  /* Running sum of the steps and the DC it drifts around */
+  float sum;
+  float dc;
+  /* Each row is the impulse of one phase, summing to 1 */
+  float kernel[BLIP_PHASES][BLIP_WIDTH];
+};
+
+blip_t*
+blip_create(size_t size)
+{
+  blip_t *blip = (blip_t*)calloc(sizeof(blip_t), 1);
+
+  blip->size = size;
+  blip->buf = (float*)calloc(sizeof(float), size + BLIP_WIDTH);
+
+  /* Windowed sinc, cut off a little below the Nyquist frequency */
+  for (int p = 0; p < BLIP_PHASES; p++) {
+    double total = 0, row[BLIP_WIDTH];
+    for (int k = 0; k < BLIP_WIDTH; k++) {
+      double x = k - (BLIP_WIDTH / 2 - 1) - (double)p / BLIP_PHASES;
+      double t = (x + BLIP_WIDTH / 2) / BLIP_WIDTH;
+      double window = 0.42 - 0.5 * cos(2 * M_PI * t) + 0.08 * cos(4 * M_PI * t);
+      double sinc = x == 0 ? 1 : sin(M_PI * 0.9 * x) / (M_PI * 0.9 * x);
+      row[k] = sinc * window;
+      total += row[k];
+    }
+    for (int k = 0; k < BLIP_WIDTH; k++)
+      blip->kernel[p][k] = row[k] / total;
+  }
+  return blip;
+}
+
+void
+blip_destroy(blip_t *blip)
+{
+  free(blip->buf);
+  free(blip);
+}
+
+void
+blip_set_rates(blip_t *blip,
+               double  clock_rate,
+               double  sample_rate)
+{
+  blip->factor = (uint64_t)(sample_rate / clock_rate *
+                            ((uint64_t)1 << BLIP_FRAC));
+}
+
+void
+blip_add_delta(blip_t  *blip,
+               uint32_t time,
+               float    delta)
+{
+  uint64_t pos = blip->offset + time * blip->factor;
+  size_t i = pos >> BLIP_FRAC;
+  const float *kernel =
+    blip->kernel[(pos >> (BLIP_FRAC - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+  float *out = blip->buf + i;
+
+  /* A frame longer than the buffer loses its end */
+  if (i > blip->size)
+    return;
+  for (int k = 0; k < BLIP_WIDTH; k++)
+    out[k] += kernel[k] * delta;
+}
+
+void
+blip_end_frame(blip_t  *blip,
+               uint32_t clocks)
+{
+  blip->offset += clocks * blip->factor;
+}
+
+size_t
+blip_samples_avail(blip_t *blip)
+{
+  size_t avail = blip->offset >> BLIP_FRAC;
+  return avail < blip->size ? avail : blip->size;
+}
+
+size_t
+blip_read_samples(blip_t  *blip,
+                  int16_t *out,
+                  size_t   count)
+{
+  size_t avail = blip_samples_avail(blip);
+  float sum = blip->sum, dc = blip->dc;
+
+  if (count > avail)
+    count = avail;
+  for (size_t i = 0; i < count; i++) {
+    float sample;
+    sum += blip->buf[i];
+    sample = sum - dc;
+    dc += sample * BLIP_HIGH_PASS;
+    if (sample > 32767)
+      sample = 32767;
+    else if (sample < -32768)
+      sample = -32768;
+    out[i] = (int16_t)sample;
+  }
+  blip->sum = sum;
+  blip->dc = dc;
+
+  memmove(blip->buf, blip->buf + count,
+          (blip->size + BLIP_WIDTH - count) * sizeof(float));
+  memset(blip->buf + blip->size + BLIP_WIDTH - count, 0,
+         count * sizeof(float));
+  blip->offset -= (uint64_t)count << BLIP_FRAC;
+  return count;
+}
+
+void
+blip_clear(blip_t *blip)
+{
+  memset(blip->buf, 0, (blip->size + BLIP_WIDTH) * sizeof(float));
+  blip->offset &= ((uint64_t)1 << BLIP_FRAC) - 1;
+}
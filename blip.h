@@ -0,0 +1,38 @@
+#ifndef __BLIP_H__
+#define __BLIP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Band-limited step synthesis. A square wave sampled at the output
+ * rate aliases badly, so instead every change of the amplitude is added
+ * as a band-limited step at its exact clock time and the samples are
+ * the running sum of those. The cost follows the number of amplitude
+ * changes, not the clock rate. */
+
+typedef struct blip_t blip_t;
+
+/* Holds up to size samples between reads */
+blip_t* blip_create(size_t size);
+void blip_destroy(blip_t *blip);
+/* Clocks per second of the source and samples per second out, the
+ * sample rate can be nudged at any time for rate control */
+void blip_set_rates(blip_t *blip,
+		    double  clock_rate,
+		    double  sample_rate);
+/* Amplitude change at time clocks after the start of the frame */
+void blip_add_delta(blip_t  *blip,
+		    uint32_t time,
+		    float    delta);
+/* Ends the frame after clocks, its samples can then be read */
+void blip_end_frame(blip_t  *blip,
+		    uint32_t clocks);
+size_t blip_samples_avail(blip_t *blip);
+/* Returns the number of samples read, at most count */
+size_t blip_read_samples(blip_t  *blip,
+			 int16_t *out,
+			 size_t   count);
+/* Drops all samples and pending steps */
+void blip_clear(blip_t *blip);
+
+#endif /* __BLIP_H__ */
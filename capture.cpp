@@ -0,0 +1,366 @@
+/* Frame capture on a writer thread */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "filter.h"
+#include "hash.h"
+#include "video.h"
+
+/* Frames queued between the emulator and the writer */
+#define CAPTURE_QUEUE 8
+
+/* Stored deflate blocks hold at most this much */
+#define CAPTURE_DEFLATE_BLOCK 65535
+
+/* NTSC frame rate and pixel aspect ratio */
+#define CAPTURE_Y4M_HEADER \
+  "YUV4MPEG2 W%d H%d F39375000:655171 Ip A8:7 C420jpeg XCOLORRANGE=FULL\n"
+
+struct capture_t {
+  filter_t *filter;
+  int width;
+  int height;
+  int format;
+  /* Raw and Y4M output, and the printf pattern of PNG files */
+  FILE *out;
+  char *pattern;
+  FILE *hashes;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t drained;
+  video_frame_t *slots[CAPTURE_QUEUE];
+  /* Frames queued and taken so far, the slot is the count modulo
+   * CAPTURE_QUEUE */
+  uint64_t head;
+  uint64_t tail;
+  bool done;
+
+  /* Only touched by the writer */
+  bool error;
+  uint8_t *buf;
+  uint32_t *pixels;
+};
+
+int
+capture_format(const char *filename)
+{
+  const char *ext = strrchr(filename, '.');
+
+  if (ext && strcmp(ext, ".y4m") == 0)
+    return CAPTURE_Y4M;
+  if (ext && strcmp(ext, ".png") == 0)
+    return CAPTURE_PNG;
+  return CAPTURE_RAW;
+}
+
+static void
+capture_rgb(capture_t *capture, uint8_t *out, size_t stride)
+{
+  const uint32_t *pixels = capture->pixels;
+  int width = capture->width;
+
+  for (int y = 0; y < capture->height; y++, out += stride) {
+    for (int x = 0; x < width; x++) {
+      uint32_t p = pixels[y * width + x];
+      out[x * 3] = p >> 16;
+      out[x * 3 + 1] = p >> 8;
+      out[x * 3 + 2] = p;
+    }
+  }
+}
+
+/* Full range BT.601 in 16 bit fixed point, chroma is the average of
+ * each 2x2 block */
+static void
+capture_yuv(capture_t *capture, uint8_t *out)
+{
+  const uint32_t *pixels = capture->pixels;
+  int width = capture->width, count = width * capture->height;
+  uint8_t *luma = out;
+  uint8_t *cb = luma + count;
+  uint8_t *cr = cb + count / 4;
+
+  for (int i = 0; i < count; i++) {
+    uint32_t p = pixels[i];
+    int r = (p >> 16) & 0xff, g = (p >> 8) & 0xff, b = p & 0xff;
+    luma[i] = (19595 * r + 38470 * g + 7471 * b + 32768) >> 16;
+  }
+  for (int y = 0; y < capture->height; y += 2) {
+    for (int x = 0; x < width; x += 2) {
+      const uint32_t *p = &pixels[y * width + x];
+      int r = 0, g = 0, b = 0;
+      for (int i = 0; i < 4; i++) {
+        uint32_t c = p[(i >> 1) * width + (i & 1)];
+        r += (c >> 16) & 0xff;
+        g += (c >> 8) & 0xff;
+        b += c & 0xff;
+      }
+      int i = (y / 2) * (width / 2) + x / 2;
+      cb[i] = (-11059 * r - 21709 * g + 32768 * b + (512 << 16)) >> 18;
+      cr[i] = (32768 * r - 27439 * g - 5329 * b + (512 << 16)) >> 18;
+    }
+  }
+}
+
+static void
+capture_be32(uint8_t *out, uint32_t value)
+{
+  out[0] = value >> 24;
+  out[1] = value >> 16;
+  out[2] = value >> 8;
+  out[3] = value;
+}
+
+static bool
+capture_png_chunk(FILE *f, const char *type, const uint8_t *data, size_t size)
+{
+  uint8_t header[8], crc[4];
+
+  capture_be32(header, size);
+  memcpy(header + 4, type, 4);
+  capture_be32(crc, crc32_update(crc32_update(0, header + 4, 4), data, size));
+  return fwrite(header, sizeof(header), 1, f) == 1 &&
+    (size == 0 || fwrite(data, size, 1, f) == 1) &&
+    fwrite(crc, sizeof(crc), 1, f) == 1;
+}
+
+/* RGB without filtering, in stored deflate blocks. Compressing is left
+ * to whatever the frames are made into. */
+static bool
+capture_png(capture_t *capture, uint64_t frame)
+{
+  static const uint8_t signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+  const size_t stride = 1 + capture->width * 3;
+  const size_t size = stride * capture->height;
+  uint8_t *rows = capture->buf;
+  uint8_t *zlib = rows + size;
+  uint8_t ihdr[13];
+  uint32_t a = 1, b = 0;
+  size_t pos = 0;
+  char filename[4096];
+  FILE *f;
+  bool ok;
+
+  for (int y = 0; y < capture->height; y++)
+    rows[y * stride] = 0;
+  capture_rgb(capture, rows + 1, stride);
+
+  zlib[pos++] = 0x78;
+  zlib[pos++] = 0x01;
+  for (size_t done = 0; done < size;) {
+    size_t n = size - done < CAPTURE_DEFLATE_BLOCK ?
+      size - done : CAPTURE_DEFLATE_BLOCK;
+    zlib[pos++] = done + n == size;
+    zlib[pos++] = n;
+    zlib[pos++] = n >> 8;
+    zlib[pos++] = ~n;
+    zlib[pos++] = ~n >> 8;
+    memcpy(zlib + pos, rows + done, n);
+    pos += n;
+    done += n;
+  }
+  /* Adler-32 */
+  for (size_t i = 0; i < size; i++) {
+    a = (a + rows[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  capture_be32(zlib + pos, (b << 16) | a);
+  pos += 4;
+
+  capture_be32(ihdr, capture->width);
+  capture_be32(ihdr + 4, capture->height);
+  ihdr[8] = 8;
+  ihdr[9] = 2;
+  ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+  snprintf(filename, sizeof(filename), capture->pattern, (int)frame);
+  f = fopen(filename, "wb");
+  if (f == NULL) {
+    perror(filename);
+    return false;
+  }
+  ok = fwrite(signature, sizeof(signature), 1, f) == 1 &&
+    capture_png_chunk(f, "IHDR", ihdr, sizeof(ihdr)) &&
+    capture_png_chunk(f, "IDAT", zlib, pos) &&
+    capture_png_chunk(f, "IEND", NULL, 0);
+  if (fclose(f) != 0)
+    ok = false;
+  return ok;
+}
+
+static bool
+capture_write(capture_t *capture, uint64_t frame)
+{
+  size_t count = capture->width * capture->height;
+
+  switch (capture->format) {
+  case CAPTURE_RAW:
+    capture_rgb(capture, capture->buf, capture->width * 3);
+    return fwrite(capture->buf, count * 3, 1, capture->out) == 1;
+  case CAPTURE_Y4M:
+    capture_yuv(capture, capture->buf);
+    return fputs("FRAME\n", capture->out) >= 0 &&
+      fwrite(capture->buf, count * 3 / 2, 1, capture->out) == 1;
+  case CAPTURE_PNG:
+    return capture_png(capture, frame);
+  }
+  return true;
+}
+
+static void*
+capture_thread(void *opaque)
+{
+  capture_t *capture = (capture_t*)opaque;
+
+  for (;;) {
+    uint64_t frame;
+
+    pthread_mutex_lock(&capture->lock);
+    while (capture->tail == capture->head && !capture->done)
+      pthread_cond_wait(&capture->filled, &capture->lock);
+    if (capture->tail == capture->head) {
+      pthread_mutex_unlock(&capture->lock);
+      break;
+    }
+    frame = capture->tail;
+    pthread_mutex_unlock(&capture->lock);
+
+    filter_run(capture->filter, capture->slots[frame % CAPTURE_QUEUE],
+               capture->pixels, capture->width);
+    if (!capture->error && !capture_write(capture, frame))
+      capture->error = true;
+    if (capture->hashes)
+      fprintf(capture->hashes, "%llu %08x\n", (unsigned long long)frame,
+              crc32_update(0, (const uint8_t*)capture->pixels,
+                           capture->width * capture->height *
+                           sizeof(uint32_t)));
+
+    pthread_mutex_lock(&capture->lock);
+    capture->tail++;
+    pthread_cond_signal(&capture->drained);
+    pthread_mutex_unlock(&capture->lock);
+  }
+  return NULL;
+}
+
+capture_t*
+capture_create(filter_t   *filter,
+               const char *filename,
+               int         format,
+               const char *hashes)
+{
+  capture_t *capture = (capture_t*)calloc(sizeof(capture_t), 1);
+  size_t count;
+
+  capture->filter = filter;
+  capture->width = filter_width(filter);
+  capture->height = filter_height(filter);
+  count = capture->width * capture->height;
+  capture->format = filename ? format : CAPTURE_NONE;
+  if (capture->format == CAPTURE_PNG) {
+    if (strchr(filename, '%') == NULL) {
+      printf("PNG capture needs a %%d in the filename for the frame\n");
+      capture_destroy(capture);
+      return NULL;
+    }
+    capture->pattern = strdup(filename);
+  } else if (capture->format != CAPTURE_NONE) {
+    if (strcmp(filename, "-") == 0) {
+      /* The frames take over standard output, messages go to standard
+       * error from now on */
+      int fd = dup(STDOUT_FILENO);
+      fflush(stdout);
+      capture->out = fd == -1 ? NULL : fdopen(fd, "wb");
+      if (capture->out)
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+      capture->out = fopen(filename, "wb");
+    }
+    if (capture->out == NULL) {
+      perror("Cannot create capture");
+      capture_destroy(capture);
+      return NULL;
+    }
+    if (capture->format == CAPTURE_Y4M)
+      fprintf(capture->out, CAPTURE_Y4M_HEADER, capture->width,
+              capture->height);
+  }
+  if (hashes) {
+    capture->hashes = fopen(hashes, "w");
+    if (capture->hashes == NULL) {
+      perror("Cannot create frame hashes");
+      capture_destroy(capture);
+      return NULL;
+    }
+  }
+
+  /* Big enough for a PNG: the rows and their deflate stream */
+  capture->buf = (uint8_t*)malloc(2 * count * 4);
+  capture->pixels = (uint32_t*)malloc(count * sizeof(uint32_t));
+  for (int i = 0; i < CAPTURE_QUEUE; i++)
+    capture->slots[i] = (video_frame_t*)malloc(sizeof(video_frame_t));
+  pthread_mutex_init(&capture->lock, NULL);
+  pthread_cond_init(&capture->filled, NULL);
+  pthread_cond_init(&capture->drained, NULL);
+  pthread_create(&capture->thread, NULL, capture_thread, capture);
+  return capture;
+}
+
+void
+capture_frame(capture_t           *capture,
+              const video_frame_t *frame)
+{
+  pthread_mutex_lock(&capture->lock);
+  while (capture->head - capture->tail == CAPTURE_QUEUE)
+    pthread_cond_wait(&capture->drained, &capture->lock);
+  pthread_mutex_unlock(&capture->lock);
+
+  /* The slot is the emulator's until head moves past it */
+  memcpy(capture->slots[capture->head % CAPTURE_QUEUE], frame,
+         sizeof(video_frame_t));
+
+  pthread_mutex_lock(&capture->lock);
+  capture->head++;
+  pthread_cond_signal(&capture->filled);
+  pthread_mutex_unlock(&capture->lock);
+}
+
+int
+capture_destroy(capture_t *capture)
+{
+  int ret = 0;
+
+  if (capture->buf) {
+    pthread_mutex_lock(&capture->lock);
+    capture->done = true;
+    pthread_cond_signal(&capture->filled);
+    pthread_mutex_unlock(&capture->lock);
+    pthread_join(capture->thread, NULL);
+    pthread_mutex_destroy(&capture->lock);
+    pthread_cond_destroy(&capture->filled);
+    pthread_cond_destroy(&capture->drained);
+    for (int i = 0; i < CAPTURE_QUEUE; i++)
+      free(capture->slots[i]);
+    free(capture->buf);
+    free(capture->pixels);
+  }
+  if (capture->error) {
+    printf("Cannot write capture\n");
+    ret = -1;
+  }
+  if (capture->out && fclose(capture->out) != 0)
+    ret = -1;
+  if (capture->hashes && fclose(capture->hashes) != 0)
+    ret = -1;
+  filter_destroy(capture->filter);
+  free(capture->pattern);
+  free(capture);
+  return ret;
+}
@@ -0,0 +1,39 @@
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <stdint.h>
+
+#include "types.h"
+#include "video.h"
+
+/* Frame capture. Each shown frame is copied into a bounded queue and a
+ * writer thread runs it through a filter, turns the pixels into raw
+ * RGB, Y4M or a PNG file, and appends their CRC-32 to a hash file.
+ * Emulation only waits when the writer falls a whole queue behind. */
+
+#define CAPTURE_NONE 0
+/* 24 bit RGB, frame after frame */
+#define CAPTURE_RAW  1
+/* YUV4MPEG2 4:2:0, for piping into an encoder */
+#define CAPTURE_Y4M  2
+/* One file per frame, the filename has a printf %d for the number */
+#define CAPTURE_PNG  3
+
+/* The format from the extension of filename, raw if it has none of
+ * the others */
+int capture_format(const char *filename);
+/* Frames are the size filter makes them, the capture owns filter from
+ * now on. Either filename or hashes can be NULL. "-" writes raw or Y4M
+ * to standard output, and moves what is printed after to standard
+ * error. Returns NULL when the output cannot be opened. */
+capture_t* capture_create(filter_t   *filter,
+			  const char *filename,
+			  int         format,
+			  const char *hashes);
+/* Queues a frame */
+void capture_frame(capture_t           *capture,
+		   const video_frame_t *frame);
+/* Writes the frames still queued, returns -1 if any write failed */
+int capture_destroy(capture_t *capture);
+
+#endif /* __CAPTURE_H__ */
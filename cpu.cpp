@@ -1,51 +1,120 @@
 /* CPU Emulation of a Ricoh 2A02 (NTSC) based on a MOS 6502 CPU
  * Operates at 1.79Mhz
  */
-#include <signal.h>
-#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #include "cpu.h"
-#include "ppu.h"
+#include "idle.h"
+#include "jit.h"
+#include "opcodes.h"
+#include "prof.h"
+#include "state.h"
+#include "trace.h"
 
-#define NMI_ADDRESS 0xFFFA
-#define DEBUG_ASM 0
+#define NMI_ADDRESS   0xFFFA
+#define RESET_ADDRESS 0xFFFC
+#define IRQ_ADDRESS   0xFFFE
+
+static uint8_t
+cpu_open_bus_read(void *opaque __attribute__((unused)),
+                  uint16_t addr)
+{
+  /* Nothing drives the bus, the high byte of the address remains */
+  return addr >> 8;
+}
+
+static void
+cpu_open_bus_write(void *opaque __attribute__((unused)),
+                   uint16_t addr __attribute__((unused)),
+                   uint8_t value __attribute__((unused)))
+{
+}
 
 cpu_t*
 cpu_create(emu_t *emu)
 {
     cpu_t *cpu;
     cpu = (cpu_t*)calloc(sizeof(cpu_t), 1);
-    cpu->mem = (uint8_t*)calloc(sizeof(uint8_t), 65536);
     cpu->emu = emu;
+
+    cpu_map_io(cpu, 0x0000, 0x10000, cpu_open_bus_read, cpu_open_bus_write,
+               NULL);
+    /* Internal RAM and its mirrors */
+    for (uint32_t addr = 0x0000; addr < 0x2000; addr += sizeof(cpu->ram)) {
+      cpu_map_ram(cpu, addr, cpu->ram, sizeof(cpu->ram));
+    }
     return cpu;
 }
 
+void
+cpu_destroy(cpu_t *cpu)
+{
+    free(cpu);
+}
+
+/* Maps read-only memory such as PRG-ROM, writes still go to the io
+ * handlers of the pages so mappers can see them */
 void
 cpu_map(cpu_t         *cpu,
         uint16_t       dest,
         const uint8_t *src,
-        uint16_t       size)
+        uint32_t       size)
+{
+    for (uint32_t offset = 0; offset < size && dest + offset < 0x10000;
+         offset += 0x100) {
+      uint8_t page = (dest + offset) >> 8;
+      cpu->read_map[page] = src + offset;
+      cpu->write_map[page] = NULL;
+    }
+}
+
+/* Maps readable and writable memory */
+void
+cpu_map_ram(cpu_t   *cpu,
+            uint16_t dest,
+            uint8_t *src,
+            uint32_t size)
 {
-    memcpy(&cpu->mem[dest], src, size);
+    for (uint32_t offset = 0; offset < size && dest + offset < 0x10000;
+         offset += 0x100) {
+      uint8_t page = (dest + offset) >> 8;
+      cpu->read_map[page] = src + offset;
+      cpu->write_map[page] = src + offset;
+    }
+}
+
+/* Routes all accesses of the pages to handlers */
+void
+cpu_map_io(cpu_t       *cpu,
+           uint16_t     dest,
+           uint32_t     size,
+           cpu_read_fn  read,
+           cpu_write_fn write,
+           void        *opaque)
+{
+    for (uint32_t offset = 0; offset < size && dest + offset < 0x10000;
+         offset += 0x100) {
+      uint8_t page = (dest + offset) >> 8;
+      cpu->read_map[page] = NULL;
+      cpu->write_map[page] = NULL;
+      cpu->io[page].read = read;
+      cpu->io[page].write = write;
+      cpu->io[page].opaque = opaque;
+    }
 }
 
 static inline uint8_t
 cpu_read_byte(cpu_t *cpu,
 	      uint16_t addr)
 {
-  /* 0x2000..0x3fff is PPU and mirrors */
-  if (addr >= 0x2000 && addr <= 0x3fff) {
-    return ppu_read(cpu->emu->ppu, addr);
-  } else if (addr >= 0x4000 && addr <= 0x401f) {
-    //printf("FIXME: apu_read(%04X)\n", addr);
-    return 0;
-  /* Normal memory read */
-  } else {
-    return cpu->mem[addr];
+  const uint8_t *page = cpu->read_map[addr >> 8];
+  if (likely(page != NULL)) {
+    return page[addr & 0xff];
   }
+  cpu_io_t *io = &cpu->io[addr >> 8];
+  return io->read(io->opaque, addr);
 }
 
 static inline uint16_t
@@ -63,17 +132,21 @@ cpu_write_byte(cpu_t    *cpu,
 	       uint16_t  addr,
 	       uint8_t   value)
 {
-  /* 0x2000..0x3fff is PPU and mirrors */
-  if (addr >= 0x2000 && addr <= 0x3fff) {
-    ppu_write(cpu->emu->ppu, addr, value);
-  } else if (addr >= 0x4000 && addr <= 0x401f) {
-    printf("FIXME: apu_write(%04X) = %02X\n", addr, value);
-  } else if (addr >= 0xfffa) {
-    printf("FIXME: write(%04X) = %02X\n", addr, value);
-  /* Normal memory write */
-  } else {
-    cpu->mem[addr] = value;
+  uint8_t *page = cpu->write_map[addr >> 8];
+  if (likely(page != NULL)) {
+    page[addr & 0xff] = value;
+    return;
   }
+  cpu_io_t *io = &cpu->io[addr >> 8];
+  io->write(io->opaque, addr, value);
+}
+
+/* Bus read for other devices, DMA reads through the same page map */
+uint8_t
+cpu_read(cpu_t   *cpu,
+	 uint16_t addr)
+{
+  return cpu_read_byte(cpu, addr);
 }
 
 static inline uint8_t
@@ -91,387 +164,645 @@ cpu_next16(cpu_t *cpu)
   return word;
 }
 
-#if DEBUG_ASM
-static void
-cpu_printf(cpu_t *cpu, int n, const char *str, ...)
+static inline void
+cpu_push(cpu_t *cpu, uint8_t value)
+{
+  cpu->ram[0x100 | cpu->sp--] = value;
+}
+
+static inline uint8_t
+cpu_pull(cpu_t *cpu)
+{
+  return cpu->ram[0x100 | ++cpu->sp];
+}
+
+uint8_t
+cpu_get_p(cpu_t *cpu)
+{
+  return (cpu->p.c << 0 | cpu->p.z << 1 | cpu->p.i << 2 | cpu->p.d << 3 |
+          cpu->p.b << 4 | cpu->p.u << 5 | cpu->p.v << 6 | cpu->p.n << 7);
+}
+
+void
+cpu_set_p(cpu_t *cpu, uint8_t value)
+{
+  cpu->p.c = value >> 0 & 1;
+  cpu->p.z = value >> 1 & 1;
+  cpu->p.i = value >> 2 & 1;
+  cpu->p.d = value >> 3 & 1;
+  cpu->p.b = value >> 4 & 1;
+  cpu->p.u = value >> 5 & 1;
+  cpu->p.v = value >> 6 & 1;
+  cpu->p.n = value >> 7 & 1;
+}
+
+static inline void
+cpu_set_nz(cpu_t *cpu, uint8_t value)
+{
+  cpu->p.n = (value >> 7) & 1;
+  cpu->p.z = (value == 0) ? 1 : 0;
+}
+
+/*
+ * Addressing modes, each one consumes its operand bytes and returns
+ * the effective address. Indexed modes add a cycle when crossing a
+ * page if the opcode has a page penalty.
+ */
+
+static inline uint16_t
+mode_IMP(cpu_t *cpu __attribute__((unused)),
+         int penalty __attribute__((unused)))
+{
+  return 0;
+}
+
+static inline uint16_t
+mode_ACC(cpu_t *cpu __attribute__((unused)),
+         int penalty __attribute__((unused)))
+{
+  return 0;
+}
+
+static inline uint16_t
+mode_IMM(cpu_t *cpu, int penalty __attribute__((unused)))
+{
+  return cpu->pc++;
+}
+
+static inline uint16_t
+mode_ZP0(cpu_t *cpu, int penalty __attribute__((unused)))
+{
+  return cpu_next8(cpu);
+}
+
+static inline uint16_t
+mode_ZPX(cpu_t *cpu, int penalty __attribute__((unused)))
+{
+  return (cpu_next8(cpu) + cpu->x) & 0xff;
+}
+
+static inline uint16_t
+mode_ZPY(cpu_t *cpu, int penalty __attribute__((unused)))
+{
+  return (cpu_next8(cpu) + cpu->y) & 0xff;
+}
+
+static inline uint16_t
+mode_ABS(cpu_t *cpu, int penalty __attribute__((unused)))
+{
+  return cpu_next16(cpu);
+}
+
+static inline uint16_t
+cpu_index(cpu_t *cpu, uint16_t base, uint8_t index, int penalty)
+{
+  uint16_t addr = base + index;
+  if (penalty && ((base ^ addr) & 0xff00))
+    cpu->cycles++;
+  return addr;
+}
+
+static inline uint16_t
+mode_ABX(cpu_t *cpu, int penalty)
 {
-  va_list args;
-  char format[80];
-  char tmp[5];
+  return cpu_index(cpu, cpu_next16(cpu), cpu->x, penalty);
+}
+
+static inline uint16_t
+mode_ABY(cpu_t *cpu, int penalty)
+{
+  return cpu_index(cpu, cpu_next16(cpu), cpu->y, penalty);
+}
+
+static inline uint16_t
+mode_IND(cpu_t *cpu, int penalty __attribute__((unused)))
+{
+  /* The high byte is not carried over a page boundary, JMP ($10FF)
+   * reads its target from $10FF and $1000 */
+  uint16_t ptr = cpu_next16(cpu);
+  uint16_t addr = cpu_read_byte(cpu, ptr);
+  addr |= cpu_read_byte(cpu, (ptr & 0xff00) | ((ptr + 1) & 0xff)) << 8;
+  return addr;
+}
+
+static inline uint16_t
+cpu_read_zp16(cpu_t *cpu, uint8_t ptr)
+{
+  uint16_t addr = cpu_read_byte(cpu, ptr);
+  addr |= cpu_read_byte(cpu, (uint8_t)(ptr + 1)) << 8;
+  return addr;
+}
+
+static inline uint16_t
+mode_IZX(cpu_t *cpu, int penalty __attribute__((unused)))
+{
+  return cpu_read_zp16(cpu, cpu_next8(cpu) + cpu->x);
+}
 
-  va_start(args, str);
-  snprintf(format, 20, "[%08d] $%X: ", cpu->instructions, cpu->pc - n);
-  for (int i = n; i > 0; i--) {
-    snprintf(tmp, 4, "%02X ", cpu->mem[cpu->pc - i]);
-    strncat(format, tmp, 4);
+static inline uint16_t
+mode_IZY(cpu_t *cpu, int penalty)
+{
+  return cpu_index(cpu, cpu_read_zp16(cpu, cpu_next8(cpu)), cpu->y, penalty);
+}
+
+static inline uint16_t
+mode_REL(cpu_t *cpu, int penalty __attribute__((unused)))
+{
+  int8_t offset = (int8_t)cpu_next8(cpu);
+  return cpu->pc + offset;
+}
+
+/*
+ * Operations, called with the effective address computed by the
+ * addressing mode. Read-modify-write operations also work on the
+ * accumulator when the mode is MODE_ACC.
+ */
+
+#define OP(name) \
+  static inline void \
+  op_##name(cpu_t *cpu __attribute__((unused)), \
+            uint16_t addr __attribute__((unused)), \
+            int mode __attribute__((unused)))
+
+static inline uint8_t
+cpu_rmw_read(cpu_t *cpu, uint16_t addr, int mode)
+{
+  if (mode == MODE_ACC)
+    return cpu->a;
+  return cpu_read_byte(cpu, addr);
+}
+
+static inline void
+cpu_rmw_write(cpu_t *cpu, uint16_t addr, int mode, uint8_t old, uint8_t value)
+{
+  if (mode == MODE_ACC) {
+    cpu->a = value;
+  } else {
+    /* The unmodified value is written back first, mappers such as
+     * MMC1 can see the double write */
+    cpu_write_byte(cpu, addr, old);
+    cpu_write_byte(cpu, addr, value);
   }
-  for (int i = 0; i < 10 - n * 3; i++) {
-    strncat(format, " ", 1);
+}
+
+static inline void
+cpu_adc(cpu_t *cpu, uint8_t m)
+{
+  /* The Ricoh 2A03 used in a NES has decimal mode disabled */
+  uint16_t t = cpu->a + m + cpu->p.c;
+  cpu->p.v = (~(cpu->a ^ m) & (cpu->a ^ t) & 0x80) ? 1 : 0;
+  cpu->p.c = (t > 0xff) ? 1 : 0;
+  cpu->a = t & 0xff;
+  cpu_set_nz(cpu, cpu->a);
+}
+
+static inline void
+cpu_compare(cpu_t *cpu, uint8_t reg, uint8_t m)
+{
+  cpu->p.c = (reg >= m) ? 1 : 0;
+  cpu_set_nz(cpu, reg - m);
+}
+
+static inline void
+cpu_branch(cpu_t *cpu, bool cond, uint16_t addr)
+{
+  if (cond) {
+    uint16_t from = cpu->pc - 2;
+    cpu->cycles += ((cpu->pc ^ addr) & 0xff00) ? 2 : 1;
+    cpu->pc = addr;
+    /* Short loops back may be waiting for vblank, so may jumps */
+    if (unlikely(cpu->idle != NULL) && addr <= from)
+      idle_branch(cpu->idle, cpu, from);
   }
-  strncat(format, str, strlen(str));
-  vprintf(format, args);
-  va_end(args);
 }
-#else
-static void
-cpu_printf(cpu_t *cpu __attribute__((unused)),
-	   int n __attribute__((unused)),
-	   const char *str __attribute__((unused)), ...)
+
+static inline uint8_t
+cpu_asl(cpu_t *cpu, uint8_t m)
 {
+  cpu->p.c = (m >> 7) & 1;
+  m <<= 1;
+  cpu_set_nz(cpu, m);
+  return m;
 }
-#endif
 
-static inline uint16_t
-cpu_wrap_add(uint16_t a, uint16_t b)
+static inline uint8_t
+cpu_lsr(cpu_t *cpu, uint8_t m)
+{
+  cpu->p.c = m & 1;
+  m >>= 1;
+  cpu_set_nz(cpu, m);
+  return m;
+}
+
+static inline uint8_t
+cpu_rol(cpu_t *cpu, uint8_t m)
+{
+  uint8_t c = cpu->p.c;
+  cpu->p.c = (m >> 7) & 1;
+  m = (m << 1) | c;
+  cpu_set_nz(cpu, m);
+  return m;
+}
+
+static inline uint8_t
+cpu_ror(cpu_t *cpu, uint8_t m)
+{
+  uint8_t c = cpu->p.c;
+  cpu->p.c = m & 1;
+  m = (m >> 1) | (c << 7);
+  cpu_set_nz(cpu, m);
+  return m;
+}
+
+static inline void
+cpu_interrupt(cpu_t *cpu, uint16_t vector, bool brk)
 {
-  uint16_t res = a + b;
-  if ((a & 0xff) + b >= 0x100)
-    res &= ~0x100;
-  return res;
+  cpu_push(cpu, cpu->pc >> 8);
+  cpu_push(cpu, cpu->pc & 0xff);
+  cpu_push(cpu, cpu_get_p(cpu) | (brk ? 0x30 : 0x20));
+  cpu->p.i = 1;
+  cpu->pc = cpu_read16(cpu, vector);
+}
+
+/* Loads and stores */
+OP(LDA) { cpu->a = cpu_read_byte(cpu, addr); cpu_set_nz(cpu, cpu->a); }
+OP(LDX) { cpu->x = cpu_read_byte(cpu, addr); cpu_set_nz(cpu, cpu->x); }
+OP(LDY) { cpu->y = cpu_read_byte(cpu, addr); cpu_set_nz(cpu, cpu->y); }
+OP(STA) { cpu_write_byte(cpu, addr, cpu->a); }
+OP(STX) { cpu_write_byte(cpu, addr, cpu->x); }
+OP(STY) { cpu_write_byte(cpu, addr, cpu->y); }
+
+/* Register transfers */
+OP(TAX) { cpu->x = cpu->a; cpu_set_nz(cpu, cpu->x); }
+OP(TAY) { cpu->y = cpu->a; cpu_set_nz(cpu, cpu->y); }
+OP(TXA) { cpu->a = cpu->x; cpu_set_nz(cpu, cpu->a); }
+OP(TYA) { cpu->a = cpu->y; cpu_set_nz(cpu, cpu->a); }
+OP(TSX) { cpu->x = cpu->sp; cpu_set_nz(cpu, cpu->x); }
+OP(TXS) { cpu->sp = cpu->x; }
+
+/* Stack */
+OP(PHA) { cpu_push(cpu, cpu->a); }
+OP(PHP) { cpu_push(cpu, cpu_get_p(cpu) | 0x30); }
+OP(PLA) { cpu->a = cpu_pull(cpu); cpu_set_nz(cpu, cpu->a); }
+OP(PLP) { cpu_set_p(cpu, cpu_pull(cpu)); cpu->p.b = 0; cpu->p.u = 1; }
+
+/* Logic and arithmetic */
+OP(AND) { cpu->a &= cpu_read_byte(cpu, addr); cpu_set_nz(cpu, cpu->a); }
+OP(ORA) { cpu->a |= cpu_read_byte(cpu, addr); cpu_set_nz(cpu, cpu->a); }
+OP(EOR) { cpu->a ^= cpu_read_byte(cpu, addr); cpu_set_nz(cpu, cpu->a); }
+OP(ADC) { cpu_adc(cpu, cpu_read_byte(cpu, addr)); }
+OP(SBC) { cpu_adc(cpu, ~cpu_read_byte(cpu, addr)); }
+OP(CMP) { cpu_compare(cpu, cpu->a, cpu_read_byte(cpu, addr)); }
+OP(CPX) { cpu_compare(cpu, cpu->x, cpu_read_byte(cpu, addr)); }
+OP(CPY) { cpu_compare(cpu, cpu->y, cpu_read_byte(cpu, addr)); }
+OP(BIT) {
+  uint8_t m = cpu_read_byte(cpu, addr);
+  cpu->p.n = (m >> 7) & 1;
+  cpu->p.v = (m >> 6) & 1;
+  cpu->p.z = ((cpu->a & m) == 0) ? 1 : 0;
+}
+
+/* Increments and decrements */
+OP(INX) { cpu->x++; cpu_set_nz(cpu, cpu->x); }
+OP(INY) { cpu->y++; cpu_set_nz(cpu, cpu->y); }
+OP(DEX) { cpu->x--; cpu_set_nz(cpu, cpu->x); }
+OP(DEY) { cpu->y--; cpu_set_nz(cpu, cpu->y); }
+OP(INC) {
+  uint8_t m = cpu_rmw_read(cpu, addr, mode);
+  cpu_set_nz(cpu, m + 1);
+  cpu_rmw_write(cpu, addr, mode, m, m + 1);
+}
+OP(DEC) {
+  uint8_t m = cpu_rmw_read(cpu, addr, mode);
+  cpu_set_nz(cpu, m - 1);
+  cpu_rmw_write(cpu, addr, mode, m, m - 1);
+}
+
+/* Shifts */
+#define OP_SHIFT(name, fn) \
+  OP(name) { \
+    uint8_t m = cpu_rmw_read(cpu, addr, mode); \
+    cpu_rmw_write(cpu, addr, mode, m, fn(cpu, m)); \
+  }
+OP_SHIFT(ASL, cpu_asl)
+OP_SHIFT(LSR, cpu_lsr)
+OP_SHIFT(ROL, cpu_rol)
+OP_SHIFT(ROR, cpu_ror)
+
+/* Jumps and calls */
+OP(JMP) {
+  uint16_t from = cpu->pc - 3;
+  cpu->pc = addr;
+  if (unlikely(cpu->idle != NULL) && mode == MODE_ABS && addr <= from)
+    idle_branch(cpu->idle, cpu, from);
+}
+OP(JSR) {
+  uint16_t t = cpu->pc - 1;
+  cpu_push(cpu, t >> 8);
+  cpu_push(cpu, t & 0xff);
+  cpu->pc = addr;
+}
+OP(RTS) {
+  uint16_t m = cpu_pull(cpu);
+  m |= cpu_pull(cpu) << 8;
+  cpu->pc = m + 1;
+}
+OP(RTI) {
+  uint16_t m;
+  cpu_set_p(cpu, cpu_pull(cpu));
+  cpu->p.b = 0;
+  cpu->p.u = 1;
+  m = cpu_pull(cpu);
+  m |= cpu_pull(cpu) << 8;
+  cpu->pc = m;
+}
+OP(BRK) {
+  /* BRK skips a padding byte */
+  cpu->pc++;
+  cpu_interrupt(cpu, IRQ_ADDRESS, true);
+}
+
+/* Branches */
+OP(BPL) { cpu_branch(cpu, cpu->p.n == 0, addr); }
+OP(BMI) { cpu_branch(cpu, cpu->p.n == 1, addr); }
+OP(BVC) { cpu_branch(cpu, cpu->p.v == 0, addr); }
+OP(BVS) { cpu_branch(cpu, cpu->p.v == 1, addr); }
+OP(BCC) { cpu_branch(cpu, cpu->p.c == 0, addr); }
+OP(BCS) { cpu_branch(cpu, cpu->p.c == 1, addr); }
+OP(BNE) { cpu_branch(cpu, cpu->p.z == 0, addr); }
+OP(BEQ) { cpu_branch(cpu, cpu->p.z == 1, addr); }
+
+/* Status flags */
+OP(CLC) { cpu->p.c = 0; }
+OP(SEC) { cpu->p.c = 1; }
+OP(CLI) { cpu->p.i = 0; }
+OP(SEI) { cpu->p.i = 1; }
+OP(CLV) { cpu->p.v = 0; }
+OP(CLD) { cpu->p.d = 0; }
+OP(SED) { cpu->p.d = 1; }
+
+OP(NOP) {
+  /* The unofficial variants still perform their read */
+  if (mode != MODE_IMP)
+    cpu_read_byte(cpu, addr);
+}
+
+/* Unofficial opcodes */
+OP(JAM) {
+  /* Halts the processor, keep fetching the same opcode */
+  cpu->jammed = true;
+  cpu->pc--;
+}
+OP(LAX) {
+  cpu->a = cpu->x = cpu_read_byte(cpu, addr);
+  cpu_set_nz(cpu, cpu->a);
+}
+OP(SAX) { cpu_write_byte(cpu, addr, cpu->a & cpu->x); }
+OP(SLO) {
+  uint8_t m = cpu_read_byte(cpu, addr);
+  uint8_t r = cpu_asl(cpu, m);
+  cpu_rmw_write(cpu, addr, mode, m, r);
+  cpu->a |= r;
+  cpu_set_nz(cpu, cpu->a);
+}
+OP(RLA) {
+  uint8_t m = cpu_read_byte(cpu, addr);
+  uint8_t r = cpu_rol(cpu, m);
+  cpu_rmw_write(cpu, addr, mode, m, r);
+  cpu->a &= r;
+  cpu_set_nz(cpu, cpu->a);
+}
+OP(SRE) {
+  uint8_t m = cpu_read_byte(cpu, addr);
+  uint8_t r = cpu_lsr(cpu, m);
+  cpu_rmw_write(cpu, addr, mode, m, r);
+  cpu->a ^= r;
+  cpu_set_nz(cpu, cpu->a);
+}
+OP(RRA) {
+  uint8_t m = cpu_read_byte(cpu, addr);
+  uint8_t r = cpu_ror(cpu, m);
+  cpu_rmw_write(cpu, addr, mode, m, r);
+  cpu_adc(cpu, r);
+}
+OP(DCP) {
+  uint8_t m = cpu_read_byte(cpu, addr);
+  cpu_rmw_write(cpu, addr, mode, m, m - 1);
+  cpu_compare(cpu, cpu->a, m - 1);
+}
+OP(ISB) {
+  uint8_t m = cpu_read_byte(cpu, addr);
+  cpu_rmw_write(cpu, addr, mode, m, m + 1);
+  cpu_adc(cpu, ~(m + 1));
+}
+OP(ANC) {
+  cpu->a &= cpu_read_byte(cpu, addr);
+  cpu_set_nz(cpu, cpu->a);
+  cpu->p.c = cpu->p.n;
+}
+OP(ALR) {
+  cpu->a = cpu_lsr(cpu, cpu->a & cpu_read_byte(cpu, addr));
+}
+OP(ARR) {
+  cpu->a = ((cpu->a & cpu_read_byte(cpu, addr)) >> 1) | (cpu->p.c << 7);
+  cpu_set_nz(cpu, cpu->a);
+  cpu->p.c = (cpu->a >> 6) & 1;
+  cpu->p.v = ((cpu->a >> 6) ^ (cpu->a >> 5)) & 1;
+}
+OP(AXS) {
+  uint8_t t = cpu->a & cpu->x;
+  uint8_t m = cpu_read_byte(cpu, addr);
+  cpu->p.c = (t >= m) ? 1 : 0;
+  cpu->x = t - m;
+  cpu_set_nz(cpu, cpu->x);
+}
+OP(LAS) {
+  cpu->a = cpu->x = cpu->sp = cpu_read_byte(cpu, addr) & cpu->sp;
+  cpu_set_nz(cpu, cpu->a);
+}
+/* The unstable opcodes below use the common "magic" constant $EE and
+ * the unindexed high byte approximation */
+OP(XAA) {
+  cpu->a = (cpu->a | 0xee) & cpu->x & cpu_read_byte(cpu, addr);
+  cpu_set_nz(cpu, cpu->a);
+}
+OP(LXA) {
+  cpu->a = cpu->x = (cpu->a | 0xee) & cpu_read_byte(cpu, addr);
+  cpu_set_nz(cpu, cpu->a);
+}
+OP(SHA) { cpu_write_byte(cpu, addr, cpu->a & cpu->x & ((addr >> 8) + 1)); }
+OP(SHX) { cpu_write_byte(cpu, addr, cpu->x & ((addr >> 8) + 1)); }
+OP(SHY) { cpu_write_byte(cpu, addr, cpu->y & ((addr >> 8) + 1)); }
+OP(TAS) {
+  cpu->sp = cpu->a & cpu->x;
+  cpu_write_byte(cpu, addr, cpu->sp & ((addr >> 8) + 1));
+}
+
+/*
+ * One handler per opcode, generated from the opcode table. The base
+ * cycles are accounted before the operation so that memory mapped
+ * registers see the time of the last cycle of the instruction.
+ */
+#define CPU_HANDLER(code, name, mode, base, penalty) \
+  static void \
+  opcode_##code(cpu_t *cpu) \
+  { \
+    cpu->cycles += base; \
+    op_##name(cpu, mode_##mode(cpu, penalty), MODE_##mode); \
+  }
+CPU_OPCODES(CPU_HANDLER)
+#undef CPU_HANDLER
+
+#define CPU_HANDLER_ENTRY(code, name, mode, base, penalty) opcode_##code,
+static const cpu_handler_t cpu_handlers[256] = {
+  CPU_OPCODES(CPU_HANDLER_ENTRY)
+};
+#undef CPU_HANDLER_ENTRY
+
+#define CPU_OPCODE_ENTRY(code, name, mode, base, penalty) \
+  { #name, MODE_##mode, base, penalty },
+const cpu_opcode_t cpu_opcodes[256] = {
+  CPU_OPCODES(CPU_OPCODE_ENTRY)
+};
+#undef CPU_OPCODE_ENTRY
+
+/* Operand size in bytes, indexed by addressing mode */
+const uint8_t cpu_mode_size[] = {
+  0, // MODE_IMP
+  0, // MODE_ACC
+  1, // MODE_IMM
+  1, // MODE_ZP0
+  1, // MODE_ZPX
+  1, // MODE_ZPY
+  2, // MODE_ABS
+  2, // MODE_ABX
+  2, // MODE_ABY
+  2, // MODE_IND
+  1, // MODE_IZX
+  1, // MODE_IZY
+  1, // MODE_REL
+};
+
+/* Disassembles the instruction at addr, returns its size in bytes */
+int
+cpu_disassemble(cpu_t   *cpu,
+                uint16_t addr,
+                char    *buf,
+                size_t   size)
+{
+  const cpu_opcode_t *op = &cpu_opcodes[cpu_read_byte(cpu, addr)];
+  uint16_t m = 0;
+
+  if (cpu_mode_size[op->mode] >= 1)
+    m = cpu_read_byte(cpu, addr + 1);
+  if (cpu_mode_size[op->mode] == 2)
+    m |= cpu_read_byte(cpu, addr + 2) << 8;
+
+  switch (op->mode) {
+  case MODE_IMP: snprintf(buf, size, "%s", op->name); break;
+  case MODE_ACC: snprintf(buf, size, "%s A", op->name); break;
+  case MODE_IMM: snprintf(buf, size, "%s #$%02X", op->name, m); break;
+  case MODE_ZP0: snprintf(buf, size, "%s $%02X", op->name, m); break;
+  case MODE_ZPX: snprintf(buf, size, "%s $%02X,X", op->name, m); break;
+  case MODE_ZPY: snprintf(buf, size, "%s $%02X,Y", op->name, m); break;
+  case MODE_ABS: snprintf(buf, size, "%s $%04X", op->name, m); break;
+  case MODE_ABX: snprintf(buf, size, "%s $%04X,X", op->name, m); break;
+  case MODE_ABY: snprintf(buf, size, "%s $%04X,Y", op->name, m); break;
+  case MODE_IND: snprintf(buf, size, "%s ($%04X)", op->name, m); break;
+  case MODE_IZX: snprintf(buf, size, "%s ($%02X,X)", op->name, m); break;
+  case MODE_IZY: snprintf(buf, size, "%s ($%02X),Y", op->name, m); break;
+  case MODE_REL:
+    snprintf(buf, size, "%s $%04X", op->name,
+             (uint16_t)(addr + 2 + (int8_t)m));
+    break;
+  }
+  return 1 + cpu_mode_size[op->mode];
+}
+
+cpu_handler_t
+cpu_handler(uint8_t opcode)
+{
+  return cpu_handlers[opcode];
 }
 
 void
-cpu_cycle(cpu_t *cpu)
+cpu_nmi(cpu_t *cpu)
 {
-  uint8_t next = cpu_next8(cpu);
-  //printf("%02X (pc=%04x)\n", next, cpu->pc);
-  switch(next) {
-    case 0x09: { // ORA, immediate
-      uint8_t m = cpu_next8(cpu);
-      cpu->a |= m;
-      cpu->p.n = (cpu->a >> 7) & 1;
-      cpu->p.z = (cpu->a == 0) ? 1 : 0;
-      cpu_printf(cpu, 2, "ORA #$%02X\n", m);
-      break;
-    }
-    case 0x0A: { // ASL, accumulator
-      uint8_t b;
-      cpu->p.c = (cpu->a >> 7) & 1;
-      b = (cpu->a << 1) & 0xFE;
-      cpu->p.n = (b >> 7) & 1;
-      cpu->p.z = (b == 0) ? 1 : 0;
-      cpu_printf(cpu, 1, "ASL A\n");
-      break;
-    }
-    case 0x10: { // BPL, relative
-      uint8_t m = cpu_next8(cpu);
-      uint16_t addr = cpu_wrap_add(cpu->pc, m);
-      cpu_printf(cpu, 2, "BPL $%04X (?%x)\n", addr, cpu->p.n == 0);
-      if (cpu->p.n == 0) cpu->pc = addr;
-      break;
-    }
-    case 0x20: { // JSR
-      uint16_t addr = cpu_next16(cpu);
-      uint16_t t = cpu->pc - 1;
-      cpu->mem[0x100 | cpu->sp--] = t >> 8;
-      cpu->mem[0x100 | cpu->sp--] = t & 0xFF;
-      cpu_printf(cpu, 3, "JSR $%04X\n", addr);
-      cpu->pc = addr;
-      break;
-    }
-    case 0x29: { // AND, immediate
-      uint8_t m = cpu_next8(cpu);
-      cpu->a &= m;
-      cpu->p.n = (cpu->a >> 7) & 1;
-      cpu->p.z = (cpu->a == 0) ? 1 : 0;
-      cpu_printf(cpu, 2, "AND #$%02X\n", m);
-      break;
-    }
-    case 0x2C: { // BIT, absolute
-      uint16_t m = cpu_next16(cpu);
-      uint16_t t = cpu->a & m;
-      cpu->p.n = (t >> 7) & 1;
-      cpu->p.v = (t >> 6) & 1;
-      cpu->p.z = (t == 0) ? 1 : 0;
-      cpu_printf(cpu, 3, "BIT $%04X = #&02X\n", m, cpu->a);
-      break;
-    }
-    case 0x38: { // SEC, implied
-      cpu->p.c = 1;
-      cpu_printf(cpu, 1, "SEC\n");
-      break;
-    }
-    case 0x48: { // PHA, accumulator
-      cpu->mem[0x100 | cpu->sp--] = cpu->a;
-      cpu_printf(cpu, 1, "PHA\n");
-      break;
-    }
-    case 0x4A: { // LSR, accumulator
-      uint8_t b = cpu->a;
-      cpu->p.n = 0;
-      b = (b >> 1) & 0x7F;
-      cpu->p.z = (b == 0) ? 1 : 0;
-      cpu_printf(cpu, 1, "LSR A\n");
-      break;
-    }
-    case 0x4C: { // JMP, absolute
-      uint16_t m = cpu_next16(cpu);
-      cpu_printf(cpu, 3, "JMP $%04X\n", m);
-      cpu->pc = m;
-      break;
-    }
-    case 0x60: { // RTS
-      uint16_t m;
-      m = cpu->mem[0x100 | ++cpu->sp];
-      m |= cpu->mem[0x100 | ++cpu->sp] << 8;
-      cpu_printf(cpu, 1, "RTS -------------------\n");
-      cpu->pc = m + 1;
-      break;
-    }
-    case 0x65: { // ADC, zero page
-      uint16_t t, m = cpu_next8(cpu);
-      t = cpu->a + m + cpu->p.c;
-      cpu->p.v = (((cpu->a >> 7) & 1) != ((cpu->a >> 7) & 1)) ? 1 : 0;
-      cpu->p.n = (cpu->a >> 7) & 1;
-      cpu->p.z = (t == 0) ? 1 : 0;
-      if (cpu->p.d) {
-	/* Normally A and M should be BCD() in a 6502, but
-	 * Ricoh 2A03 used in a NES has decimal mode disabled
-	 */
-	t = cpu->a + m + cpu->p.c;
-	cpu->p.c = (t > 99) ? 1:0;
-      } else
-	cpu->p.c = (t > 255) ? 1:0;
-      cpu->a = t & 0xFF;
-      cpu_printf(cpu, 2, "ADC $%04X = #$%02X\n", m, cpu->a);
-      break;
-    }
-    case 0x68: { // PLA
-      cpu->a = cpu->mem[0x100 | ++cpu->sp];
-      cpu->p.n = (cpu->a >> 7) & 1;
-      cpu->p.z = (cpu->a == 0) ? 1 : 0;
-      cpu_printf(cpu, 1, "PLA\n");
-      break;
-    }
-    case 0x78: { // SEI
-      cpu->p.i = 1;
-      cpu_printf(cpu, 1, "SEI\n");
-      break;
-    }
-    case 0x85: { // STA, zero page
-      uint16_t addr = cpu_next8(cpu);
-      cpu_write_byte(cpu, addr, cpu->a);
-      cpu_printf(cpu, 2, "STA $%04X = #$%02X\n", addr, cpu->a);
-      break;
-    }
-    case 0x86: { // STX, zero page
-      uint16_t addr = cpu_next8(cpu);
-      cpu_write_byte(cpu, addr, cpu->x);
-      cpu_printf(cpu, 2, "STX $%04X = #$%02X\n", addr, cpu->x);
-      break;
-    }
-    case 0x88: { // DEY
-      cpu->y--;
-      cpu->p.z = (cpu->y == 0) ? 1 : 0;
-      cpu->p.n = (cpu->y >> 7) & 1;
-      cpu_printf(cpu, 1, "DEY\n");
-      break;
-    }
-    case 0x8A: { // TXA
-      cpu->a = cpu->x;
-      cpu_printf(cpu, 1, "TXA\n");
-      break;
-    }
-    case 0x8D: { // STA
-      uint16_t m = cpu_next16(cpu);
-      cpu_printf(cpu, 3, "STA $%04X = #%02X\n", m, cpu->a);
-      cpu_write_byte(cpu, m, cpu->a);
-      break;
-    }
-    case 0x90: { // BCC, relative
-      uint8_t m = cpu_next8(cpu);
-      uint16_t addr = cpu_wrap_add(cpu->pc, m);
-      cpu_printf(cpu, 2, "BCC $%04X (?%x)\n", addr, cpu->p.c == 0);
-      if (cpu->p.c == 0) cpu->pc = addr;
-      break;
-    }
-    case 0x91: { // STA, indirect, Y
-      uint16_t m = cpu_next8(cpu);
-      cpu_printf(cpu, 2, "STA ($%02X),Y @ $%04X = #&%02X\n",
-		 m, cpu->y, cpu->a);
-      cpu_write_byte(cpu, m, cpu->y);
-      break;
-    }
-    case 0x9A: { // TXS
-      cpu->sp = cpu->x;
-      cpu_printf(cpu, 1, "TXS\n");
-      break;
-    }
-    case 0x98: { // TYA
-      cpu->a = cpu->y;
-      cpu_printf(cpu, 1, "TYA\n");
-      break;
-    }
-    case 0x99: { // STA, absolute, y
-      uint16_t m = cpu_next16(cpu);
-      cpu_printf(cpu, 3, "STA #&%04X,Y\n", cpu->y);
-      cpu_write_byte(cpu, m, cpu->y);
-      break;
-    }
-    case 0xA0: { // LDY, immediate
-      cpu->y = cpu_next8(cpu);
-      cpu->p.n = (cpu->y >> 7) & 1;
-      cpu->p.z = (cpu->y == 0) ? 1 : 0;
-      cpu_printf(cpu, 2, "LDY #&%02X\n", cpu->y);
-      break;
-    }
-    case 0xA2: { // LDX, immediate
-      cpu->x = cpu_next8(cpu);
-      cpu->p.n = (cpu->x >> 7) & 1;
-      cpu->p.z = (cpu->x == 0) ? 1 : 0;
-      cpu_printf(cpu, 2, "LDX #&%02X\n", cpu->x);
-      break;
-    }
-    case 0xA8: { // TAY, implied
-      cpu->y = cpu->a;
-      cpu_printf(cpu, 1, "TAY\n");
-      break;
-    }
-    case 0xA9: { // LDA, immediate
-      cpu->a = cpu_next8(cpu);
-      cpu->p.n = (cpu->a >> 7) & 1;
-      cpu->p.z = (cpu->a == 0) ? 1 : 0;
-      cpu_printf(cpu, 2, "LDA #&%02X\n", cpu->a);
-      break;
-    }
-    case 0xAA: { // TAX, implied
-      cpu->x = cpu->a;
-      cpu_printf(cpu, 1, "TAX\n");
-      break;
-    }
-    case 0xAC: { // LDY, absolute
-      uint16_t addr = cpu_next16(cpu);
-      cpu->y = cpu_read_byte(cpu, addr);
-      cpu->p.n = (cpu->y >> 7) & 1;
-      cpu->p.z = (cpu->y == 0) ? 1 : 0;
-      cpu_printf(cpu, 3, "LDY $%04X = #&%02X (n=%d)\n", addr, cpu->y, cpu->p.n);
-      break;
-    }
-    case 0xAD: { // LDA, absolute
-      uint16_t addr = cpu_next16(cpu);
-      cpu->a = cpu_read_byte(cpu, addr);
-      cpu->p.n = (cpu->a >> 7) & 1;
-      cpu->p.z = (cpu->a == 0) ? 1 : 0;
-      cpu_printf(cpu, 3, "LDA $%04X = #&%02X (n=%d)\n", addr, cpu->a, cpu->p.n);
-      break;
-    }
-    case 0xAE: { // LDX, absolute
-      uint16_t addr = cpu_next16(cpu);
-      cpu->x = cpu_read_byte(cpu, addr);
-      cpu->p.n = (cpu->x >> 7) & 1;
-      cpu->p.z = (cpu->x == 0) ? 1 : 0;
-      cpu_printf(cpu, 3, "LDX $%04X = #&%02X (n=%d)\n", addr, cpu->x, cpu->p.n);
-      break;
-    }
-    case 0xB0: { // BCS, relative
-      uint16_t m = cpu_next8(cpu);
-      uint16_t addr = cpu_wrap_add(cpu->pc, m);
-      cpu_printf(cpu, 2, "BCS $%04X (?%d)\n", addr, cpu->p.c == 1);
-      if (cpu->p.c == 1) cpu->pc = addr;
-      break;
-    }
-    case 0xB1: { // LDA, indirect, Y
-      uint8_t addr = cpu_next8(cpu);
-      uint16_t t = cpu_read16(cpu, addr);
-      // FIXME: wrong here some where.
-      cpu->a = t;
-      cpu->p.n = (t >> 7) & 1;
-      cpu->p.z = (t == 0) ? 1 : 0;
-      cpu_printf(cpu, 2, "LDA ($%02X),Y @ $%04X = #&%02X\n",
-      		 addr, t, cpu->a);
-      break;
-    }
-    case 0xBD: { // LDA, absolute, X
-      uint16_t addr = cpu_next16(cpu);
-      cpu->a = cpu_read_byte(cpu, addr);
-      cpu->p.n = (cpu->a >> 7) & 1;
-      cpu->p.z = (cpu->a == 0) ? 1 : 0;
-      cpu_printf(cpu, 3, "LDA $%04X,X = #&%02X\n", addr, cpu->a);
-      break;
-    }
-    case 0xC0: { // CPY, immediate
-      uint16_t m = cpu_next8(cpu);
-      uint16_t t = cpu->y - m;
-      cpu->p.n = (t >> 7) & 1;
-      cpu->p.c = (cpu->y >= m) ? 1 : 0;
-      cpu->p.z = (t == 0) ? 1 : 0;
-      cpu_printf(cpu, 2, "CPY #$%02X\n", m);
-      break;
-    }
-    case 0xC8: { // INY
-      cpu->y++;
-      cpu->p.z = (cpu->y == 0) ? 1 : 0;
-      cpu->p.n = (cpu->y >> 7) & 1;
-      cpu_printf(cpu, 1, "INY\n");
-      break;
-    }
-    case 0xCA: { // DEX
-      cpu->x--;
-      cpu->p.z = (cpu->x == 0) ? 1 : 0;
-      cpu->p.n = (cpu->x >> 7) & 1;
-      cpu_printf(cpu, 1, "DEX\n");
-      break;
-    }
-    case 0xC9: { // CMP, immediate
-      uint16_t m = cpu_next8(cpu);
-      uint16_t t = cpu->a - m;
-      cpu->p.n = (t >> 7) & 1;
-      cpu->p.c = (cpu->a >= m) ? 1 : 0;
-      cpu->p.z = (t == 0) ? 1 : 0;
-      cpu_printf(cpu, 2, "CMP #&%02X\n", m);
-      break;
-    }
-    case 0xD0: { // BNE, relative
-      uint8_t m = cpu_next8(cpu);
-      uint16_t addr = cpu_wrap_add(cpu->pc, m);
-      cpu_printf(cpu, 2, "BNE $%04X (?%d)\n", addr, cpu->p.z == 0);
-      if (cpu->p.z == 0) cpu->pc = addr;
-      break;
-    }
-    case 0xD8: { // CLD
-      cpu->p.d = 0;
-      cpu_printf(cpu, 1, "CLD\n");
-      break;
-    }
-    case 0xE0: { // CPX, immediate
-      uint16_t m = cpu_next8(cpu);
-      uint16_t t = cpu->x - m;
-      cpu->p.n = (t >> 7) & 1;
-      cpu->p.c = (cpu->x >= m) ? 1 : 0;
-      cpu->p.z = (t == 0) ? 1 : 0;
-      cpu_printf(cpu, 2, "CPX #&%02X\n", m);
-      break;
-    }
-    case 0xEE: { // INC, absolute
-      uint16_t addr = cpu_next16(cpu);
-      uint16_t value = cpu_read_byte(cpu, addr);
-      uint16_t m = (value + 1) & 0xff;
-      cpu_write_byte(cpu, addr, m);
-      cpu->p.n = (m >> 7) & 1;
-      cpu->p.z = (m == 0) ? 1 : 0;
-      cpu_printf(cpu, 3, "INC $%04X = #&%02X\n", addr, m);
-      break;
-    }
-    default:
-      cpu_printf(cpu, 1, "OPCODE $%02X not implemented\n", next);
-      exit(-1);
-      break;
+  cpu->nmi = 1;
+}
+
+static void
+cpu_poll_interrupts(cpu_t *cpu)
+{
+  if (cpu->nmi) {
+    cpu->nmi = 0;
+    cpu_interrupt(cpu, NMI_ADDRESS, false);
+    cpu->cycles += 7;
+    if (unlikely(cpu->prof != NULL))
+      prof_interrupt(cpu->prof, cpu, true);
+  } else if (cpu->irq && !cpu->p.i) {
+    cpu_interrupt(cpu, IRQ_ADDRESS, false);
+    cpu->cycles += 7;
+    if (unlikely(cpu->prof != NULL))
+      prof_interrupt(cpu->prof, cpu, false);
   }
+}
+
+void
+cpu_cycle(cpu_t *cpu)
+{
+  /* A masked IRQ can stay asserted for long, the APU frame IRQ of a
+   * game that never acknowledges it, so check the mask here too */
+  if (unlikely(cpu->nmi | (cpu->irq && !cpu->p.i)))
+    cpu_poll_interrupts(cpu);
 
+  if (unlikely(cpu->trace != NULL))
+    trace_instruction(cpu->trace, cpu);
+  if (unlikely(cpu->prof != NULL)) {
+    uint16_t pc = cpu->pc;
+    uint64_t start = cpu->cycles;
+    uint8_t opcode = cpu_next8(cpu);
+    cpu_handlers[opcode](cpu);
+    cpu->instructions++;
+    prof_instruction(cpu->prof, cpu, pc, opcode, start);
+    return;
+  }
+  cpu_handlers[cpu_next8(cpu)](cpu);
   cpu->instructions++;
 }
 
 void
-cpu_nmi_handler(cpu_t *cpu)
+cpu_reset(cpu_t *cpu)
 {
-  uint16_t addr;
-  addr = cpu_read16(cpu, NMI_ADDRESS);
+  cpu->sp = 0xFD;
+  cpu_set_p(cpu, 0x24);
+  cpu->pc = cpu_read16(cpu, RESET_ADDRESS);
+  cpu->cycles = 7;
+  cpu->jammed = false;
+}
 
-  printf("NMI handler: %04X\n", addr);
-  if (addr) {
-    cpu->pc = addr;
-  }
-  ppu_nmi_disable(cpu->emu->ppu);
+/* Saves or loads the registers and internal RAM, the memory map is
+ * set up by the cartridge and not part of the state */
+void
+cpu_state(cpu_t   *cpu,
+	  state_t *s)
+{
+  uint8_t p = cpu_get_p(cpu);
+
+  STATE_FIELD(s, cpu->ram);
+  STATE_FIELD(s, cpu->pc);
+  STATE_FIELD(s, cpu->a);
+  STATE_FIELD(s, cpu->x);
+  STATE_FIELD(s, cpu->y);
+  STATE_FIELD(s, cpu->sp);
+  STATE_FIELD(s, p);
+  STATE_FIELD(s, cpu->instructions);
+  STATE_FIELD(s, cpu->cycles);
+  STATE_FIELD(s, cpu->nmi);
+  STATE_FIELD(s, cpu->irq);
+  STATE_FIELD(s, cpu->jammed);
+  if (s->loading)
+    cpu_set_p(cpu, p);
 }
 
 void
@@ -492,20 +823,23 @@ cpu_dump(cpu_t *cpu)
          cpu->p.i ? 'I' : ' ',
          cpu->p.z ? 'Z' : ' ',
          cpu->p.c ? 'C' : ' ');
+  printf("Cycles: %llu, instructions: %u\n",
+         (unsigned long long)cpu->cycles, cpu->instructions);
   printf("===[ CPU DUMP STOP ]===\n\n");
 }
 
+/* Runs instructions until the deadline, in CPU cycles, is reached.
+ * Memory mapped devices may pull the deadline in. */
 void
-cpu_run(cpu_t *cpu,
-	uint16_t address)
+cpu_run(cpu_t   *cpu,
+	uint64_t deadline)
 {
-    cpu->pc = address;
-    while (1) {
-      bool nmi = ppu_nmi_is_enabled(cpu->emu->ppu);
+    if (cpu->jit) {
+      jit_run(cpu->jit, cpu, deadline);
+      return;
+    }
+    cpu->deadline = deadline;
+    while (cpu->cycles < cpu->deadline) {
       cpu_cycle(cpu);
-      if (nmi) {
-	cpu_nmi_handler(cpu);
-      }
-      ppu_run(cpu->emu->ppu, 4);
     }
 }
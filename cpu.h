@@ -1,17 +1,53 @@
 #ifndef __CPU_H__
 #define __CPU_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "emu.h"
 
+/* Sources of the IRQ line, bits of cpu_t.irq */
+#define CPU_IRQ_MAPPER 0x01
+#define CPU_IRQ_FRAME  0x02
+#define CPU_IRQ_DMC    0x04
+
+/* Runs one instruction, the PC is past the opcode */
+typedef void (*cpu_handler_t)(cpu_t *cpu);
+
 cpu_t* cpu_create(emu_t *emu);
+void cpu_destroy(cpu_t *cpu);
 void cpu_map(cpu_t   *cpu,
 	     uint16_t dest,
 	     const uint8_t *src,
-	     uint16_t  size);
-void cpu_run(cpu_t *cpu,
-	     uint16_t address);
+	     uint32_t  size);
+void cpu_map_ram(cpu_t   *cpu,
+		 uint16_t dest,
+		 uint8_t *src,
+		 uint32_t size);
+void cpu_map_io(cpu_t       *cpu,
+		uint16_t     dest,
+		uint32_t     size,
+		cpu_read_fn  read,
+		cpu_write_fn write,
+		void        *opaque);
+uint8_t cpu_read(cpu_t   *cpu,
+		 uint16_t addr);
+void cpu_reset(cpu_t *cpu);
+void cpu_state(cpu_t   *cpu,
+	       state_t *s);
+void cpu_cycle(cpu_t *cpu);
+void cpu_run(cpu_t   *cpu,
+	     uint64_t deadline);
+/* Handler of an opcode, the JIT calls it for what it does not translate */
+cpu_handler_t cpu_handler(uint8_t opcode);
+void cpu_nmi(cpu_t *cpu);
+uint8_t cpu_get_p(cpu_t *cpu);
+void cpu_set_p(cpu_t   *cpu,
+	       uint8_t  value);
+int cpu_disassemble(cpu_t   *cpu,
+		    uint16_t addr,
+		    char    *buf,
+		    size_t   size);
 void cpu_dump(cpu_t *cpu);
 
 #endif /* __CPU_H__ */
@@ -1,36 +1,341 @@
 /* Global emulator structures */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "apu.h"
+#include "audio.h"
+#include "idle.h"
 #include "ines.h"
+#include "input.h"
+#include "jit.h"
+#include "mapper.h"
+#include "movie.h"
 #include "emu.h"
 #include "cpu.h"
 #include "ppu.h"
+#include "rewind.h"
+#include "romdb.h"
+#include "state.h"
+#include "video.h"
+
+/* The PPU is only run when its registers are accessed or when its
+ * next event is due, until then the CPU runs ahead of it */
+static uint8_t
+emu_ppu_read(void *opaque, uint16_t addr)
+{
+  emu_t *emu = (emu_t*)opaque;
+  ppu_catch_up(emu->ppu, emu_clock(emu));
+  return ppu_read(emu->ppu, addr);
+}
+
+static void
+emu_ppu_write(void *opaque, uint16_t addr, uint8_t value)
+{
+  emu_t *emu = (emu_t*)opaque;
+  ppu_catch_up(emu->ppu, emu_clock(emu));
+  ppu_write(emu->ppu, addr, value);
+  /* PPUCTRL and PPUMASK can move the next event, return to emu_step()
+   * so it is scheduled again */
+  if ((addr & 7) < 2)
+    emu->cpu->deadline = emu->cpu->cycles;
+}
+
+/* 0x4000..0x401f is APU and I/O, the rest of the page is open bus */
+static uint8_t
+emu_io_read(void *opaque, uint16_t addr)
+{
+  emu_t *emu = (emu_t*)opaque;
+
+  if (addr == 0x4015) {
+    apu_catch_up(emu->apu, emu->cpu->cycles);
+    return apu_read(emu->apu, addr);
+  }
+  /* Only bit 0 is driven, the rest is open bus from the address */
+  if (addr == 0x4016 || addr == 0x4017)
+    return input_read(emu->input, addr - 0x4016) | (addr >> 8);
+  if (addr <= 0x401f)
+    return 0;
+  return addr >> 8;
+}
+
+/* $4014, OAM DMA. Pages backed by memory are copied at once, others
+ * are read through their handlers. The CPU is stalled for 513 cycles,
+ * plus one to align on an odd cycle. */
+static void
+emu_oam_dma(emu_t *emu, uint8_t page)
+{
+  cpu_t *cpu = emu->cpu;
+  const uint8_t *src = cpu->read_map[page];
+  uint8_t buf[256];
+
+  ppu_catch_up(emu->ppu, emu_clock(emu));
+  if (src == NULL) {
+    for (int i = 0; i < 256; i++) {
+      buf[i] = cpu_read(cpu, (page << 8) | i);
+    }
+    src = buf;
+  }
+  ppu_oam_dma(emu->ppu, src);
+  cpu->cycles += 513 + (cpu->cycles & 1);
+}
+
+static void
+emu_io_write(void *opaque,
+             uint16_t addr,
+             uint8_t value)
+{
+  emu_t *emu = (emu_t*)opaque;
+
+  switch (addr) {
+  case 0x4014:
+    emu_oam_dma(emu, value);
+    break;
+  case 0x4016:
+    input_write(emu->input, value);
+    break;
+  default:
+    if (addr > 0x4017)
+      break;
+    apu_catch_up(emu->apu, emu->cpu->cycles);
+    apu_write(emu->apu, addr, value);
+    /* The DMC and the frame counter can move the next event */
+    if (addr == 0x4010 || addr == 0x4015 || addr == 0x4017)
+      emu->cpu->deadline = emu->cpu->cycles;
+    break;
+  }
+}
 
 emu_t*
-emu_create(void)
+emu_create(video_t *video)
 {
   emu_t * emu;
 
   emu = (emu_t*)calloc(sizeof(emu_t), 1);
+  emu->video = video;
   emu->cpu = cpu_create(emu);
+  emu->cpu->idle = idle_create();
   emu->ppu = ppu_create(emu);
+  emu->apu = apu_create(emu);
+  emu->input = input_create();
+  emu->prg_ram = (uint8_t*)calloc(sizeof(uint8_t), 0x2000);
+  emu->chr_ram_size = 0x2000;
+  emu->chr_ram = (uint8_t*)calloc(sizeof(uint8_t), emu->chr_ram_size);
+
+  /* 0x2000..0x3fff is PPU and mirrors */
+  cpu_map_io(emu->cpu, 0x2000, 0x2000, emu_ppu_read, emu_ppu_write, emu);
+  cpu_map_io(emu->cpu, 0x4000, 0x100, emu_io_read, emu_io_write, emu);
+  cpu_map_ram(emu->cpu, 0x6000, emu->prg_ram, 0x2000);
+  ppu_map_chr_ram(emu->ppu, 0x0000, emu->chr_ram, 0x2000);
 
   return emu;
 }
 
 void
+emu_destroy(emu_t *emu)
+{
+    if (emu->mapper)
+      mapper_destroy(emu->mapper);
+    if (emu->cart)
+      ines_destroy(emu->cart);
+    if (emu->cpu->idle)
+      idle_destroy(emu->cpu->idle);
+    cpu_destroy(emu->cpu);
+    ppu_destroy(emu->ppu);
+    apu_destroy(emu->apu);
+    input_destroy(emu->input);
+    free(emu->prg_ram);
+    free(emu->chr_ram);
+    free(emu->runahead_state);
+    free(emu);
+}
+
+/* Inserts a cartridge and resets the machine, returns -1 when the
+ * file cannot be loaded */
+int
 emu_load(emu_t *emu, const char *filename)
 {
     ines_t *nes;
+    mapper_t *mapper;
 
     nes = ines_load(filename);
-    cpu_map(emu->cpu, 0x8000, nes->prg, ines_prg_size(nes) * 1024);
-    ppu_map(emu->ppu, 0x0000, nes->chr, ines_chr_size(nes) * 1024);
+    if (nes == NULL)
+      return -1;
+    if (emu->romdb && romdb_fix(emu->romdb, nes))
+      printf("Header corrected from the ROM index\n");
+
+    if (ines_chr_size(nes) == 0 && nes->chr_ram_size > emu->chr_ram_size) {
+      free(emu->chr_ram);
+      emu->chr_ram_size = nes->chr_ram_size;
+      emu->chr_ram = (uint8_t*)calloc(sizeof(uint8_t), emu->chr_ram_size);
+    }
+
+    /* The board maps PRG and CHR in place */
+    mapper = mapper_create(emu, nes);
+    if (mapper == NULL) {
+      ines_destroy(nes);
+      return -1;
+    }
+    /* Blocks are keyed by host addresses of the old ROM */
+    if (emu->cpu->jit)
+      jit_flush(emu->cpu->jit);
+    if (emu->mapper)
+      mapper_destroy(emu->mapper);
+    if (emu->cart)
+      ines_destroy(emu->cart);
+    emu->cart = nes;
+    emu->mapper = mapper;
+
+    if (nes->trainer)
+      memcpy(emu->prg_ram + 0x1000, nes->trainer, INES_TRAINER_SIZE);
+    cpu_reset(emu->cpu);
+    apu_reset(emu->apu, emu->cpu->cycles);
+    /* Synthesizing from the first cycle keeps savestates of the same
+     * run alike whether or not they were loaded */
+    if (emu->audio)
+      apu_set_rate(emu->apu, audio_rate(emu->audio));
+    return 0;
 }
 
-void
-emu_run(emu_t *emu)
+/* Runs the CPU uninterrupted until the next scheduled event, then
+ * brings the PPU and APU up to the same point in time */
+static void
+emu_step(emu_t *emu)
+{
+    uint64_t deadline = ppu_next_event(emu->ppu);
+    uint64_t apu_event = apu_next_event(emu->apu);
+
+    if (apu_event < deadline)
+      deadline = apu_event;
+    cpu_run(emu->cpu,
+            (deadline + MASTER_CPU_DIVIDER - 1) / MASTER_CPU_DIVIDER);
+    ppu_catch_up(emu->ppu, emu_clock(emu));
+    apu_catch_up(emu->apu, emu->cpu->cycles);
+}
+
+/* Hands the sound of the frame to the audio output, and sets the rate
+ * of the next one so the output queue stays at its latency */
+static void
+emu_audio_frame(emu_t *emu)
+{
+    int16_t samples[APU_MAX_SAMPLES];
+    size_t count = apu_end_frame(emu->apu, samples, APU_MAX_SAMPLES);
+
+    audio_write(emu->audio, samples, count);
+    apu_set_rate(emu->apu, audio_rate(emu->audio));
+}
+
+static int
+emu_run_frame_once(emu_t *emu)
+{
+    uint16_t frame = emu->ppu->framecount;
+
+    while (emu->ppu->framecount == frame) {
+      if (unlikely(emu->cpu->jammed))
+        return EMU_JAMMED;
+      emu_step(emu);
+    }
+    return EMU_OK;
+}
+
+/* Runs the frame heard but not seen, then the next emu->runahead
+ * frames seen but not heard, and goes back to the end of the first.
+ * Input read during the frame is then shown as many frames earlier as
+ * the game takes to react to it. */
+static int
+emu_run_ahead(emu_t *emu)
+{
+    size_t size = state_size(emu);
+    uint64_t skipped = 0;
+    int ret;
+
+    if (emu->runahead_size < size) {
+      free(emu->runahead_state);
+      emu->runahead_state = (uint8_t*)malloc(size);
+      emu->runahead_size = size;
+    }
+
+    emu->ppu->hidden = true;
+    ret = emu_run_frame_once(emu);
+    if (ret != EMU_OK) {
+      emu->ppu->hidden = false;
+      return ret;
+    }
+    if (emu->audio)
+      emu_audio_frame(emu);
+
+    state_save(emu, emu->runahead_state, size);
+    /* The cycles skipped in the frames run ahead go back with them */
+    if (emu->cpu->idle)
+      skipped = idle_skipped(emu->cpu->idle);
+    apu_set_quiet(emu->apu, true);
+    /* Only the last frame is drawn. One jamming on the way is shown
+     * for real once the emulator gets there. */
+    for (uint32_t i = 0; i < emu->runahead && ret == EMU_OK; i++) {
+      emu->ppu->hidden = i + 1 < emu->runahead;
+      ret = emu_run_frame_once(emu);
+    }
+    state_load(emu, emu->runahead_state, size);
+    if (emu->cpu->idle)
+      idle_set_skipped(emu->cpu->idle, skipped);
+    apu_set_quiet(emu->apu, false);
+    emu->ppu->hidden = false;
+    return EMU_OK;
+}
+
+/* Sets the buttons of the frame, from the host or the movie. Returns
+ * false at the end of the movie. */
+static bool
+emu_input_frame(emu_t *emu)
+{
+    uint8_t buttons[INPUT_PORTS] = { video_buttons(emu->video), 0 };
+
+    if (emu->movie && !movie_frame(emu->movie, buttons))
+      return false;
+    for (int i = 0; i < INPUT_PORTS; i++)
+      input_set(emu->input, i, buttons[i]);
+    return true;
+}
+
+/* Returns EMU_JAMMED once the CPU halted, the frame is not finished,
+ * and EMU_MOVIE_END when there is no more input to play back */
+int
+emu_run_frame(emu_t *emu)
+{
+    int ret;
+
+    if (!emu_input_frame(emu))
+      return EMU_MOVIE_END;
+    /* Rewinding goes back to the start of the last frame run and runs
+     * it again with its own input. The oldest state recorded is kept,
+     * and shown for as long as rewind is held. */
+    if (emu->rewind) {
+      if (video_rewinding(emu->video) && rewind_pop(emu->rewind)) {
+        if (emu->rewind->count == 0)
+          rewind_push(emu->rewind);
+      } else {
+        rewind_push(emu->rewind);
+      }
+    }
+    if (emu->runahead)
+      return emu_run_ahead(emu);
+    ret = emu_run_frame_once(emu);
+    if (ret == EMU_OK && emu->audio)
+      emu_audio_frame(emu);
+    return ret;
+}
+
+/* Runs until the user quits, or for a number of frames if non-zero */
+int
+emu_run(emu_t *emu, uint64_t frames)
 {
-    cpu_run(emu->cpu, 0x8000);
+    for (uint64_t i = 0; frames == 0 || i < frames; i++) {
+      int ret = emu_run_frame(emu);
+      if (ret != EMU_OK)
+        return ret;
+      if (!video_poll(emu->video))
+        break;
+    }
+    return EMU_OK;
 }
@@ -3,8 +3,27 @@
 
 #include "types.h"
 
-emu_t* emu_create(void);
-void emu_load(emu_t *emu, const char *filename);
-void emu_run(emu_t *emu);
+/* The NTSC master clock runs at 21.477272Mhz, the CPU divides it by 12
+ * and the PPU by 4, giving three PPU dots per CPU cycle */
+#define MASTER_CPU_DIVIDER 12
+#define MASTER_PPU_DIVIDER 4
+
+/* Results of running the emulator */
+#define EMU_OK 0
+#define EMU_JAMMED -1
+#define EMU_MOVIE_END -2
+
+emu_t* emu_create(video_t *video);
+void emu_destroy(emu_t *emu);
+int emu_load(emu_t *emu, const char *filename);
+int emu_run_frame(emu_t *emu);
+int emu_run(emu_t *emu, uint64_t frames);
+
+/* Current time of the master clock, as seen by the CPU */
+static inline uint64_t
+emu_clock(emu_t *emu)
+{
+  return emu->cpu->cycles * MASTER_CPU_DIVIDER;
+}
 
 #endif /* __EMU_H__ */
@@ -0,0 +1,654 @@
+/* Video filters, each band of lines is converted to ARGB and filtered
+ * by one task of a thread pool */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "filter.h"
+#include "pool.h"
+#include "render.h"
+
+/* Lines of the frame in each task */
+#define FILTER_BAND_LINES 16
+#define FILTER_BANDS ((VIDEO_HEIGHT + FILTER_BAND_LINES - 1) / FILTER_BAND_LINES)
+/* Past this the bands wait on memory more than on the threads */
+#define FILTER_MAX_THREADS 4
+/* A converted line, with the edge pixels repeated on both sides */
+#define FILTER_ROW (VIDEO_WIDTH + 2)
+
+/* hqx thresholds on the difference of Y, U and V */
+#define FILTER_HQ_Y 48
+#define FILTER_HQ_U 7
+#define FILTER_HQ_V 6
+
+/* The PPU puts out 8 samples of the composite signal per pixel, at
+ * twelve phases of the color subcarrier. An output pixel averages one
+ * subcarrier cycle around it, for luma and for the two chroma
+ * components demodulated with the phase. Hue and saturation of the
+ * decoder are those the palette was made with. */
+#define FILTER_NTSC_SAMPLES 8
+#define FILTER_NTSC_CYCLE 12
+#define FILTER_NTSC_MAX_SCALE 4
+#define FILTER_NTSC_HUE 4.0
+#define FILTER_NTSC_SATURATION 1.6
+#define FILTER_NTSC_BLACK 0.518
+#define FILTER_NTSC_WHITE 1.962
+#define FILTER_NTSC_EMPHASIS 0.746
+
+/* A line and the lines above and below, FILTER_ROW pixels from the
+ * left of the first */
+typedef struct {
+  const uint32_t *rgb[3];
+  /* Their colors with the emphasis, indices into the palettes, only
+   * for the filters comparing colors */
+  const uint16_t *indices[3];
+} filter_rows_t;
+
+typedef void (*filter_line_fn)(const filter_t      *filter,
+                               const filter_rows_t *rows,
+                               uint32_t            *out,
+                               int                  pitch);
+
+typedef struct {
+  const char *name;
+  int scale;
+  /* NULL for NTSC, which works on the colors instead of ARGB */
+  filter_line_fn line;
+  bool indices;
+} filter_kind_t;
+
+/* Y, I and Q a pixel adds to the output pixels of the pixel to its
+ * right, its own and the one to its left, for each of the three phases
+ * it can start at. Up to four output pixels in a row, so that a pixel
+ * takes a vector for each of Y, I and Q. */
+typedef float filter_ntsc_t[3][3][3][4] __attribute__((aligned(16)));
+
+struct filter_t {
+  const filter_kind_t *kind;
+  const uint32_t *palettes;
+  int threads;
+  pool_t *pool;
+  uint32_t *rgb[FILTER_BANDS];
+  uint16_t *indices[FILTER_BANDS];
+  /* Bits of the palette indices that differ enough to be an edge */
+  uint8_t (*differ)[512 / 8];
+  /* For each color with each emphasis */
+  filter_ntsc_t *ntsc;
+
+  /* The frame being filtered */
+  const video_frame_t *frame;
+  uint32_t *out;
+  int pitch;
+};
+
+static void filter_nearest(const filter_t*, const filter_rows_t*, uint32_t*, int);
+static void filter_scale2x(const filter_t*, const filter_rows_t*, uint32_t*, int);
+static void filter_scale3x(const filter_t*, const filter_rows_t*, uint32_t*, int);
+static void filter_hq2x(const filter_t*, const filter_rows_t*, uint32_t*, int);
+
+/* The first one is the default */
+static const filter_kind_t kinds[] = {
+  { "none", 1, filter_nearest, false },
+  { "nearest2", 2, filter_nearest, false },
+  { "nearest3", 3, filter_nearest, false },
+  { "nearest4", 4, filter_nearest, false },
+  { "scale2x", 2, filter_scale2x, false },
+  { "scale3x", 3, filter_scale3x, false },
+  { "hq2x", 2, filter_hq2x, true },
+  { "ntsc2", 2, NULL, false },
+  { "ntsc3", 3, NULL, false },
+  { "ntsc4", 4, NULL, false },
+};
+
+static void
+filter_nearest(const filter_t      *filter,
+               const filter_rows_t *rows,
+               uint32_t            *out,
+               int                  pitch)
+{
+  const uint32_t *in = rows->rgb[1] + 1;
+  int scale = filter->kind->scale;
+  int x = 0;
+
+#ifdef __SSE2__
+  if (scale == 2) {
+    for (; x + 4 <= VIDEO_WIDTH; x += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(in + x));
+      _mm_storeu_si128((__m128i*)(out + x * 2), _mm_unpacklo_epi32(v, v));
+      _mm_storeu_si128((__m128i*)(out + x * 2 + 4), _mm_unpackhi_epi32(v, v));
+    }
+  } else if (scale == 4) {
+    for (; x + 4 <= VIDEO_WIDTH; x += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(in + x));
+      _mm_storeu_si128((__m128i*)(out + x * 4), _mm_shuffle_epi32(v, 0x00));
+      _mm_storeu_si128((__m128i*)(out + x * 4 + 4), _mm_shuffle_epi32(v, 0x55));
+      _mm_storeu_si128((__m128i*)(out + x * 4 + 8), _mm_shuffle_epi32(v, 0xaa));
+      _mm_storeu_si128((__m128i*)(out + x * 4 + 12), _mm_shuffle_epi32(v, 0xff));
+    }
+  }
+#endif
+  for (; x < VIDEO_WIDTH; x++) {
+    for (int i = 0; i < scale; i++)
+      out[x * scale + i] = in[x];
+  }
+  for (int i = 1; i < scale; i++)
+    memcpy(out + i * pitch, out, VIDEO_WIDTH * scale * sizeof(uint32_t));
+}
+
+#ifdef __SSE2__
+static inline __m128i
+filter_select(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+#endif
+
+/* Scale2x: with B above, D left, F right and H below E, a corner takes
+ * the color of the two sides meeting there when they match, unless the
+ * opposite sides match too */
+static void
+filter_scale2x(const filter_t      *filter __attribute__((unused)),
+               const filter_rows_t *rows,
+               uint32_t            *out,
+               int                  pitch)
+{
+  const uint32_t *b = rows->rgb[0] + 1;
+  const uint32_t *e = rows->rgb[1] + 1;
+  const uint32_t *h = rows->rgb[2] + 1;
+  uint32_t *out1 = out + pitch;
+  int x = 0;
+
+#ifdef __SSE2__
+  for (; x + 4 <= VIDEO_WIDTH; x += 4) {
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + x));
+    __m128i vd = _mm_loadu_si128((const __m128i*)(e + x - 1));
+    __m128i ve = _mm_loadu_si128((const __m128i*)(e + x));
+    __m128i vf = _mm_loadu_si128((const __m128i*)(e + x + 1));
+    __m128i vh = _mm_loadu_si128((const __m128i*)(h + x));
+    __m128i same = _mm_or_si128(_mm_cmpeq_epi32(vb, vh),
+                                _mm_cmpeq_epi32(vd, vf));
+    __m128i e0 = filter_select(_mm_andnot_si128(same, _mm_cmpeq_epi32(vd, vb)),
+                               vd, ve);
+    __m128i e1 = filter_select(_mm_andnot_si128(same, _mm_cmpeq_epi32(vb, vf)),
+                               vf, ve);
+    __m128i e2 = filter_select(_mm_andnot_si128(same, _mm_cmpeq_epi32(vd, vh)),
+                               vd, ve);
+    __m128i e3 = filter_select(_mm_andnot_si128(same, _mm_cmpeq_epi32(vh, vf)),
+                               vf, ve);
+    _mm_storeu_si128((__m128i*)(out + x * 2), _mm_unpacklo_epi32(e0, e1));
+    _mm_storeu_si128((__m128i*)(out + x * 2 + 4), _mm_unpackhi_epi32(e0, e1));
+    _mm_storeu_si128((__m128i*)(out1 + x * 2), _mm_unpacklo_epi32(e2, e3));
+    _mm_storeu_si128((__m128i*)(out1 + x * 2 + 4), _mm_unpackhi_epi32(e2, e3));
+  }
+#else
+  for (; x < VIDEO_WIDTH; x++) {
+    uint32_t vb = b[x], vd = e[x - 1], ve = e[x], vf = e[x + 1], vh = h[x];
+    bool edge = vb != vh && vd != vf;
+    out[x * 2] = edge && vd == vb ? vd : ve;
+    out[x * 2 + 1] = edge && vb == vf ? vf : ve;
+    out1[x * 2] = edge && vd == vh ? vd : ve;
+    out1[x * 2 + 1] = edge && vh == vf ? vf : ve;
+  }
+#endif
+}
+
+/* Scale3x, the same rules with the middles of the sides following the
+ * corners on either side of them */
+static void
+filter_scale3x(const filter_t      *filter __attribute__((unused)),
+               const filter_rows_t *rows,
+               uint32_t            *out,
+               int                  pitch)
+{
+  const uint32_t *above = rows->rgb[0] + 1;
+  const uint32_t *line = rows->rgb[1] + 1;
+  const uint32_t *below = rows->rgb[2] + 1;
+  uint32_t *out1 = out + pitch, *out2 = out + pitch * 2;
+
+  for (int x = 0; x < VIDEO_WIDTH; x++) {
+    uint32_t a = above[x - 1], b = above[x], c = above[x + 1];
+    uint32_t d = line[x - 1], e = line[x], f = line[x + 1];
+    uint32_t g = below[x - 1], h = below[x], i = below[x + 1];
+    uint32_t *o0 = out + x * 3, *o1 = out1 + x * 3, *o2 = out2 + x * 3;
+
+    if (b != h && d != f) {
+      o0[0] = d == b ? d : e;
+      o0[1] = (d == b && e != c) || (b == f && e != a) ? b : e;
+      o0[2] = b == f ? f : e;
+      o1[0] = (d == b && e != g) || (d == h && e != a) ? d : e;
+      o1[1] = e;
+      o1[2] = (b == f && e != i) || (h == f && e != c) ? f : e;
+      o2[0] = d == h ? d : e;
+      o2[1] = (d == h && e != i) || (h == f && e != g) ? h : e;
+      o2[2] = h == f ? f : e;
+    } else {
+      o0[0] = o0[1] = o0[2] = e;
+      o1[0] = o1[1] = o1[2] = e;
+      o2[0] = o2[1] = o2[2] = e;
+    }
+  }
+}
+
+/* Y, U and V in a byte each, the weights hqx uses */
+static uint32_t
+filter_yuv(uint32_t rgb)
+{
+  int r = (rgb >> 16) & 0xff, g = (rgb >> 8) & 0xff, b = rgb & 0xff;
+  int y = (77 * r + 150 * g + 29 * b) >> 8;
+  int u = ((-43 * r - 85 * g + 128 * b) >> 8) + 128;
+  int v = ((128 * r - 107 * g - 21 * b) >> 8) + 128;
+
+  return (y << 16) | (u << 8) | v;
+}
+
+/* Frames only have the 512 colors of the palettes, so which of them
+ * are far enough apart in YUV is worked out once */
+static void
+filter_differ_init(filter_t *filter)
+{
+  uint32_t yuv[512];
+
+  for (int i = 0; i < 512; i++)
+    yuv[i] = filter_yuv(filter->palettes[i]);
+  filter->differ = (uint8_t(*)[512 / 8])calloc(512, 512 / 8);
+  for (int a = 0; a < 512; a++) {
+    for (int b = 0; b < 512; b++) {
+      uint32_t ya = yuv[a], yb = yuv[b];
+      if (abs((int)(ya >> 16) - (int)(yb >> 16)) > FILTER_HQ_Y ||
+          abs((int)((ya >> 8) & 0xff) - (int)((yb >> 8) & 0xff)) > FILTER_HQ_U ||
+          abs((int)(ya & 0xff) - (int)(yb & 0xff)) > FILTER_HQ_V)
+        filter->differ[a][b / 8] |= 1 << (b % 8);
+    }
+  }
+}
+
+static inline bool
+filter_differ(const uint8_t (*differ)[512 / 8], uint16_t a, uint16_t b)
+{
+  return (differ[a][b / 8] >> (b % 8)) & 1;
+}
+
+/* Average of four pixels, rounded */
+static inline uint32_t
+filter_mix(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+  uint32_t rb = (a & 0xff00ff) + (b & 0xff00ff) + (c & 0xff00ff) +
+    (d & 0xff00ff) + 0x020002;
+  uint32_t g = (a & 0xff00) + (b & 0xff00) + (c & 0xff00) + (d & 0xff00) +
+    0x200;
+
+  return 0xff000000 | ((rb >> 2) & 0xff00ff) | ((g >> 2) & 0xff00);
+}
+
+/* The quarter of e toward a corner, between its neighbours s1 and s2.
+ * An edge crossing the corner blends e with both neighbours, otherwise
+ * a corner of another color bleeds in a little. */
+static inline uint32_t
+filter_hq_corner(uint32_t e, uint32_t s1, uint32_t s2, uint32_t corner,
+                 bool d1, bool d2, bool dc, bool d12)
+{
+  /* Without branches, which edges in patterns would mispredict */
+  uint32_t edge = -(uint32_t)(d1 & d2 & !d12);
+  uint32_t bleed = -(uint32_t)dc & ~edge;
+
+  return (filter_mix(e, e, s1, s2) & edge) |
+    (filter_mix(e, e, e, corner) & bleed) | (e & ~(edge | bleed));
+}
+
+/* hq2x in its rule form: the quarters of each pixel are blended with
+ * the neighbours they face, where the colors differ enough in YUV */
+static void
+filter_hq2x(const filter_t      *filter,
+            const filter_rows_t *rows,
+            uint32_t            *out,
+            int                  pitch)
+{
+  const uint32_t *rgb[3] = { rows->rgb[0], rows->rgb[1], rows->rgb[2] };
+  const uint16_t *indices[3] = {
+    rows->indices[0], rows->indices[1], rows->indices[2],
+  };
+  const uint8_t (*differ)[512 / 8] = filter->differ;
+  uint32_t *out1 = out + pitch;
+
+  for (int x = 0; x < VIDEO_WIDTH; x++) {
+    /* The 3x3 neighbourhood row by row, E in the middle */
+    uint32_t p[9];
+    uint16_t c[9];
+    bool d[9];
+    bool flat = true;
+
+    for (int i = 0; i < 9; i++)
+      p[i] = rgb[i / 3][x + i % 3];
+    for (int i = 0; i < 9; i++)
+      flat &= p[i] == p[4];
+    if (flat) {
+      out[x * 2] = out[x * 2 + 1] = out1[x * 2] = out1[x * 2 + 1] = p[4];
+      continue;
+    }
+    for (int i = 0; i < 9; i++)
+      c[i] = indices[i / 3][x + i % 3];
+    for (int i = 0; i < 9; i++)
+      d[i] = filter_differ(differ, c[4], c[i]);
+    out[x * 2] = filter_hq_corner(p[4], p[1], p[3], p[0], d[1], d[3], d[0],
+                                  filter_differ(differ, c[1], c[3]));
+    out[x * 2 + 1] = filter_hq_corner(p[4], p[1], p[5], p[2], d[1], d[5], d[2],
+                                      filter_differ(differ, c[1], c[5]));
+    out1[x * 2] = filter_hq_corner(p[4], p[7], p[3], p[6], d[7], d[3], d[6],
+                                   filter_differ(differ, c[7], c[3]));
+    out1[x * 2 + 1] = filter_hq_corner(p[4], p[7], p[5], p[8], d[7], d[5],
+                                       d[8], filter_differ(differ, c[7], c[5]));
+  }
+}
+
+/* The signal of a pixel, summed over its first 0 to 8 samples */
+static void
+filter_ntsc_signal(int index, int start, double sums[][3])
+{
+  static const double low[4] = { 0.350, 0.518, 0.962, 1.550 };
+  static const double high[4] = { 1.094, 1.506, 1.962, 1.962 };
+  int hue = index & 0x0f, level = (index >> 4) & 3, emphasis = index >> 6;
+  double lo, hi;
+
+  /* $xE and $xF are black, $x0 and $xD grey without chroma */
+  if (hue > 13)
+    level = 1;
+  lo = low[level];
+  hi = high[level];
+  if (hue == 0)
+    lo = hi;
+  if (hue > 12)
+    hi = lo;
+  sums[0][0] = sums[0][1] = sums[0][2] = 0;
+  for (int i = 0; i < FILTER_NTSC_SAMPLES; i++) {
+    int phase = (start * 4 + i) % FILTER_NTSC_CYCLE;
+    double v = (hue + phase) % FILTER_NTSC_CYCLE < 6 ? hi : lo;
+    double angle = M_PI * (phase + FILTER_NTSC_HUE) / 6;
+
+    /* Each emphasis bit lowers the signal for half of the cycle, red,
+     * green and blue four phases apart */
+    for (int bit = 0; bit < 3; bit++) {
+      if ((emphasis & (1 << bit)) &&
+          (bit * 4 + phase) % FILTER_NTSC_CYCLE < 6) {
+        v *= FILTER_NTSC_EMPHASIS;
+        break;
+      }
+    }
+    v = (v - FILTER_NTSC_BLACK) /
+      (FILTER_NTSC_WHITE - FILTER_NTSC_BLACK) / FILTER_NTSC_CYCLE;
+    sums[i + 1][0] = sums[i][0] + v;
+    sums[i + 1][1] = sums[i][1] + v * cos(angle) * FILTER_NTSC_SATURATION;
+    sums[i + 1][2] = sums[i][2] + v * sin(angle) * FILTER_NTSC_SATURATION;
+  }
+}
+
+/* An output pixel averages the twelve samples around its center, which
+ * reach into the pixels on both sides of the one it is in */
+static void
+filter_ntsc_init(filter_t *filter)
+{
+  int scale = filter->kind->scale;
+
+  filter->ntsc = (filter_ntsc_t*)calloc(sizeof(filter_ntsc_t), 512);
+  for (int index = 0; index < 512; index++) {
+    for (int start = 0; start < 3; start++) {
+      double sums[FILTER_NTSC_SAMPLES + 1][3];
+
+      filter_ntsc_signal(index, start, sums);
+      for (int side = 0; side < 3; side++) {
+        for (int j = 0; j < scale; j++) {
+          /* The window of output pixel j of the pixel to the left, this
+           * one and the one to the right, in samples of this one */
+          int center = j * FILTER_NTSC_SAMPLES / scale +
+            (1 - side) * FILTER_NTSC_SAMPLES;
+          int begin = center - FILTER_NTSC_CYCLE / 2;
+          int end = center + FILTER_NTSC_CYCLE / 2;
+
+          begin = begin < 0 ? 0 : begin > 8 ? 8 : begin;
+          end = end < 0 ? 0 : end > 8 ? 8 : end;
+          for (int c = 0; c < 3; c++)
+            filter->ntsc[index][start][side][c][j] = sums[end][c] - sums[begin][c];
+        }
+      }
+    }
+  }
+}
+
+static void
+filter_yiq_rgb(const float *y, const float *i, const float *q, uint32_t *out,
+               int count)
+{
+  int x = 0;
+
+#ifdef __SSE2__
+  const __m128 zero = _mm_setzero_ps(), full = _mm_set1_ps(255);
+  const __m128i alpha = _mm_set1_epi32(0xff000000);
+
+  for (; x + 4 <= count; x += 4) {
+    __m128 vy = _mm_mul_ps(_mm_loadu_ps(y + x), full);
+    __m128 vi = _mm_mul_ps(_mm_loadu_ps(i + x), full);
+    __m128 vq = _mm_mul_ps(_mm_loadu_ps(q + x), full);
+    __m128 r = _mm_add_ps(vy, _mm_add_ps(_mm_mul_ps(vi, _mm_set1_ps(0.946882f)),
+                                         _mm_mul_ps(vq, _mm_set1_ps(0.623557f))));
+    __m128 g = _mm_sub_ps(vy, _mm_add_ps(_mm_mul_ps(vi, _mm_set1_ps(0.274788f)),
+                                         _mm_mul_ps(vq, _mm_set1_ps(0.635691f))));
+    __m128 b = _mm_add_ps(vy, _mm_sub_ps(_mm_mul_ps(vq, _mm_set1_ps(1.709007f)),
+                                         _mm_mul_ps(vi, _mm_set1_ps(1.108545f))));
+    __m128i ir = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(r, zero), full));
+    __m128i ig = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(g, zero), full));
+    __m128i ib = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(b, zero), full));
+    __m128i p = _mm_or_si128(_mm_or_si128(alpha, _mm_slli_epi32(ir, 16)),
+                             _mm_or_si128(_mm_slli_epi32(ig, 8), ib));
+    _mm_storeu_si128((__m128i*)(out + x), p);
+  }
+#endif
+  for (; x < count; x++) {
+    float c[3] = {
+      y[x] + 0.946882f * i[x] + 0.623557f * q[x],
+      y[x] - 0.274788f * i[x] - 0.635691f * q[x],
+      y[x] - 1.108545f * i[x] + 1.709007f * q[x],
+    };
+    uint32_t p = 0xff000000;
+    for (int j = 0; j < 3; j++) {
+      float v = c[j] * 255;
+      v = v < 0 ? 0 : v > 255 ? 255 : v;
+      p |= (uint32_t)lrintf(v) << (16 - j * 8);
+    }
+    out[x] = p;
+  }
+}
+
+/* The signal of the line is never made, each output pixel adds up
+ * what the pixels around it put into its window */
+static void
+filter_ntsc_line(filter_t *filter, int line, uint32_t *out, int pitch)
+{
+  static const filter_ntsc_t black = {};
+  const video_frame_t *frame = filter->frame;
+  const uint8_t *colors = frame->colors + line * VIDEO_WIDTH;
+  uint8_t grey = (frame->masks[line] & 0x01) ? 0x30 : 0x3f;
+  int emphasis = (frame->masks[line] >> 5) << 6;
+  int scale = filter->kind->scale, width = VIDEO_WIDTH * scale;
+  /* The subcarrier moves on by a third of a cycle every line, and by
+   * two thirds every pixel */
+  int start = ((frame->phase + line * 4) % FILTER_NTSC_CYCLE) / 4;
+  /* Past the edges the signal is black */
+  const float (*pixels[VIDEO_WIDTH + 2])[3][4];
+  /* Up to 4 written per pixel, the next one writes over the rest */
+  float yiq[3][VIDEO_WIDTH * FILTER_NTSC_MAX_SCALE + 4];
+
+  pixels[0] = pixels[VIDEO_WIDTH + 1] = black[0];
+  for (int x = 0; x < VIDEO_WIDTH; x++) {
+    pixels[x + 1] = filter->ntsc[emphasis | (colors[x] & grey)][start];
+    start = (start + 2) % 3;
+  }
+  for (int x = 0; x < VIDEO_WIDTH; x++) {
+    const float (*left)[4] = pixels[x][0];
+    const float (*self)[4] = pixels[x + 1][1];
+    const float (*right)[4] = pixels[x + 2][2];
+
+    for (int c = 0; c < 3; c++) {
+#ifdef __SSE2__
+      __m128 v = _mm_add_ps(_mm_add_ps(_mm_load_ps(left[c]),
+                                       _mm_load_ps(self[c])),
+                            _mm_load_ps(right[c]));
+      _mm_storeu_ps(yiq[c] + x * scale, v);
+#else
+      for (int j = 0; j < 4; j++)
+        yiq[c][x * scale + j] = left[c][j] + self[c][j] + right[c][j];
+#endif
+    }
+  }
+  filter_yiq_rgb(yiq[0], yiq[1], yiq[2], out, width);
+  for (int i = 1; i < scale; i++)
+    memcpy(out + i * pitch, out, width * sizeof(uint32_t));
+}
+
+static void
+filter_band(void *opaque, size_t band)
+{
+  filter_t *filter = (filter_t*)opaque;
+  const video_frame_t *frame = filter->frame;
+  const filter_kind_t *kind = filter->kind;
+  int first = band * FILTER_BAND_LINES;
+  int last = first + FILTER_BAND_LINES;
+  uint32_t *rgb = filter->rgb[band];
+  uint16_t *indices = filter->indices[band];
+
+  if (last > VIDEO_HEIGHT)
+    last = VIDEO_HEIGHT;
+  if (kind->line == NULL) {
+    for (int y = first; y < last; y++) {
+      filter_ntsc_line(filter, y, filter->out + y * kind->scale * filter->pitch,
+                       filter->pitch);
+    }
+    return;
+  }
+
+  /* Row r is line first - 1 + r, the lines past the top and bottom
+   * repeat the edge */
+  for (int r = 0; r < last - first + 2; r++) {
+    int y = first - 1 + r;
+    uint32_t *row = rgb + r * FILTER_ROW;
+
+    y = y < 0 ? 0 : y >= VIDEO_HEIGHT ? VIDEO_HEIGHT - 1 : y;
+    render_convert(frame->colors + y * VIDEO_WIDTH, frame->masks + y,
+                   filter->palettes, row + 1, FILTER_ROW, VIDEO_WIDTH, 1);
+    row[0] = row[1];
+    row[VIDEO_WIDTH + 1] = row[VIDEO_WIDTH];
+    if (kind->indices) {
+      uint16_t *index = indices + r * FILTER_ROW;
+      uint8_t grey = (frame->masks[y] & 0x01) ? 0x30 : 0x3f;
+      uint16_t emphasis = (frame->masks[y] >> 5) << 6;
+
+      for (int x = 0; x < VIDEO_WIDTH; x++)
+        index[x + 1] = emphasis | (frame->colors[y * VIDEO_WIDTH + x] & grey);
+      index[0] = index[1];
+      index[VIDEO_WIDTH + 1] = index[VIDEO_WIDTH];
+    }
+  }
+  for (int y = first; y < last; y++) {
+    int r = y - first;
+    filter_rows_t rows;
+
+    for (int i = 0; i < 3; i++) {
+      rows.rgb[i] = rgb + (r + i) * FILTER_ROW;
+      rows.indices[i] = indices + (r + i) * FILTER_ROW;
+    }
+    kind->line(filter, &rows,
+               filter->out + y * kind->scale * filter->pitch, filter->pitch);
+  }
+}
+
+filter_t*
+filter_create(const video_t *video,
+              const char    *name)
+{
+  const filter_kind_t *kind = NULL;
+  filter_t *filter;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+  for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    if (name == NULL || strcmp(kinds[i].name, name) == 0) {
+      kind = &kinds[i];
+      break;
+    }
+  }
+  if (kind == NULL) {
+    printf("Unknown video filter: %s\n", name);
+    return NULL;
+  }
+
+  filter = (filter_t*)calloc(sizeof(filter_t), 1);
+  filter->kind = kind;
+  filter->palettes = video->palettes;
+  if (kind->line == NULL) {
+    filter_ntsc_init(filter);
+  } else {
+    for (int i = 0; i < FILTER_BANDS; i++) {
+      size_t size = (FILTER_BAND_LINES + 2) * FILTER_ROW;
+      filter->rgb[i] = (uint32_t*)malloc(size * sizeof(uint32_t));
+      if (kind->indices)
+        filter->indices[i] = (uint16_t*)malloc(size * sizeof(uint16_t));
+    }
+    if (kind->indices)
+      filter_differ_init(filter);
+  }
+  filter->threads = threads < FILTER_MAX_THREADS ? threads : FILTER_MAX_THREADS;
+  return filter;
+}
+
+void
+filter_destroy(filter_t *filter)
+{
+  if (filter->pool)
+    pool_destroy(filter->pool);
+  for (int i = 0; i < FILTER_BANDS; i++) {
+    free(filter->rgb[i]);
+    free(filter->indices[i]);
+  }
+  free(filter->ntsc);
+  free(filter->differ);
+  free(filter);
+}
+
+int
+filter_width(const filter_t *filter)
+{
+  return VIDEO_WIDTH * filter->kind->scale;
+}
+
+int
+filter_height(const filter_t *filter)
+{
+  return VIDEO_HEIGHT * filter->kind->scale;
+}
+
+void
+filter_run(filter_t            *filter,
+           const video_frame_t *frame,
+           uint32_t            *out,
+           int                  pitch)
+{
+  /* Started on the thread using the filter, the null backend never
+   * does */
+  if (filter->pool == NULL)
+    filter->pool = pool_create(filter->threads);
+  filter->frame = frame;
+  filter->out = out;
+  filter->pitch = pitch;
+  pool_dispatch(filter->pool, FILTER_BANDS, filter_band, filter);
+}
+
+void
+filter_list(void)
+{
+  for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    printf("                       %s%s\n", kinds[i].name, i == 0 ? " (default)" : "");
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <stdint.h>
+
+#include "video.h"
+
+/* Video filters, the stage between a finished frame and the pixels
+ * shown or captured. They run on the thread taking the frame, never on
+ * the emulator, and split the frame into bands of lines for a few
+ * threads of their own. Each one scales the frame by a whole factor:
+ * nearest neighbour, Scale2x and Scale3x, an hq2x style blend of edges,
+ * or an NTSC composite signal decoded back to RGB with its artifacts.
+ * A filter is used by one thread at a time. */
+
+/* The filter called name, "none" if NULL, with the palettes of video.
+ * Returns NULL for an unknown name. */
+filter_t* filter_create(const video_t *video,
+			const char    *name);
+void filter_destroy(filter_t *filter);
+int filter_width(const filter_t *filter);
+int filter_height(const filter_t *filter);
+/* Writes filter_width() x filter_height() ARGB8888 pixels of frame,
+ * pitch is the distance between lines of out in pixels */
+void filter_run(filter_t            *filter,
+		const video_frame_t *frame,
+		uint32_t            *out,
+		int                  pitch);
+void filter_list(void);
+
+#endif /* __FILTER_H__ */
@@ -0,0 +1,399 @@
+/* CRC-32 and SHA-1 */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "hash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HASH_X86 1
+#endif
+
+/* Slicing by 8 tables of the reflected polynomial 0xEDB88320 */
+static uint32_t crc32_table[8][256];
+
+static void
+crc32_init_tables(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c >> 1) ^ (0xedb88320 & -(c & 1));
+    crc32_table[0][i] = c;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    for (int t = 1; t < 8; t++)
+      crc32_table[t][i] = (crc32_table[t - 1][i] >> 8) ^
+        crc32_table[0][crc32_table[t - 1][i] & 0xff];
+  }
+}
+
+/* Works on the inverted CRC */
+static uint32_t
+crc32_scalar(uint32_t c, const uint8_t *p, size_t size)
+{
+  while (size >= 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, p, 4);
+    memcpy(&hi, p + 4, 4);
+    lo ^= c;
+    c = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+      crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+      crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+      crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+    p += 8;
+    size -= 8;
+  }
+  while (size--)
+    c = (c >> 8) ^ crc32_table[0][(c ^ *p++) & 0xff];
+  return c;
+}
+
+#ifdef HASH_X86
+/* Folds 64 bytes at a time with carry-less multiplies, from "Fast CRC
+ * Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * Takes the inverted CRC and at least 64 bytes, a multiple of 16. */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t
+crc32_pclmul(uint32_t c, const uint8_t *p, size_t size)
+{
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+  __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+  x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+  x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+  x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+  x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(c));
+  p += 64;
+  size -= 64;
+
+  while (size >= 64) {
+    x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i*)(p + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                       _mm_loadu_si128((const __m128i*)(p + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                       _mm_loadu_si128((const __m128i*)(p + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                       _mm_loadu_si128((const __m128i*)(p + 0x30)));
+    p += 64;
+    size -= 64;
+  }
+
+  /* Fold the four lanes into one */
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+  x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+  x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+  x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+  while (size >= 16) {
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                       _mm_loadu_si128((const __m128i*)p));
+    p += 16;
+    size -= 16;
+  }
+
+  /* 128 to 64 bits */
+  x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+  x2 = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+
+  /* Barrett reduction to 32 bits */
+  x2 = _mm_and_si128(x1, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+  x2 = _mm_and_si128(x2, mask32);
+  x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+  x1 = _mm_xor_si128(x1, x2);
+  return _mm_extract_epi32(x1, 1);
+}
+
+/* SHA-1 rounds with the SHA extensions, four rounds per instruction */
+#define SHA1_ROUNDS(e_in, e_out, m, func)                  \
+  e_in = _mm_sha1nexte_epu32(e_in, m);                     \
+  e_out = abcd;                                            \
+  abcd = _mm_sha1rnds4_epu32(abcd, e_in, func)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+sha1_blocks_shani(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+  const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+                                       0x08090a0b0c0d0e0fULL);
+  __m128i abcd, e0, e1, m0, m1, m2, m3, abcd_save, e_save;
+
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1b);
+  e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+  for (; blocks > 0; blocks--, data += 64) {
+    abcd_save = abcd;
+    e_save = e0;
+
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), bswap);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), bswap);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), bswap);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), bswap);
+
+    /* 0-3 */
+    e0 = _mm_add_epi32(e0, m0);
+    e1 = abcd;
+    abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+    /* 4-7 */
+    SHA1_ROUNDS(e1, e0, m1, 0);
+    m0 = _mm_sha1msg1_epu32(m0, m1);
+    /* 8-11 */
+    SHA1_ROUNDS(e0, e1, m2, 0);
+    m1 = _mm_sha1msg1_epu32(m1, m2);
+    m0 = _mm_xor_si128(m0, m2);
+
+    /* From here on each group of four rounds finishes the schedule of
+     * the next message words */
+#define SHA1_GROUP(e_in, e_out, a, b, c, d, func)          \
+    m##b = _mm_sha1msg2_epu32(m##b, m##a);                 \
+    SHA1_ROUNDS(e_in, e_out, m##a, func);                  \
+    m##d = _mm_sha1msg1_epu32(m##d, m##a);                 \
+    m##c = _mm_xor_si128(m##c, m##a)
+
+    /* 12-15 */
+    e1 = _mm_sha1nexte_epu32(e1, m3);
+    e0 = abcd;
+    m0 = _mm_sha1msg2_epu32(m0, m3);
+    abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+    m2 = _mm_sha1msg1_epu32(m2, m3);
+    m1 = _mm_xor_si128(m1, m3);
+
+    SHA1_GROUP(e0, e1, 0, 1, 2, 3, 0); /* 16-19 */
+    SHA1_GROUP(e1, e0, 1, 2, 3, 0, 1); /* 20-23 */
+    SHA1_GROUP(e0, e1, 2, 3, 0, 1, 1); /* 24-27 */
+    SHA1_GROUP(e1, e0, 3, 0, 1, 2, 1); /* 28-31 */
+    SHA1_GROUP(e0, e1, 0, 1, 2, 3, 1); /* 32-35 */
+    SHA1_GROUP(e1, e0, 1, 2, 3, 0, 1); /* 36-39 */
+    SHA1_GROUP(e0, e1, 2, 3, 0, 1, 2); /* 40-43 */
+    SHA1_GROUP(e1, e0, 3, 0, 1, 2, 2); /* 44-47 */
+    SHA1_GROUP(e0, e1, 0, 1, 2, 3, 2); /* 48-51 */
+    SHA1_GROUP(e1, e0, 1, 2, 3, 0, 2); /* 52-55 */
+    SHA1_GROUP(e0, e1, 2, 3, 0, 1, 2); /* 56-59 */
+    SHA1_GROUP(e1, e0, 3, 0, 1, 2, 3); /* 60-63 */
+    SHA1_GROUP(e0, e1, 0, 1, 2, 3, 3); /* 64-67 */
+#undef SHA1_GROUP
+
+    /* 68-71 */
+    m2 = _mm_sha1msg2_epu32(m2, m1);
+    SHA1_ROUNDS(e1, e0, m1, 3);
+    m3 = _mm_xor_si128(m3, m1);
+    /* 72-75 */
+    m3 = _mm_sha1msg2_epu32(m3, m2);
+    SHA1_ROUNDS(e0, e1, m2, 3);
+    /* 76-79 */
+    SHA1_ROUNDS(e1, e0, m3, 3);
+
+    e0 = _mm_sha1nexte_epu32(e0, e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+  }
+
+  _mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = _mm_extract_epi32(e0, 3);
+}
+#undef SHA1_ROUNDS
+#endif
+
+static inline uint32_t
+sha1_rol(uint32_t x, int n)
+{
+  return (x << n) | (x >> (32 - n));
+}
+
+static void
+sha1_blocks_scalar(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+  for (; blocks > 0; blocks--, data += 64) {
+    uint32_t w[80];
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+      e = state[4];
+
+    for (int i = 0; i < 16; i++) {
+      w[i] = (uint32_t)data[i * 4] << 24 | data[i * 4 + 1] << 16 |
+        data[i * 4 + 2] << 8 | data[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++)
+      w[i] = sha1_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      uint32_t t = sha1_rol(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = sha1_rol(b, 30);
+      b = a;
+      a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+/* Implementations picked once by what the CPU supports */
+typedef struct {
+  bool pclmul;
+  bool sha;
+} hash_cpu_t;
+
+__attribute__((unused)) static hash_cpu_t hash_cpu;
+
+static void
+hash_init_once(void)
+{
+  crc32_init_tables();
+#ifdef HASH_X86
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    bool sse41 = ecx & bit_SSE4_1;
+    hash_cpu.pclmul = (ecx & bit_PCLMUL) && sse41;
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+      hash_cpu.sha = (ebx & bit_SHA) && sse41;
+  }
+#endif
+}
+
+static inline void
+hash_init(void)
+{
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, hash_init_once);
+}
+
+uint32_t
+crc32_update(uint32_t       crc,
+             const uint8_t *data,
+             size_t         size)
+{
+  uint32_t c = ~crc;
+
+  hash_init();
+#ifdef HASH_X86
+  if (hash_cpu.pclmul && size >= 64) {
+    size_t n = size & ~(size_t)15;
+    c = crc32_pclmul(c, data, n);
+    data += n;
+    size -= n;
+  }
+#endif
+  return ~crc32_scalar(c, data, size);
+}
+
+static void
+sha1_blocks(uint32_t state[5], const uint8_t *data, size_t blocks)
+{
+#ifdef HASH_X86
+  if (hash_cpu.sha) {
+    sha1_blocks_shani(state, data, blocks);
+    return;
+  }
+#endif
+  sha1_blocks_scalar(state, data, blocks);
+}
+
+void
+sha1_init(sha1_t *sha1)
+{
+  static const uint32_t init[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+  };
+
+  hash_init();
+  memcpy(sha1->state, init, sizeof(init));
+  sha1->size = 0;
+}
+
+void
+sha1_update(sha1_t        *sha1,
+            const uint8_t *data,
+            size_t         size)
+{
+  size_t used = sha1->size % 64;
+
+  if (size == 0)
+    return;
+  sha1->size += size;
+  if (used) {
+    size_t n = 64 - used < size ? 64 - used : size;
+    memcpy(sha1->block + used, data, n);
+    data += n;
+    size -= n;
+    if (used + n < 64)
+      return;
+    sha1_blocks(sha1->state, sha1->block, 1);
+  }
+  sha1_blocks(sha1->state, data, size / 64);
+  memcpy(sha1->block, data + size / 64 * 64, size % 64);
+}
+
+void
+sha1_final(sha1_t  *sha1,
+           uint8_t  digest[SHA1_SIZE])
+{
+  uint64_t bits = sha1->size * 8;
+  uint8_t pad[72] = { 0x80 };
+  size_t n = (sha1->size % 64 < 56 ? 56 : 120) - sha1->size % 64;
+
+  for (int i = 0; i < 8; i++)
+    pad[n + i] = bits >> (56 - i * 8);
+  sha1_update(sha1, pad, n + 8);
+  for (int i = 0; i < 5; i++) {
+    digest[i * 4] = sha1->state[i] >> 24;
+    digest[i * 4 + 1] = sha1->state[i] >> 16;
+    digest[i * 4 + 2] = sha1->state[i] >> 8;
+    digest[i * 4 + 3] = sha1->state[i];
+  }
+}
+
+void
+sha1(const uint8_t *data,
+     size_t         size,
+     uint8_t        digest[SHA1_SIZE])
+{
+  sha1_t ctx;
+  sha1_init(&ctx);
+  sha1_update(&ctx, data, size);
+  sha1_final(&ctx, digest);
+}
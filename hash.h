@@ -0,0 +1,33 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32 (IEEE 802.3) and SHA-1, as used by ROM databases. Both use
+ * PCLMULQDQ and the SHA extensions when the CPU has them. */
+
+#define SHA1_SIZE 20
+
+/* Continues a CRC, start with 0 */
+uint32_t crc32_update(uint32_t       crc,
+		      const uint8_t *data,
+		      size_t         size);
+
+typedef struct {
+  uint32_t state[5];
+  uint64_t size;
+  uint8_t block[64];
+} sha1_t;
+
+void sha1_init(sha1_t *sha1);
+void sha1_update(sha1_t        *sha1,
+		 const uint8_t *data,
+		 size_t         size);
+void sha1_final(sha1_t  *sha1,
+		uint8_t  digest[SHA1_SIZE]);
+void sha1(const uint8_t *data,
+	  size_t         size,
+	  uint8_t        digest[SHA1_SIZE]);
+
+#endif /* __HASH_H__ */
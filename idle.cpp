@@ -0,0 +1,265 @@
+/* Idle loop detection */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "emu.h"
+#include "idle.h"
+#include "opcodes.h"
+#include "ppu.h"
+
+/* Most instructions of a loop, the branch included */
+#define IDLE_LOOP_INSTRUCTIONS 8
+
+#define IDLE_A 0x01
+#define IDLE_X 0x02
+#define IDLE_Y 0x04
+
+/* The CPU as it took the branch last time */
+typedef struct {
+  uint16_t addr;
+  const uint8_t *page;
+  uint8_t a;
+  uint8_t x;
+  uint8_t y;
+  uint8_t p;
+  uint8_t sp;
+  uint64_t cycles;
+  uint32_t instructions;
+} idle_visit_t;
+
+struct idle_t {
+  idle_visit_t last;
+  uint64_t skipped;
+};
+
+/* Instructions a loop may be made of and the registers they write,
+ * none of them writes memory */
+static const struct {
+  const char *name;
+  uint8_t writes;
+} idle_instructions[] = {
+  { "LDA", IDLE_A }, { "LDX", IDLE_X }, { "LDY", IDLE_Y },
+  { "AND", IDLE_A }, { "ORA", IDLE_A }, { "EOR", IDLE_A },
+  { "BIT", 0 }, { "CMP", 0 }, { "CPX", 0 }, { "CPY", 0 },
+  { "TAX", IDLE_X }, { "TAY", IDLE_Y }, { "TSX", IDLE_X },
+  { "TXA", IDLE_A }, { "TYA", IDLE_A },
+  { "CLC", 0 }, { "SEC", 0 }, { "CLV", 0 }, { "NOP", 0 },
+};
+
+idle_t*
+idle_create(void)
+{
+  return (idle_t*)calloc(sizeof(idle_t), 1);
+}
+
+void
+idle_destroy(idle_t *idle)
+{
+  free(idle);
+}
+
+uint64_t
+idle_skipped(idle_t *idle)
+{
+  return idle->skipped;
+}
+
+void
+idle_set_skipped(idle_t  *idle,
+                 uint64_t skipped)
+{
+  idle->skipped = skipped;
+}
+
+/* Registers the instruction writes, 0xff if loops with it are never
+ * skipped */
+static uint8_t
+idle_writes(const cpu_opcode_t *op)
+{
+  for (size_t i = 0; i < sizeof(idle_instructions) /
+         sizeof(idle_instructions[0]); i++) {
+    if (strcmp(op->name, idle_instructions[i].name) == 0)
+      return idle_instructions[i].writes;
+  }
+  return 0xff;
+}
+
+/* Reads code without going through I/O handlers */
+static bool
+idle_fetch(cpu_t *cpu, uint16_t addr, uint8_t *value)
+{
+  const uint8_t *page = cpu->read_map[addr >> 8];
+
+  if (page == NULL)
+    return false;
+  *value = page[addr & 0xff];
+  return true;
+}
+
+/* Effective address of an operand with the registers as they are, adds
+ * one to penalty when indexing crosses a page */
+static uint16_t
+idle_address(cpu_t *cpu, uint8_t mode, uint16_t m, int *penalty)
+{
+  uint16_t base, addr;
+
+  switch (mode) {
+  case MODE_ZP0:
+    return m & 0xff;
+  case MODE_ZPX:
+    return (m + cpu->x) & 0xff;
+  case MODE_ZPY:
+    return (m + cpu->y) & 0xff;
+  case MODE_ABX:
+  case MODE_ABY:
+    addr = m + (mode == MODE_ABX ? cpu->x : cpu->y);
+    *penalty += ((addr ^ m) & 0xff00) ? 1 : 0;
+    return addr;
+  case MODE_IZX:
+    return cpu->ram[(m + cpu->x) & 0xff] |
+      cpu->ram[(m + cpu->x + 1) & 0xff] << 8;
+  case MODE_IZY:
+    base = cpu->ram[m & 0xff] | cpu->ram[(m + 1) & 0xff] << 8;
+    addr = base + cpu->y;
+    *penalty += ((addr ^ base) & 0xff00) ? 1 : 0;
+    return addr;
+  }
+  return m;
+}
+
+/* Checks that the loop from the PC to the branch at addr only reads
+ * memory, and that one iteration takes the cycles and instructions
+ * seen since the last visit. Then skips as many iterations as fit
+ * before the deadline and before PPUSTATUS may change. */
+static void
+idle_skip(idle_t  *idle,
+          cpu_t   *cpu,
+          uint16_t addr,
+          uint64_t since)
+{
+  uint64_t cycles = cpu->cycles - since;
+  uint32_t count = cpu->instructions - idle->last.instructions;
+  uint64_t expected = 0, limit, iterations;
+  const cpu_opcode_t *op;
+  uint16_t pc = cpu->pc;
+  uint8_t written = 0;
+  bool status = false;
+  uint32_t n = 0;
+
+  while (pc != addr) {
+    uint8_t opcode, lo = 0, hi = 0;
+    uint8_t writes;
+    int penalty = 0;
+    uint16_t m;
+
+    if (++n == IDLE_LOOP_INSTRUCTIONS || !idle_fetch(cpu, pc, &opcode))
+      return;
+    op = &cpu_opcodes[opcode];
+    writes = idle_writes(op);
+    if (writes == 0xff || (uint16_t)(addr - pc) < 1 + cpu_mode_size[op->mode])
+      return;
+    if (cpu_mode_size[op->mode] > 0 && !idle_fetch(cpu, pc + 1, &lo))
+      return;
+    if (cpu_mode_size[op->mode] > 1 && !idle_fetch(cpu, pc + 2, &hi))
+      return;
+    m = lo | hi << 8;
+
+    if (op->mode != MODE_IMP && op->mode != MODE_ACC &&
+        op->mode != MODE_IMM) {
+      uint16_t ea;
+      /* Addresses are computed with the registers at the branch */
+      if (((op->mode == MODE_ZPX || op->mode == MODE_ABX ||
+            op->mode == MODE_IZX) && (written & IDLE_X)) ||
+          ((op->mode == MODE_ZPY || op->mode == MODE_ABY ||
+            op->mode == MODE_IZY) && (written & IDLE_Y)))
+        return;
+      ea = idle_address(cpu, op->mode, m, &penalty);
+      /* PPUSTATUS is the only register read without lasting effects */
+      if (ea >= 0x2000 && ea < 0x4000 && (ea & 7) == 2)
+        status = true;
+      else if (cpu->read_map[ea >> 8] == NULL)
+        return;
+    }
+    expected += op->cycles + (op->page_penalty ? penalty : 0);
+    written |= writes;
+    pc += 1 + cpu_mode_size[op->mode];
+  }
+  /* The branch or jump closing the loop */
+  op = &cpu_opcodes[cpu->read_map[addr >> 8][addr & 0xff]];
+  expected += op->cycles;
+  if (op->mode == MODE_REL)
+    expected += (((addr + 2) ^ cpu->pc) & 0xff00) ? 2 : 1;
+  if (cycles != expected || count != n + 1 || cycles > since)
+    return;
+
+  limit = cpu->deadline;
+  if (status) {
+    /* Reads of the last two iterations and the skipped ones must all
+     * see the same PPUSTATUS */
+    uint64_t until = ppu_status_until(cpu->emu->ppu,
+                                      (since - cycles) * MASTER_CPU_DIVIDER);
+    if ((until - 1) / MASTER_CPU_DIVIDER < limit)
+      limit = (until - 1) / MASTER_CPU_DIVIDER;
+  }
+  if (limit <= cpu->cycles)
+    return;
+  iterations = (limit - cpu->cycles) / cycles;
+  cpu->cycles += iterations * cycles;
+  cpu->instructions += iterations * count;
+  idle->skipped += iterations * cycles;
+}
+
+bool
+idle_loop(cpu_t   *cpu,
+          uint16_t pc,
+          uint16_t addr)
+{
+  uint32_t n = 0;
+
+  while (pc != addr) {
+    const cpu_opcode_t *op;
+    uint8_t opcode;
+
+    if (++n == IDLE_LOOP_INSTRUCTIONS || !idle_fetch(cpu, pc, &opcode))
+      return false;
+    op = &cpu_opcodes[opcode];
+    if (idle_writes(op) == 0xff ||
+        (uint16_t)(addr - pc) < 1 + cpu_mode_size[op->mode])
+      return false;
+    pc += 1 + cpu_mode_size[op->mode];
+  }
+  return true;
+}
+
+void
+idle_branch(idle_t  *idle,
+            cpu_t   *cpu,
+            uint16_t addr)
+{
+  idle_visit_t *last = &idle->last;
+  const uint8_t *page = cpu->read_map[addr >> 8];
+  uint8_t p = cpu_get_p(cpu);
+
+  if ((uint16_t)(addr - cpu->pc) > IDLE_LOOP_SIZE || page == NULL)
+    return;
+  /* Back with nothing changed, pending interrupts are taken first and
+   * traced or profiled instructions are not skipped */
+  if (last->addr == addr && last->page == page && last->a == cpu->a &&
+      last->x == cpu->x && last->y == cpu->y && last->p == p &&
+      last->sp == cpu->sp && last->cycles < cpu->cycles &&
+      !cpu->nmi && !(cpu->irq && !cpu->p.i) && cpu->trace == NULL &&
+      cpu->prof == NULL)
+    idle_skip(idle, cpu, addr, last->cycles);
+
+  last->addr = addr;
+  last->page = page;
+  last->a = cpu->a;
+  last->x = cpu->x;
+  last->y = cpu->y;
+  last->p = p;
+  last->sp = cpu->sp;
+  last->cycles = cpu->cycles;
+  last->instructions = cpu->instructions;
+}
@@ -0,0 +1,37 @@
+#ifndef __IDLE_H__
+#define __IDLE_H__
+
+#include <stdint.h>
+
+#include "types.h"
+
+/* Idle loop detection. Games wait for vblank or for the NMI handler in
+ * short loops like LDA $2002 / BPL, LDA flag / BEQ or a JMP to itself,
+ * which only read memory or PPUSTATUS. Once an iteration of such a
+ * loop left the CPU as it found it, the following ones will too until
+ * an interrupt or the PPU changes what it reads, so whole iterations
+ * are skipped up to the deadline of cpu_run() or the next change of
+ * PPUSTATUS. */
+
+/* Longest loop looked at, in bytes back from its branch or jump */
+#define IDLE_LOOP_SIZE 16
+
+idle_t* idle_create(void);
+void idle_destroy(idle_t *idle);
+/* Called by a taken branch or a JMP at addr back to the PC */
+void idle_branch(idle_t  *idle,
+		 cpu_t   *cpu,
+		 uint16_t addr);
+/* Whether the loop from pc back to the branch or jump at addr is only
+ * made of instructions that idle loops can be made of. Others are
+ * never skipped. */
+bool idle_loop(cpu_t   *cpu,
+	       uint16_t pc,
+	       uint16_t addr);
+/* CPU cycles skipped so far */
+uint64_t idle_skipped(idle_t *idle);
+/* Puts the count back, for frames that are run and then undone */
+void idle_set_skipped(idle_t  *idle,
+		      uint64_t skipped);
+
+#endif /* __IDLE_H__ */
@@ -1,79 +1,216 @@
-/* Simple iNes v1.0 format parser (.nes)
+/* iNES and NES 2.0 format parser (.nes)
  */
 
-#include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "ines.h"
 
 #define HEADER(ines) ines->header
 
+static_assert(sizeof(header_t) == 16, "iNES header must be 16 bytes");
+
+/* NES 2.0 ROM size: an MSB nibble of $F selects the exponent-multiplier
+ * notation, 2^E * (MM*2+1) bytes */
+static uint64_t
+ines_rom_size(uint8_t lsb, uint8_t msb, uint32_t unit)
+{
+  if (msb == 0xf)
+    return (1ULL << (lsb >> 2)) * ((lsb & 3) * 2 + 1);
+  return (uint64_t)(msb << 8 | lsb) * unit;
+}
+
+/* NES 2.0 RAM size: 64 << shift bytes, none for 0 */
+static uint32_t
+ines_ram_size(uint8_t shift)
+{
+  return shift ? 64U << shift : 0;
+}
+
+static void
+ines_parse_header(ines_t *ines)
+{
+  const header_t *h = &HEADER(ines);
+
+  ines->nes2 = (h->flags7 & 0x0c) == 0x08;
+  ines->mapper = (h->flags6 >> 4) | (h->flags7 & 0xf0);
+  ines->battery = (h->flags6 & 0x02) != 0;
+  if (h->flags6 & 0x08)
+    ines->mirroring = INES_MIRROR_FOUR;
+  else
+    ines->mirroring = h->flags6 & 0x01;
+
+  if (ines->nes2) {
+    ines->mapper |= (h->flags8 & 0x0f) << 8;
+    ines->submapper = h->flags8 >> 4;
+    ines->prg_ram_size = ines_ram_size(h->flags10 & 0x0f);
+    ines->prg_nvram_size = ines_ram_size(h->flags10 >> 4);
+    ines->chr_ram_size = ines_ram_size(h->flags11 & 0x0f);
+    ines->chr_nvram_size = ines_ram_size(h->flags11 >> 4);
+    ines->region = h->flags12 & 0x03;
+  } else {
+    /* Old dumps have garbage such as "DiskDude!" from byte 7 on,
+     * nothing past flags 6 can be trusted then */
+    bool archaic = h->flags12 || h->reserved[0] || h->reserved[1] ||
+      h->reserved[2];
+    uint8_t flags8 = archaic ? 0 : h->flags8;
+    if (archaic)
+      ines->mapper &= 0x0f;
+    ines->prg_ram_size = (flags8 ? flags8 : 1) * 8192;
+    if (ines->battery) {
+      ines->prg_nvram_size = ines->prg_ram_size;
+      ines->prg_ram_size = 0;
+    }
+    ines->chr_ram_size = h->chr_size ? 0 : 8192;
+    ines->region = archaic ? INES_REGION_NTSC : h->flags9 & 0x01;
+  }
+}
+
 ines_t*
 ines_load(const char *filename)
 {
     ines_t *ines;
+    struct stat st;
+    uint64_t prg_size, chr_size, size;
 
-    ines = (ines_t*)malloc(sizeof(ines_t));
+    ines = (ines_t*)calloc(sizeof(ines_t), 1);
     ines->filename = filename;
     ines->fd = open(filename, O_RDONLY);
     if (ines->fd == -1) {
        perror("Cannot open file");
+       free(ines);
+       return NULL;
+    }
+    if (fstat(ines->fd, &st) != 0 || st.st_size < (off_t)sizeof(header_t)) {
+       fprintf(stderr, "Invalid file: %s\n", filename);
+       close(ines->fd);
+       free(ines);
        return NULL;
     }
 
-    /* FIXME: Calculate the size of the file */
-    ines->map = mmap(0, 40 * 1024, PROT_READ, MAP_SHARED, ines->fd, 0);
+    /* The whole file, pages are only read in once a bank is used */
+    ines->map_size = st.st_size;
+    ines->map = (const uint8_t*)mmap(0, ines->map_size, PROT_READ,
+                                     MAP_PRIVATE, ines->fd, 0);
+    if (ines->map == MAP_FAILED) {
+        perror("Cannot map file");
+        close(ines->fd);
+        free(ines);
+        return NULL;
+    }
 
-    assert(sizeof(header_t) == 16);
     memcpy(&ines->header, ines->map, sizeof(header_t));
-    if (HEADER(ines).constant[0] != 'N' &&
-        HEADER(ines).constant[1] != 'E' &&
-        HEADER(ines).constant[2] != 'S' &&
-        HEADER(ines).constant[3] != '\0') {
-        perror("Invalid header");
+    if (memcmp(HEADER(ines).constant, "NES\x1a", 4) != 0) {
+        fprintf(stderr, "Invalid header: %s\n", filename);
+        ines_destroy(ines);
         return NULL;
     }
+    ines_parse_header(ines);
 
-    ines->prg = (uint8_t*)ines->map + sizeof(header_t);
-    ines->chr = ines->prg + HEADER(ines).prg_size;
+    prg_size = HEADER(ines).prg_size;
+    chr_size = HEADER(ines).chr_size;
+    if (ines->nes2) {
+      prg_size = ines_rom_size(prg_size, HEADER(ines).flags9 & 0x0f, 16384);
+      chr_size = ines_rom_size(chr_size, HEADER(ines).flags9 >> 4, 8192);
+    } else {
+      prg_size *= 16384;
+      chr_size *= 8192;
+    }
+
+    size = sizeof(header_t);
+    if (HEADER(ines).flags6 & 0x04) {
+      ines->trainer = ines->map + size;
+      size += INES_TRAINER_SIZE;
+    }
+    /* Sizes in exponent notation can be far larger than any file */
+    if (prg_size > ines->map_size || chr_size > ines->map_size)
+      prg_size = chr_size = ines->map_size;
+    ines->prg = ines->map + size;
+    ines->chr = ines->prg + prg_size;
+    size += prg_size + chr_size;
+    if (prg_size == 0 || size > ines->map_size) {
+        fprintf(stderr, "Truncated ROM: %s, %llu bytes needed\n", filename,
+                (unsigned long long)size);
+        ines_destroy(ines);
+        return NULL;
+    }
+    ines->prg_size = prg_size;
+    ines->chr_size = chr_size;
+    if (chr_size == 0)
+      ines->chr = NULL;
 
-    ines_dump(ines);
     return ines;
 }
 
 void
 ines_dump(ines_t* ines)
 {
-    printf("Constants: %c%c%c\n",
-           HEADER(ines).constant[0],
-           HEADER(ines).constant[1],
-           HEADER(ines).constant[2]);
-
-    printf("PRG size: %dkB\n", HEADER(ines).prg_size * 16);
-    printf("CHR size: %dkB\n", HEADER(ines).chr_size * 8);
-    printf("Mapper: %d\n", HEADER(ines).mapper);
+    static const char *mirroring[] = { "horizontal", "vertical", "four screen" };
+    static const char *regions[] = { "NTSC", "PAL", "multi", "Dendy" };
+
+    printf("Format: %s\n", ines->nes2 ? "NES 2.0" : "iNES");
+    printf("PRG size: %ukB\n", ines->prg_size / 1024);
+    printf("CHR size: %ukB\n", ines->chr_size / 1024);
+    printf("Mapper: %d.%d\n", ines->mapper, ines->submapper);
+    printf("Mirroring: %s\n", mirroring[ines->mirroring]);
+    printf("PRG-RAM: %u bytes, %u battery backed\n", ines->prg_ram_size,
+           ines->prg_nvram_size);
+    printf("CHR-RAM: %u bytes, %u battery backed\n", ines->chr_ram_size,
+           ines->chr_nvram_size);
+    printf("Region: %s\n", regions[ines->region]);
+    printf("Trainer: %s\n", ines->trainer ? "yes" : "no");
 }
 
-uint16_t 
+uint32_t
 ines_prg_size(ines_t *ines)
 {
-  return HEADER(ines).prg_size * 16;
+  return ines->prg_size;
 }
 
-uint16_t 
+uint32_t
 ines_chr_size(ines_t *ines)
 {
-  return HEADER(ines).chr_size * 8;
+  return ines->chr_size;
+}
+
+static const uint8_t*
+ines_bank(const uint8_t *rom, uint32_t rom_size, int bank, uint32_t size)
+{
+  int count = rom_size / size;
+
+  if (rom == NULL || count == 0)
+    return NULL;
+  bank %= count;
+  if (bank < 0)
+    bank += count;
+  return rom + (size_t)bank * size;
+}
+
+const uint8_t*
+ines_prg_bank(ines_t  *ines,
+              int      bank,
+              uint32_t size)
+{
+  return ines_bank(ines->prg, ines->prg_size, bank, size);
+}
+
+const uint8_t*
+ines_chr_bank(ines_t  *ines,
+              int      bank,
+              uint32_t size)
+{
+  return ines_bank(ines->chr, ines->chr_size, bank, size);
 }
 
 void
 ines_destroy(ines_t* ines)
 {
-    close(ines->fd); 
+    munmap((void*)ines->map, ines->map_size);
+    close(ines->fd);
     free(ines);
 }
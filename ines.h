@@ -1,39 +1,77 @@
 #ifndef __INES_H__
 #define __INES_H__
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "types.h"
+
+/* The 16 byte header of iNES and NES 2.0 files */
 typedef struct {
-  char constant[4]; /* 'N' 'E' 'S' '\0' */
-  uint8_t prg_size;
-  uint8_t chr_size;
-  char mirror : 1;
-  char battery : 1;
-  char trainer : 1;
-  char unused : 1;
-  char mapper : 4;
-  char vs : 1;
-  char playchoise : 1;
-  char v2 : 2;
-  char mapper_upper;
-  uint8_t prg_ram_size;
-  char reserved[6];
+  char constant[4]; /* 'N' 'E' 'S' '\x1a' */
+  uint8_t prg_size; /* 16Kb units, LSB on NES 2.0 */
+  uint8_t chr_size; /* 8Kb units, LSB on NES 2.0 */
+  uint8_t flags6;   /* mirroring, battery, trainer, mapper D0..D3 */
+  uint8_t flags7;   /* console type, NES 2.0 identifier, mapper D4..D7 */
+  uint8_t flags8;   /* NES 2.0: submapper, mapper D8..D11 */
+  uint8_t flags9;   /* NES 2.0: PRG and CHR size MSB */
+  uint8_t flags10;  /* NES 2.0: PRG-RAM and PRG-NVRAM shift counts */
+  uint8_t flags11;  /* NES 2.0: CHR-RAM and CHR-NVRAM shift counts */
+  uint8_t flags12;  /* NES 2.0: CPU/PPU timing */
+  uint8_t reserved[3];
 } header_t;
 
+#define INES_MIRROR_HORIZONTAL 0
+#define INES_MIRROR_VERTICAL   1
+#define INES_MIRROR_FOUR       2
 
-typedef struct {
+#define INES_REGION_NTSC  0
+#define INES_REGION_PAL   1
+#define INES_REGION_MULTI 2
+#define INES_REGION_DENDY 3
+
+#define INES_TRAINER_SIZE 512
+
+/* A ROM file mapped read-only as a whole, prg and chr point into the
+ * mapping so banks are used in place without copying */
+struct ines_t {
   const char *filename;
   int fd;
-  const void *map;
+  const uint8_t *map;
+  size_t map_size;
   header_t header;
+  /* NES 2.0 header, otherwise iNES */
+  bool nes2;
+  uint16_t mapper;
+  uint8_t submapper;
+  uint8_t mirroring;
+  bool battery;
+  uint8_t region;
+  /* Sizes in bytes, chr_size is 0 for boards with CHR-RAM */
+  uint32_t prg_size;
+  uint32_t chr_size;
+  uint32_t prg_ram_size;
+  uint32_t prg_nvram_size;
+  uint32_t chr_ram_size;
+  uint32_t chr_nvram_size;
+  /* 512 bytes to load at $7000, NULL if there is none */
+  const uint8_t *trainer;
   const uint8_t *prg;
   const uint8_t *chr;
-} ines_t;
+};
 
 ines_t * ines_load(const char *filename);
 void ines_dump(ines_t* ines);
 void ines_destroy(ines_t* ines);
-uint16_t ines_prg_size(ines_t *ines);
-uint16_t ines_chr_size(ines_t *ines);
+uint32_t ines_prg_size(ines_t *ines);
+uint32_t ines_chr_size(ines_t *ines);
+/* Banks of size bytes, negative numbers count from the last one and
+ * numbers past the end wrap around as on the address lines */
+const uint8_t* ines_prg_bank(ines_t  *ines,
+			     int      bank,
+			     uint32_t size);
+const uint8_t* ines_chr_bank(ines_t  *ines,
+			     int      bank,
+			     uint32_t size);
 
 #endif /* __INES_H__ */
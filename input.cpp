@@ -0,0 +1,68 @@
+/* Controller ports */
+
+#include <stdlib.h>
+
+#include "input.h"
+#include "state.h"
+
+struct input_t {
+  uint8_t buttons[INPUT_PORTS];
+  uint8_t shift[INPUT_PORTS];
+  bool strobe;
+};
+
+input_t*
+input_create(void)
+{
+  return (input_t*)calloc(sizeof(input_t), 1);
+}
+
+void
+input_destroy(input_t *input)
+{
+  free(input);
+}
+
+void
+input_set(input_t *input,
+          int      port,
+          uint8_t  buttons)
+{
+  input->buttons[port] = buttons;
+  if (input->strobe)
+    input->shift[port] = buttons;
+}
+
+uint8_t
+input_read(input_t *input,
+           int      port)
+{
+  uint8_t bit;
+
+  if (input->strobe)
+    return input->buttons[port] & 1;
+  bit = input->shift[port] & 1;
+  /* The serial input of the register is tied high */
+  input->shift[port] = (input->shift[port] >> 1) | 0x80;
+  return bit;
+}
+
+void
+input_write(input_t *input,
+            uint8_t  value)
+{
+  input->strobe = value & 1;
+  if (input->strobe) {
+    for (int i = 0; i < INPUT_PORTS; i++)
+      input->shift[i] = input->buttons[i];
+  }
+}
+
+void
+input_state(input_t *input,
+            state_t *s)
+{
+  STATE_FIELD(s, input->buttons);
+  STATE_FIELD(s, input->shift);
+  STATE_FIELD(s, input->strobe);
+}
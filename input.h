@@ -0,0 +1,39 @@
+#ifndef __INPUT_H__
+#define __INPUT_H__
+
+#include <stdint.h>
+
+#include "types.h"
+
+/* Standard controllers in both ports. Writing 1 to bit 0 of $4016
+ * holds the buttons in the shift registers, writing 0 stops that and
+ * each read of $4016 or $4017 then returns the next button of its
+ * port, in the order of the bits below, then 1s. */
+
+#define INPUT_PORTS 2
+
+#define INPUT_A      0x01
+#define INPUT_B      0x02
+#define INPUT_SELECT 0x04
+#define INPUT_START  0x08
+#define INPUT_UP     0x10
+#define INPUT_DOWN   0x20
+#define INPUT_LEFT   0x40
+#define INPUT_RIGHT  0x80
+
+input_t* input_create(void);
+void input_destroy(input_t *input);
+/* Buttons held on a controller from now on, INPUT_* bits */
+void input_set(input_t *input,
+	       int      port,
+	       uint8_t  buttons);
+/* Bit 0 of $4016 or $4017 */
+uint8_t input_read(input_t *input,
+		   int      port);
+/* $4016 */
+void input_write(input_t *input,
+		 uint8_t  value);
+void input_state(input_t *input,
+		 state_t *s);
+
+#endif /* __INPUT_H__ */
@@ -0,0 +1,1746 @@
+/* x86-64 dynamic recompiler for the 6502
+ *
+ * A block is a run of instructions within one 256 byte page of PRG-ROM,
+ * ending at the first branch, jump or instruction that is left to the
+ * interpreter. A, X, Y and P are kept in r8 to r11 while a block runs,
+ * the rest of cpu_t is addressed through rbx. r12 points at a table of
+ * N and Z flags and r13 is set once a block touched I/O. I/O can raise
+ * interrupts, move the deadline or switch banks, so the block returns
+ * after that instruction.
+ *
+ * Cycles are added up while translating and only written out before
+ * calls and at exits, so memory mapped devices see the same time as
+ * with the interpreter.
+ *
+ * Exits to a PC known while translating return where they jump from.
+ * jit_run() points that jump at the chain entry of the next block, so
+ * the following runs go from block to block without coming back. The
+ * chain entry checks what jit_run() would: the page, the deadline and
+ * pending interrupts.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "idle.h"
+#include "jit.h"
+#include "opcodes.h"
+
+#define JIT_CODE_SIZE (8 << 20)
+/* Room a block needs in the code buffer at most */
+#define JIT_BLOCK_CODE (16 << 10)
+#define JIT_BLOCK_INSTRUCTIONS 32
+#define JIT_TABLE_SIZE 65536
+#define JIT_MAX_BLOCKS (JIT_TABLE_SIZE / 2)
+/* I/O accesses of a block recorded for the differential mode */
+#define JIT_LOG_SIZE 16
+
+/* Returns the jump to link to the next block, NULL if none */
+typedef uint8_t* (*jit_code_t)(cpu_t *cpu);
+
+typedef struct {
+  uint16_t pc;
+  /* Host address of the page the block was translated from */
+  const uint8_t *page;
+  /* Most cycles the instructions before the last one can take, the
+   * block only runs when all of them start before the deadline */
+  uint32_t max_cycles;
+  jit_code_t code;
+  /* Entered from other blocks, with the registers in place */
+  uint8_t *chain;
+} jit_block_t;
+
+typedef struct {
+  uint16_t addr;
+  uint8_t value;
+  bool write;
+  /* Cycles the access added, such as the stall of a DMA */
+  uint32_t cycles;
+} jit_access_t;
+
+/* Registers of the CPU before the block, for the report */
+typedef struct {
+  uint16_t pc;
+  uint8_t a, x, y, p, sp;
+  uint64_t cycles;
+} jit_regs_t;
+
+struct jit_t {
+  uint8_t *code;
+  size_t code_used;
+  jit_block_t *blocks;
+  uint32_t block_count;
+  /* Open addressing, block number plus one, zero when free */
+  uint32_t *table;
+  /* Exit of the last block run, to link to the next one */
+  uint8_t *link;
+  /* N and Z of every value, as bits of P */
+  uint8_t nz[256];
+  bool disabled;
+
+  /* Differential mode: the I/O handlers of the CPU are wrapped to
+   * record what a block did, and replayed to the shadow CPU */
+  bool diff;
+  bool diverged;
+  /* The shadow needs a copy of the CPU before the next block */
+  bool stale;
+  cpu_t *cpu;
+  cpu_t *shadow;
+  uint8_t shadow_prg_ram[0x2000];
+  cpu_io_t io[256];
+  jit_access_t log[JIT_LOG_SIZE];
+  int log_count;
+  int replay_pos;
+  int io_depth;
+  bool log_overflow;
+  bool replay_failed;
+  jit_regs_t entry;
+};
+
+#if defined(__x86_64__)
+
+#define CPU_OFFSET(field) ((int32_t)offsetof(cpu_t, field))
+#define OFF_A      CPU_OFFSET(a)
+#define OFF_X      CPU_OFFSET(x)
+#define OFF_Y      CPU_OFFSET(y)
+#define OFF_SP     CPU_OFFSET(sp)
+#define OFF_P      CPU_OFFSET(p)
+#define OFF_PC     CPU_OFFSET(pc)
+#define OFF_RAM    CPU_OFFSET(ram)
+#define OFF_STACK  (OFF_RAM + 0x100)
+#define OFF_CYCLES CPU_OFFSET(cycles)
+#define OFF_INSTRUCTIONS CPU_OFFSET(instructions)
+#define OFF_READ_MAP  CPU_OFFSET(read_map)
+#define OFF_WRITE_MAP CPU_OFFSET(write_map)
+#define OFF_DEADLINE CPU_OFFSET(deadline)
+#define OFF_NMI    CPU_OFFSET(nmi)
+#define OFF_IRQ    CPU_OFFSET(irq)
+
+/* The status bits are laid out as in P, low bit first, so the JIT
+ * works on the whole byte */
+static_assert(sizeof(((cpu_t*)0)->p) == 1, "P must be a byte");
+
+#define P_C 0x01
+#define P_Z 0x02
+#define P_I 0x04
+#define P_D 0x08
+#define P_V 0x40
+#define P_N 0x80
+
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI, R8, R9, R10, R11 };
+enum { CC_AE = 0x3, CC_Z = 0x4, CC_NZ = 0x5 };
+enum { ALU_ADD = 0x01, ALU_OR = 0x09, ALU_AND = 0x21, ALU_SUB = 0x29,
+       ALU_XOR = 0x31, ALU_MOV = 0x89 };
+enum { IMM_ADD = 0, IMM_OR = 1, IMM_AND = 4, IMM_SUB = 5, IMM_XOR = 6,
+       IMM_CMP = 7 };
+
+/* The host register a 6502 register lives in, zero extended, -1 for
+ * the fields of cpu_t that stay in memory. r8 to r11 are not saved by
+ * calls, they are written back before each and loaded again after. */
+static int
+x86_host(int32_t disp)
+{
+  return disp == OFF_A ? R8 : disp == OFF_X ? R9 : disp == OFF_Y ? R10 :
+    disp == OFF_P ? R11 : -1;
+}
+
+typedef struct {
+  uint8_t *p;
+  /* Jumps to the epilogue, patched once it is emitted */
+  uint8_t *exits[JIT_BLOCK_INSTRUCTIONS * 4];
+  int exit_count;
+  /* Cycles and instructions not yet added to the CPU */
+  uint32_t cycles;
+  uint32_t count;
+  /* The current instruction may have touched I/O */
+  bool io;
+  /* Short branches back that may close idle loops are left to the
+   * interpreter, which looks for them */
+  bool idle;
+  cpu_t *cpu;
+} jit_emit_t;
+
+static inline void
+emit8(jit_emit_t *e, uint8_t b)
+{
+  *e->p++ = b;
+}
+
+static inline void
+emit16(jit_emit_t *e, uint16_t v)
+{
+  memcpy(e->p, &v, 2);
+  e->p += 2;
+}
+
+static inline void
+emit32(jit_emit_t *e, uint32_t v)
+{
+  memcpy(e->p, &v, 4);
+  e->p += 4;
+}
+
+static inline void
+emit64(jit_emit_t *e, uint64_t v)
+{
+  memcpy(e->p, &v, 8);
+  e->p += 8;
+}
+
+/* ModRM of [rbx + disp32] */
+static void
+x86_cpu(jit_emit_t *e, int reg, int32_t disp)
+{
+  emit8(e, 0x80 | (reg & 7) << 3 | EBX);
+  emit32(e, disp);
+}
+
+/* ModRM and SIB of [rbx + index + disp32] */
+static void
+x86_cpu_index(jit_emit_t *e, int reg, int index, int32_t disp)
+{
+  emit8(e, 0x84 | reg << 3);
+  emit8(e, index << 3 | EBX);
+  emit32(e, disp);
+}
+
+/* movzx reg, byte [rbx + disp], or mov reg, r8d to r11d */
+static void
+x86_load8(jit_emit_t *e, int reg, int32_t disp)
+{
+  int host = x86_host(disp);
+
+  if (host >= 0) {
+    emit8(e, 0x44);
+    emit8(e, 0x89);
+    emit8(e, 0xc0 | (host & 7) << 3 | reg);
+    return;
+  }
+  emit8(e, 0x0f);
+  emit8(e, 0xb6);
+  x86_cpu(e, reg, disp);
+}
+
+/* movzx reg, byte [rbx + index + disp] */
+static void
+x86_load8_index(jit_emit_t *e, int reg, int index, int32_t disp)
+{
+  emit8(e, 0x0f);
+  emit8(e, 0xb6);
+  x86_cpu_index(e, reg, index, disp);
+}
+
+/* mov byte [rbx + disp], reg, or movzx r8d to r11d, reg. Only al, cl
+ * and dl. */
+static void
+x86_store8(jit_emit_t *e, int reg, int32_t disp)
+{
+  int host = x86_host(disp);
+
+  if (host >= 0) {
+    emit8(e, 0x44);
+    emit8(e, 0x0f);
+    emit8(e, 0xb6);
+    emit8(e, 0xc0 | (host & 7) << 3 | reg);
+    return;
+  }
+  emit8(e, 0x88);
+  x86_cpu(e, reg, disp);
+}
+
+static void
+x86_store8_index(jit_emit_t *e, int reg, int index, int32_t disp)
+{
+  emit8(e, 0x88);
+  x86_cpu_index(e, reg, index, disp);
+}
+
+static void
+x86_store8_imm(jit_emit_t *e, int32_t disp, uint8_t imm)
+{
+  int host = x86_host(disp);
+
+  if (host >= 0) {
+    /* mov r8d to r11d, imm32 */
+    emit8(e, 0x41);
+    emit8(e, 0xb8 | (host & 7));
+    emit32(e, imm);
+    return;
+  }
+  emit8(e, 0xc6);
+  x86_cpu(e, 0, disp);
+  emit8(e, imm);
+}
+
+static void
+x86_store8_imm_index(jit_emit_t *e, int index, int32_t disp, uint8_t imm)
+{
+  emit8(e, 0xc6);
+  x86_cpu_index(e, 0, index, disp);
+  emit8(e, imm);
+}
+
+static void
+x86_store16_imm(jit_emit_t *e, int32_t disp, uint16_t imm)
+{
+  emit8(e, 0x66);
+  emit8(e, 0xc7);
+  x86_cpu(e, 0, disp);
+  emit16(e, imm);
+}
+
+static void
+x86_store16(jit_emit_t *e, int reg, int32_t disp)
+{
+  emit8(e, 0x66);
+  emit8(e, 0x89);
+  x86_cpu(e, reg, disp);
+}
+
+/* and, or byte [rbx + disp], imm8, masks are passed complemented */
+static void
+x86_alu8_imm(jit_emit_t *e, int op, int32_t disp, int imm)
+{
+  int host = x86_host(disp);
+
+  if (host >= 0) {
+    emit8(e, 0x41);
+    emit8(e, 0x80);
+    emit8(e, 0xc0 | op << 3 | (host & 7));
+  } else {
+    emit8(e, 0x80);
+    x86_cpu(e, op, disp);
+  }
+  emit8(e, imm & 0xff);
+}
+
+/* or byte [rbx + disp], reg */
+static void
+x86_or8(jit_emit_t *e, int reg, int32_t disp)
+{
+  int host = x86_host(disp);
+
+  if (host >= 0) {
+    emit8(e, 0x41);
+    emit8(e, 0x08);
+    emit8(e, 0xc0 | reg << 3 | (host & 7));
+    return;
+  }
+  emit8(e, 0x08);
+  x86_cpu(e, reg, disp);
+}
+
+/* test byte [rbx + disp], imm8 */
+static void
+x86_test8_imm(jit_emit_t *e, int32_t disp, uint8_t imm)
+{
+  int host = x86_host(disp);
+
+  if (host >= 0) {
+    emit8(e, 0x41);
+    emit8(e, 0xf6);
+    emit8(e, 0xc0 | (host & 7));
+  } else {
+    emit8(e, 0xf6);
+    x86_cpu(e, 0, disp);
+  }
+  emit8(e, imm);
+}
+
+/* add qword [rbx + disp], imm32 */
+static void
+x86_add64_imm(jit_emit_t *e, int32_t disp, int32_t imm)
+{
+  if (imm == 0)
+    return;
+  emit8(e, 0x48);
+  emit8(e, 0x81);
+  x86_cpu(e, 0, disp);
+  emit32(e, imm);
+}
+
+/* add qword [rbx + disp], reg */
+static void
+x86_add64_reg(jit_emit_t *e, int reg, int32_t disp)
+{
+  emit8(e, 0x48);
+  emit8(e, 0x01);
+  x86_cpu(e, reg, disp);
+}
+
+/* add dword [rbx + disp], imm32 */
+static void
+x86_add32_imm(jit_emit_t *e, int32_t disp, int32_t imm)
+{
+  if (imm == 0)
+    return;
+  emit8(e, 0x81);
+  x86_cpu(e, 0, disp);
+  emit32(e, imm);
+}
+
+/* op dst, src on 32 bit registers */
+static void
+x86_alu(jit_emit_t *e, int op, int dst, int src)
+{
+  emit8(e, op);
+  emit8(e, 0xc0 | src << 3 | dst);
+}
+
+/* op reg, imm32 */
+static void
+x86_alu_imm(jit_emit_t *e, int op, int reg, uint32_t imm)
+{
+  emit8(e, 0x81);
+  emit8(e, 0xc0 | op << 3 | reg);
+  emit32(e, imm);
+}
+
+static void
+x86_shl(jit_emit_t *e, int reg, uint8_t n)
+{
+  emit8(e, 0xc1);
+  emit8(e, 0xe0 | reg);
+  emit8(e, n);
+}
+
+static void
+x86_shr(jit_emit_t *e, int reg, uint8_t n)
+{
+  emit8(e, 0xc1);
+  emit8(e, 0xe8 | reg);
+  emit8(e, n);
+}
+
+static void
+x86_not(jit_emit_t *e, int reg)
+{
+  emit8(e, 0xf7);
+  emit8(e, 0xd0 | reg);
+}
+
+/* movzx dst, low byte of src */
+static void
+x86_movzx8(jit_emit_t *e, int dst, int src)
+{
+  emit8(e, 0x0f);
+  emit8(e, 0xb6);
+  emit8(e, 0xc0 | dst << 3 | src);
+}
+
+/* movzx dst, low word of src */
+static void
+x86_movzx16(jit_emit_t *e, int dst, int src)
+{
+  emit8(e, 0x0f);
+  emit8(e, 0xb7);
+  emit8(e, 0xc0 | dst << 3 | src);
+}
+
+static void
+x86_setcc(jit_emit_t *e, int cc, int reg)
+{
+  emit8(e, 0x0f);
+  emit8(e, 0x90 | cc);
+  emit8(e, 0xc0 | reg);
+}
+
+static void
+x86_mov_imm(jit_emit_t *e, int reg, uint32_t imm)
+{
+  emit8(e, 0xb8 | reg);
+  emit32(e, imm);
+}
+
+/* inc al, dec al and add al, imm8 wrap around in the low byte */
+static void
+x86_inc_al(jit_emit_t *e)
+{
+  emit8(e, 0xfe);
+  emit8(e, 0xc0);
+}
+
+static void
+x86_dec_al(jit_emit_t *e)
+{
+  emit8(e, 0xfe);
+  emit8(e, 0xc8);
+}
+
+static void
+x86_add_al(jit_emit_t *e, uint8_t imm)
+{
+  emit8(e, 0x04);
+  emit8(e, imm);
+}
+
+static void
+x86_call(jit_emit_t *e, const void *fn)
+{
+  /* mov rdi, rbx; mov rax, fn; call rax */
+  emit8(e, 0x48);
+  emit8(e, 0x89);
+  emit8(e, 0xdf);
+  emit8(e, 0x48);
+  emit8(e, 0xb8);
+  emit64(e, (uint64_t)(uintptr_t)fn);
+  emit8(e, 0xff);
+  emit8(e, 0xd0);
+}
+
+/* Writes the registers kept in r8 to r11 back to the CPU */
+static void
+jit_spill(jit_emit_t *e)
+{
+  static const int32_t regs[] = { OFF_A, OFF_X, OFF_Y, OFF_P };
+
+  for (size_t i = 0; i < sizeof(regs) / sizeof(regs[0]); i++) {
+    /* mov byte [rbx + disp], r8b to r11b */
+    emit8(e, 0x44);
+    emit8(e, 0x88);
+    x86_cpu(e, x86_host(regs[i]), regs[i]);
+  }
+}
+
+static void
+jit_reload(jit_emit_t *e)
+{
+  static const int32_t regs[] = { OFF_A, OFF_X, OFF_Y, OFF_P };
+
+  for (size_t i = 0; i < sizeof(regs) / sizeof(regs[0]); i++) {
+    /* movzx r8d to r11d, byte [rbx + disp] */
+    emit8(e, 0x44);
+    emit8(e, 0x0f);
+    emit8(e, 0xb6);
+    x86_cpu(e, x86_host(regs[i]), regs[i]);
+  }
+}
+
+/* Calls fn with the CPU up to date, eax is kept for what it returns */
+static void
+jit_call(jit_emit_t *e, const void *fn)
+{
+  jit_spill(e);
+  x86_call(e, fn);
+  jit_reload(e);
+}
+
+/* Conditional and plain jumps, return where to patch the target */
+static uint8_t*
+x86_jcc(jit_emit_t *e, int cc)
+{
+  emit8(e, 0x0f);
+  emit8(e, 0x80 | cc);
+  emit32(e, 0);
+  return e->p - 4;
+}
+
+static uint8_t*
+x86_jmp(jit_emit_t *e)
+{
+  emit8(e, 0xe9);
+  emit32(e, 0);
+  return e->p - 4;
+}
+
+static void
+x86_patch(uint8_t *rel, uint8_t *target)
+{
+  int32_t d = target - (rel + 4);
+  memcpy(rel, &d, 4);
+}
+
+/* Sets N and Z of P from eax, clobbers ecx */
+static void
+jit_nz(jit_emit_t *e)
+{
+  /* movzx ecx, byte [r12 + rax] */
+  emit8(e, 0x41);
+  emit8(e, 0x0f);
+  emit8(e, 0xb6);
+  emit8(e, 0x0c);
+  emit8(e, 0x04);
+  x86_alu8_imm(e, IMM_AND, OFF_P, ~(P_N | P_Z));
+  x86_or8(e, ECX, OFF_P);
+}
+
+/* Same for a value known while translating */
+static void
+jit_nz_const(jit_emit_t *e, uint8_t value)
+{
+  x86_alu8_imm(e, IMM_AND, OFF_P, ~(P_N | P_Z));
+  if (value == 0 || (value & 0x80))
+    x86_alu8_imm(e, IMM_OR, OFF_P, value ? P_N : P_Z);
+}
+
+static uint8_t
+jit_io_read(cpu_t *cpu, uint32_t addr)
+{
+  cpu_io_t *io = &cpu->io[addr >> 8];
+  return io->read(io->opaque, addr);
+}
+
+static void
+jit_io_write(cpu_t *cpu, uint32_t addr, uint32_t value)
+{
+  cpu_io_t *io = &cpu->io[addr >> 8];
+  io->write(io->opaque, addr, value);
+}
+
+/* Reads the byte at the address in eax into eax. Pages without memory
+ * go through their handlers with the cycles up to date. */
+static void
+jit_read(jit_emit_t *e)
+{
+  uint8_t *slow, *done;
+
+  /* mov edx, eax; shr edx, 8; mov rdx, [rbx + rdx * 8 + read_map] */
+  x86_alu(e, ALU_MOV, EDX, EAX);
+  x86_shr(e, EDX, 8);
+  emit8(e, 0x48);
+  emit8(e, 0x8b);
+  emit8(e, 0x94);
+  emit8(e, 0xd3);
+  emit32(e, OFF_READ_MAP);
+  /* test rdx, rdx */
+  emit8(e, 0x48);
+  emit8(e, 0x85);
+  emit8(e, 0xd2);
+  slow = x86_jcc(e, CC_Z);
+  /* movzx ecx, al; movzx eax, byte [rdx + rcx] */
+  x86_movzx8(e, ECX, EAX);
+  emit8(e, 0x0f);
+  emit8(e, 0xb6);
+  emit8(e, 0x04);
+  emit8(e, 0x0a);
+  done = x86_jmp(e);
+
+  x86_patch(slow, e->p);
+  x86_add64_imm(e, OFF_CYCLES, e->cycles);
+  x86_alu(e, ALU_MOV, ESI, EAX);
+  jit_call(e, (const void*)jit_io_read);
+  x86_movzx8(e, EAX, EAX);
+  x86_add64_imm(e, OFF_CYCLES, -(int32_t)e->cycles);
+  /* mov r13d, 1 */
+  emit8(e, 0x41);
+  emit8(e, 0xbd);
+  emit32(e, 1);
+  x86_patch(done, e->p);
+  e->io = true;
+}
+
+/* Writes cl to the address in eax */
+static void
+jit_write(jit_emit_t *e)
+{
+  uint8_t *slow, *done;
+
+  x86_alu(e, ALU_MOV, EDX, EAX);
+  x86_shr(e, EDX, 8);
+  emit8(e, 0x48);
+  emit8(e, 0x8b);
+  emit8(e, 0x94);
+  emit8(e, 0xd3);
+  emit32(e, OFF_WRITE_MAP);
+  emit8(e, 0x48);
+  emit8(e, 0x85);
+  emit8(e, 0xd2);
+  slow = x86_jcc(e, CC_Z);
+  /* movzx eax, al; mov [rdx + rax], cl */
+  x86_movzx8(e, EAX, EAX);
+  emit8(e, 0x88);
+  emit8(e, 0x0c);
+  emit8(e, 0x02);
+  done = x86_jmp(e);
+
+  x86_patch(slow, e->p);
+  x86_add64_imm(e, OFF_CYCLES, e->cycles);
+  x86_alu(e, ALU_MOV, ESI, EAX);
+  x86_alu(e, ALU_MOV, EDX, ECX);
+  jit_call(e, (const void*)jit_io_write);
+  x86_add64_imm(e, OFF_CYCLES, -(int32_t)e->cycles);
+  emit8(e, 0x41);
+  emit8(e, 0xbd);
+  emit32(e, 1);
+  x86_patch(done, e->p);
+  e->io = true;
+}
+
+/* Internal RAM is always mapped, accesses below $2000 need no checks */
+static bool
+jit_is_ram(uint32_t addr)
+{
+  return addr < 0x2000;
+}
+
+/* Leaves base plus an index register in eax, adding the page penalty
+ * if asked */
+static void
+jit_index(jit_emit_t *e, int32_t reg, uint16_t base, bool penalty)
+{
+  x86_load8(e, EAX, reg);
+  x86_alu_imm(e, IMM_ADD, EAX, base);
+  x86_movzx16(e, EAX, EAX);
+  if (penalty) {
+    /* cmp ah, base >> 8; setne cl; movzx ecx, cl; add [cycles], rcx */
+    emit8(e, 0x80);
+    emit8(e, 0xfc);
+    emit8(e, base >> 8);
+    x86_setcc(e, CC_NZ, ECX);
+    x86_movzx8(e, ECX, ECX);
+    x86_add64_reg(e, ECX, OFF_CYCLES);
+  }
+}
+
+/* ($nn,X) into eax */
+static void
+jit_izx(jit_emit_t *e, uint8_t zp)
+{
+  x86_load8(e, EAX, OFF_X);
+  x86_add_al(e, zp);
+  x86_load8_index(e, ECX, EAX, OFF_RAM);
+  x86_inc_al(e);
+  x86_load8_index(e, EAX, EAX, OFF_RAM);
+  x86_shl(e, EAX, 8);
+  x86_alu(e, ALU_OR, EAX, ECX);
+}
+
+/* ($nn),Y into eax */
+static void
+jit_izy(jit_emit_t *e, uint8_t zp, bool penalty)
+{
+  x86_load8(e, EAX, OFF_RAM + (uint8_t)(zp + 1));
+  x86_shl(e, EAX, 8);
+  x86_load8(e, ECX, OFF_RAM + zp);
+  x86_alu(e, ALU_OR, EAX, ECX);
+  x86_load8(e, ECX, OFF_Y);
+  x86_alu(e, ALU_ADD, ECX, EAX);
+  if (penalty) {
+    /* Crossing when the address and base differ above the low byte */
+    x86_alu(e, ALU_MOV, EDX, ECX);
+    x86_alu(e, ALU_XOR, EDX, EAX);
+    x86_shr(e, EDX, 8);
+    x86_setcc(e, CC_NZ, EDX);
+    x86_movzx8(e, EDX, EDX);
+    x86_add64_reg(e, EDX, OFF_CYCLES);
+  }
+  x86_movzx16(e, EAX, ECX);
+}
+
+/* Loads the operand of a read instruction into eax. Returns false for
+ * modes that are left to the interpreter. */
+static bool
+jit_operand(jit_emit_t *e, const cpu_opcode_t *op, uint16_t m)
+{
+  uint8_t zp = m & 0xff;
+
+  switch (op->mode) {
+  case MODE_IMM:
+    x86_mov_imm(e, EAX, zp);
+    return true;
+  case MODE_ZP0:
+    x86_load8(e, EAX, OFF_RAM + zp);
+    return true;
+  case MODE_ZPX:
+  case MODE_ZPY:
+    x86_load8(e, EAX, op->mode == MODE_ZPX ? OFF_X : OFF_Y);
+    x86_add_al(e, zp);
+    x86_load8_index(e, EAX, EAX, OFF_RAM);
+    return true;
+  case MODE_ABS:
+    if (jit_is_ram(m)) {
+      x86_load8(e, EAX, OFF_RAM + (m & 0x7ff));
+    } else {
+      x86_mov_imm(e, EAX, m);
+      jit_read(e);
+    }
+    return true;
+  case MODE_ABX:
+  case MODE_ABY:
+    jit_index(e, op->mode == MODE_ABX ? OFF_X : OFF_Y, m, op->page_penalty);
+    if (jit_is_ram(m + 0xff)) {
+      x86_alu_imm(e, IMM_AND, EAX, 0x7ff);
+      x86_load8_index(e, EAX, EAX, OFF_RAM);
+    } else {
+      jit_read(e);
+    }
+    return true;
+  case MODE_IZX:
+    jit_izx(e, zp);
+    jit_read(e);
+    return true;
+  case MODE_IZY:
+    jit_izy(e, zp, op->page_penalty);
+    jit_read(e);
+    return true;
+  }
+  return false;
+}
+
+/* Stores a register to the operand address */
+static bool
+jit_store(jit_emit_t *e, const cpu_opcode_t *op, uint16_t m, int32_t reg)
+{
+  uint8_t zp = m & 0xff;
+
+  switch (op->mode) {
+  case MODE_ZP0:
+    x86_load8(e, ECX, reg);
+    x86_store8(e, ECX, OFF_RAM + zp);
+    return true;
+  case MODE_ZPX:
+  case MODE_ZPY:
+    x86_load8(e, EAX, op->mode == MODE_ZPX ? OFF_X : OFF_Y);
+    x86_add_al(e, zp);
+    x86_load8(e, ECX, reg);
+    x86_store8_index(e, ECX, EAX, OFF_RAM);
+    return true;
+  case MODE_ABS:
+    x86_load8(e, ECX, reg);
+    if (jit_is_ram(m)) {
+      x86_store8(e, ECX, OFF_RAM + (m & 0x7ff));
+    } else {
+      x86_mov_imm(e, EAX, m);
+      jit_write(e);
+    }
+    return true;
+  case MODE_ABX:
+  case MODE_ABY:
+    jit_index(e, op->mode == MODE_ABX ? OFF_X : OFF_Y, m, false);
+    x86_load8(e, ECX, reg);
+    if (jit_is_ram(m + 0xff)) {
+      x86_alu_imm(e, IMM_AND, EAX, 0x7ff);
+      x86_store8_index(e, ECX, EAX, OFF_RAM);
+    } else {
+      jit_write(e);
+    }
+    return true;
+  case MODE_IZX:
+    jit_izx(e, zp);
+    x86_load8(e, ECX, reg);
+    jit_write(e);
+    return true;
+  case MODE_IZY:
+    jit_izy(e, zp, false);
+    x86_load8(e, ECX, reg);
+    jit_write(e);
+    return true;
+  }
+  return false;
+}
+
+/* Read-modify-write operands in RAM, the address is kept in esi */
+static bool
+jit_rmw_load(jit_emit_t *e, const cpu_opcode_t *op, uint16_t m)
+{
+  switch (op->mode) {
+  case MODE_ACC:
+    x86_load8(e, EAX, OFF_A);
+    return true;
+  case MODE_ZP0:
+    x86_load8(e, EAX, OFF_RAM + (m & 0xff));
+    return true;
+  case MODE_ZPX:
+    x86_load8(e, EAX, OFF_X);
+    x86_add_al(e, m & 0xff);
+    x86_alu(e, ALU_MOV, ESI, EAX);
+    x86_load8_index(e, EAX, ESI, OFF_RAM);
+    return true;
+  case MODE_ABS:
+    if (!jit_is_ram(m))
+      return false;
+    x86_load8(e, EAX, OFF_RAM + (m & 0x7ff));
+    return true;
+  }
+  return false;
+}
+
+static void
+jit_rmw_store(jit_emit_t *e, const cpu_opcode_t *op, uint16_t m)
+{
+  switch (op->mode) {
+  case MODE_ACC:
+    x86_store8(e, EAX, OFF_A);
+    break;
+  case MODE_ZP0:
+    x86_store8(e, EAX, OFF_RAM + (m & 0xff));
+    break;
+  case MODE_ZPX:
+    x86_store8_index(e, EAX, ESI, OFF_RAM);
+    break;
+  case MODE_ABS:
+    x86_store8(e, EAX, OFF_RAM + (m & 0x7ff));
+    break;
+  }
+}
+
+/* A = A + eax + C */
+static void
+jit_adc(jit_emit_t *e)
+{
+  x86_load8(e, ECX, OFF_A);
+  x86_load8(e, EDX, OFF_P);
+  x86_alu_imm(e, IMM_AND, EDX, P_C);
+  x86_alu(e, ALU_ADD, EDX, ECX);
+  x86_alu(e, ALU_ADD, EDX, EAX);
+  /* V from ~(A ^ m) & (A ^ t) & 0x80, moved down to bit 6 */
+  x86_alu(e, ALU_XOR, EAX, ECX);
+  x86_not(e, EAX);
+  x86_alu(e, ALU_XOR, ECX, EDX);
+  x86_alu(e, ALU_AND, EAX, ECX);
+  x86_alu_imm(e, IMM_AND, EAX, 0x80);
+  x86_shr(e, EAX, 1);
+  /* C from bit 8 */
+  x86_alu(e, ALU_MOV, ECX, EDX);
+  x86_shr(e, ECX, 8);
+  x86_alu(e, ALU_OR, EAX, ECX);
+  x86_store8(e, EDX, OFF_A);
+  x86_alu8_imm(e, IMM_AND, OFF_P, ~(P_V | P_C));
+  x86_or8(e, EAX, OFF_P);
+  x86_movzx8(e, EAX, EDX);
+  jit_nz(e);
+}
+
+/* Compares a register with eax */
+static void
+jit_compare(jit_emit_t *e, int32_t reg)
+{
+  x86_load8(e, ECX, reg);
+  x86_alu(e, ALU_SUB, ECX, EAX);
+  x86_setcc(e, CC_AE, EDX);
+  x86_movzx8(e, EAX, ECX);
+  x86_alu8_imm(e, IMM_AND, OFF_P, ~P_C);
+  x86_or8(e, EDX, OFF_P);
+  jit_nz(e);
+}
+
+/* Shifts eax, the carry out goes to edx */
+static void
+jit_shift(jit_emit_t *e, const char *name)
+{
+  bool left = name[0] == 'A' || (name[0] == 'R' && name[2] == 'L');
+  bool rotate = name[0] == 'R';
+
+  if (rotate) {
+    x86_load8(e, ECX, OFF_P);
+    x86_alu_imm(e, IMM_AND, ECX, P_C);
+    if (!left)
+      x86_shl(e, ECX, 7);
+  }
+  x86_alu(e, ALU_MOV, EDX, EAX);
+  if (left) {
+    x86_shr(e, EDX, 7);
+    x86_alu(e, ALU_ADD, EAX, EAX);
+  } else {
+    x86_alu_imm(e, IMM_AND, EDX, 1);
+    x86_shr(e, EAX, 1);
+  }
+  if (rotate)
+    x86_alu(e, ALU_OR, EAX, ECX);
+  x86_movzx8(e, EAX, EAX);
+}
+
+/* Returns from the block */
+static void
+jit_exit_jump(jit_emit_t *e)
+{
+  /* xor eax, eax */
+  emit8(e, 0x31);
+  emit8(e, 0xc0);
+  e->exits[e->exit_count++] = x86_jmp(e);
+}
+
+/* Leaves the block at pc, or at the PC already stored when negative */
+static void
+jit_exit(jit_emit_t *e, int pc, uint32_t cycles, uint32_t count)
+{
+  if (pc >= 0)
+    x86_store16_imm(e, OFF_PC, pc);
+  x86_add64_imm(e, OFF_CYCLES, cycles);
+  x86_add32_imm(e, OFF_INSTRUCTIONS, count);
+  jit_exit_jump(e);
+}
+
+/* Same, to a block that is linked to once known. Until then the jump
+ * goes to the next instruction, which returns where it is. */
+static void
+jit_exit_link(jit_emit_t *e, uint16_t pc, uint32_t cycles, uint32_t count)
+{
+  uint8_t *link;
+
+  x86_store16_imm(e, OFF_PC, pc);
+  x86_add64_imm(e, OFF_CYCLES, cycles);
+  x86_add32_imm(e, OFF_INSTRUCTIONS, count);
+  link = x86_jmp(e);
+  x86_patch(link, e->p);
+  /* mov rax, link */
+  emit8(e, 0x48);
+  emit8(e, 0xb8);
+  emit64(e, (uint64_t)(uintptr_t)link);
+  e->exits[e->exit_count++] = x86_jmp(e);
+}
+
+/* Pushes ecx or an immediate */
+static void
+jit_push(jit_emit_t *e, int imm)
+{
+  x86_load8(e, EAX, OFF_SP);
+  if (imm >= 0)
+    x86_store8_imm_index(e, EAX, OFF_STACK, imm);
+  else
+    x86_store8_index(e, ECX, EAX, OFF_STACK);
+  x86_dec_al(e);
+  x86_store8(e, EAX, OFF_SP);
+}
+
+typedef enum {
+  JIT_NATIVE,
+  /* Native and ends the block */
+  JIT_END,
+  /* Left to the interpreter, ends the block */
+  JIT_INTERPRET,
+} jit_kind_t;
+
+/* Translates the instruction at addr. Its base cycles are already in
+ * e->cycles, its operand is m. */
+static jit_kind_t
+jit_instruction(jit_emit_t *e, uint16_t addr, uint8_t opcode, uint16_t m)
+{
+  const cpu_opcode_t *op = &cpu_opcodes[opcode];
+  const char *name = op->name;
+  uint16_t next = addr + 1 + cpu_mode_size[op->mode];
+
+#define IS(s) (strcmp(name, s) == 0)
+  if (IS("LDA") || IS("LDX") || IS("LDY")) {
+    int32_t reg = IS("LDA") ? OFF_A : IS("LDX") ? OFF_X : OFF_Y;
+    if (op->mode == MODE_IMM) {
+      x86_store8_imm(e, reg, m);
+      jit_nz_const(e, m);
+      return JIT_NATIVE;
+    }
+    if (!jit_operand(e, op, m))
+      return JIT_INTERPRET;
+    x86_store8(e, EAX, reg);
+    jit_nz(e);
+    return JIT_NATIVE;
+  }
+  if (IS("STA") || IS("STX") || IS("STY")) {
+    int32_t reg = IS("STA") ? OFF_A : IS("STX") ? OFF_X : OFF_Y;
+    return jit_store(e, op, m, reg) ? JIT_NATIVE : JIT_INTERPRET;
+  }
+  if (IS("AND") || IS("ORA") || IS("EOR")) {
+    if (!jit_operand(e, op, m))
+      return JIT_INTERPRET;
+    x86_load8(e, ECX, OFF_A);
+    x86_alu(e, IS("AND") ? ALU_AND : IS("ORA") ? ALU_OR : ALU_XOR, EAX, ECX);
+    x86_store8(e, EAX, OFF_A);
+    jit_nz(e);
+    return JIT_NATIVE;
+  }
+  if ((IS("ADC") || IS("SBC"))) {
+    if (!jit_operand(e, op, m))
+      return JIT_INTERPRET;
+    if (IS("SBC"))
+      x86_alu_imm(e, IMM_XOR, EAX, 0xff);
+    jit_adc(e);
+    return JIT_NATIVE;
+  }
+  if (IS("CMP") || IS("CPX") || IS("CPY")) {
+    if (!jit_operand(e, op, m))
+      return JIT_INTERPRET;
+    jit_compare(e, IS("CMP") ? OFF_A : IS("CPX") ? OFF_X : OFF_Y);
+    return JIT_NATIVE;
+  }
+  if (IS("BIT")) {
+    if (!jit_operand(e, op, m))
+      return JIT_INTERPRET;
+    x86_load8(e, ECX, OFF_A);
+    x86_alu(e, ALU_AND, ECX, EAX);
+    x86_setcc(e, CC_Z, ECX);
+    x86_movzx8(e, ECX, ECX);
+    x86_alu(e, ALU_ADD, ECX, ECX);
+    x86_alu_imm(e, IMM_AND, EAX, P_N | P_V);
+    x86_alu(e, ALU_OR, EAX, ECX);
+    x86_alu8_imm(e, IMM_AND, OFF_P, ~(P_N | P_V | P_Z));
+    x86_or8(e, EAX, OFF_P);
+    return JIT_NATIVE;
+  }
+  if (IS("ASL") || IS("LSR") || IS("ROL") || IS("ROR")) {
+    if (!jit_rmw_load(e, op, m))
+      return JIT_INTERPRET;
+    jit_shift(e, name);
+    jit_rmw_store(e, op, m);
+    x86_alu8_imm(e, IMM_AND, OFF_P, ~P_C);
+    x86_or8(e, EDX, OFF_P);
+    jit_nz(e);
+    return JIT_NATIVE;
+  }
+  if (IS("INC") || IS("DEC")) {
+    if (!jit_rmw_load(e, op, m))
+      return JIT_INTERPRET;
+    if (IS("INC"))
+      x86_inc_al(e);
+    else
+      x86_dec_al(e);
+    jit_rmw_store(e, op, m);
+    jit_nz(e);
+    return JIT_NATIVE;
+  }
+
+  if (IS("INX") || IS("INY") || IS("DEX") || IS("DEY")) {
+    int32_t reg = name[2] == 'X' ? OFF_X : OFF_Y;
+    x86_load8(e, EAX, reg);
+    if (name[0] == 'I')
+      x86_inc_al(e);
+    else
+      x86_dec_al(e);
+    x86_store8(e, EAX, reg);
+    jit_nz(e);
+    return JIT_NATIVE;
+  }
+  if (IS("TAX") || IS("TAY") || IS("TXA") || IS("TYA") || IS("TSX") ||
+      IS("TXS")) {
+    static const struct {
+      char c;
+      int32_t offset;
+    } regs[] = {
+      { 'A', OFF_A }, { 'X', OFF_X }, { 'Y', OFF_Y }, { 'S', OFF_SP },
+    };
+    int32_t src = 0, dst = 0;
+    for (int i = 0; i < 4; i++) {
+      if (regs[i].c == name[1])
+        src = regs[i].offset;
+      if (regs[i].c == name[2])
+        dst = regs[i].offset;
+    }
+    x86_load8(e, EAX, src);
+    x86_store8(e, EAX, dst);
+    if (!IS("TXS"))
+      jit_nz(e);
+    return JIT_NATIVE;
+  }
+  if (IS("CLC") || IS("CLD") || IS("CLV")) {
+    x86_alu8_imm(e, IMM_AND, OFF_P,
+                 ~(IS("CLC") ? P_C : IS("CLD") ? P_D : P_V));
+    return JIT_NATIVE;
+  }
+  /* SEI only masks interrupts, CLI may let one in and is interpreted */
+  if (IS("SEC") || IS("SED") || IS("SEI")) {
+    x86_alu8_imm(e, IMM_OR, OFF_P, IS("SEC") ? P_C : IS("SED") ? P_D : P_I);
+    return JIT_NATIVE;
+  }
+  if (IS("NOP") && (op->mode == MODE_IMP || op->mode == MODE_IMM))
+    return JIT_NATIVE;
+
+  if (IS("PHA")) {
+    x86_load8(e, ECX, OFF_A);
+    jit_push(e, -1);
+    return JIT_NATIVE;
+  }
+  if (IS("PHP")) {
+    x86_load8(e, ECX, OFF_P);
+    x86_alu_imm(e, IMM_OR, ECX, 0x30);
+    jit_push(e, -1);
+    return JIT_NATIVE;
+  }
+  if (IS("PLA")) {
+    x86_load8(e, EAX, OFF_SP);
+    x86_inc_al(e);
+    x86_store8(e, EAX, OFF_SP);
+    x86_load8_index(e, EAX, EAX, OFF_STACK);
+    x86_store8(e, EAX, OFF_A);
+    jit_nz(e);
+    return JIT_NATIVE;
+  }
+
+  /* Control flow ends the block */
+  if (op->mode == MODE_REL) {
+    static const struct {
+      const char *name;
+      uint8_t mask;
+      bool set;
+    } branches[] = {
+      { "BPL", P_N, false }, { "BMI", P_N, true },
+      { "BVC", P_V, false }, { "BVS", P_V, true },
+      { "BCC", P_C, false }, { "BCS", P_C, true },
+      { "BNE", P_Z, false }, { "BEQ", P_Z, true },
+    };
+    uint16_t target = next + (int8_t)m;
+    uint8_t *taken;
+    if (e->idle && target <= addr && addr - target <= IDLE_LOOP_SIZE &&
+        idle_loop(e->cpu, target, addr))
+      return JIT_INTERPRET;
+    for (size_t i = 0; i < sizeof(branches) / sizeof(branches[0]); i++) {
+      if (!IS(branches[i].name))
+        continue;
+      x86_test8_imm(e, OFF_P, branches[i].mask);
+      taken = x86_jcc(e, branches[i].set ? CC_NZ : CC_Z);
+      jit_exit_link(e, next, e->cycles, e->count + 1);
+      x86_patch(taken, e->p);
+      jit_exit_link(e, target,
+                    e->cycles + (((next ^ target) & 0xff00) ? 2 : 1),
+                    e->count + 1);
+      return JIT_END;
+    }
+  }
+  if (IS("JMP") && op->mode == MODE_ABS) {
+    if (e->idle && m <= addr && addr - m <= IDLE_LOOP_SIZE &&
+        idle_loop(e->cpu, m, addr))
+      return JIT_INTERPRET;
+    jit_exit_link(e, m, e->cycles, e->count + 1);
+    return JIT_END;
+  }
+  if (IS("JSR")) {
+    uint16_t ret = next - 1;
+    jit_push(e, ret >> 8);
+    jit_push(e, ret & 0xff);
+    jit_exit_link(e, m, e->cycles, e->count + 1);
+    return JIT_END;
+  }
+  if (IS("RTS")) {
+    x86_load8(e, EAX, OFF_SP);
+    x86_inc_al(e);
+    x86_load8_index(e, ECX, EAX, OFF_STACK);
+    x86_inc_al(e);
+    x86_load8_index(e, EDX, EAX, OFF_STACK);
+    x86_store8(e, EAX, OFF_SP);
+    x86_shl(e, EDX, 8);
+    x86_alu(e, ALU_OR, ECX, EDX);
+    emit8(e, 0xff);
+    emit8(e, 0xc1); /* inc ecx */
+    x86_store16(e, ECX, OFF_PC);
+    jit_exit(e, -1, e->cycles, e->count + 1);
+    return JIT_END;
+  }
+#undef IS
+  return JIT_INTERPRET;
+}
+
+static uint32_t
+jit_hash(uint16_t pc, const uint8_t *page)
+{
+  uint32_t h = (uint32_t)((uintptr_t)page >> 8) * 0x9e3779b1u ^ pc;
+  h *= 0x85ebca6bu;
+  return (h ^ h >> 16) & (JIT_TABLE_SIZE - 1);
+}
+
+/* Translates the block at the PC, NULL when the interpreter has to run
+ * its first instruction */
+static jit_block_t*
+jit_translate(jit_t *jit, cpu_t *cpu)
+{
+  const uint8_t *page = cpu->read_map[cpu->pc >> 8];
+  uint8_t *start = jit->code + jit->code_used;
+  uint16_t addr = cpu->pc;
+  uint32_t max_cycles = 0, last_max = 0;
+  jit_kind_t kind = JIT_NATIVE;
+  jit_block_t *block;
+  uint8_t *body, *epilogue, *ok;
+  uint8_t *fail[4];
+  jit_emit_t e;
+
+  if (jit->code_used + JIT_BLOCK_CODE > JIT_CODE_SIZE ||
+      jit->block_count == JIT_MAX_BLOCKS)
+    jit_flush(jit);
+  start = jit->code + jit->code_used;
+
+  memset(&e, 0, sizeof(e));
+  e.p = start;
+  e.idle = cpu->idle != NULL && !jit->diff;
+  e.cpu = cpu;
+  /* push rbx; push r12; push r13; mov rbx, rdi; mov r12, nz;
+   * xor r13d, r13d; then load the registers */
+  emit8(&e, 0x53);
+  emit8(&e, 0x41);
+  emit8(&e, 0x54);
+  emit8(&e, 0x41);
+  emit8(&e, 0x55);
+  emit8(&e, 0x48);
+  emit8(&e, 0x89);
+  emit8(&e, 0xfb);
+  emit8(&e, 0x49);
+  emit8(&e, 0xbc);
+  emit64(&e, (uint64_t)(uintptr_t)jit->nz);
+  emit8(&e, 0x45);
+  emit8(&e, 0x31);
+  emit8(&e, 0xed);
+  jit_reload(&e);
+  body = e.p;
+
+  while (e.count < JIT_BLOCK_INSTRUCTIONS && kind == JIT_NATIVE) {
+    uint8_t offset = addr & 0xff;
+    uint8_t opcode = page[offset];
+    const cpu_opcode_t *op = &cpu_opcodes[opcode];
+    int size = 1 + cpu_mode_size[op->mode];
+    uint16_t m = 0;
+    uint8_t *rewind = e.p;
+    int exits = e.exit_count;
+
+    /* Blocks stay within their page, the next one may be switched */
+    if (((addr ^ cpu->pc) & 0xff00) || offset + size > 0x100)
+      break;
+    if (size > 1)
+      m = page[offset + 1];
+    if (size > 2)
+      m |= page[offset + 2] << 8;
+
+    max_cycles += last_max;
+    last_max = op->cycles + op->page_penalty + (op->mode == MODE_REL ? 2 : 0);
+    e.cycles += op->cycles;
+    e.io = false;
+    kind = jit_instruction(&e, addr, opcode, m);
+
+    if (kind == JIT_INTERPRET) {
+      /* Drop what the operand already emitted, the handler expects
+       * the PC after the opcode and adds its own cycles */
+      e.p = rewind;
+      e.exit_count = exits;
+      e.cycles -= op->cycles;
+      x86_store16_imm(&e, OFF_PC, addr + 1);
+      x86_add64_imm(&e, OFF_CYCLES, e.cycles);
+      x86_add32_imm(&e, OFF_INSTRUCTIONS, e.count + 1);
+      jit_call(&e, (const void*)cpu_handler(opcode));
+      jit_exit_jump(&e);
+      break;
+    }
+    addr += size;
+    if (kind == JIT_NATIVE && e.io) {
+      /* test r13d, r13d; jz next; leave after the access */
+      uint8_t *skip;
+      emit8(&e, 0x45);
+      emit8(&e, 0x85);
+      emit8(&e, 0xed);
+      skip = x86_jcc(&e, CC_Z);
+      jit_exit(&e, addr, e.cycles, e.count + 1);
+      x86_patch(skip, e.p);
+    }
+    e.count++;
+  }
+  if (e.count == 0 && kind == JIT_NATIVE)
+    return NULL;
+  if (kind == JIT_NATIVE)
+    jit_exit_link(&e, addr, e.cycles, e.count);
+
+  /* Write back the registers; pop r13; pop r12; pop rbx; ret */
+  for (int i = 0; i < e.exit_count; i++)
+    x86_patch(e.exits[i], e.p);
+  epilogue = e.p;
+  jit_spill(&e);
+  emit8(&e, 0x41);
+  emit8(&e, 0x5d);
+  emit8(&e, 0x41);
+  emit8(&e, 0x5c);
+  emit8(&e, 0x5b);
+  emit8(&e, 0xc3);
+
+  /* Chain entry, the block before stored the PC and its cycles.
+   * mov rax, [rbx + read_map + page * 8]; mov rcx, page; cmp rax, rcx */
+  uint8_t *chain = e.p;
+  emit8(&e, 0x48);
+  emit8(&e, 0x8b);
+  x86_cpu(&e, EAX, OFF_READ_MAP + (cpu->pc >> 8) * 8);
+  emit8(&e, 0x48);
+  emit8(&e, 0xb9);
+  emit64(&e, (uint64_t)(uintptr_t)page);
+  emit8(&e, 0x48);
+  emit8(&e, 0x39);
+  emit8(&e, 0xc8);
+  fail[0] = x86_jcc(&e, CC_NZ);
+  /* mov rax, [rbx + cycles]; add rax, max_cycles; cmp rax, [rbx + deadline] */
+  emit8(&e, 0x48);
+  emit8(&e, 0x8b);
+  x86_cpu(&e, EAX, OFF_CYCLES);
+  emit8(&e, 0x48);
+  emit8(&e, 0x05);
+  emit32(&e, max_cycles);
+  emit8(&e, 0x48);
+  emit8(&e, 0x3b);
+  x86_cpu(&e, EAX, OFF_DEADLINE);
+  fail[1] = x86_jcc(&e, CC_AE);
+  x86_alu8_imm(&e, IMM_CMP, OFF_NMI, 0);
+  fail[2] = x86_jcc(&e, CC_NZ);
+  x86_test8_imm(&e, OFF_P, P_I);
+  ok = x86_jcc(&e, CC_NZ);
+  x86_alu8_imm(&e, IMM_CMP, OFF_IRQ, 0);
+  fail[3] = x86_jcc(&e, CC_NZ);
+  x86_patch(ok, e.p);
+  x86_patch(x86_jmp(&e), body);
+  for (int i = 0; i < 4; i++)
+    x86_patch(fail[i], e.p);
+  /* xor eax, eax */
+  emit8(&e, 0x31);
+  emit8(&e, 0xc0);
+  x86_patch(x86_jmp(&e), epilogue);
+
+  jit->code_used += e.p - start;
+  block = &jit->blocks[jit->block_count++];
+  block->pc = cpu->pc;
+  block->page = page;
+  block->max_cycles = max_cycles;
+  block->code = (jit_code_t)(void*)start;
+  block->chain = chain;
+
+  uint32_t h = jit_hash(block->pc, page);
+  while (jit->table[h])
+    h = (h + 1) & (JIT_TABLE_SIZE - 1);
+  jit->table[h] = jit->block_count;
+  return block;
+}
+
+/* The block at the PC, if it is in read-only memory */
+static inline jit_block_t*
+jit_lookup(jit_t *jit, cpu_t *cpu)
+{
+  uint8_t index = cpu->pc >> 8;
+  const uint8_t *page = cpu->read_map[index];
+
+  if (page == NULL || cpu->write_map[index] != NULL)
+    return NULL;
+  for (uint32_t h = jit_hash(cpu->pc, page); jit->table[h];
+       h = (h + 1) & (JIT_TABLE_SIZE - 1)) {
+    jit_block_t *block = &jit->blocks[jit->table[h] - 1];
+    if (block->pc == cpu->pc && block->page == page)
+      return block;
+  }
+  return jit_translate(jit, cpu);
+}
+
+/*
+ * Differential mode
+ */
+
+static void
+jit_log(jit_t *jit, uint16_t addr, uint8_t value, bool write,
+        uint32_t cycles)
+{
+  if (jit->log_count == JIT_LOG_SIZE) {
+    jit->log_overflow = true;
+    return;
+  }
+  jit_access_t *a = &jit->log[jit->log_count++];
+  a->addr = addr;
+  a->value = value;
+  a->write = write;
+  a->cycles = cycles;
+}
+
+/* Wrap the handlers of the real CPU, nested accesses such as the reads
+ * of a DMA are not recorded */
+static uint8_t
+jit_log_read(void *opaque, uint16_t addr)
+{
+  jit_t *jit = (jit_t*)opaque;
+  cpu_io_t *io = &jit->io[addr >> 8];
+  uint64_t cycles = jit->cpu->cycles;
+  uint8_t value;
+
+  jit->io_depth++;
+  value = io->read(io->opaque, addr);
+  jit->io_depth--;
+  if (jit->io_depth == 0)
+    jit_log(jit, addr, value, false, jit->cpu->cycles - cycles);
+  return value;
+}
+
+static void
+jit_log_write(void *opaque, uint16_t addr, uint8_t value)
+{
+  jit_t *jit = (jit_t*)opaque;
+  cpu_io_t *io = &jit->io[addr >> 8];
+  uint64_t cycles = jit->cpu->cycles;
+
+  jit->io_depth++;
+  io->write(io->opaque, addr, value);
+  jit->io_depth--;
+  if (jit->io_depth == 0)
+    jit_log(jit, addr, value, true, jit->cpu->cycles - cycles);
+}
+
+/* Handlers of the shadow CPU, they replay the log */
+static const jit_access_t*
+jit_replay(jit_t *jit, uint16_t addr, bool write)
+{
+  const jit_access_t *a;
+
+  if (jit->replay_pos == jit->log_count) {
+    jit->replay_failed = true;
+    return NULL;
+  }
+  a = &jit->log[jit->replay_pos++];
+  if (a->addr != addr || a->write != write) {
+    jit->replay_failed = true;
+    return NULL;
+  }
+  jit->shadow->cycles += a->cycles;
+  return a;
+}
+
+static uint8_t
+jit_replay_read(void *opaque, uint16_t addr)
+{
+  const jit_access_t *a = jit_replay((jit_t*)opaque, addr, false);
+  return a ? a->value : 0;
+}
+
+static void
+jit_replay_write(void *opaque, uint16_t addr, uint8_t value)
+{
+  jit_t *jit = (jit_t*)opaque;
+  const jit_access_t *a = jit_replay(jit, addr, true);
+  if (a && a->value != value)
+    jit->replay_failed = true;
+}
+
+/* Where a pointer of the CPU map points in the shadow */
+static uint8_t*
+jit_shadow_ptr(jit_t *jit, cpu_t *cpu, const uint8_t *p)
+{
+  uint8_t *prg_ram = cpu->emu->prg_ram;
+
+  if (p >= cpu->ram && p < cpu->ram + sizeof(cpu->ram))
+    return jit->shadow->ram + (p - cpu->ram);
+  if (p >= prg_ram && p < prg_ram + sizeof(jit->shadow_prg_ram))
+    return jit->shadow_prg_ram + (p - prg_ram);
+  return (uint8_t*)p;
+}
+
+static void
+jit_diff_sync(jit_t *jit, cpu_t *cpu)
+{
+  cpu_t *shadow = jit->shadow;
+
+  /* Handlers mapped since the last sync get wrapped too */
+  jit->cpu = cpu;
+  for (int page = 0; page < 256; page++) {
+    if (cpu->io[page].read == jit_log_read)
+      continue;
+    jit->io[page] = cpu->io[page];
+    cpu->io[page].read = jit_log_read;
+    cpu->io[page].write = jit_log_write;
+    cpu->io[page].opaque = jit;
+  }
+
+  memcpy(shadow, cpu, sizeof(*shadow));
+  memcpy(jit->shadow_prg_ram, cpu->emu->prg_ram,
+         sizeof(jit->shadow_prg_ram));
+  for (int page = 0; page < 256; page++) {
+    if (cpu->read_map[page])
+      shadow->read_map[page] = jit_shadow_ptr(jit, cpu, cpu->read_map[page]);
+    if (cpu->write_map[page])
+      shadow->write_map[page] = jit_shadow_ptr(jit, cpu, cpu->write_map[page]);
+    shadow->io[page].read = jit_replay_read;
+    shadow->io[page].write = jit_replay_write;
+    shadow->io[page].opaque = jit;
+  }
+  shadow->trace = NULL;
+  shadow->prof = NULL;
+  shadow->jit = NULL;
+  shadow->idle = NULL;
+  jit->stale = false;
+}
+
+static void
+jit_diff_report(jit_t *jit, cpu_t *cpu, jit_block_t *block, const char *what)
+{
+  cpu_t *s = jit->shadow;
+
+  fprintf(stderr, "JIT diverged from the interpreter in the block at "
+          "$%04X: %s\n", block->pc, what);
+  fprintf(stderr, "              PC   A  X  Y  P  SP cycles\n");
+  fprintf(stderr, "  before      %04X %02X %02X %02X %02X %02X %llu\n",
+          jit->entry.pc, jit->entry.a, jit->entry.x, jit->entry.y,
+          jit->entry.p, jit->entry.sp,
+          (unsigned long long)jit->entry.cycles);
+  fprintf(stderr, "  jit         %04X %02X %02X %02X %02X %02X %llu\n",
+          cpu->pc, cpu->a, cpu->x, cpu->y, cpu_get_p(cpu), cpu->sp,
+          (unsigned long long)cpu->cycles);
+  fprintf(stderr, "  interpreter %04X %02X %02X %02X %02X %02X %llu\n",
+          s->pc, s->a, s->x, s->y, cpu_get_p(s), s->sp,
+          (unsigned long long)s->cycles);
+  jit->diverged = true;
+  jit->disabled = true;
+}
+
+static void
+jit_diff_check(jit_t *jit, cpu_t *cpu, jit_block_t *block)
+{
+  cpu_t *s = jit->shadow;
+  char what[64];
+
+  /* I/O may have switched banks, the shadow map is copied again */
+  if (jit->log_count > 0)
+    jit->stale = true;
+  if (jit->log_overflow)
+    return;
+  /* Linked blocks may have run many instructions, but never fewer
+   * cycles than the shadow */
+  while (s->instructions != cpu->instructions && s->cycles < cpu->cycles)
+    cpu_cycle(s);
+
+  if (s->instructions != cpu->instructions) {
+    jit_diff_report(jit, cpu, block, "instruction count");
+  } else if (jit->replay_failed || jit->replay_pos != jit->log_count) {
+    jit_diff_report(jit, cpu, block, "I/O accesses");
+  } else if (s->pc != cpu->pc || s->a != cpu->a || s->x != cpu->x ||
+             s->y != cpu->y || s->sp != cpu->sp ||
+             cpu_get_p(s) != cpu_get_p(cpu) || s->cycles != cpu->cycles ||
+             s->jammed != cpu->jammed) {
+    jit_diff_report(jit, cpu, block, "registers");
+  } else if (memcmp(s->ram, cpu->ram, sizeof(cpu->ram)) != 0) {
+    for (size_t i = 0; i < sizeof(cpu->ram); i++) {
+      if (s->ram[i] != cpu->ram[i]) {
+        snprintf(what, sizeof(what), "RAM at $%04zX, %02X instead of %02X",
+                 i, cpu->ram[i], s->ram[i]);
+        jit_diff_report(jit, cpu, block, what);
+        return;
+      }
+    }
+  } else if (memcmp(jit->shadow_prg_ram, cpu->emu->prg_ram,
+                    sizeof(jit->shadow_prg_ram)) != 0) {
+    for (size_t i = 0; i < sizeof(jit->shadow_prg_ram); i++) {
+      if (jit->shadow_prg_ram[i] != cpu->emu->prg_ram[i]) {
+        snprintf(what, sizeof(what), "RAM at $%04zX, %02X instead of %02X",
+                 0x6000 + i, cpu->emu->prg_ram[i], jit->shadow_prg_ram[i]);
+        jit_diff_report(jit, cpu, block, what);
+        return;
+      }
+    }
+  }
+}
+
+jit_t*
+jit_create(bool diff)
+{
+  jit_t *jit;
+  void *code;
+
+  code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (code == MAP_FAILED) {
+    perror("Cannot allocate JIT code");
+    return NULL;
+  }
+  jit = (jit_t*)calloc(sizeof(jit_t), 1);
+  jit->code = (uint8_t*)code;
+  jit->blocks = (jit_block_t*)calloc(sizeof(jit_block_t), JIT_MAX_BLOCKS);
+  jit->table = (uint32_t*)calloc(sizeof(uint32_t), JIT_TABLE_SIZE);
+  for (int i = 0; i < 256; i++)
+    jit->nz[i] = (i & 0x80 ? P_N : 0) | (i == 0 ? P_Z : 0);
+  jit->diff = diff;
+  jit->stale = true;
+  if (diff)
+    jit->shadow = (cpu_t*)calloc(sizeof(cpu_t), 1);
+  return jit;
+}
+
+void
+jit_destroy(jit_t *jit)
+{
+  /* Unwrap the handlers of the differential mode */
+  if (jit->cpu) {
+    for (int page = 0; page < 256; page++) {
+      if (jit->cpu->io[page].read == jit_log_read)
+        jit->cpu->io[page] = jit->io[page];
+    }
+  }
+  munmap(jit->code, JIT_CODE_SIZE);
+  free(jit->blocks);
+  free(jit->table);
+  free(jit->shadow);
+  free(jit);
+}
+
+void
+jit_flush(jit_t *jit)
+{
+  jit->code_used = 0;
+  jit->block_count = 0;
+  memset(jit->table, 0, sizeof(uint32_t) * JIT_TABLE_SIZE);
+  jit->link = NULL;
+  jit->stale = true;
+}
+
+void
+jit_run(jit_t   *jit,
+        cpu_t   *cpu,
+        uint64_t deadline)
+{
+  cpu->deadline = deadline;
+  /* The CPU may have been changed since, such as by a savestate */
+  jit->link = NULL;
+  while (cpu->cycles < cpu->deadline) {
+    jit_block_t *block = NULL;
+
+    if (likely(!jit->disabled && cpu->trace == NULL && cpu->prof == NULL &&
+               !cpu->nmi && !(cpu->irq && !cpu->p.i)))
+      block = jit_lookup(jit, cpu);
+    /* The last block left for the PC of this one */
+    if (block != NULL && jit->link != NULL)
+      x86_patch(jit->link, block->chain);
+    jit->link = NULL;
+    if (block == NULL || cpu->cycles + block->max_cycles >= cpu->deadline) {
+      cpu_cycle(cpu);
+      jit->stale = true;
+      continue;
+    }
+
+    if (unlikely(jit->diff)) {
+      /* Resets and savestates change the CPU behind our back */
+      if (jit->stale || jit->shadow->cycles != cpu->cycles ||
+          jit->shadow->pc != cpu->pc)
+        jit_diff_sync(jit, cpu);
+      jit->log_count = 0;
+      jit->replay_pos = 0;
+      jit->log_overflow = false;
+      jit->replay_failed = false;
+      jit->entry.pc = cpu->pc;
+      jit->entry.a = cpu->a;
+      jit->entry.x = cpu->x;
+      jit->entry.y = cpu->y;
+      jit->entry.p = cpu_get_p(cpu);
+      jit->entry.sp = cpu->sp;
+      jit->entry.cycles = cpu->cycles;
+      jit->link = block->code(cpu);
+      jit_diff_check(jit, cpu, block);
+    } else {
+      jit->link = block->code(cpu);
+    }
+  }
+}
+
+#else
+
+jit_t*
+jit_create(bool diff __attribute__((unused)))
+{
+  fprintf(stderr, "The JIT needs an x86-64 host\n");
+  return NULL;
+}
+
+void
+jit_destroy(jit_t *jit __attribute__((unused)))
+{
+}
+
+void
+jit_flush(jit_t *jit __attribute__((unused)))
+{
+}
+
+void
+jit_run(jit_t   *jit __attribute__((unused)),
+        cpu_t   *cpu __attribute__((unused)),
+        uint64_t deadline __attribute__((unused)))
+{
+}
+
+#endif
+
+bool
+jit_diverged(jit_t *jit)
+{
+  return jit->diverged;
+}
@@ -0,0 +1,33 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "types.h"
+
+/* Dynamic recompiler for x86-64. Basic blocks in read-only PRG pages
+ * are translated to host code the first time they run. Blocks are
+ * keyed by the PC and the host address of its page, so a bank switch
+ * selects other blocks instead of invalidating any. Code in RAM, and
+ * every instruction near a scheduler deadline or with an interrupt
+ * pending, still goes through the interpreter.
+ *
+ * In differential mode every block is also run by the interpreter on
+ * a shadow CPU, with the I/O of the block replayed to it, and the two
+ * are compared afterwards. */
+
+/* Returns NULL when the host is not supported */
+jit_t* jit_create(bool diff);
+void jit_destroy(jit_t *jit);
+/* Drops all blocks, needed when another ROM is mapped */
+void jit_flush(jit_t *jit);
+/* Runs like cpu_run() */
+void jit_run(jit_t   *jit,
+	     cpu_t   *cpu,
+	     uint64_t deadline);
+/* Set once the differential mode found a difference, the JIT is off
+ * from then on */
+bool jit_diverged(jit_t *jit);
+
+#endif /* __JIT_H__ */
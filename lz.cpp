@@ -0,0 +1,198 @@
+/* LZ4 block format compressor and decompressor
+ *
+ * A sequence is a token byte, holding the literal length in the high
+ * nibble and the match length - 4 in the low one, followed by extra
+ * literal length bytes, the literals, a 16 bit match offset and extra
+ * match length bytes. Lengths of 15 continue in bytes of 255 until a
+ * smaller one. The last sequence only has literals.
+ */
+#include <string.h>
+
+#include "lz.h"
+#include "types.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+/* The format requires the last 5 bytes to be literals, and no match
+ * to start within the last 12 */
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+static inline uint32_t
+lz_read32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t
+lz_read64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t
+lz_hash(uint32_t v)
+{
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t*
+lz_write_length(uint8_t *op, size_t length)
+{
+  while (length >= 255) {
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = length;
+  return op;
+}
+
+static inline uint8_t*
+lz_write_literals(uint8_t *op, const uint8_t *literals, size_t length,
+                  uint8_t match)
+{
+  *op++ = (length >= 15 ? 15 : length) << 4 | match;
+  if (length >= 15)
+    op = lz_write_length(op, length - 15);
+  memcpy(op, literals, length);
+  return op + length;
+}
+
+/* Length of the common prefix of p and q, up to end */
+static inline const uint8_t*
+lz_match_end(const uint8_t *p, const uint8_t *q, const uint8_t *end)
+{
+  while (p + 8 <= end) {
+    uint64_t diff = lz_read64(p) ^ lz_read64(q);
+    if (diff)
+      return p + (__builtin_ctzll(diff) >> 3);
+    p += 8;
+    q += 8;
+  }
+  while (p < end && *p == *q) {
+    p++;
+    q++;
+  }
+  return p;
+}
+
+size_t
+lz_compress(const uint8_t *src,
+            size_t         size,
+            uint8_t       *dst,
+            size_t         capacity)
+{
+  uint32_t table[1 << LZ_HASH_BITS];
+  const uint8_t *ip = src, *anchor = src, *end = src + size;
+  uint8_t *op = dst;
+
+  if (capacity < LZ_BOUND(size))
+    return 0;
+
+  if (size > LZ_MATCH_LIMIT) {
+    const uint8_t *limit = end - LZ_MATCH_LIMIT;
+    const uint8_t *match_limit = end - LZ_LAST_LITERALS;
+
+    memset(table, 0, sizeof(table));
+    ip++;
+    while (ip < limit) {
+      uint32_t seq = lz_read32(ip);
+      uint32_t h = lz_hash(seq);
+      const uint8_t *ref = src + table[h];
+
+      table[h] = ip - src;
+      if (ip - ref > LZ_MAX_OFFSET || lz_read32(ref) != seq) {
+        ip++;
+        continue;
+      }
+
+      while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uint8_t *p = lz_match_end(ip + LZ_MIN_MATCH, ref + LZ_MIN_MATCH,
+                                      match_limit);
+      size_t length = p - ip - LZ_MIN_MATCH;
+      uint16_t offset = ip - ref;
+
+      op = lz_write_literals(op, anchor, ip - anchor,
+                             length >= 15 ? 15 : length);
+      *op++ = offset & 0xff;
+      *op++ = offset >> 8;
+      if (length >= 15)
+        op = lz_write_length(op, length - 15);
+      ip = anchor = p;
+    }
+  }
+
+  op = lz_write_literals(op, anchor, end - anchor, 0);
+  return op - dst;
+}
+
+/* Reads the extra bytes of a length of 15 */
+static inline bool
+lz_read_length(const uint8_t **ip, const uint8_t *end, size_t *length)
+{
+  uint8_t b;
+  do {
+    if (*ip >= end)
+      return false;
+    b = *(*ip)++;
+    *length += b;
+  } while (b == 255);
+  return true;
+}
+
+size_t
+lz_decompress(const uint8_t *src,
+              size_t         size,
+              uint8_t       *dst,
+              size_t         capacity)
+{
+  const uint8_t *ip = src, *end = src + size;
+  uint8_t *op = dst, *oend = dst + capacity;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+    size_t length = token >> 4;
+
+    if (length == 15 && !lz_read_length(&ip, end, &length))
+      return 0;
+    if (length > (size_t)(end - ip) || length > (size_t)(oend - op))
+      return 0;
+    memcpy(op, ip, length);
+    op += length;
+    ip += length;
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return 0;
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    length = token & 15;
+    if (length == 15 && !lz_read_length(&ip, end, &length))
+      return 0;
+    length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - dst) ||
+        length > (size_t)(oend - op))
+      return 0;
+
+    const uint8_t *ref = op - offset;
+    if (offset == 1) {
+      memset(op, *ref, length);
+    } else if (offset >= length) {
+      memcpy(op, ref, length);
+    } else {
+      for (size_t i = 0; i < length; i++)
+        op[i] = ref[i];
+    }
+    op += length;
+  }
+  return op - dst;
+}
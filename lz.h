@@ -0,0 +1,24 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fast LZ77 compression in the LZ4 block format. Tuned for speed over
+ * ratio, long runs of zeroes such as in XOR deltas compress best. */
+
+/* Worst case compressed size of size bytes */
+#define LZ_BOUND(size) ((size) + (size) / 255 + 16)
+
+size_t lz_compress(const uint8_t *src,
+		   size_t         size,
+		   uint8_t       *dst,
+		   size_t         capacity);
+/* Returns the decompressed size, or 0 when the input is corrupt or
+ * does not fit */
+size_t lz_decompress(const uint8_t *src,
+		     size_t         size,
+		     uint8_t       *dst,
+		     size_t         capacity);
+
+#endif /* __LZ_H__ */
@@ -1,20 +1,345 @@
+#include <getopt.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
+#include "audio.h"
+#include "capture.h"
 #include "emu.h"
+#include "filter.h"
+#include "idle.h"
+#include "jit.h"
+#include "movie.h"
+#include "prof.h"
+#include "rewind.h"
+#include "romdb.h"
+#include "state.h"
+#include "trace.h"
+#include "video.h"
+
+/* The emulator, run by video_run() */
+typedef struct {
+  emu_t *emu;
+  uint64_t frames;
+  int ret;
+  struct timespec start, end;
+} main_run_t;
+
+static void
+main_run(void *opaque)
+{
+    main_run_t *run = (main_run_t*)opaque;
+
+    clock_gettime(CLOCK_MONOTONIC, &run->start);
+    run->ret = emu_run(run->emu, run->frames);
+    clock_gettime(CLOCK_MONOTONIC, &run->end);
+}
+
+static void
+usage(const char *prog)
+{
+    printf("usage: %s [options] <rom.nes>\n", prog);
+    printf("  -v, --video=NAME   video backend, one of:\n");
+    video_list_backends();
+    printf("  -F, --filter=NAME  video filter, for the window and the capture:\n");
+    filter_list();
+    printf("  -a, --audio=NAME   audio backend, null by default with the null video,\n");
+    printf("                     --frames or --play, one of:\n");
+    audio_list_backends();
+    printf("  -f, --frames=N     exit after N frames and print the frame rate\n");
+    printf("  -r, --run-ahead=N  show each frame N frames early, hides input lag\n");
+    printf("  -l, --load=FILE    start from a savestate\n");
+    printf("  -s, --save=FILE    write a savestate on exit\n");
+    printf("  -m, --record=FILE  record the input to a movie\n");
+    printf("  -M, --play=FILE    play back a movie, until its end\n");
+    printf("  -w, --rewind=MB    keep MB of history to rewind through, hold\n");
+    printf("                     backspace to rewind\n");
+    printf("  -c, --capture=FILE write the frames as raw RGB, or .y4m or .png\n");
+    printf("                     (name with %%d for the frame), - for stdout\n");
+    printf("      --hashes=FILE  write the CRC-32 of every frame\n");
+    printf("  -d, --db=FILE      correct bad headers with a nes-index ROM index\n");
+    printf("  -t, --trace=FILE   record the last instructions to FILE, see nes-trace\n");
+    printf("      --trace-size=N instructions kept in the trace (1048576)\n");
+    printf("      --no-idle      run idle loops instead of skipping them\n");
+    printf("  -p, --profile=FILE write a guest profile as JSON to FILE\n");
+    printf("      --folded=FILE  write the profiled call stacks for flamegraph.pl\n");
+    printf("  -J, --jit          translate the program to native code\n");
+    printf("      --jit-diff     check the JIT against the interpreter, slow\n");
+}
 
 int main(int argc, char **argv)
 {
+    enum { OPT_TRACE_SIZE = 256, OPT_JIT_DIFF, OPT_NO_IDLE, OPT_FOLDED,
+           OPT_HASHES };
+    static const struct option options[] = {
+      { "video",  required_argument, NULL, 'v' },
+      { "filter", required_argument, NULL, 'F' },
+      { "audio",  required_argument, NULL, 'a' },
+      { "frames", required_argument, NULL, 'f' },
+      { "run-ahead", required_argument, NULL, 'r' },
+      { "load",   required_argument, NULL, 'l' },
+      { "save",   required_argument, NULL, 's' },
+      { "record", required_argument, NULL, 'm' },
+      { "play",   required_argument, NULL, 'M' },
+      { "rewind", required_argument, NULL, 'w' },
+      { "capture", required_argument, NULL, 'c' },
+      { "hashes", required_argument, NULL, OPT_HASHES },
+      { "db",     required_argument, NULL, 'd' },
+      { "trace",  required_argument, NULL, 't' },
+      { "trace-size", required_argument, NULL, OPT_TRACE_SIZE },
+      { "no-idle", no_argument,      NULL, OPT_NO_IDLE },
+      { "profile", required_argument, NULL, 'p' },
+      { "folded", required_argument, NULL, OPT_FOLDED },
+      { "jit",    no_argument,       NULL, 'J' },
+      { "jit-diff", no_argument,     NULL, OPT_JIT_DIFF },
+      { "help",   no_argument,       NULL, 'h' },
+      { NULL, 0, NULL, 0 },
+    };
+    const char *backend = NULL;
+    const char *filter = NULL;
+    const char *audio_backend = NULL;
+    const char *load = NULL;
+    const char *save = NULL;
+    const char *record = NULL;
+    const char *play = NULL;
+    const char *capture = NULL;
+    const char *hashes = NULL;
+    const char *db = NULL;
+    const char *trace = NULL;
+    const char *profile = NULL;
+    const char *folded = NULL;
+    uint32_t trace_size = 1 << 20;
+    bool jit = false, jit_diff = false, idle = true;
+    uint64_t frames = 0;
+    uint32_t runahead = 0;
+    size_t rewind_size = 0;
+    main_run_t run;
+    video_t *video;
+    audio_t *audio;
     emu_t *emu;
+    int c, ret;
 
-    if (argc < 2) {
+    while ((c = getopt_long(argc, argv, "v:F:a:f:r:l:s:m:M:w:c:d:t:p:Jh", options, NULL)) != -1) {
+      switch (c) {
+      case 'v':
+        backend = optarg;
+        break;
+      case 'F':
+        filter = optarg;
+        break;
+      case 'a':
+        audio_backend = optarg;
+        break;
+      case 'f':
+        frames = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        runahead = strtoul(optarg, NULL, 10);
+        break;
+      case 'l':
+        load = optarg;
+        break;
+      case 's':
+        save = optarg;
+        break;
+      case 'm':
+        record = optarg;
+        break;
+      case 'M':
+        play = optarg;
+        break;
+      case 'w':
+        rewind_size = strtoull(optarg, NULL, 10) << 20;
+        break;
+      case 'c':
+        capture = optarg;
+        break;
+      case OPT_HASHES:
+        hashes = optarg;
+        break;
+      case 'd':
+        db = optarg;
+        break;
+      case 't':
+        trace = optarg;
+        break;
+      case OPT_TRACE_SIZE:
+        trace_size = strtoul(optarg, NULL, 10);
+        break;
+      case 'p':
+        profile = optarg;
+        break;
+      case OPT_FOLDED:
+        folded = optarg;
+        break;
+      case OPT_NO_IDLE:
+        idle = false;
+        break;
+      case 'J':
+        jit = true;
+        break;
+      case OPT_JIT_DIFF:
+        jit = jit_diff = true;
+        break;
+      default:
+        usage(argv[0]);
+        return c == 'h' ? 0 : 1;
+      }
+    }
+
+    if (optind >= argc) {
        printf("need a filename\n");
        return 1;
     }
+    /* A movie sets its own starting point */
+    if (play && (load || record)) {
+      printf("--play cannot be combined with --load or --record\n");
+      return 1;
+    }
+    /* Both would see the frames that are run ahead and undone */
+    if (runahead && (trace || profile || folded)) {
+      printf("--run-ahead cannot be combined with --trace or --profile\n");
+      return 1;
+    }
+    /* Frames run again would take the next input of the movie */
+    if (rewind_size && (record || play)) {
+      printf("--rewind cannot be combined with --record or --play\n");
+      return 1;
+    }
 
-    emu = emu_create();
-    emu_load(emu, argv[1]);
-    emu_run(emu);
+    video = video_create(backend, filter);
+    if (video == NULL) {
+      return 1;
+    }
+
+    /* Sound paces the emulator to real time, which a headless run, a
+     * frame count or a movie played back do not want */
+    if (audio_backend == NULL &&
+        (video->backend == &video_null_backend || frames || play))
+      audio_backend = "null";
+    audio = audio_create(audio_backend);
+    if (audio == NULL) {
+      return 1;
+    }
 
+    emu = emu_create(video);
+    emu->audio = audio;
+    emu->runahead = runahead;
+    if (!idle) {
+      idle_destroy(emu->cpu->idle);
+      emu->cpu->idle = NULL;
+    }
+    if (db) {
+      emu->romdb = romdb_load(db);
+      if (emu->romdb == NULL) {
+        printf("Cannot read ROM index: %s\n", db);
+        return 1;
+      }
+    }
+    if (emu_load(emu, argv[optind]) != 0) {
+      return 1;
+    }
+    if (load && state_load_file(emu, load) != 0) {
+      return 1;
+    }
+    if (record) {
+      emu->movie = movie_record(emu, record, load == NULL);
+      if (emu->movie == NULL) {
+        return 1;
+      }
+    }
+    if (play) {
+      emu->movie = movie_play(emu, play);
+      if (emu->movie == NULL) {
+        return 1;
+      }
+    }
+    if (rewind_size) {
+      emu->rewind = rewind_create(emu, rewind_size);
+    }
+    if (capture || hashes) {
+      emu->capture = capture_create(filter_create(video, filter), capture,
+                                    capture ? capture_format(capture) : 0,
+                                    hashes);
+      if (emu->capture == NULL) {
+        return 1;
+      }
+    }
+    if (trace) {
+      emu->cpu->trace = trace_create(trace, trace_size);
+      if (emu->cpu->trace == NULL) {
+        return 1;
+      }
+    }
+    if (profile || folded) {
+      emu->cpu->prof = prof_create(emu);
+    }
+    if (jit) {
+      emu->cpu->jit = jit_create(jit_diff);
+      if (emu->cpu->jit == NULL) {
+        return 1;
+      }
+    }
+
+    run.emu = emu;
+    run.frames = frames;
+    video_run(video, main_run, &run);
+    ret = run.ret;
+    if (ret == EMU_JAMMED) {
+      printf("CPU jammed at $%04X\n", emu->cpu->pc);
+    } else if (ret == EMU_MOVIE_END) {
+      printf("Movie over after %llu frames\n",
+             (unsigned long long)movie_frames(emu->movie));
+    }
+
+    if (save && state_save_file(emu, save) != 0) {
+      return 1;
+    }
+
+    if (profile && prof_write_json(emu->cpu->prof, profile) != 0) {
+      return 1;
+    }
+    if (folded && prof_write_folded(emu->cpu->prof, folded) != 0) {
+      return 1;
+    }
+
+    if (frames || play) {
+      double secs = (run.end.tv_sec - run.start.tv_sec) +
+        (run.end.tv_nsec - run.start.tv_nsec) / 1e9;
+      printf("%llu frames in %.3fs, %.1f fps\n",
+             (unsigned long long)video->frames, secs, video->frames / secs);
+      if (emu->cpu->idle && emu->cpu->cycles)
+        printf("%.1f%% of the CPU time skipped in idle loops\n",
+               100.0 * idle_skipped(emu->cpu->idle) / emu->cpu->cycles);
+    }
+
+    if (emu->movie && movie_close(emu->movie) != 0) {
+      return 1;
+    }
+    if (emu->capture && capture_destroy(emu->capture) != 0) {
+      return 1;
+    }
+
+    if (emu->cpu->jit) {
+      if (jit_diverged(emu->cpu->jit)) {
+        printf("JIT diverged from the interpreter\n");
+        return 1;
+      }
+      jit_destroy(emu->cpu->jit);
+    }
+    if (emu->cpu->trace)
+      trace_destroy(emu->cpu->trace);
+    if (emu->cpu->prof)
+      prof_destroy(emu->cpu->prof);
+    if (emu->romdb)
+      romdb_destroy(emu->romdb);
+    if (emu->rewind)
+      rewind_destroy(emu->rewind);
+    if (audio->underruns)
+      printf("%llu audio underruns\n", (unsigned long long)audio->underruns);
+    emu_destroy(emu);
+    audio_destroy(audio);
+    video_destroy(video);
     printf("okay\n");
     return 0;
 }
@@ -0,0 +1,140 @@
+/* Cartridge boards, dispatches to the mapper of the loaded ROM */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "cpu.h"
+#include "ines.h"
+#include "mapper.h"
+#include "ppu.h"
+#include "state.h"
+
+static const mapper_ops_t *mappers[] = {
+  &mapper_nrom,
+  &mapper_mmc1,
+  &mapper_uxrom,
+  &mapper_cnrom,
+  &mapper_mmc3,
+  NULL,
+};
+
+/* Nothing drives the data bus on reads that miss the ROM */
+static uint8_t
+mapper_read(void *opaque __attribute__((unused)), uint16_t addr)
+{
+  return addr >> 8;
+}
+
+static void
+mapper_write(void *opaque, uint16_t addr, uint8_t value)
+{
+  mapper_t *mapper = (mapper_t*)opaque;
+  mapper->ops->write(mapper, addr, value);
+}
+
+mapper_t*
+mapper_create(emu_t  *emu,
+              ines_t *cart)
+{
+    const mapper_ops_t *ops = NULL;
+    mapper_t *mapper;
+
+    for (int i = 0; mappers[i] != NULL; i++) {
+      if (mappers[i]->number == cart->mapper) {
+        ops = mappers[i];
+        break;
+      }
+    }
+    if (ops == NULL) {
+      fprintf(stderr, "Unsupported mapper: %d\n", cart->mapper);
+      return NULL;
+    }
+
+    mapper = (mapper_t*)calloc(sizeof(mapper_t), 1);
+    mapper->ops = ops;
+    mapper->emu = emu;
+    mapper->cart = cart;
+
+    /* Writes to ROM are the registers of the board */
+    cpu_map_io(emu->cpu, 0x8000, 0x8000, mapper_read, mapper_write, mapper);
+    ppu_set_mirroring(emu->ppu, cart->mirroring);
+    ops->reset(mapper);
+    ops->update(mapper);
+    return mapper;
+}
+
+void
+mapper_destroy(mapper_t *mapper)
+{
+    free(mapper);
+}
+
+void
+mapper_state(mapper_t *mapper,
+             state_t  *s)
+{
+  STATE_FIELD(s, mapper->regs);
+  STATE_FIELD(s, mapper->shift);
+  STATE_FIELD(s, mapper->shift_count);
+  STATE_FIELD(s, mapper->irq_counter);
+  STATE_FIELD(s, mapper->irq_latch);
+  STATE_FIELD(s, mapper->irq_reload);
+  STATE_FIELD(s, mapper->irq_enabled);
+  if (s->loading)
+    mapper->ops->update(mapper);
+}
+
+void
+mapper_map_prg(mapper_t *mapper,
+               uint16_t  addr,
+               int       bank,
+               uint32_t  size)
+{
+  ines_t *cart = mapper->cart;
+
+  if (cart->prg_size >= size) {
+    cpu_map(mapper->emu->cpu, addr, ines_prg_bank(cart, bank, size), size);
+    return;
+  }
+  /* Smaller than the bank, such as 8Kb NROM, and mirrored */
+  for (uint32_t offset = 0; offset < size; offset += cart->prg_size) {
+    cpu_map(mapper->emu->cpu, addr + offset, cart->prg, cart->prg_size);
+  }
+}
+
+/* Boards without CHR-ROM bank their CHR-RAM the same way */
+void
+mapper_map_chr(mapper_t *mapper,
+               uint16_t  addr,
+               int       bank,
+               uint32_t  size)
+{
+  emu_t *emu = mapper->emu;
+
+  if (mapper->cart->chr_size >= size) {
+    ppu_map_chr(emu->ppu, addr, ines_chr_bank(mapper->cart, bank, size),
+                size);
+  } else {
+    uint32_t count = emu->chr_ram_size / size;
+    uint32_t index = ((bank % (int)count) + count) % count;
+    ppu_map_chr_ram(emu->ppu, addr, emu->chr_ram + index * size, size);
+  }
+}
+
+void
+mapper_set_mirroring(mapper_t *mapper,
+                     int       mirroring)
+{
+  if (mapper->cart->mirroring != INES_MIRROR_FOUR)
+    ppu_set_mirroring(mapper->emu->ppu, mirroring);
+}
+
+void
+mapper_irq(mapper_t *mapper,
+           bool      level)
+{
+  if (level)
+    mapper->emu->cpu->irq |= CPU_IRQ_MAPPER;
+  else
+    mapper->emu->cpu->irq &= ~CPU_IRQ_MAPPER;
+}
@@ -0,0 +1,84 @@
+#ifndef __MAPPER_H__
+#define __MAPPER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+
+/* A cartridge board. Banks are switched by pointing the CPU and PPU
+ * page tables at other parts of the mapped ROM, nothing is copied. */
+typedef struct {
+  uint16_t number;
+  const char *name;
+  /* Resets the registers to their power on values */
+  void (*reset)(mapper_t *mapper);
+  /* Applies the registers to the memory maps */
+  void (*update)(mapper_t *mapper);
+  /* CPU write to $8000-$FFFF */
+  void (*write)(mapper_t *mapper, uint16_t addr, uint8_t value);
+  /* Rising edge of PPU A12, NULL if the board does not watch it */
+  void (*a12_rise)(mapper_t *mapper);
+} mapper_ops_t;
+
+struct mapper_t {
+  const mapper_ops_t *ops;
+  emu_t *emu;
+  ines_t *cart;
+  /* Board registers, what they mean is up to the board. Everything
+   * below is the savestate of the mapper. */
+  uint8_t regs[16];
+  /* MMC1 serial port */
+  uint8_t shift;
+  uint8_t shift_count;
+  /* Scanline counter */
+  uint8_t irq_counter;
+  uint8_t irq_latch;
+  bool irq_reload;
+  bool irq_enabled;
+};
+
+extern const mapper_ops_t mapper_nrom;
+extern const mapper_ops_t mapper_mmc1;
+extern const mapper_ops_t mapper_uxrom;
+extern const mapper_ops_t mapper_cnrom;
+extern const mapper_ops_t mapper_mmc3;
+
+/* Returns NULL when the board of the cartridge is not supported */
+mapper_t* mapper_create(emu_t  *emu,
+			ines_t *cart);
+void mapper_destroy(mapper_t *mapper);
+void mapper_state(mapper_t *mapper,
+		  state_t  *s);
+
+/* Bank switching helpers for the boards, bank numbers wrap around
+ * the size of the ROM and negative ones count from the end */
+void mapper_map_prg(mapper_t *mapper,
+		    uint16_t  addr,
+		    int       bank,
+		    uint32_t  size);
+void mapper_map_chr(mapper_t *mapper,
+		    uint16_t  addr,
+		    int       bank,
+		    uint32_t  size);
+/* Ignored on four screen boards */
+void mapper_set_mirroring(mapper_t *mapper,
+			  int       mirroring);
+void mapper_irq(mapper_t *mapper,
+		bool      level);
+
+static inline bool
+mapper_wants_a12(mapper_t *mapper)
+{
+  return mapper != NULL && mapper->ops->a12_rise != NULL;
+}
+
+static inline void
+mapper_a12_rise(mapper_t *mapper)
+{
+  if (mapper_wants_a12(mapper))
+    mapper->ops->a12_rise(mapper);
+}
+
+#endif /* __MAPPER_H__ */
@@ -0,0 +1,36 @@
+/* Mapper 3, CNROM: fixed PRG-ROM as on NROM and a switchable 8Kb
+ * CHR-ROM bank */
+
+#include "mapper.h"
+
+static void
+mapper_cnrom_reset(mapper_t *mapper)
+{
+  mapper->regs[0] = 0;
+}
+
+static void
+mapper_cnrom_update(mapper_t *mapper)
+{
+  mapper_map_prg(mapper, 0x8000, 0, 0x4000);
+  mapper_map_prg(mapper, 0xc000, 1, 0x4000);
+  mapper_map_chr(mapper, 0x0000, mapper->regs[0], 0x2000);
+}
+
+static void
+mapper_cnrom_write(mapper_t *mapper,
+                   uint16_t addr __attribute__((unused)),
+                   uint8_t value)
+{
+  mapper->regs[0] = value;
+  mapper_map_chr(mapper, 0x0000, value, 0x2000);
+}
+
+const mapper_ops_t mapper_cnrom = {
+  3,
+  "CNROM",
+  mapper_cnrom_reset,
+  mapper_cnrom_update,
+  mapper_cnrom_write,
+  NULL,
+};
@@ -0,0 +1,95 @@
+/* Mapper 1, MMC1 (SxROM): registers are written one bit at a time
+ * through a serial port, five writes load the register selected by
+ * the address of the last one */
+
+#include "ines.h"
+#include "mapper.h"
+#include "ppu.h"
+
+#define MMC1_CONTROL 0
+#define MMC1_CHR0    1
+#define MMC1_CHR1    2
+#define MMC1_PRG     3
+
+static void
+mapper_mmc1_reset(mapper_t *mapper)
+{
+  /* The last PRG bank is fixed at $C000 on power on */
+  mapper->regs[MMC1_CONTROL] = 0x0c;
+  mapper->shift = 0;
+  mapper->shift_count = 0;
+}
+
+static void
+mapper_mmc1_update(mapper_t *mapper)
+{
+  static const int mirroring[] = {
+    PPU_MIRROR_SINGLE_LOWER,
+    PPU_MIRROR_SINGLE_UPPER,
+    PPU_MIRROR_VERTICAL,
+    PPU_MIRROR_HORIZONTAL,
+  };
+  uint8_t control = mapper->regs[MMC1_CONTROL];
+  int prg = mapper->regs[MMC1_PRG] & 0x0f;
+  /* SUROM, 512Kb of PRG-ROM in two halves selected by CHR bank 0 */
+  int outer = (mapper->cart->prg_size > 0x40000) ?
+    (mapper->regs[MMC1_CHR0] & 0x10) : 0;
+  int last = outer | 0x0f;
+
+  mapper_set_mirroring(mapper, mirroring[control & 3]);
+
+  switch ((control >> 2) & 3) {
+  case 0:
+  case 1: // 32Kb at $8000
+    mapper_map_prg(mapper, 0x8000, (outer | prg) & ~1, 0x4000);
+    mapper_map_prg(mapper, 0xc000, (outer | prg) | 1, 0x4000);
+    break;
+  case 2: // First bank fixed at $8000
+    mapper_map_prg(mapper, 0x8000, outer, 0x4000);
+    mapper_map_prg(mapper, 0xc000, outer | prg, 0x4000);
+    break;
+  case 3: // Last bank fixed at $C000
+    mapper_map_prg(mapper, 0x8000, outer | prg, 0x4000);
+    mapper_map_prg(mapper, 0xc000, last, 0x4000);
+    break;
+  }
+
+  if (control & 0x10) {
+    mapper_map_chr(mapper, 0x0000, mapper->regs[MMC1_CHR0], 0x1000);
+    mapper_map_chr(mapper, 0x1000, mapper->regs[MMC1_CHR1], 0x1000);
+  } else {
+    mapper_map_chr(mapper, 0x0000, mapper->regs[MMC1_CHR0] >> 1, 0x2000);
+  }
+}
+
+static void
+mapper_mmc1_write(mapper_t *mapper,
+                  uint16_t addr,
+                  uint8_t value)
+{
+  if (value & 0x80) {
+    mapper->shift = 0;
+    mapper->shift_count = 0;
+    mapper->regs[MMC1_CONTROL] |= 0x0c;
+    mapper_mmc1_update(mapper);
+    return;
+  }
+
+  mapper->shift |= (value & 1) << mapper->shift_count;
+  if (++mapper->shift_count < 5)
+    return;
+
+  mapper->regs[(addr >> 13) & 3] = mapper->shift;
+  mapper->shift = 0;
+  mapper->shift_count = 0;
+  mapper_mmc1_update(mapper);
+}
+
+const mapper_ops_t mapper_mmc1 = {
+  1,
+  "MMC1",
+  mapper_mmc1_reset,
+  mapper_mmc1_update,
+  mapper_mmc1_write,
+  NULL,
+};
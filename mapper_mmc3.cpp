@@ -0,0 +1,109 @@
+/* Mapper 4, MMC3 (TxROM): 8Kb PRG and 1/2Kb CHR banks selected through
+ * a bank select and bank data register pair, and a scanline counter
+ * clocked by rising edges of PPU A12 */
+
+#include "mapper.h"
+#include "ppu.h"
+
+/* regs[0..7] are the bank registers R0-R7 */
+#define MMC3_SELECT    8
+#define MMC3_MIRRORING 9
+
+static void
+mapper_mmc3_reset(mapper_t *mapper)
+{
+  static const uint8_t banks[8] = { 0, 2, 4, 5, 6, 7, 0, 1 };
+
+  for (int i = 0; i < 8; i++) {
+    mapper->regs[i] = banks[i];
+  }
+  mapper->regs[MMC3_SELECT] = 0;
+  mapper->irq_counter = 0;
+  mapper->irq_latch = 0;
+  mapper->irq_reload = false;
+  mapper->irq_enabled = false;
+}
+
+static void
+mapper_mmc3_update(mapper_t *mapper)
+{
+  uint8_t select = mapper->regs[MMC3_SELECT];
+  /* Bit 7 swaps the 2Kb and 1Kb CHR halves */
+  uint16_t chr = (select & 0x80) ? 0x1000 : 0x0000;
+  /* Bit 6 swaps $8000 with the fixed second to last bank at $C000 */
+  uint16_t prg = (select & 0x40) ? 0xc000 : 0x8000;
+
+  mapper_map_prg(mapper, prg, mapper->regs[6] & 0x3f, 0x2000);
+  mapper_map_prg(mapper, 0xa000, mapper->regs[7] & 0x3f, 0x2000);
+  mapper_map_prg(mapper, prg ^ 0x4000, -2, 0x2000);
+  mapper_map_prg(mapper, 0xe000, -1, 0x2000);
+
+  mapper_map_chr(mapper, chr, mapper->regs[0] >> 1, 0x0800);
+  mapper_map_chr(mapper, chr + 0x0800, mapper->regs[1] >> 1, 0x0800);
+  for (int i = 0; i < 4; i++) {
+    mapper_map_chr(mapper, (chr ^ 0x1000) + i * 0x400, mapper->regs[2 + i],
+                   0x0400);
+  }
+
+  mapper_set_mirroring(mapper, (mapper->regs[MMC3_MIRRORING] & 1) ?
+                       PPU_MIRROR_HORIZONTAL : PPU_MIRROR_VERTICAL);
+}
+
+static void
+mapper_mmc3_write(mapper_t *mapper,
+                  uint16_t addr,
+                  uint8_t value)
+{
+  switch (addr & 0xe001) {
+  case 0x8000: // Bank select
+    mapper->regs[MMC3_SELECT] = value;
+    mapper_mmc3_update(mapper);
+    break;
+  case 0x8001: // Bank data
+    mapper->regs[mapper->regs[MMC3_SELECT] & 7] = value;
+    mapper_mmc3_update(mapper);
+    break;
+  case 0xa000:
+    mapper->regs[MMC3_MIRRORING] = value;
+    mapper_mmc3_update(mapper);
+    break;
+  case 0xa001: // PRG-RAM protect, the RAM is always enabled here
+    break;
+  case 0xc000:
+    mapper->irq_latch = value;
+    break;
+  case 0xc001:
+    mapper->irq_counter = 0;
+    mapper->irq_reload = true;
+    break;
+  case 0xe000: // Disabling also acknowledges a pending IRQ
+    mapper->irq_enabled = false;
+    mapper_irq(mapper, false);
+    break;
+  case 0xe001:
+    mapper->irq_enabled = true;
+    break;
+  }
+}
+
+static void
+mapper_mmc3_a12_rise(mapper_t *mapper)
+{
+  if (mapper->irq_counter == 0 || mapper->irq_reload) {
+    mapper->irq_counter = mapper->irq_latch;
+    mapper->irq_reload = false;
+  } else {
+    mapper->irq_counter--;
+  }
+  if (mapper->irq_counter == 0 && mapper->irq_enabled)
+    mapper_irq(mapper, true);
+}
+
+const mapper_ops_t mapper_mmc3 = {
+  4,
+  "MMC3",
+  mapper_mmc3_reset,
+  mapper_mmc3_update,
+  mapper_mmc3_write,
+  mapper_mmc3_a12_rise,
+};
@@ -0,0 +1,33 @@
+/* Mapper 0, NROM: 16 or 32Kb of PRG-ROM and 8Kb of CHR, no registers */
+
+#include "mapper.h"
+
+static void
+mapper_nrom_reset(mapper_t *mapper __attribute__((unused)))
+{
+}
+
+static void
+mapper_nrom_update(mapper_t *mapper)
+{
+  /* NROM-128 is mirrored at $C000 */
+  mapper_map_prg(mapper, 0x8000, 0, 0x4000);
+  mapper_map_prg(mapper, 0xc000, 1, 0x4000);
+  mapper_map_chr(mapper, 0x0000, 0, 0x2000);
+}
+
+static void
+mapper_nrom_write(mapper_t *mapper __attribute__((unused)),
+                  uint16_t addr __attribute__((unused)),
+                  uint8_t value __attribute__((unused)))
+{
+}
+
+const mapper_ops_t mapper_nrom = {
+  0,
+  "NROM",
+  mapper_nrom_reset,
+  mapper_nrom_update,
+  mapper_nrom_write,
+  NULL,
+};
@@ -0,0 +1,36 @@
+/* Mapper 2, UxROM: a switchable 16Kb PRG bank at $8000 and the last
+ * one fixed at $C000, with 8Kb of CHR-RAM */
+
+#include "mapper.h"
+
+static void
+mapper_uxrom_reset(mapper_t *mapper)
+{
+  mapper->regs[0] = 0;
+}
+
+static void
+mapper_uxrom_update(mapper_t *mapper)
+{
+  mapper_map_prg(mapper, 0x8000, mapper->regs[0], 0x4000);
+  mapper_map_prg(mapper, 0xc000, -1, 0x4000);
+  mapper_map_chr(mapper, 0x0000, 0, 0x2000);
+}
+
+static void
+mapper_uxrom_write(mapper_t *mapper,
+                   uint16_t addr __attribute__((unused)),
+                   uint8_t value)
+{
+  mapper->regs[0] = value;
+  mapper_map_prg(mapper, 0x8000, value, 0x4000);
+}
+
+const mapper_ops_t mapper_uxrom = {
+  2,
+  "UxROM",
+  mapper_uxrom_reset,
+  mapper_uxrom_update,
+  mapper_uxrom_write,
+  NULL,
+};
@@ -0,0 +1,182 @@
+/* Input movie recording and playback */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu.h"
+#include "ines.h"
+#include "movie.h"
+#include "state.h"
+
+static_assert(sizeof(movie_header_t) == 64, "movie header is on disk");
+
+/* Bytes of frames buffered between reads or writes of the file */
+#define MOVIE_BUFFER 65536
+
+struct movie_t {
+  FILE *f;
+  bool recording;
+  /* A write failed, reported on close */
+  bool error;
+  uint64_t frames;
+  uint8_t buf[MOVIE_BUFFER];
+  size_t pos;
+  size_t len;
+};
+
+static void
+movie_rom_sha1(emu_t *emu, uint8_t digest[SHA1_SIZE])
+{
+  sha1_t sha1;
+
+  sha1_init(&sha1);
+  sha1_update(&sha1, emu->cart->prg, emu->cart->prg_size);
+  sha1_update(&sha1, emu->cart->chr, emu->cart->chr_size);
+  sha1_final(&sha1, digest);
+}
+
+movie_t*
+movie_record(emu_t      *emu,
+             const char *filename,
+             bool        power_on)
+{
+  movie_header_t header;
+  uint8_t *state = NULL;
+  movie_t *movie;
+  FILE *f;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MOVIE_MAGIC, sizeof(header.magic));
+  header.version = MOVIE_VERSION;
+  header.ports = INPUT_PORTS;
+  movie_rom_sha1(emu, header.rom_sha1);
+  if (!power_on) {
+    header.state_size = state_size(emu);
+    state = (uint8_t*)malloc(header.state_size);
+    state_save(emu, state, header.state_size);
+  }
+
+  f = fopen(filename, "wb");
+  if (f == NULL) {
+    perror("Cannot create movie");
+    free(state);
+    return NULL;
+  }
+  if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+      (state && fwrite(state, header.state_size, 1, f) != 1)) {
+    perror("Cannot write movie");
+    fclose(f);
+    free(state);
+    return NULL;
+  }
+  free(state);
+
+  movie = (movie_t*)calloc(sizeof(movie_t), 1);
+  movie->f = f;
+  movie->recording = true;
+  return movie;
+}
+
+movie_t*
+movie_play(emu_t      *emu,
+           const char *filename)
+{
+  movie_header_t header;
+  uint8_t digest[SHA1_SIZE];
+  movie_t *movie;
+  FILE *f;
+
+  f = fopen(filename, "rb");
+  if (f == NULL) {
+    perror("Cannot read movie");
+    return NULL;
+  }
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, MOVIE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != MOVIE_VERSION || header.ports != INPUT_PORTS) {
+    printf("Invalid movie file: %s\n", filename);
+    fclose(f);
+    return NULL;
+  }
+  movie_rom_sha1(emu, digest);
+  if (memcmp(digest, header.rom_sha1, SHA1_SIZE) != 0) {
+    printf("Movie is of another ROM: %s\n", filename);
+    fclose(f);
+    return NULL;
+  }
+  if (header.state_size) {
+    uint8_t *state = (uint8_t*)malloc(header.state_size);
+    int ret = -1;
+
+    if (fread(state, header.state_size, 1, f) == 1)
+      ret = state_load(emu, state, header.state_size);
+    free(state);
+    if (ret != 0) {
+      printf("Invalid state in movie: %s\n", filename);
+      fclose(f);
+      return NULL;
+    }
+  }
+
+  movie = (movie_t*)calloc(sizeof(movie_t), 1);
+  movie->f = f;
+  return movie;
+}
+
+static void
+movie_flush(movie_t *movie)
+{
+  if (movie->pos && fwrite(movie->buf, movie->pos, 1, movie->f) != 1)
+    movie->error = true;
+  movie->pos = 0;
+}
+
+bool
+movie_frame(movie_t *movie,
+            uint8_t  buttons[INPUT_PORTS])
+{
+  if (movie->recording) {
+    if (movie->pos + INPUT_PORTS > MOVIE_BUFFER)
+      movie_flush(movie);
+    memcpy(movie->buf + movie->pos, buttons, INPUT_PORTS);
+    movie->pos += INPUT_PORTS;
+    movie->frames++;
+    return true;
+  }
+
+  if (movie->pos + INPUT_PORTS > movie->len) {
+    /* MOVIE_BUFFER is a multiple of the frame size, and so are the
+     * reads short of the end of the file */
+    movie->len = fread(movie->buf, 1, MOVIE_BUFFER, movie->f);
+    movie->pos = 0;
+    if (movie->len < INPUT_PORTS)
+      return false;
+  }
+  memcpy(buttons, movie->buf + movie->pos, INPUT_PORTS);
+  movie->pos += INPUT_PORTS;
+  movie->frames++;
+  return true;
+}
+
+uint64_t
+movie_frames(movie_t *movie)
+{
+  return movie->frames;
+}
+
+int
+movie_close(movie_t *movie)
+{
+  int ret = 0;
+
+  if (movie->recording) {
+    movie_flush(movie);
+    if (movie->error)
+      printf("Cannot write movie\n");
+  }
+  if (fclose(movie->f) != 0 || movie->error)
+    ret = -1;
+  free(movie);
+  return ret;
+}
@@ -0,0 +1,47 @@
+#ifndef __MOVIE_H__
+#define __MOVIE_H__
+
+#include <stdint.h>
+
+#include "hash.h"
+#include "input.h"
+#include "types.h"
+
+/* Input movies: the buttons of every frame, to play a session back
+ * exactly. A header names the ROM and optionally holds the savestate
+ * the movie starts from, then each frame is one byte per port, the
+ * INPUT_* bits. Frames are streamed to and from the file in blocks. */
+#define MOVIE_MAGIC "NESM"
+#define MOVIE_VERSION 1
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  /* Bytes per frame */
+  uint32_t ports;
+  /* Size of the savestate following the header, 0 for a movie that
+   * starts at power on */
+  uint32_t state_size;
+  /* SHA-1 of PRG-ROM followed by CHR-ROM */
+  uint8_t rom_sha1[SHA1_SIZE];
+  uint8_t reserved[28];
+} movie_header_t;
+
+/* Starts recording from the current state of the emulator, which is
+ * saved in the movie unless it is at power on */
+movie_t* movie_record(emu_t      *emu,
+		      const char *filename,
+		      bool        power_on);
+/* Checks the movie is of the loaded ROM and loads its savestate */
+movie_t* movie_play(emu_t      *emu,
+		    const char *filename);
+/* Called at the start of each frame with the buttons of the host.
+ * Recording stores them, playback replaces them and returns false
+ * once the movie is over. */
+bool movie_frame(movie_t *movie,
+		 uint8_t  buttons[INPUT_PORTS]);
+uint64_t movie_frames(movie_t *movie);
+/* Returns -1 when the recording could not be written */
+int movie_close(movie_t *movie);
+
+#endif /* __MOVIE_H__ */
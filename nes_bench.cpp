@@ -0,0 +1,850 @@
+/* nes-bench, repeatable performance numbers
+ *
+ * The ROMs are assembled here from the opcode table, so no copyrighted
+ * ROMs are needed: instruction mixes for the interpreter and the JIT, a
+ * small game that renders a background and moving sprites from NMI,
+ * which also gives the frames for the video filters, and a large MMC3
+ * image for load times. Every benchmark runs a fixed
+ * amount of work a few times and keeps the fastest run, timed in CPU
+ * time of the process so other load on the machine counts less.
+ *
+ * Results are written as JSON and compared against a baseline written
+ * earlier the same way, any benchmark slower than the baseline by more
+ * than the tolerance fails the run.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "emu.h"
+#include "filter.h"
+#include "jit.h"
+#include "opcodes.h"
+#include "ppu.h"
+#include "video.h"
+
+#define BENCH_PRG_SIZE 0x8000
+#define BENCH_CHR_SIZE 0x2000
+#define BENCH_MAX_RESULTS 32
+#define BENCH_NAME_SIZE 32
+
+/* Dots in a frame, not counting the short pre-render line of odd
+ * frames */
+#define BENCH_FRAME_DOTS (341 * 262)
+
+/* Work done by each run, long enough for timer and scheduling noise
+ * to stay below a few percent */
+#define BENCH_CPU_FRAMES 300
+#define BENCH_PPU_FRAMES 300
+#define BENCH_FRAMES 600
+#define BENCH_LOADS 2000
+/* Filters differ in speed by 40 times, their runs go on in batches of
+ * frames until they took long enough */
+#define BENCH_FILTER_FRAMES 50
+#define BENCH_FILTER_SECONDS 0.25
+
+/* Zero page flag set by the NMI handler of the game */
+#define BENCH_NMI_FLAG 0x10
+
+typedef struct {
+  char name[BENCH_NAME_SIZE];
+  const char *unit;
+  double value;
+  double seconds;
+} bench_result_t;
+
+typedef struct {
+  int runs;
+  const char *filter;
+  char dir[64];
+  bench_result_t results[BENCH_MAX_RESULTS];
+  size_t count;
+} bench_t;
+
+/* 32Kb of PRG-ROM at $8000 being assembled */
+typedef struct {
+  uint8_t prg[BENCH_PRG_SIZE];
+  uint16_t pc;
+} bench_asm_t;
+
+static double
+bench_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* For work spread over threads, where the time until it is done is
+ * what counts */
+static double
+bench_wall(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Assembles an instruction at the PC and returns its address. The
+ * operand of a branch is its destination. */
+static uint16_t
+bench_op(bench_asm_t *a, const char *name, uint8_t mode, uint16_t operand = 0)
+{
+  uint16_t at = a->pc;
+  int opcode = -1;
+
+  for (int i = 0; i < 256 && opcode < 0; i++) {
+    if (cpu_opcodes[i].mode == mode && strcmp(cpu_opcodes[i].name, name) == 0)
+      opcode = i;
+  }
+  if (opcode < 0) {
+    fprintf(stderr, "no opcode for %s in mode %d\n", name, mode);
+    abort();
+  }
+  if (mode == MODE_REL)
+    operand = (operand - (at + 2)) & 0xff;
+  a->prg[a->pc++ - 0x8000] = opcode;
+  if (cpu_mode_size[mode] > 0)
+    a->prg[a->pc++ - 0x8000] = operand & 0xff;
+  if (cpu_mode_size[mode] > 1)
+    a->prg[a->pc++ - 0x8000] = operand >> 8;
+  return at;
+}
+
+/* Points the forward branch at addr to the PC */
+static void
+bench_patch(bench_asm_t *a, uint16_t addr)
+{
+  a->prg[addr + 1 - 0x8000] = (a->pc - (addr + 2)) & 0xff;
+}
+
+static void
+bench_vectors(bench_asm_t *a, uint16_t nmi, uint16_t reset, uint16_t irq)
+{
+  uint16_t vectors[] = { nmi, reset, irq };
+
+  for (int i = 0; i < 3; i++) {
+    a->prg[0x7ffa + i * 2] = vectors[i] & 0xff;
+    a->prg[0x7ffb + i * 2] = vectors[i] >> 8;
+  }
+}
+
+static void
+bench_prologue(bench_asm_t *a)
+{
+  bench_op(a, "SEI", MODE_IMP);
+  bench_op(a, "CLD", MODE_IMP);
+  bench_op(a, "LDX", MODE_IMM, 0xff);
+  bench_op(a, "TXS", MODE_IMP);
+}
+
+/* Writes an iNES file of the given sizes, banks beyond the first PRG
+ * and CHR ones are filled with noise */
+static int
+bench_write_rom(const char *filename, uint8_t mapper, const bench_asm_t *a,
+                uint32_t prg_size, uint32_t chr_size)
+{
+  uint8_t header[16] = { 'N', 'E', 'S', 0x1a };
+  uint8_t *prg = (uint8_t*)malloc(prg_size);
+  uint8_t *chr = (uint8_t*)malloc(chr_size);
+  uint32_t seed = 0x2a03;
+  FILE *f;
+  int ret = -1;
+
+  for (uint32_t i = 0; i < chr_size; i++) {
+    seed = seed * 1103515245 + 12345;
+    chr[i] = seed >> 16;
+  }
+  for (uint32_t i = 0; i < prg_size; i++) {
+    seed = seed * 1103515245 + 12345;
+    prg[i] = seed >> 16;
+  }
+  /* The program is in the last 32Kb, where the boards start */
+  memcpy(prg + prg_size - BENCH_PRG_SIZE, a->prg, BENCH_PRG_SIZE);
+
+  header[4] = prg_size / 0x4000;
+  header[5] = chr_size / 0x2000;
+  header[6] = (mapper & 0x0f) << 4 | 0x01;
+  header[7] = mapper & 0xf0;
+
+  f = fopen(filename, "wb");
+  if (f == NULL) {
+    perror(filename);
+  } else {
+    if (fwrite(header, 1, sizeof(header), f) == sizeof(header) &&
+        fwrite(prg, 1, prg_size, f) == prg_size &&
+        fwrite(chr, 1, chr_size, f) == chr_size)
+      ret = 0;
+    if (fclose(f) != 0)
+      ret = -1;
+  }
+  free(prg);
+  free(chr);
+  return ret;
+}
+
+/* Loads, stores and arithmetic on the zero page */
+static void
+bench_asm_alu(bench_asm_t *a)
+{
+  uint16_t loop;
+
+  bench_prologue(a);
+  loop = a->pc;
+  for (int i = 0; i < 4; i++) {
+    bench_op(a, "LDA", MODE_IMM, 0x13);
+    bench_op(a, "CLC", MODE_IMP);
+    bench_op(a, "ADC", MODE_ZP0, 0x10);
+    bench_op(a, "STA", MODE_ZP0, 0x10);
+    bench_op(a, "EOR", MODE_IMM, 0x5a);
+    bench_op(a, "ASL", MODE_ACC);
+    bench_op(a, "ROL", MODE_ZP0, 0x11);
+    bench_op(a, "AND", MODE_IMM, 0x7f);
+    bench_op(a, "ORA", MODE_ZP0, 0x12);
+    bench_op(a, "SEC", MODE_IMP);
+    bench_op(a, "SBC", MODE_IMM, 0x03);
+    bench_op(a, "STA", MODE_ZP0, 0x12);
+    bench_op(a, "TAX", MODE_IMP);
+    bench_op(a, "INX", MODE_IMP);
+    bench_op(a, "TXA", MODE_IMP);
+    bench_op(a, "LSR", MODE_ACC);
+    bench_op(a, "TAY", MODE_IMP);
+    bench_op(a, "DEY", MODE_IMP);
+    bench_op(a, "STY", MODE_ZP0, 0x13);
+    bench_op(a, "INC", MODE_ZP0, 0x14);
+    bench_op(a, "DEC", MODE_ZP0, 0x15);
+    bench_op(a, "CMP", MODE_IMM, 0x40);
+    bench_op(a, "ROR", MODE_ZP0, 0x16);
+    bench_op(a, "BIT", MODE_ZP0, 0x16);
+  }
+  bench_op(a, "JMP", MODE_ABS, loop);
+  bench_vectors(a, loop, 0x8000, loop);
+}
+
+/* Short loops, conditional branches and subroutine calls */
+static void
+bench_asm_branch(bench_asm_t *a)
+{
+  uint16_t sub, loop, inner, skip, neg;
+
+  a->pc = 0x9000;
+  sub = a->pc;
+  bench_op(a, "INC", MODE_ZP0, 0x20);
+  bench_op(a, "LDA", MODE_ZP0, 0x20);
+  neg = bench_op(a, "BMI", MODE_REL, a->pc);
+  bench_op(a, "RTS", MODE_IMP);
+  bench_patch(a, neg);
+  bench_op(a, "LSR", MODE_ZP0, 0x20);
+  bench_op(a, "RTS", MODE_IMP);
+
+  a->pc = 0x8000;
+  bench_prologue(a);
+  loop = a->pc;
+  bench_op(a, "LDX", MODE_IMM, 0x10);
+  inner = a->pc;
+  bench_op(a, "JSR", MODE_ABS, sub);
+  bench_op(a, "DEX", MODE_IMP);
+  bench_op(a, "BNE", MODE_REL, inner);
+  bench_op(a, "CPY", MODE_IMM, 0x80);
+  skip = bench_op(a, "BCC", MODE_REL, a->pc);
+  bench_op(a, "LDY", MODE_IMM, 0x00);
+  bench_patch(a, skip);
+  bench_op(a, "INY", MODE_IMP);
+  bench_op(a, "JMP", MODE_ABS, loop);
+  bench_vectors(a, loop, 0x8000, loop);
+}
+
+/* Indexed and indirect accesses and the stack */
+static void
+bench_asm_memory(bench_asm_t *a)
+{
+  uint16_t loop;
+
+  bench_prologue(a);
+  bench_op(a, "LDA", MODE_IMM, 0x00);
+  bench_op(a, "STA", MODE_ZP0, 0x00);
+  bench_op(a, "LDA", MODE_IMM, 0x03);
+  bench_op(a, "STA", MODE_ZP0, 0x01);
+  loop = a->pc;
+  bench_op(a, "LDA", MODE_ABX, 0x0300);
+  bench_op(a, "STA", MODE_ABY, 0x0480);
+  bench_op(a, "LDA", MODE_IZY, 0x00);
+  bench_op(a, "ADC", MODE_ABX, 0x0500);
+  bench_op(a, "STA", MODE_IZY, 0x00);
+  bench_op(a, "LDA", MODE_ZPX, 0x40);
+  bench_op(a, "STA", MODE_ABX, 0x0700);
+  bench_op(a, "INC", MODE_ABX, 0x0600);
+  bench_op(a, "PHA", MODE_IMP);
+  bench_op(a, "PLA", MODE_IMP);
+  bench_op(a, "INX", MODE_IMP);
+  bench_op(a, "INY", MODE_IMP);
+  bench_op(a, "INY", MODE_IMP);
+  bench_op(a, "JMP", MODE_ABS, loop);
+  bench_vectors(a, loop, 0x8000, loop);
+}
+
+/* Sets up a nametable, a palette and 64 sprites, then moves the sprites
+ * every frame and waits for the NMI handler to upload them */
+static void
+bench_asm_game(bench_asm_t *a, uint8_t mask)
+{
+  uint16_t nmi, irq, sub, wait, loop, main, work;
+
+  a->pc = 0x9000;
+  sub = a->pc;
+  bench_op(a, "LDA", MODE_ZP0, 0x20);
+  bench_op(a, "CLC", MODE_IMP);
+  bench_op(a, "ADC", MODE_ABY, 0x0200);
+  bench_op(a, "STA", MODE_ZP0, 0x20);
+  bench_op(a, "RTS", MODE_IMP);
+
+  nmi = a->pc;
+  bench_op(a, "PHA", MODE_IMP);
+  bench_op(a, "LDA", MODE_IMM, 0x02);
+  bench_op(a, "STA", MODE_ABS, 0x4014);
+  bench_op(a, "LDA", MODE_ZP0, 0x11);
+  bench_op(a, "STA", MODE_ABS, 0x2005);
+  bench_op(a, "STA", MODE_ABS, 0x2005);
+  bench_op(a, "INC", MODE_ZP0, 0x11);
+  bench_op(a, "LDA", MODE_IMM, 0x01);
+  bench_op(a, "STA", MODE_ZP0, BENCH_NMI_FLAG);
+  bench_op(a, "PLA", MODE_IMP);
+  bench_op(a, "RTI", MODE_IMP);
+  irq = a->pc;
+  bench_op(a, "RTI", MODE_IMP);
+
+  a->pc = 0x8000;
+  bench_prologue(a);
+  bench_op(a, "LDA", MODE_IMM, 0x00);
+  bench_op(a, "STA", MODE_ABS, 0x2000);
+  bench_op(a, "STA", MODE_ABS, 0x2001);
+  for (int i = 0; i < 2; i++) {
+    wait = a->pc;
+    bench_op(a, "BIT", MODE_ABS, 0x2002);
+    bench_op(a, "BPL", MODE_REL, wait);
+  }
+
+  /* Palette, then the first nametable with its attributes */
+  bench_op(a, "LDA", MODE_IMM, 0x3f);
+  bench_op(a, "STA", MODE_ABS, 0x2006);
+  bench_op(a, "LDA", MODE_IMM, 0x00);
+  bench_op(a, "STA", MODE_ABS, 0x2006);
+  bench_op(a, "LDX", MODE_IMM, 0x00);
+  loop = a->pc;
+  bench_op(a, "TXA", MODE_IMP);
+  bench_op(a, "STA", MODE_ABS, 0x2007);
+  bench_op(a, "INX", MODE_IMP);
+  bench_op(a, "CPX", MODE_IMM, 0x20);
+  bench_op(a, "BNE", MODE_REL, loop);
+  bench_op(a, "LDA", MODE_IMM, 0x20);
+  bench_op(a, "STA", MODE_ABS, 0x2006);
+  bench_op(a, "LDA", MODE_IMM, 0x00);
+  bench_op(a, "STA", MODE_ABS, 0x2006);
+  bench_op(a, "LDY", MODE_IMM, 0x04);
+  loop = a->pc;
+  bench_op(a, "TXA", MODE_IMP);
+  bench_op(a, "STA", MODE_ABS, 0x2007);
+  bench_op(a, "INX", MODE_IMP);
+  bench_op(a, "BNE", MODE_REL, loop);
+  bench_op(a, "DEY", MODE_IMP);
+  bench_op(a, "BNE", MODE_REL, loop);
+
+  /* Sprites spread over the screen, two per line */
+  loop = a->pc;
+  bench_op(a, "TXA", MODE_IMP);
+  bench_op(a, "STA", MODE_ABX, 0x0200);
+  bench_op(a, "INX", MODE_IMP);
+  bench_op(a, "BNE", MODE_REL, loop);
+
+  bench_op(a, "LDA", MODE_IMM, 0x80);
+  bench_op(a, "STA", MODE_ABS, 0x2000);
+  bench_op(a, "LDA", MODE_IMM, mask);
+  bench_op(a, "STA", MODE_ABS, 0x2001);
+
+  main = a->pc;
+  bench_op(a, "LDX", MODE_IMM, 0x00);
+  loop = a->pc;
+  bench_op(a, "INC", MODE_ABX, 0x0203);
+  bench_op(a, "INX", MODE_IMP);
+  bench_op(a, "INX", MODE_IMP);
+  bench_op(a, "INX", MODE_IMP);
+  bench_op(a, "INX", MODE_IMP);
+  bench_op(a, "BNE", MODE_REL, loop);
+  bench_op(a, "LDY", MODE_IMM, 0x40);
+  work = a->pc;
+  bench_op(a, "JSR", MODE_ABS, sub);
+  bench_op(a, "DEY", MODE_IMP);
+  bench_op(a, "BNE", MODE_REL, work);
+  wait = a->pc;
+  bench_op(a, "LDA", MODE_ZP0, BENCH_NMI_FLAG);
+  bench_op(a, "BEQ", MODE_REL, wait);
+  bench_op(a, "LDA", MODE_IMM, 0x00);
+  bench_op(a, "STA", MODE_ZP0, BENCH_NMI_FLAG);
+  bench_op(a, "JMP", MODE_ABS, main);
+  bench_vectors(a, nmi, 0x8000, irq);
+}
+
+static bool
+bench_enabled(bench_t *bench, const char *name)
+{
+  return bench->filter == NULL || strstr(name, bench->filter) != NULL;
+}
+
+static void
+bench_add(bench_t *bench, const char *name, const char *unit, double work,
+          double seconds)
+{
+  bench_result_t *result;
+
+  if (bench->count == BENCH_MAX_RESULTS)
+    return;
+  result = &bench->results[bench->count++];
+  snprintf(result->name, sizeof(result->name), "%s", name);
+  result->unit = unit;
+  result->value = work / seconds;
+  result->seconds = seconds;
+}
+
+/* Builds a ROM in the scratch directory */
+static int
+bench_rom(bench_t *bench, const char *name, void (*assemble)(bench_asm_t *a),
+          char *filename, size_t size)
+{
+  bench_asm_t *a = (bench_asm_t*)calloc(sizeof(bench_asm_t), 1);
+  int ret;
+
+  a->pc = 0x8000;
+  assemble(a);
+  snprintf(filename, size, "%s/%s.nes", bench->dir, name);
+  ret = bench_write_rom(filename, 0, a, BENCH_PRG_SIZE, BENCH_CHR_SIZE);
+  free(a);
+  return ret;
+}
+
+/* Instructions per second of an instruction mix, frames are run with
+ * rendering off so the CPU dominates */
+static void
+bench_cpu(bench_t *bench, const char *name, void (*assemble)(bench_asm_t *a),
+          bool jit)
+{
+  char filename[128], label[BENCH_NAME_SIZE];
+  double best = 0;
+  uint32_t instructions = 0;
+
+  snprintf(label, sizeof(label), "cpu-%s%s", name, jit ? "-jit" : "");
+  if (!bench_enabled(bench, label) || bench_rom(bench, name, assemble,
+                                                filename, sizeof(filename)))
+    return;
+  for (int run = 0; run < bench->runs; run++) {
+    video_t *video = video_create("null", NULL);
+    emu_t *emu = emu_create(video);
+    double start, seconds;
+    uint32_t first;
+
+    if (jit) {
+      emu->cpu->jit = jit_create(false);
+      if (emu->cpu->jit == NULL) {
+        emu_destroy(emu);
+        video_destroy(video);
+        return;
+      }
+    }
+    if (emu_load(emu, filename) == 0) {
+      start = bench_now();
+      first = emu->cpu->instructions;
+      for (int i = 0; i < BENCH_CPU_FRAMES; i++)
+        emu_run_frame(emu);
+      seconds = bench_now() - start;
+      if (best == 0 || seconds < best) {
+        best = seconds;
+        instructions = emu->cpu->instructions - first;
+      }
+    }
+    if (emu->cpu->jit)
+      jit_destroy(emu->cpu->jit);
+    emu_destroy(emu);
+    video_destroy(video);
+  }
+  if (best > 0)
+    bench_add(bench, label, "instructions/s", instructions, best);
+}
+
+/* Dots per second of ppu_run() alone, with VRAM and OAM set up by the
+ * game through the registers */
+static void
+bench_ppu(bench_t *bench, const char *name, uint8_t mask,
+          const char *filename)
+{
+  char label[BENCH_NAME_SIZE];
+  double best = 0;
+
+  snprintf(label, sizeof(label), "ppu-%s", name);
+  if (!bench_enabled(bench, label))
+    return;
+  for (int run = 0; run < bench->runs; run++) {
+    video_t *video = video_create("null", NULL);
+    emu_t *emu = emu_create(video);
+    ppu_t *ppu = emu->ppu;
+    uint8_t oam[256];
+    double start, seconds;
+
+    if (emu_load(emu, filename) == 0) {
+      ppu_write(ppu, 0x2006, 0x3f);
+      ppu_write(ppu, 0x2006, 0x00);
+      for (int i = 0; i < 0x20; i++)
+        ppu_write(ppu, 0x2007, i);
+      ppu_write(ppu, 0x2006, 0x20);
+      ppu_write(ppu, 0x2006, 0x00);
+      for (int i = 0; i < 0x400; i++)
+        ppu_write(ppu, 0x2007, i);
+      for (int i = 0; i < 256; i++)
+        oam[i] = i;
+      ppu_oam_dma(ppu, oam);
+      ppu_write(ppu, 0x2001, mask);
+
+      start = bench_now();
+      for (int i = 0; i < BENCH_PPU_FRAMES; i++)
+        ppu_run(ppu, BENCH_FRAME_DOTS);
+      seconds = bench_now() - start;
+      if (best == 0 || seconds < best)
+        best = seconds;
+    }
+    emu_destroy(emu);
+    video_destroy(video);
+  }
+  if (best > 0)
+    bench_add(bench, label, "dots/s",
+              (double)BENCH_PPU_FRAMES * BENCH_FRAME_DOTS, best);
+}
+
+/* Frames per second of the whole emulator with the null video backend */
+static void
+bench_frames(bench_t *bench, const char *name, const char *filename)
+{
+  char label[BENCH_NAME_SIZE];
+  double best = 0;
+
+  snprintf(label, sizeof(label), "frames-%s", name);
+  if (!bench_enabled(bench, label))
+    return;
+  for (int run = 0; run < bench->runs; run++) {
+    video_t *video = video_create("null", NULL);
+    emu_t *emu = emu_create(video);
+    double start, seconds;
+
+    if (emu_load(emu, filename) == 0) {
+      start = bench_now();
+      emu_run(emu, BENCH_FRAMES);
+      seconds = bench_now() - start;
+      if (best == 0 || seconds < best)
+        best = seconds;
+    }
+    emu_destroy(emu);
+    video_destroy(video);
+  }
+  if (best > 0)
+    bench_add(bench, label, "frames/s", BENCH_FRAMES, best);
+}
+
+/* Frames per second through a video filter, of a frame of the game
+ * with sprites. Timed on the wall clock, the filters use a few
+ * threads. */
+static void
+bench_filter(bench_t *bench, const char *name, const char *filename)
+{
+  char label[BENCH_NAME_SIZE];
+  double best = 0, best_frames = 0, best_seconds = 0;
+  video_t *video;
+  emu_t *emu;
+  filter_t *filter;
+  const video_frame_t *frame;
+  uint32_t *out;
+
+  snprintf(label, sizeof(label), "filter-%s", name);
+  if (!bench_enabled(bench, label))
+    return;
+  video = video_create("null", NULL);
+  emu = emu_create(video);
+  filter = filter_create(video, name);
+  if (filter == NULL || emu_load(emu, filename) != 0) {
+    if (filter)
+      filter_destroy(filter);
+    emu_destroy(emu);
+    video_destroy(video);
+    return;
+  }
+  emu_run(emu, 60);
+  frame = video_latest(video);
+  out = (uint32_t*)malloc(filter_width(filter) * filter_height(filter) *
+                          sizeof(uint32_t));
+  /* The first frame also starts the threads of the filter */
+  filter_run(filter, frame, out, filter_width(filter));
+  for (int run = 0; run < bench->runs; run++) {
+    double start = bench_wall(), seconds;
+    int frames = 0;
+
+    do {
+      for (int i = 0; i < BENCH_FILTER_FRAMES; i++)
+        filter_run(filter, frame, out, filter_width(filter));
+      frames += BENCH_FILTER_FRAMES;
+      seconds = bench_wall() - start;
+    } while (seconds < BENCH_FILTER_SECONDS);
+    if (frames / seconds > best) {
+      best = frames / seconds;
+      best_frames = frames;
+      best_seconds = seconds;
+    }
+  }
+  bench_add(bench, label, "frames/s", best_frames, best_seconds);
+  free(out);
+  filter_destroy(filter);
+  emu_destroy(emu);
+  video_destroy(video);
+}
+
+static void bench_asm_game_off(bench_asm_t *a) { bench_asm_game(a, 0x00); }
+static void bench_asm_game_bg(bench_asm_t *a) { bench_asm_game(a, 0x0a); }
+static void bench_asm_game_all(bench_asm_t *a) { bench_asm_game(a, 0x1e); }
+
+/* Loads per second of a 256Kb MMC3 image with 128Kb of CHR-ROM */
+static void
+bench_load(bench_t *bench)
+{
+  bench_asm_t *a;
+  char filename[128];
+  double best = 0;
+
+  if (!bench_enabled(bench, "rom-load"))
+    return;
+  a = (bench_asm_t*)calloc(sizeof(bench_asm_t), 1);
+  a->pc = 0x8000;
+  bench_asm_game(a, 0x1e);
+  snprintf(filename, sizeof(filename), "%s/mmc3.nes", bench->dir);
+  if (bench_write_rom(filename, 4, a, 0x40000, 0x20000) != 0) {
+    free(a);
+    return;
+  }
+  free(a);
+
+  for (int run = 0; run < bench->runs; run++) {
+    video_t *video = video_create("null", NULL);
+    emu_t *emu = emu_create(video);
+    double start = bench_now(), seconds;
+    bool ok = true;
+
+    for (int i = 0; i < BENCH_LOADS && ok; i++)
+      ok = emu_load(emu, filename) == 0;
+    seconds = bench_now() - start;
+    if (ok && (best == 0 || seconds < best))
+      best = seconds;
+    emu_destroy(emu);
+    video_destroy(video);
+  }
+  if (best > 0)
+    bench_add(bench, "rom-load", "loads/s", BENCH_LOADS, best);
+}
+
+/* Removes the ROMs and their directory */
+static void
+bench_cleanup(bench_t *bench)
+{
+  static const char *roms[] = {
+    "alu", "branch", "memory", "off", "bg", "sprites", "mmc3",
+  };
+  char filename[128];
+
+  for (size_t i = 0; i < sizeof(roms) / sizeof(roms[0]); i++) {
+    snprintf(filename, sizeof(filename), "%s/%s.nes", bench->dir, roms[i]);
+    unlink(filename);
+  }
+  rmdir(bench->dir);
+}
+
+static int
+bench_write_json(bench_t *bench, const char *filename)
+{
+  FILE *f = fopen(filename, "w");
+
+  if (f == NULL) {
+    perror(filename);
+    return -1;
+  }
+  fprintf(f, "{\n  \"benchmarks\": [\n");
+  for (size_t i = 0; i < bench->count; i++) {
+    const bench_result_t *r = &bench->results[i];
+    fprintf(f, "    {\"name\": \"%s\", \"unit\": \"%s\", \"value\": %.1f, "
+            "\"seconds\": %.4f}%s\n", r->name, r->unit, r->value, r->seconds,
+            i + 1 < bench->count ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  return fclose(f);
+}
+
+/* Reads back the values of a file from bench_write_json(), one
+ * benchmark per line. Returns the number found or -1. */
+static int
+bench_read_baseline(const char *filename, bench_result_t *results,
+                    size_t size)
+{
+  FILE *f = fopen(filename, "r");
+  char line[512];
+  size_t count = 0;
+
+  if (f == NULL) {
+    perror(filename);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) && count < size) {
+    const char *name = strstr(line, "\"name\": \"");
+    const char *value = strstr(line, "\"value\": ");
+    const char *end;
+
+    if (name == NULL || value == NULL)
+      continue;
+    name += strlen("\"name\": \"");
+    end = strchr(name, '"');
+    if (end == NULL || end - name >= BENCH_NAME_SIZE)
+      continue;
+    memcpy(results[count].name, name, end - name);
+    results[count].name[end - name] = '\0';
+    results[count].value = strtod(value + strlen("\"value\": "), NULL);
+    count++;
+  }
+  fclose(f);
+  return count;
+}
+
+static void
+usage(const char *prog)
+{
+    printf("usage: %s [options]\n", prog);
+    printf("  -n, --runs=N        runs of every benchmark, the fastest counts (5)\n");
+    printf("  -f, --filter=TEXT   only run benchmarks with TEXT in their name\n");
+    printf("      --json=FILE     write the results as JSON\n");
+    printf("  -b, --baseline=FILE compare against results written by --json\n");
+    printf("  -t, --tolerance=PCT slowdown from the baseline that fails (25)\n");
+}
+
+int main(int argc, char **argv)
+{
+    enum { OPT_JSON = 256 };
+    static const struct option options[] = {
+      { "runs",      required_argument, NULL, 'n' },
+      { "filter",    required_argument, NULL, 'f' },
+      { "json",      required_argument, NULL, OPT_JSON },
+      { "baseline",  required_argument, NULL, 'b' },
+      { "tolerance", required_argument, NULL, 't' },
+      { "help",      no_argument,       NULL, 'h' },
+      { NULL, 0, NULL, 0 },
+    };
+    static const struct {
+      const char *name;
+      void (*assemble)(bench_asm_t *a);
+    } cpu_mixes[] = {
+      { "alu", bench_asm_alu },
+      { "branch", bench_asm_branch },
+      { "memory", bench_asm_memory },
+    }, render_modes[] = {
+      { "off", bench_asm_game_off },
+      { "bg", bench_asm_game_bg },
+      { "sprites", bench_asm_game_all },
+    };
+    static const uint8_t render_masks[] = { 0x00, 0x0a, 0x1e };
+    static const char *filters[] = {
+      "none", "nearest4", "scale2x", "scale3x", "hq2x", "ntsc4",
+    };
+    static bench_t bench;
+    static bench_result_t baseline[BENCH_MAX_RESULTS];
+    const char *json = NULL, *baseline_file = NULL;
+    double tolerance = 25;
+    int baseline_count = 0, regressions = 0;
+    int c;
+
+    bench.runs = 5;
+    while ((c = getopt_long(argc, argv, "n:f:b:t:h", options, NULL)) != -1) {
+      switch (c) {
+      case 'n':
+        bench.runs = atoi(optarg);
+        break;
+      case 'f':
+        bench.filter = optarg;
+        break;
+      case OPT_JSON:
+        json = optarg;
+        break;
+      case 'b':
+        baseline_file = optarg;
+        break;
+      case 't':
+        tolerance = strtod(optarg, NULL);
+        break;
+      default:
+        usage(argv[0]);
+        return c == 'h' ? 0 : 1;
+      }
+    }
+    if (bench.runs < 1)
+      bench.runs = 1;
+    if (baseline_file) {
+      baseline_count = bench_read_baseline(baseline_file, baseline,
+                                           BENCH_MAX_RESULTS);
+      if (baseline_count < 0)
+        return 1;
+    }
+
+    snprintf(bench.dir, sizeof(bench.dir), "/tmp/nes-bench-XXXXXX");
+    if (mkdtemp(bench.dir) == NULL) {
+      perror("mkdtemp");
+      return 1;
+    }
+
+    for (size_t i = 0; i < 3; i++) {
+      bench_cpu(&bench, cpu_mixes[i].name, cpu_mixes[i].assemble, false);
+      bench_cpu(&bench, cpu_mixes[i].name, cpu_mixes[i].assemble, true);
+    }
+    for (size_t i = 0; i < 3; i++) {
+      char filename[128];
+      if (bench_rom(&bench, render_modes[i].name, render_modes[i].assemble,
+                    filename, sizeof(filename)) != 0)
+        continue;
+      bench_ppu(&bench, render_modes[i].name, render_masks[i], filename);
+      bench_frames(&bench, render_modes[i].name, filename);
+      if (i == 2) {
+        for (size_t j = 0; j < sizeof(filters) / sizeof(filters[0]); j++)
+          bench_filter(&bench, filters[j], filename);
+      }
+    }
+    bench_load(&bench);
+
+    for (size_t i = 0; i < bench.count; i++) {
+      const bench_result_t *r = &bench.results[i];
+      printf("%-18s %14.1f %-15s", r->name, r->value, r->unit);
+      for (int j = 0; j < baseline_count; j++) {
+        double change;
+        if (strcmp(baseline[j].name, r->name) != 0 || baseline[j].value <= 0)
+          continue;
+        change = 100.0 * (r->value - baseline[j].value) / baseline[j].value;
+        printf(" %+6.1f%%", change);
+        if (change < -tolerance) {
+          printf(" REGRESSION");
+          regressions++;
+        }
+      }
+      printf("\n");
+    }
+
+    bench_cleanup(&bench);
+
+    if (json && bench_write_json(&bench, json) != 0)
+      return 1;
+    if (regressions) {
+      printf("%d benchmarks slower than the baseline by more than %.0f%%\n",
+             regressions, tolerance);
+      return 1;
+    }
+    return 0;
+}
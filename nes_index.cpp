@@ -0,0 +1,458 @@
+/* nes-index, indexes a ROM library in parallel
+ *
+ * Records the decoded header and the CRC-32 and SHA-1 of PRG and CHR
+ * of every ROM below the given directories. Running it again only
+ * hashes files whose size or modification time changed. The emulator
+ * uses the index to correct bad headers (nes --db), from corrections
+ * given here or from a NES 2.0 dump of the same ROM in the library.
+ *
+ * Corrections are lines of the CRC-32 of PRG and CHR followed by the
+ * fields to override, for example
+ *
+ *   1a2b3c4d mapper=4 mirroring=v battery=1 prg_nvram=8192
+ *
+ * Fields are mapper, submapper, mirroring (h, v or 4), battery,
+ * region (ntsc, pal, multi or dendy), prg_ram, prg_nvram, chr_ram and
+ * chr_nvram. They apply to new and unchanged entries alike, use
+ * --full to drop corrections that were removed.
+ */
+#include <dirent.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ines.h"
+#include "pool.h"
+#include "romdb.h"
+
+typedef enum {
+  ROM_UNCHANGED,
+  ROM_HASHED,
+  ROM_ERROR,
+} rom_status_t;
+
+typedef struct {
+  char *path;
+  struct stat st;
+  rom_status_t status;
+  romdb_entry_t entry;
+} rom_t;
+
+typedef struct {
+  uint32_t crc32;
+  /* Bit per field below that is overridden */
+  uint32_t fields;
+  romdb_entry_t entry;
+} correction_t;
+
+enum {
+  FIELD_MAPPER = 1 << 0,
+  FIELD_SUBMAPPER = 1 << 1,
+  FIELD_MIRRORING = 1 << 2,
+  FIELD_BATTERY = 1 << 3,
+  FIELD_REGION = 1 << 4,
+  FIELD_PRG_RAM = 1 << 5,
+  FIELD_PRG_NVRAM = 1 << 6,
+  FIELD_CHR_RAM = 1 << 7,
+  FIELD_CHR_NVRAM = 1 << 8,
+};
+
+static const char *mirroring_names[] = { "h", "v", "4" };
+static const char *region_names[] = { "ntsc", "pal", "multi", "dendy" };
+
+static double
+index_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int64_t
+index_mtime(const struct stat *st)
+{
+  return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static void
+index_add(rom_t **roms, size_t *count, size_t *size, const char *path,
+          const struct stat *st)
+{
+  if (*count == *size) {
+    *size = *size ? *size * 2 : 256;
+    *roms = (rom_t*)realloc(*roms, sizeof(rom_t) * *size);
+  }
+  memset(&(*roms)[*count], 0, sizeof(rom_t));
+  (*roms)[*count].path = strdup(path);
+  (*roms)[(*count)++].st = *st;
+}
+
+/* Adds a ROM, or all .nes files below a directory */
+static void
+index_collect(rom_t **roms, size_t *count, size_t *size, const char *path)
+{
+  struct stat st;
+  struct dirent *entry;
+  DIR *dir;
+
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    index_add(roms, count, size, path, &st);
+    return;
+  }
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    perror(path);
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    const char *name = entry->d_name;
+    size_t len = strlen(name);
+    char child[4096];
+
+    if (name[0] == '.')
+      continue;
+    snprintf(child, sizeof(child), "%s/%s", path, name);
+    if (stat(child, &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode))
+      index_collect(roms, count, size, child);
+    else if (len > 4 && strcasecmp(name + len - 4, ".nes") == 0)
+      index_add(roms, count, size, child, &st);
+  }
+  closedir(dir);
+}
+
+static int
+index_compare(const void *a, const void *b)
+{
+  return strcmp(((const rom_t*)a)->path, ((const rom_t*)b)->path);
+}
+
+static void
+index_job(void *opaque, size_t index)
+{
+  rom_t *rom = &((rom_t*)opaque)[index];
+  ines_t *cart;
+
+  if (rom->status == ROM_UNCHANGED)
+    return;
+  cart = ines_load(rom->path);
+  if (cart == NULL) {
+    rom->status = ROM_ERROR;
+    return;
+  }
+  /* Every byte is read once, front to back */
+  madvise((void*)cart->map, cart->map_size, MADV_SEQUENTIAL);
+  romdb_hash(&rom->entry, cart);
+  ines_destroy(cart);
+}
+
+static bool
+index_parse_name(const char *value, const char **names, int count,
+                 uint8_t *out)
+{
+  for (int i = 0; i < count; i++) {
+    if (strcasecmp(value, names[i]) == 0) {
+      *out = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool
+index_parse_field(correction_t *c, const char *key, const char *value)
+{
+  romdb_entry_t *e = &c->entry;
+  uint32_t n = strtoul(value, NULL, 0);
+
+  if (strcmp(key, "mapper") == 0) {
+    e->mapper = n;
+    c->fields |= FIELD_MAPPER;
+  } else if (strcmp(key, "submapper") == 0) {
+    e->submapper = n;
+    c->fields |= FIELD_SUBMAPPER;
+  } else if (strcmp(key, "mirroring") == 0) {
+    if (!index_parse_name(value, mirroring_names, 3, &e->mirroring))
+      return false;
+    c->fields |= FIELD_MIRRORING;
+  } else if (strcmp(key, "battery") == 0) {
+    e->flags = n ? ROMDB_BATTERY : 0;
+    c->fields |= FIELD_BATTERY;
+  } else if (strcmp(key, "region") == 0) {
+    if (!index_parse_name(value, region_names, 4, &e->region))
+      return false;
+    c->fields |= FIELD_REGION;
+  } else if (strcmp(key, "prg_ram") == 0) {
+    e->prg_ram_size = n;
+    c->fields |= FIELD_PRG_RAM;
+  } else if (strcmp(key, "prg_nvram") == 0) {
+    e->prg_nvram_size = n;
+    c->fields |= FIELD_PRG_NVRAM;
+  } else if (strcmp(key, "chr_ram") == 0) {
+    e->chr_ram_size = n;
+    c->fields |= FIELD_CHR_RAM;
+  } else if (strcmp(key, "chr_nvram") == 0) {
+    e->chr_nvram_size = n;
+    c->fields |= FIELD_CHR_NVRAM;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static int
+index_load_corrections(const char *filename, correction_t **corrections,
+                       size_t *count)
+{
+  size_t size = 0;
+  char line[1024];
+  int lineno = 0;
+  FILE *f;
+
+  *corrections = NULL;
+  *count = 0;
+  f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    char *save, *token, *end;
+    correction_t c;
+
+    lineno++;
+    token = strtok_r(line, " \t\r\n", &save);
+    if (token == NULL || token[0] == '#')
+      continue;
+    memset(&c, 0, sizeof(c));
+    c.crc32 = strtoul(token, &end, 16);
+    if (*end != '\0') {
+      fprintf(stderr, "%s:%d: invalid CRC-32 %s\n", filename, lineno, token);
+      continue;
+    }
+    while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+      char *value = strchr(token, '=');
+      if (value)
+        *value++ = '\0';
+      if (value == NULL || !index_parse_field(&c, token, value))
+        fprintf(stderr, "%s:%d: invalid field %s\n", filename, lineno, token);
+    }
+
+    if (*count == size) {
+      size = size ? size * 2 : 64;
+      *corrections = (correction_t*)realloc(*corrections,
+                                            sizeof(correction_t) * size);
+    }
+    (*corrections)[(*count)++] = c;
+  }
+  fclose(f);
+  return 0;
+}
+
+static void
+index_correct(romdb_entry_t *e, const correction_t *c)
+{
+  if (c->fields & FIELD_MAPPER)
+    e->mapper = c->entry.mapper;
+  if (c->fields & FIELD_SUBMAPPER)
+    e->submapper = c->entry.submapper;
+  if (c->fields & FIELD_MIRRORING)
+    e->mirroring = c->entry.mirroring;
+  if (c->fields & FIELD_BATTERY)
+    e->flags = (e->flags & ~ROMDB_BATTERY) | c->entry.flags;
+  if (c->fields & FIELD_REGION)
+    e->region = c->entry.region;
+  if (c->fields & FIELD_PRG_RAM)
+    e->prg_ram_size = c->entry.prg_ram_size;
+  if (c->fields & FIELD_PRG_NVRAM)
+    e->prg_nvram_size = c->entry.prg_nvram_size;
+  if (c->fields & FIELD_CHR_RAM)
+    e->chr_ram_size = c->entry.chr_ram_size;
+  if (c->fields & FIELD_CHR_NVRAM)
+    e->chr_nvram_size = c->entry.chr_nvram_size;
+  e->flags |= ROMDB_CORRECTED;
+}
+
+static void
+index_list(romdb_t *db)
+{
+  for (size_t i = 0; i < romdb_count(db); i++) {
+    const romdb_entry_t *e = romdb_entry(db, i);
+    printf("%08x %4d.%-2d %s %-5s %5uK %5uK ", e->crc32, e->mapper,
+           e->submapper, mirroring_names[e->mirroring % 3],
+           region_names[e->region & 3], e->prg_size / 1024,
+           e->chr_size / 1024);
+    for (int j = 0; j < SHA1_SIZE; j++)
+      printf("%02x", e->prg_sha1[j]);
+    printf(" %s%s%s\n", romdb_path(db, e),
+           e->flags & ROMDB_NES2 ? " [nes2]" : "",
+           e->flags & ROMDB_CORRECTED ? " [corrected]" : "");
+  }
+}
+
+static void
+usage(const char *prog)
+{
+    printf("usage: %s [options] <rom.nes|directory>...\n", prog);
+    printf("  -o, --output=FILE       index file (nes.idx)\n");
+    printf("  -j, --jobs=N            worker threads, defaults to the number of CPUs\n");
+    printf("  -c, --corrections=FILE  header corrections by CRC-32\n");
+    printf("  -f, --full              hash every ROM again\n");
+    printf("  -l, --list              print the index\n");
+    printf("  -q, --quiet             only print the summary\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+      { "output",      required_argument, NULL, 'o' },
+      { "jobs",        required_argument, NULL, 'j' },
+      { "corrections", required_argument, NULL, 'c' },
+      { "full",        no_argument,       NULL, 'f' },
+      { "list",        no_argument,       NULL, 'l' },
+      { "quiet",       no_argument,       NULL, 'q' },
+      { "help",        no_argument,       NULL, 'h' },
+      { NULL, 0, NULL, 0 },
+    };
+    const char *output = "nes.idx";
+    const char *corrections_file = NULL;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool full = false, list = false, quiet = false;
+    correction_t *corrections = NULL;
+    size_t corrections_count = 0;
+    rom_t *roms = NULL;
+    size_t count = 0, size = 0, unique = 0;
+    size_t results[3] = { 0, 0, 0 };
+    romdb_t *old, *db;
+    double start;
+    int c, ret = 0;
+
+    while ((c = getopt_long(argc, argv, "o:j:c:flqh", options, NULL)) != -1) {
+      switch (c) {
+      case 'o':
+        output = optarg;
+        break;
+      case 'j':
+        jobs = atoi(optarg);
+        break;
+      case 'c':
+        corrections_file = optarg;
+        break;
+      case 'f':
+        full = true;
+        break;
+      case 'l':
+        list = true;
+        break;
+      case 'q':
+        quiet = true;
+        break;
+      default:
+        usage(argv[0]);
+        return c == 'h' ? 0 : 1;
+      }
+    }
+
+    /* Only listing an existing index */
+    if (optind >= argc && list) {
+      db = romdb_load(output);
+      if (db == NULL) {
+        printf("Cannot read ROM index: %s\n", output);
+        return 1;
+      }
+      index_list(db);
+      romdb_destroy(db);
+      return 0;
+    }
+    if (optind >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    if (corrections_file &&
+        index_load_corrections(corrections_file, &corrections,
+                               &corrections_count) != 0) {
+      return 1;
+    }
+
+    start = index_now();
+    for (int i = optind; i < argc; i++) {
+      index_collect(&roms, &count, &size, argv[i]);
+    }
+    qsort(roms, count, sizeof(rom_t), index_compare);
+    for (size_t i = 0; i < count; i++) {
+      if (unique && strcmp(roms[unique - 1].path, roms[i].path) == 0) {
+        free(roms[i].path);
+        continue;
+      }
+      roms[unique++] = roms[i];
+    }
+    count = unique;
+
+    /* Files of the same size and time as in the last run are kept */
+    old = full ? NULL : romdb_load(output);
+    for (size_t i = 0; i < count; i++) {
+      rom_t *rom = &roms[i];
+      const romdb_entry_t *e = old ? romdb_find_path(old, rom->path) : NULL;
+
+      rom->status = ROM_HASHED;
+      if (e && e->size == (uint64_t)rom->st.st_size &&
+          e->mtime == index_mtime(&rom->st)) {
+        rom->entry = *e;
+        rom->status = ROM_UNCHANGED;
+      }
+      rom->entry.size = rom->st.st_size;
+      rom->entry.mtime = index_mtime(&rom->st);
+    }
+    if (old)
+      romdb_destroy(old);
+
+    pool_run(count, jobs, index_job, roms);
+
+    db = romdb_create();
+    for (size_t i = 0; i < count; i++) {
+      rom_t *rom = &roms[i];
+      romdb_entry_t *e;
+
+      results[rom->status]++;
+      if (rom->status == ROM_ERROR)
+        continue;
+      e = romdb_add(db, rom->path);
+      uint32_t path = e->path;
+      *e = rom->entry;
+      e->path = path;
+      for (size_t j = 0; j < corrections_count; j++) {
+        if (corrections[j].crc32 == e->crc32)
+          index_correct(e, &corrections[j]);
+      }
+      if (!quiet && rom->status == ROM_HASHED)
+        printf("%08x %s\n", e->crc32, rom->path);
+    }
+
+    if (romdb_save(db, output) != 0)
+      ret = 1;
+    if (list)
+      index_list(db);
+    printf("%zu ROMs, %zu hashed, %zu unchanged, %zu errors in %.2fs\n",
+           count, results[ROM_HASHED], results[ROM_UNCHANGED],
+           results[ROM_ERROR], index_now() - start);
+
+    romdb_destroy(db);
+    for (size_t i = 0; i < count; i++) {
+      free(roms[i].path);
+    }
+    free(roms);
+    free(corrections);
+    return ret;
+}
@@ -0,0 +1,494 @@
+/* nes-test, runs a suite of test ROMs in parallel
+ *
+ * Test ROMs report through cartridge RAM as done by blargg's tests:
+ * $6001-$6003 holds DE B0 61 once $6000 is valid. $6000 is $80 while
+ * running, $81 when the ROM wants to be reset, and the result code
+ * otherwise, 0 for a pass. A message is at $6004. ROMs which report
+ * through a RAM address instead (--result) are done once the CPU
+ * parks in a JMP to itself.
+ *
+ * With --rewind, every test also checks the rewind history: each
+ * TEST_REWIND_PERIOD frames it steps back TEST_REWIND_FRAMES and
+ * compares the state with a savestate taken that many frames before.
+ */
+#include <dirent.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "emu.h"
+#include "jit.h"
+#include "pool.h"
+#include "rewind.h"
+#include "state.h"
+#include "video.h"
+
+/* Frames to wait before acting on a reset request */
+#define TEST_RESET_DELAY 6
+#define TEST_MESSAGE_SIZE 256
+
+/* Small enough for the history to wrap around within a test */
+#define TEST_REWIND_SIZE (64 * 1024)
+#define TEST_REWIND_PERIOD 60
+#define TEST_REWIND_FRAMES 20
+
+typedef enum {
+  TEST_PASS,
+  TEST_FAIL,
+  TEST_TIMEOUT,
+  TEST_ERROR,
+} test_status_t;
+
+static const char *test_status_names[] = {
+  "pass", "fail", "timeout", "error",
+};
+
+typedef struct {
+  char *filename;
+  test_status_t status;
+  int code;
+  uint64_t frames;
+  double seconds;
+  char message[TEST_MESSAGE_SIZE];
+} test_t;
+
+typedef struct {
+  uint64_t timeout;
+  /* RAM address of the result, -1 for the $6000 protocol */
+  int result_addr;
+  /* Run with the JIT, checked against the interpreter if diff */
+  bool jit;
+  bool jit_diff;
+  /* Check the rewind history while running */
+  bool rewind;
+} test_options_t;
+
+static double
+test_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool
+test_protocol_valid(emu_t *emu)
+{
+  return emu->prg_ram[1] == 0xde && emu->prg_ram[2] == 0xb0 &&
+    emu->prg_ram[3] == 0x61;
+}
+
+/* A JMP to itself, the usual end of a test */
+static bool
+test_parked(emu_t *emu)
+{
+  cpu_t *cpu = emu->cpu;
+  return cpu_read(cpu, cpu->pc) == 0x4c &&
+    cpu_read(cpu, cpu->pc + 1) == (cpu->pc & 0xff) &&
+    cpu_read(cpu, cpu->pc + 2) == (cpu->pc >> 8);
+}
+
+/* Steps back TEST_REWIND_FRAMES and compares the state with expected,
+ * then goes on from where it was. Returns false if they differ. */
+static bool
+test_rewind(emu_t *emu, const uint8_t *expected, uint8_t *now,
+            uint8_t *rewound, size_t size)
+{
+  bool ok = true;
+
+  state_save(emu, now, size);
+  for (int i = 0; i < TEST_REWIND_FRAMES && ok; i++)
+    ok = rewind_pop(emu->rewind);
+  if (ok) {
+    state_save(emu, rewound, size);
+    ok = memcmp(rewound, expected, size) == 0;
+  }
+  state_load(emu, now, size);
+  return ok;
+}
+
+static void
+test_run(test_t *test, const test_options_t *options)
+{
+  double start = test_now();
+  uint64_t reset_at = 0;
+  uint8_t *states = NULL;
+  size_t size = 0;
+  video_t *video;
+  emu_t *emu;
+
+  test->status = TEST_TIMEOUT;
+  video = video_create("null", NULL);
+  emu = emu_create(video);
+  if (options->jit)
+    emu->cpu->jit = jit_create(options->jit_diff);
+  if (emu_load(emu, test->filename) != 0) {
+    test->status = TEST_ERROR;
+    snprintf(test->message, sizeof(test->message), "cannot load ROM");
+    goto out;
+  }
+  if (options->rewind) {
+    emu->rewind = rewind_create(emu, TEST_REWIND_SIZE);
+    size = state_size(emu);
+    states = (uint8_t*)malloc(size * 3);
+  }
+
+  while (test->frames < options->timeout) {
+    /* Recorded by emu_run_frame() once the frame starts */
+    if (emu->rewind && test->frames % TEST_REWIND_PERIOD ==
+        TEST_REWIND_PERIOD - TEST_REWIND_FRAMES)
+      state_save(emu, states, size);
+    int ret = emu_run_frame(emu);
+    test->frames++;
+    if (ret != EMU_OK) {
+      test->status = TEST_ERROR;
+      snprintf(test->message, sizeof(test->message),
+               "CPU jammed at $%04X", emu->cpu->pc);
+      break;
+    }
+    if (emu->rewind && test->frames % TEST_REWIND_PERIOD == 0 &&
+        !test_rewind(emu, states, states + size, states + size * 2, size)) {
+      test->status = TEST_ERROR;
+      snprintf(test->message, sizeof(test->message),
+               "rewind differs at frame %llu",
+               (unsigned long long)test->frames - TEST_REWIND_FRAMES);
+      break;
+    }
+    if (emu->cpu->jit && jit_diverged(emu->cpu->jit)) {
+      test->status = TEST_ERROR;
+      snprintf(test->message, sizeof(test->message), "JIT diverged");
+      break;
+    }
+
+    if (options->result_addr >= 0) {
+      if (test_parked(emu)) {
+        test->code = cpu_read(emu->cpu, options->result_addr);
+        test->status = test->code == 0 ? TEST_PASS : TEST_FAIL;
+        break;
+      }
+      continue;
+    }
+
+    if (!test_protocol_valid(emu))
+      continue;
+    uint8_t status = emu->prg_ram[0];
+    if (status == 0x81) {
+      if (reset_at == 0)
+        reset_at = test->frames + TEST_RESET_DELAY;
+      if (test->frames == reset_at) {
+        cpu_reset(emu->cpu);
+        reset_at = 0;
+      }
+    } else if (status < 0x80) {
+      test->code = status;
+      test->status = status == 0 ? TEST_PASS : TEST_FAIL;
+      break;
+    }
+  }
+
+  if (options->result_addr < 0 && test_protocol_valid(emu) &&
+      test->status != TEST_ERROR) {
+    size_t n = 0;
+    for (int addr = 4; addr < 0x2000 && emu->prg_ram[addr] &&
+           n < sizeof(test->message) - 1; addr++) {
+      test->message[n++] = emu->prg_ram[addr];
+    }
+    test->message[n] = '\0';
+  }
+
+ out:
+  if (emu->cpu->jit)
+    jit_destroy(emu->cpu->jit);
+  if (emu->rewind)
+    rewind_destroy(emu->rewind);
+  free(states);
+  emu_destroy(emu);
+  video_destroy(video);
+  test->seconds = test_now() - start;
+}
+
+typedef struct {
+  test_t *tests;
+  const test_options_t *options;
+} test_batch_t;
+
+static void
+test_job(void *opaque, size_t index)
+{
+  test_batch_t *batch = (test_batch_t*)opaque;
+  test_run(&batch->tests[index], batch->options);
+}
+
+static int
+test_compare(const void *a, const void *b)
+{
+  return strcmp(((const test_t*)a)->filename, ((const test_t*)b)->filename);
+}
+
+static void
+test_add(test_t **tests, size_t *count, size_t *size, const char *filename)
+{
+  if (*count == *size) {
+    *size = *size ? *size * 2 : 64;
+    *tests = (test_t*)realloc(*tests, sizeof(test_t) * *size);
+  }
+  memset(&(*tests)[*count], 0, sizeof(test_t));
+  (*tests)[(*count)++].filename = strdup(filename);
+}
+
+/* Adds a ROM, or all .nes files below a directory */
+static void
+test_collect(test_t **tests, size_t *count, size_t *size, const char *path)
+{
+  struct stat st;
+  struct dirent *entry;
+  DIR *dir;
+
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    test_add(tests, count, size, path);
+    return;
+  }
+
+  dir = opendir(path);
+  if (dir == NULL) {
+    perror(path);
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    const char *name = entry->d_name;
+    size_t len = strlen(name);
+    char child[4096];
+
+    if (name[0] == '.')
+      continue;
+    snprintf(child, sizeof(child), "%s/%s", path, name);
+    if (stat(child, &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode) ||
+        (len > 4 && strcasecmp(name + len - 4, ".nes") == 0))
+      test_collect(tests, count, size, child);
+  }
+  closedir(dir);
+}
+
+static void
+test_write_escaped(FILE *f, const char *s, bool xml)
+{
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (xml && c == '<')
+      fputs("&lt;", f);
+    else if (xml && c == '>')
+      fputs("&gt;", f);
+    else if (xml && c == '&')
+      fputs("&amp;", f);
+    else if (xml && c == '"')
+      fputs("&quot;", f);
+    else if (!xml && (c == '"' || c == '\\'))
+      fprintf(f, "\\%c", c);
+    else if (c == '\n')
+      fputs(xml ? "&#10;" : "\\n", f);
+    else if (c < 0x20 || c >= 0x7f)
+      fprintf(f, xml ? "&#%d;" : "\\u%04x", c);
+    else
+      fputc(c, f);
+  }
+}
+
+static int
+test_write_json(const char *filename, const test_t *tests, size_t count)
+{
+  FILE *f = fopen(filename, "w");
+
+  if (f == NULL) {
+    perror(filename);
+    return -1;
+  }
+  fprintf(f, "[\n");
+  for (size_t i = 0; i < count; i++) {
+    const test_t *test = &tests[i];
+    fprintf(f, "  {\"rom\": \"");
+    test_write_escaped(f, test->filename, false);
+    fprintf(f, "\", \"status\": \"%s\", \"code\": %d, \"frames\": %llu, "
+            "\"seconds\": %.3f, \"message\": \"",
+            test_status_names[test->status], test->code,
+            (unsigned long long)test->frames, test->seconds);
+    test_write_escaped(f, test->message, false);
+    fprintf(f, "\"}%s\n", i + 1 < count ? "," : "");
+  }
+  fprintf(f, "]\n");
+  return fclose(f);
+}
+
+static int
+test_write_junit(const char *filename, const test_t *tests, size_t count,
+                 double seconds)
+{
+  FILE *f = fopen(filename, "w");
+  size_t failures = 0, errors = 0;
+
+  if (f == NULL) {
+    perror(filename);
+    return -1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (tests[i].status == TEST_FAIL || tests[i].status == TEST_TIMEOUT)
+      failures++;
+    else if (tests[i].status == TEST_ERROR)
+      errors++;
+  }
+
+  fprintf(f, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+  fprintf(f, "<testsuite name=\"nes-test\" tests=\"%zu\" failures=\"%zu\" "
+          "errors=\"%zu\" time=\"%.3f\">\n", count, failures, errors,
+          seconds);
+  for (size_t i = 0; i < count; i++) {
+    const test_t *test = &tests[i];
+    fprintf(f, "  <testcase name=\"");
+    test_write_escaped(f, test->filename, true);
+    fprintf(f, "\" time=\"%.3f\">", test->seconds);
+    if (test->status != TEST_PASS) {
+      fprintf(f, "\n    <%s type=\"%s\" message=\"",
+              test->status == TEST_ERROR ? "error" : "failure",
+              test_status_names[test->status]);
+      if (test->status == TEST_FAIL)
+        fprintf(f, "code %d: ", test->code);
+      test_write_escaped(f, test->message, true);
+      fprintf(f, "\"/>\n  ");
+    }
+    fprintf(f, "</testcase>\n");
+  }
+  fprintf(f, "</testsuite>\n");
+  return fclose(f);
+}
+
+static void
+usage(const char *prog)
+{
+    printf("usage: %s [options] <rom.nes|directory>...\n", prog);
+    printf("  -j, --jobs=N       worker threads, defaults to the number of CPUs\n");
+    printf("  -t, --timeout=N    frames before a test times out (3600)\n");
+    printf("  -r, --result=ADDR  result byte in RAM instead of $6000\n");
+    printf("      --json=FILE    write a JSON report\n");
+    printf("      --junit=FILE   write a JUnit XML report\n");
+    printf("      --jit          run with the JIT\n");
+    printf("      --jit-diff     run with the JIT checked against the interpreter\n");
+    printf("      --rewind       check stepping back through the rewind history\n");
+    printf("  -q, --quiet        only print failures and the summary\n");
+}
+
+int main(int argc, char **argv)
+{
+    enum { OPT_JSON = 256, OPT_JUNIT, OPT_JIT, OPT_JIT_DIFF, OPT_REWIND };
+    static const struct option options[] = {
+      { "jobs",    required_argument, NULL, 'j' },
+      { "timeout", required_argument, NULL, 't' },
+      { "result",  required_argument, NULL, 'r' },
+      { "json",    required_argument, NULL, OPT_JSON },
+      { "junit",   required_argument, NULL, OPT_JUNIT },
+      { "jit",     no_argument,       NULL, OPT_JIT },
+      { "jit-diff", no_argument,      NULL, OPT_JIT_DIFF },
+      { "rewind",  no_argument,       NULL, OPT_REWIND },
+      { "quiet",   no_argument,       NULL, 'q' },
+      { "help",    no_argument,       NULL, 'h' },
+      { NULL, 0, NULL, 0 },
+    };
+    test_options_t test_options = { 60 * 60, -1, false, false, false };
+    const char *json = NULL, *junit = NULL;
+    int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    bool quiet = false;
+    test_t *tests = NULL;
+    size_t count = 0, size = 0;
+    size_t results[4] = { 0, 0, 0, 0 };
+    double start, seconds;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "j:t:r:qh", options, NULL)) != -1) {
+      switch (c) {
+      case 'j':
+        jobs = atoi(optarg);
+        break;
+      case 't':
+        test_options.timeout = strtoull(optarg, NULL, 10);
+        break;
+      case 'r':
+        test_options.result_addr = strtol(optarg, NULL, 16) & 0xffff;
+        break;
+      case OPT_JSON:
+        json = optarg;
+        break;
+      case OPT_JUNIT:
+        junit = optarg;
+        break;
+      case OPT_JIT:
+        test_options.jit = true;
+        break;
+      case OPT_JIT_DIFF:
+        test_options.jit = test_options.jit_diff = true;
+        break;
+      case OPT_REWIND:
+        test_options.rewind = true;
+        break;
+      case 'q':
+        quiet = true;
+        break;
+      default:
+        usage(argv[0]);
+        return c == 'h' ? 0 : 1;
+      }
+    }
+
+    if (optind >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    for (int i = optind; i < argc; i++) {
+      test_collect(&tests, &count, &size, argv[i]);
+    }
+    if (count == 0) {
+      printf("no test ROMs found\n");
+      return 1;
+    }
+    qsort(tests, count, sizeof(test_t), test_compare);
+    if (jobs < 1)
+      jobs = 1;
+
+    start = test_now();
+    test_batch_t batch = { tests, &test_options };
+    pool_run(count, jobs, test_job, &batch);
+    seconds = test_now() - start;
+
+    for (size_t i = 0; i < count; i++) {
+      const test_t *test = &tests[i];
+      results[test->status]++;
+      if (quiet && test->status == TEST_PASS)
+        continue;
+      printf("%-7s %s", test_status_names[test->status], test->filename);
+      if (test->status == TEST_FAIL)
+        printf(" (code %d)", test->code);
+      printf("\n");
+    }
+    printf("%zu tests, %zu passed, %zu failed, %zu timed out, %zu errors "
+           "in %.2fs\n", count, results[TEST_PASS], results[TEST_FAIL],
+           results[TEST_TIMEOUT], results[TEST_ERROR], seconds);
+
+    if (json && test_write_json(json, tests, count) != 0)
+      return 1;
+    if (junit && test_write_junit(junit, tests, count, seconds) != 0)
+      return 1;
+
+    for (size_t i = 0; i < count; i++) {
+      free(tests[i].filename);
+    }
+    free(tests);
+    return results[TEST_PASS] == count ? 0 : 1;
+}
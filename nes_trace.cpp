@@ -0,0 +1,142 @@
+/* nes-trace, decodes instruction traces written by nes --trace
+ *
+ * Prints the trace in the log format of nestest, or compares it with
+ * a reference log and reports the first instruction that differs.
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define TRACE_CONTEXT 8
+
+/* The part of a log line to compare: everything, or only the PC, the
+ * registers and the cycle count */
+static void
+trace_key(const char *line, bool registers, char *key, size_t size)
+{
+  size_t len = strcspn(line, "\r\n");
+
+  while (len > 0 && line[len - 1] == ' ')
+    len--;
+  if (registers) {
+    const char *regs = strstr(line, "A:");
+    const char *ppu = strstr(line, " PPU:");
+    const char *cyc = strstr(line, "CYC:");
+    if (regs && ppu && cyc && regs < ppu) {
+      snprintf(key, size, "%.4s %.*s %.*s", line, (int)(ppu - regs), regs,
+               (int)strcspn(cyc, "\r\n "), cyc);
+      return;
+    }
+  }
+  snprintf(key, size, "%.*s", (int)len, line);
+}
+
+static int
+trace_compare(trace_t *trace, uint64_t first, const char *filename,
+              bool registers)
+{
+  uint64_t count = trace_count(trace);
+  char line[256], key[256], ours[256], expected[256];
+  FILE *f;
+
+  f = fopen(filename, "r");
+  if (f == NULL) {
+    perror(filename);
+    return 1;
+  }
+  for (uint64_t i = first; i < count; i++) {
+    if (fgets(line, sizeof(line), f) == NULL) {
+      printf("%llu instructions match, the log ends there\n",
+             (unsigned long long)(i - first));
+      fclose(f);
+      return 0;
+    }
+    trace_key(line, registers, expected, sizeof(expected));
+    trace_format(trace_get(trace, i), line, sizeof(line));
+    trace_key(line, registers, key, sizeof(key));
+    if (strcmp(key, expected) == 0)
+      continue;
+
+    printf("Difference at instruction %llu:\n",
+           (unsigned long long)(i - first + 1));
+    for (uint64_t j = i > first + TRACE_CONTEXT ? i - TRACE_CONTEXT : first;
+         j < i; j++) {
+      trace_format(trace_get(trace, j), ours, sizeof(ours));
+      printf("  %s\n", ours);
+    }
+    printf("- %s\n+ %s\n", expected, key);
+    fclose(f);
+    return 1;
+  }
+  printf("%llu instructions match\n", (unsigned long long)(count - first));
+  fclose(f);
+  return 0;
+}
+
+static void
+usage(const char *prog)
+{
+    printf("usage: %s [options] <trace>\n", prog);
+    printf("  -n, --last=N         only the last N instructions\n");
+    printf("  -c, --compare=LOG    compare with a nestest format log\n");
+    printf("  -r, --registers      only compare the PC, registers and cycles\n");
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option options[] = {
+      { "last",      required_argument, NULL, 'n' },
+      { "compare",   required_argument, NULL, 'c' },
+      { "registers", no_argument,       NULL, 'r' },
+      { "help",      no_argument,       NULL, 'h' },
+      { NULL, 0, NULL, 0 },
+    };
+    const char *compare = NULL;
+    bool registers = false;
+    uint64_t last = 0, count, first = 0;
+    trace_t *trace;
+    char line[256];
+    int c, ret = 0;
+
+    while ((c = getopt_long(argc, argv, "n:c:rh", options, NULL)) != -1) {
+      switch (c) {
+      case 'n':
+        last = strtoull(optarg, NULL, 10);
+        break;
+      case 'c':
+        compare = optarg;
+        break;
+      case 'r':
+        registers = true;
+        break;
+      default:
+        usage(argv[0]);
+        return c == 'h' ? 0 : 1;
+      }
+    }
+    if (optind >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+
+    trace = trace_open(argv[optind]);
+    if (trace == NULL)
+      return 1;
+    count = trace_count(trace);
+    if (last && last < count)
+      first = count - last;
+
+    if (compare) {
+      ret = trace_compare(trace, first, compare, registers);
+    } else {
+      for (uint64_t i = first; i < count; i++) {
+        trace_format(trace_get(trace, i), line, sizeof(line));
+        puts(line);
+      }
+    }
+    trace_destroy(trace);
+    return ret;
+}
@@ -0,0 +1,298 @@
+#ifndef __OPCODES_H__
+#define __OPCODES_H__
+
+#include <stdint.h>
+
+/* Addressing modes of the 6502 */
+enum {
+  MODE_IMP, // Implied
+  MODE_ACC, // Accumulator
+  MODE_IMM, // Immediate, #$nn
+  MODE_ZP0, // Zero page, $nn
+  MODE_ZPX, // Zero page indexed, $nn,X
+  MODE_ZPY, // Zero page indexed, $nn,Y
+  MODE_ABS, // Absolute, $nnnn
+  MODE_ABX, // Absolute indexed, $nnnn,X
+  MODE_ABY, // Absolute indexed, $nnnn,Y
+  MODE_IND, // Indirect, ($nnnn)
+  MODE_IZX, // Indexed indirect, ($nn,X)
+  MODE_IZY, // Indirect indexed, ($nn),Y
+  MODE_REL, // Relative, branches
+};
+
+typedef struct {
+  const char *name;
+  uint8_t mode;
+  uint8_t cycles;       // Base cycle count
+  uint8_t page_penalty; // +1 cycle when indexing crosses a page
+} cpu_opcode_t;
+
+extern const cpu_opcode_t cpu_opcodes[256];
+extern const uint8_t cpu_mode_size[];
+
+/* All 256 opcodes of the Ricoh 2A03, official and unofficial, ordered
+ * by opcode: X(opcode, mnemonic, addressing mode, cycles, page penalty)
+ *
+ * Branches take one extra cycle when taken and another one when the
+ * destination is on a different page, that is handled by the branch
+ * itself and not by the table.
+ */
+#define CPU_OPCODES(X) \
+  X(0x00, BRK, IMP, 7, 0) \
+  X(0x01, ORA, IZX, 6, 0) \
+  X(0x02, JAM, IMP, 2, 0) \
+  X(0x03, SLO, IZX, 8, 0) \
+  X(0x04, NOP, ZP0, 3, 0) \
+  X(0x05, ORA, ZP0, 3, 0) \
+  X(0x06, ASL, ZP0, 5, 0) \
+  X(0x07, SLO, ZP0, 5, 0) \
+  X(0x08, PHP, IMP, 3, 0) \
+  X(0x09, ORA, IMM, 2, 0) \
+  X(0x0A, ASL, ACC, 2, 0) \
+  X(0x0B, ANC, IMM, 2, 0) \
+  X(0x0C, NOP, ABS, 4, 0) \
+  X(0x0D, ORA, ABS, 4, 0) \
+  X(0x0E, ASL, ABS, 6, 0) \
+  X(0x0F, SLO, ABS, 6, 0) \
+  X(0x10, BPL, REL, 2, 0) \
+  X(0x11, ORA, IZY, 5, 1) \
+  X(0x12, JAM, IMP, 2, 0) \
+  X(0x13, SLO, IZY, 8, 0) \
+  X(0x14, NOP, ZPX, 4, 0) \
+  X(0x15, ORA, ZPX, 4, 0) \
+  X(0x16, ASL, ZPX, 6, 0) \
+  X(0x17, SLO, ZPX, 6, 0) \
+  X(0x18, CLC, IMP, 2, 0) \
+  X(0x19, ORA, ABY, 4, 1) \
+  X(0x1A, NOP, IMP, 2, 0) \
+  X(0x1B, SLO, ABY, 7, 0) \
+  X(0x1C, NOP, ABX, 4, 1) \
+  X(0x1D, ORA, ABX, 4, 1) \
+  X(0x1E, ASL, ABX, 7, 0) \
+  X(0x1F, SLO, ABX, 7, 0) \
+  X(0x20, JSR, ABS, 6, 0) \
+  X(0x21, AND, IZX, 6, 0) \
+  X(0x22, JAM, IMP, 2, 0) \
+  X(0x23, RLA, IZX, 8, 0) \
+  X(0x24, BIT, ZP0, 3, 0) \
+  X(0x25, AND, ZP0, 3, 0) \
+  X(0x26, ROL, ZP0, 5, 0) \
+  X(0x27, RLA, ZP0, 5, 0) \
+  X(0x28, PLP, IMP, 4, 0) \
+  X(0x29, AND, IMM, 2, 0) \
+  X(0x2A, ROL, ACC, 2, 0) \
+  X(0x2B, ANC, IMM, 2, 0) \
+  X(0x2C, BIT, ABS, 4, 0) \
+  X(0x2D, AND, ABS, 4, 0) \
+  X(0x2E, ROL, ABS, 6, 0) \
+  X(0x2F, RLA, ABS, 6, 0) \
+  X(0x30, BMI, REL, 2, 0) \
+  X(0x31, AND, IZY, 5, 1) \
+  X(0x32, JAM, IMP, 2, 0) \
+  X(0x33, RLA, IZY, 8, 0) \
+  X(0x34, NOP, ZPX, 4, 0) \
+  X(0x35, AND, ZPX, 4, 0) \
+  X(0x36, ROL, ZPX, 6, 0) \
+  X(0x37, RLA, ZPX, 6, 0) \
+  X(0x38, SEC, IMP, 2, 0) \
+  X(0x39, AND, ABY, 4, 1) \
+  X(0x3A, NOP, IMP, 2, 0) \
+  X(0x3B, RLA, ABY, 7, 0) \
+  X(0x3C, NOP, ABX, 4, 1) \
+  X(0x3D, AND, ABX, 4, 1) \
+  X(0x3E, ROL, ABX, 7, 0) \
+  X(0x3F, RLA, ABX, 7, 0) \
+  X(0x40, RTI, IMP, 6, 0) \
+  X(0x41, EOR, IZX, 6, 0) \
+  X(0x42, JAM, IMP, 2, 0) \
+  X(0x43, SRE, IZX, 8, 0) \
+  X(0x44, NOP, ZP0, 3, 0) \
+  X(0x45, EOR, ZP0, 3, 0) \
+  X(0x46, LSR, ZP0, 5, 0) \
+  X(0x47, SRE, ZP0, 5, 0) \
+  X(0x48, PHA, IMP, 3, 0) \
+  X(0x49, EOR, IMM, 2, 0) \
+  X(0x4A, LSR, ACC, 2, 0) \
+  X(0x4B, ALR, IMM, 2, 0) \
+  X(0x4C, JMP, ABS, 3, 0) \
+  X(0x4D, EOR, ABS, 4, 0) \
+  X(0x4E, LSR, ABS, 6, 0) \
+  X(0x4F, SRE, ABS, 6, 0) \
+  X(0x50, BVC, REL, 2, 0) \
+  X(0x51, EOR, IZY, 5, 1) \
+  X(0x52, JAM, IMP, 2, 0) \
+  X(0x53, SRE, IZY, 8, 0) \
+  X(0x54, NOP, ZPX, 4, 0) \
+  X(0x55, EOR, ZPX, 4, 0) \
+  X(0x56, LSR, ZPX, 6, 0) \
+  X(0x57, SRE, ZPX, 6, 0) \
+  X(0x58, CLI, IMP, 2, 0) \
+  X(0x59, EOR, ABY, 4, 1) \
+  X(0x5A, NOP, IMP, 2, 0) \
+  X(0x5B, SRE, ABY, 7, 0) \
+  X(0x5C, NOP, ABX, 4, 1) \
+  X(0x5D, EOR, ABX, 4, 1) \
+  X(0x5E, LSR, ABX, 7, 0) \
+  X(0x5F, SRE, ABX, 7, 0) \
+  X(0x60, RTS, IMP, 6, 0) \
+  X(0x61, ADC, IZX, 6, 0) \
+  X(0x62, JAM, IMP, 2, 0) \
+  X(0x63, RRA, IZX, 8, 0) \
+  X(0x64, NOP, ZP0, 3, 0) \
+  X(0x65, ADC, ZP0, 3, 0) \
+  X(0x66, ROR, ZP0, 5, 0) \
+  X(0x67, RRA, ZP0, 5, 0) \
+  X(0x68, PLA, IMP, 4, 0) \
+  X(0x69, ADC, IMM, 2, 0) \
+  X(0x6A, ROR, ACC, 2, 0) \
+  X(0x6B, ARR, IMM, 2, 0) \
+  X(0x6C, JMP, IND, 5, 0) \
+  X(0x6D, ADC, ABS, 4, 0) \
+  X(0x6E, ROR, ABS, 6, 0) \
+  X(0x6F, RRA, ABS, 6, 0) \
+  X(0x70, BVS, REL, 2, 0) \
+  X(0x71, ADC, IZY, 5, 1) \
+  X(0x72, JAM, IMP, 2, 0) \
+  X(0x73, RRA, IZY, 8, 0) \
+  X(0x74, NOP, ZPX, 4, 0) \
+  X(0x75, ADC, ZPX, 4, 0) \
+  X(0x76, ROR, ZPX, 6, 0) \
+  X(0x77, RRA, ZPX, 6, 0) \
+  X(0x78, SEI, IMP, 2, 0) \
+  X(0x79, ADC, ABY, 4, 1) \
+  X(0x7A, NOP, IMP, 2, 0) \
+  X(0x7B, RRA, ABY, 7, 0) \
+  X(0x7C, NOP, ABX, 4, 1) \
+  X(0x7D, ADC, ABX, 4, 1) \
+  X(0x7E, ROR, ABX, 7, 0) \
+  X(0x7F, RRA, ABX, 7, 0) \
+  X(0x80, NOP, IMM, 2, 0) \
+  X(0x81, STA, IZX, 6, 0) \
+  X(0x82, NOP, IMM, 2, 0) \
+  X(0x83, SAX, IZX, 6, 0) \
+  X(0x84, STY, ZP0, 3, 0) \
+  X(0x85, STA, ZP0, 3, 0) \
+  X(0x86, STX, ZP0, 3, 0) \
+  X(0x87, SAX, ZP0, 3, 0) \
+  X(0x88, DEY, IMP, 2, 0) \
+  X(0x89, NOP, IMM, 2, 0) \
+  X(0x8A, TXA, IMP, 2, 0) \
+  X(0x8B, XAA, IMM, 2, 0) \
+  X(0x8C, STY, ABS, 4, 0) \
+  X(0x8D, STA, ABS, 4, 0) \
+  X(0x8E, STX, ABS, 4, 0) \
+  X(0x8F, SAX, ABS, 4, 0) \
+  X(0x90, BCC, REL, 2, 0) \
+  X(0x91, STA, IZY, 6, 0) \
+  X(0x92, JAM, IMP, 2, 0) \
+  X(0x93, SHA, IZY, 6, 0) \
+  X(0x94, STY, ZPX, 4, 0) \
+  X(0x95, STA, ZPX, 4, 0) \
+  X(0x96, STX, ZPY, 4, 0) \
+  X(0x97, SAX, ZPY, 4, 0) \
+  X(0x98, TYA, IMP, 2, 0) \
+  X(0x99, STA, ABY, 5, 0) \
+  X(0x9A, TXS, IMP, 2, 0) \
+  X(0x9B, TAS, ABY, 5, 0) \
+  X(0x9C, SHY, ABX, 5, 0) \
+  X(0x9D, STA, ABX, 5, 0) \
+  X(0x9E, SHX, ABY, 5, 0) \
+  X(0x9F, SHA, ABY, 5, 0) \
+  X(0xA0, LDY, IMM, 2, 0) \
+  X(0xA1, LDA, IZX, 6, 0) \
+  X(0xA2, LDX, IMM, 2, 0) \
+  X(0xA3, LAX, IZX, 6, 0) \
+  X(0xA4, LDY, ZP0, 3, 0) \
+  X(0xA5, LDA, ZP0, 3, 0) \
+  X(0xA6, LDX, ZP0, 3, 0) \
+  X(0xA7, LAX, ZP0, 3, 0) \
+  X(0xA8, TAY, IMP, 2, 0) \
+  X(0xA9, LDA, IMM, 2, 0) \
+  X(0xAA, TAX, IMP, 2, 0) \
+  X(0xAB, LXA, IMM, 2, 0) \
+  X(0xAC, LDY, ABS, 4, 0) \
+  X(0xAD, LDA, ABS, 4, 0) \
+  X(0xAE, LDX, ABS, 4, 0) \
+  X(0xAF, LAX, ABS, 4, 0) \
+  X(0xB0, BCS, REL, 2, 0) \
+  X(0xB1, LDA, IZY, 5, 1) \
+  X(0xB2, JAM, IMP, 2, 0) \
+  X(0xB3, LAX, IZY, 5, 1) \
+  X(0xB4, LDY, ZPX, 4, 0) \
+  X(0xB5, LDA, ZPX, 4, 0) \
+  X(0xB6, LDX, ZPY, 4, 0) \
+  X(0xB7, LAX, ZPY, 4, 0) \
+  X(0xB8, CLV, IMP, 2, 0) \
+  X(0xB9, LDA, ABY, 4, 1) \
+  X(0xBA, TSX, IMP, 2, 0) \
+  X(0xBB, LAS, ABY, 4, 1) \
+  X(0xBC, LDY, ABX, 4, 1) \
+  X(0xBD, LDA, ABX, 4, 1) \
+  X(0xBE, LDX, ABY, 4, 1) \
+  X(0xBF, LAX, ABY, 4, 1) \
+  X(0xC0, CPY, IMM, 2, 0) \
+  X(0xC1, CMP, IZX, 6, 0) \
+  X(0xC2, NOP, IMM, 2, 0) \
+  X(0xC3, DCP, IZX, 8, 0) \
+  X(0xC4, CPY, ZP0, 3, 0) \
+  X(0xC5, CMP, ZP0, 3, 0) \
+  X(0xC6, DEC, ZP0, 5, 0) \
+  X(0xC7, DCP, ZP0, 5, 0) \
+  X(0xC8, INY, IMP, 2, 0) \
+  X(0xC9, CMP, IMM, 2, 0) \
+  X(0xCA, DEX, IMP, 2, 0) \
+  X(0xCB, AXS, IMM, 2, 0) \
+  X(0xCC, CPY, ABS, 4, 0) \
+  X(0xCD, CMP, ABS, 4, 0) \
+  X(0xCE, DEC, ABS, 6, 0) \
+  X(0xCF, DCP, ABS, 6, 0) \
+  X(0xD0, BNE, REL, 2, 0) \
+  X(0xD1, CMP, IZY, 5, 1) \
+  X(0xD2, JAM, IMP, 2, 0) \
+  X(0xD3, DCP, IZY, 8, 0) \
+  X(0xD4, NOP, ZPX, 4, 0) \
+  X(0xD5, CMP, ZPX, 4, 0) \
+  X(0xD6, DEC, ZPX, 6, 0) \
+  X(0xD7, DCP, ZPX, 6, 0) \
+  X(0xD8, CLD, IMP, 2, 0) \
+  X(0xD9, CMP, ABY, 4, 1) \
+  X(0xDA, NOP, IMP, 2, 0) \
+  X(0xDB, DCP, ABY, 7, 0) \
+  X(0xDC, NOP, ABX, 4, 1) \
+  X(0xDD, CMP, ABX, 4, 1) \
+  X(0xDE, DEC, ABX, 7, 0) \
+  X(0xDF, DCP, ABX, 7, 0) \
+  X(0xE0, CPX, IMM, 2, 0) \
+  X(0xE1, SBC, IZX, 6, 0) \
+  X(0xE2, NOP, IMM, 2, 0) \
+  X(0xE3, ISB, IZX, 8, 0) \
+  X(0xE4, CPX, ZP0, 3, 0) \
+  X(0xE5, SBC, ZP0, 3, 0) \
+  X(0xE6, INC, ZP0, 5, 0) \
+  X(0xE7, ISB, ZP0, 5, 0) \
+  X(0xE8, INX, IMP, 2, 0) \
+  X(0xE9, SBC, IMM, 2, 0) \
+  X(0xEA, NOP, IMP, 2, 0) \
+  X(0xEB, SBC, IMM, 2, 0) \
+  X(0xEC, CPX, ABS, 4, 0) \
+  X(0xED, SBC, ABS, 4, 0) \
+  X(0xEE, INC, ABS, 6, 0) \
+  X(0xEF, ISB, ABS, 6, 0) \
+  X(0xF0, BEQ, REL, 2, 0) \
+  X(0xF1, SBC, IZY, 5, 1) \
+  X(0xF2, JAM, IMP, 2, 0) \
+  X(0xF3, ISB, IZY, 8, 0) \
+  X(0xF4, NOP, ZPX, 4, 0) \
+  X(0xF5, SBC, ZPX, 4, 0) \
+  X(0xF6, INC, ZPX, 6, 0) \
+  X(0xF7, ISB, ZPX, 6, 0) \
+  X(0xF8, SED, IMP, 2, 0) \
+  X(0xF9, SBC, ABY, 4, 1) \
+  X(0xFA, NOP, IMP, 2, 0) \
+  X(0xFB, ISB, ABY, 7, 0) \
+  X(0xFC, NOP, ABX, 4, 1) \
+  X(0xFD, SBC, ABX, 4, 1) \
+  X(0xFE, INC, ABX, 7, 0) \
+  X(0xFF, ISB, ABX, 7, 0)
+
+#endif /* __OPCODES_H__ */
@@ -0,0 +1,205 @@
+/* Thread pools: a work stealing one for the batch tools, and one kept
+ * across runs for work split up every frame */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+typedef struct {
+  pthread_mutex_t lock;
+  size_t head;
+  size_t tail;
+} pool_queue_t;
+
+typedef struct {
+  pool_queue_t *queues;
+  int workers;
+  pool_fn fn;
+  void *opaque;
+} pool_batch_t;
+
+typedef struct {
+  pool_batch_t *pool;
+  int id;
+} pool_worker_t;
+
+struct pool_t {
+  pthread_t *threads;
+  int workers;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t finished;
+  /* Bumped for every dispatch, and for the workers to quit */
+  uint64_t generation;
+  bool quit;
+  /* The work of the current dispatch */
+  pool_fn fn;
+  void *opaque;
+  size_t count;
+  size_t next;
+  size_t done;
+};
+
+static bool
+pool_queue_pop(pool_queue_t *queue, bool steal, size_t *index)
+{
+  bool found = false;
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->head < queue->tail) {
+    *index = steal ? --queue->tail : queue->head++;
+    found = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static void*
+pool_worker(void *opaque)
+{
+  pool_worker_t *worker = (pool_worker_t*)opaque;
+  pool_batch_t *pool = worker->pool;
+  size_t index;
+
+  for (;;) {
+    bool found = pool_queue_pop(&pool->queues[worker->id], false, &index);
+    for (int i = 1; !found && i < pool->workers; i++) {
+      found = pool_queue_pop(&pool->queues[(worker->id + i) % pool->workers],
+                             true, &index);
+    }
+    if (!found)
+      break;
+    pool->fn(pool->opaque, index);
+  }
+  return NULL;
+}
+
+void
+pool_run(size_t   count,
+         int      workers,
+         pool_fn  fn,
+         void    *opaque)
+{
+  pool_batch_t pool;
+  pthread_t *threads;
+  pool_worker_t *args;
+
+  if (workers < 1)
+    workers = 1;
+  if ((size_t)workers > count)
+    workers = count ? count : 1;
+  pool.workers = workers;
+  pool.fn = fn;
+  pool.opaque = opaque;
+  pool.queues = (pool_queue_t*)calloc(sizeof(pool_queue_t), workers);
+  threads = (pthread_t*)calloc(sizeof(pthread_t), workers);
+  args = (pool_worker_t*)calloc(sizeof(pool_worker_t), workers);
+
+  for (int i = 0; i < workers; i++) {
+    pthread_mutex_init(&pool.queues[i].lock, NULL);
+    pool.queues[i].head = count * i / workers;
+    pool.queues[i].tail = count * (i + 1) / workers;
+  }
+  for (int i = 0; i < workers; i++) {
+    args[i].pool = &pool;
+    args[i].id = i;
+    pthread_create(&threads[i], NULL, pool_worker, &args[i]);
+  }
+  for (int i = 0; i < workers; i++) {
+    pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&pool.queues[i].lock);
+  }
+
+  free(args);
+  free(threads);
+  free(pool.queues);
+}
+
+/* Takes indices of the current dispatch until there are none left,
+ * with the lock held on entry and exit */
+static void
+pool_work(pool_t *pool)
+{
+  while (pool->next < pool->count) {
+    size_t index = pool->next++;
+
+    pthread_mutex_unlock(&pool->lock);
+    pool->fn(pool->opaque, index);
+    pthread_mutex_lock(&pool->lock);
+    if (++pool->done == pool->count)
+      pthread_cond_signal(&pool->finished);
+  }
+}
+
+static void*
+pool_thread(void *opaque)
+{
+  pool_t *pool = (pool_t*)opaque;
+  uint64_t generation = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->generation == generation && !pool->quit)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->quit)
+      break;
+    generation = pool->generation;
+    pool_work(pool);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+pool_t*
+pool_create(int workers)
+{
+  pool_t *pool = (pool_t*)calloc(sizeof(pool_t), 1);
+
+  /* The dispatching thread is one of the workers */
+  pool->workers = workers > 1 ? workers - 1 : 0;
+  pool->threads = (pthread_t*)calloc(sizeof(pthread_t), pool->workers + 1);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->start, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  for (int i = 0; i < pool->workers; i++)
+    pthread_create(&pool->threads[i], NULL, pool_thread, pool);
+  return pool;
+}
+
+void
+pool_dispatch(pool_t  *pool,
+              size_t   count,
+              pool_fn  fn,
+              void    *opaque)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->opaque = opaque;
+  pool->count = count;
+  pool->next = 0;
+  pool->done = 0;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->start);
+  pool_work(pool);
+  while (pool->done < pool->count)
+    pthread_cond_wait(&pool->finished, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void
+pool_destroy(pool_t *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = true;
+  pthread_cond_broadcast(&pool->start);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->workers; i++)
+    pthread_join(pool->threads[i], NULL);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->start);
+  pthread_cond_destroy(&pool->finished);
+  free(pool->threads);
+  free(pool);
+}
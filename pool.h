@@ -0,0 +1,30 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stddef.h>
+
+/* Runs fn for every index below count on a number of threads and
+ * returns once all are done. Each worker owns a range of the indices,
+ * takes from its front and steals from the back of others when done. */
+typedef void (*pool_fn)(void *opaque, size_t index);
+
+void pool_run(size_t   count,
+	      int      workers,
+	      pool_fn  fn,
+	      void    *opaque);
+
+/* Threads kept waiting for work that comes often, like the bands of a
+ * frame. Indices are handed out in order to whichever thread is free,
+ * the thread dispatching takes its share too. Dispatches must not
+ * overlap. */
+typedef struct pool_t pool_t;
+
+pool_t* pool_create(int workers);
+/* Runs fn for every index below count and returns once all are done */
+void pool_dispatch(pool_t  *pool,
+		   size_t   count,
+		   pool_fn  fn,
+		   void    *opaque);
+void pool_destroy(pool_t *pool);
+
+#endif /* __POOL_H__ */
@@ -5,9 +5,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <SDL2/SDL.h>
 
+#include "cpu.h"
+#include "emu.h"
+#include "ines.h"
 #include "ppu.h"
+#include "mapper.h"
+#include "capture.h"
+#include "render.h"
+#include "state.h"
+#include "video.h"
 
 #define TICKS_PER_SCANLINE 341
 #define SCANLINE_START_NMI 241 // NTSC
@@ -16,69 +23,149 @@
 #define WIDTH 256
 #define HEIGHT 240
 
-static uint32_t palette[] = {
-  0x666666, 0x002a88, 0x1412a7, 0x3b00a4,
-  0x5c007e, 0x6e0040, 0x6c0600, 0x561d00,
-  0x333500, 0x0b4800, 0x005200, 0x004f08,
-  0x00404d, 0x000000, 0x000000, 0x000000,
-  0xadadad, 0x155fd9, 0x4240ff, 0x7527fe,
-  0xa01acc, 0xb71e7b, 0xb53120, 0x994e00,
-  0x6b6d00, 0x388700, 0x0c9300, 0x008f32,
-  0x007c8d, 0x000000, 0x000000, 0x000000,
-  0xfffeff, 0x64b0ff, 0x9290ff, 0xc676ff,
-  0xf36aff, 0xfe6ecc, 0xfe8170, 0xea9e22,
-  0xbcbe00, 0x88d800, 0x5ce430, 0x45e082,
-  0x48cdde, 0x4f4f4f, 0x000000, 0x000000,
-  0xfffeff, 0xc0dfff, 0xd3d2ff, 0xe8c8ff,
-  0xfbc2ff, 0xfec4ea, 0xfeccc5, 0xf7d8a5,
-  0xe4e594, 0xcfef96, 0xbdf4ab, 0xb3f3cc,
-  0xb5ebf2, 0xb8b8b8, 0x000000, 0x000000,
-};
-
-static SDL_Window *win;
-static SDL_Renderer *renderer;
-
 ppu_t*
 ppu_create(emu_t *emu)
 {
     ppu_t *ppu;
     ppu = (ppu_t*)calloc(sizeof(ppu_t), 1);
-    ppu->mem = (uint8_t*)calloc(sizeof(uint8_t), 0x4000);
+    ppu->tiles = (uint8_t*)calloc(RENDER_TILE_SIZE, 512);
     ppu->emu = emu;
+    ppu_set_mirroring(ppu, PPU_MIRROR_HORIZONTAL);
+    return ppu;
+}
 
-    if (SDL_Init(SDL_INIT_VIDEO) != 0) {
-      printf("Unable to initialize SDL: %s\n", SDL_GetError());
-      return NULL;
+void
+ppu_destroy(ppu_t *ppu)
+{
+    free(ppu->tiles);
+    free(ppu->four_screen);
+    free(ppu);
+}
+
+/* Marks the decoded tiles covering a range of the pattern tables */
+static inline void
+ppu_invalidate_tiles(ppu_t *ppu, uint16_t addr, uint32_t size)
+{
+    uint32_t last = (addr + size - 1) >> 4;
+    for (uint32_t tile = addr >> 4; tile < 512 && tile <= last; tile++) {
+      ppu->tiles_dirty[tile / 64] |= 1ULL << (tile % 64);
     }
-    atexit(SDL_Quit);
-
-    win = SDL_CreateWindow("nes",
-                           SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
-                           WIDTH, HEIGHT,
-                           SDL_WINDOW_SHOWN);
-    if (win == NULL) {
-      printf("Unable to create SDL window: %s\n", SDL_GetError());
-      return NULL;
+    ppu->tiles_any_dirty = true;
+}
+
+/* Decodes the tiles that changed since the last scanline */
+static void
+ppu_update_tiles(ppu_t *ppu)
+{
+    for (int i = 0; i < 512 / 64; i++) {
+      while (ppu->tiles_dirty[i]) {
+        int tile = i * 64 + __builtin_ctzll(ppu->tiles_dirty[i]);
+        render_decode_pattern(&ppu->chr_map[tile >> 6][(tile & 63) * 16],
+                              &ppu->tiles[tile * RENDER_TILE_SIZE], 1);
+        ppu->tiles_dirty[i] &= ppu->tiles_dirty[i] - 1;
+      }
     }
+    ppu->tiles_any_dirty = false;
+}
 
-    renderer = SDL_CreateRenderer(win, -1, SDL_RENDERER_SOFTWARE);
-    if (renderer == NULL) {
-      printf("Unable to create SDL renderer: %s\n", SDL_GetError());
-      return NULL;
+/* Points pattern table pages at CHR memory, which is used in place.
+ * Only the tiles of pages that actually changed are decoded again. */
+static void
+ppu_map_pages(ppu_t         *ppu,
+              uint16_t       dest,
+              const uint8_t *src,
+              uint8_t       *write,
+              uint32_t       size)
+{
+    for (uint32_t offset = 0; offset < size && dest + offset < 0x2000;
+         offset += 0x400) {
+      int page = (dest + offset) >> 10;
+      if (ppu->chr_map[page] != src + offset ||
+          ppu->chr_write[page] != (write ? write + offset : NULL)) {
+        ppu->chr_map[page] = src + offset;
+        ppu->chr_write[page] = write ? write + offset : NULL;
+        ppu_invalidate_tiles(ppu, page << 10, 0x400);
+      }
     }
-    SDL_RenderClear(renderer);
-    SDL_RenderPresent(renderer);
+}
 
-    return ppu;
+void
+ppu_map_chr(ppu_t         *ppu,
+            uint16_t       dest,
+            const uint8_t *src,
+            uint32_t       size)
+{
+    ppu_map_pages(ppu, dest, src, NULL, size);
 }
 
 void
-ppu_map(ppu_t         *ppu,
-        uint16_t       dest,
-        const uint8_t *src,
-        uint16_t       size)
+ppu_map_chr_ram(ppu_t   *ppu,
+                uint16_t dest,
+                uint8_t *src,
+                uint32_t size)
 {
-    memcpy(&ppu->mem[dest], src, size);
+    ppu_map_pages(ppu, dest, src, src, size);
+}
+
+/* Nametable byte of a $2000-$3EFF address, after mirroring */
+static inline uint8_t*
+ppu_nametable(ppu_t *ppu, uint16_t addr)
+{
+  return ppu->nametables[(addr >> 10) & 3] + (addr & 0x3ff);
+}
+
+/* Palette byte of a $3F00-$3FFF address */
+static inline uint8_t*
+ppu_palette(ppu_t *ppu, uint16_t addr)
+{
+  addr &= 0x1f;
+  if ((addr & 0x13) == 0x10)
+    addr &= 0x0f;
+  return &ppu->palette[addr];
+}
+
+/* Nametable arrangement, which of the four nametables are backed by
+ * the same memory. Four screen boards bring the memory of the other
+ * two, it is only allocated for them. */
+void
+ppu_set_mirroring(ppu_t *ppu, int mirroring)
+{
+  /* 1Kb pages of VRAM, then of the cartridge, in the order of the
+   * PPU_MIRROR_ constants */
+  static const uint8_t layouts[][4] = {
+    { 0, 0, 1, 1 }, // horizontal
+    { 0, 1, 0, 1 }, // vertical
+    { 0, 1, 2, 3 }, // four screen
+    { 0, 0, 0, 0 }, // single screen, lower
+    { 1, 1, 1, 1 }, // single screen, upper
+  };
+
+  if (mirroring == PPU_MIRROR_FOUR && ppu->four_screen == NULL)
+    ppu->four_screen = (uint8_t*)calloc(sizeof(uint8_t), 0x800);
+  for (int i = 0; i < 4; i++) {
+    int page = layouts[mirroring][i];
+    ppu->nametables[i] = page < 2 ? &ppu->vram[page << 10] :
+      &ppu->four_screen[(page - 2) << 10];
+  }
+  ppu->mirroring = mirroring;
+}
+
+/* The mapper sees PPU address line 12, MMC3 counts scanlines by its
+ * rising edges */
+static inline void
+ppu_set_a12(ppu_t *ppu, bool level)
+{
+  if (level && !ppu->a12)
+    mapper_a12_rise(ppu->emu->mapper);
+  ppu->a12 = level;
+}
+
+/* Outside of rendering the address bus follows the VRAM address */
+static inline void
+ppu_vram_a12(ppu_t *ppu)
+{
+  if (!(ppu->regs[1] & 0x18))
+    ppu_set_a12(ppu, ppu->pc & 0x1000);
 }
 
 // CPU $2006, PPUADDR, write x 2
@@ -86,8 +173,57 @@ static inline void
 ppu_prepare_write_data(ppu_t *ppu, uint8_t value)
 {
   //printf("ppuaddr: %04X = %02X\n", ppu->pc, value);
-  ppu->pc <<= 8;
-  ppu->pc |= value;
+  if (ppu->w == 0) {
+    ppu->t = (ppu->t & 0x00ff) | ((value & 0x3f) << 8);
+  } else {
+    ppu->t = (ppu->t & 0xff00) | value;
+    ppu->pc = ppu->t;
+  }
+  ppu->w ^= 1;
+}
+
+// CPU $2005, PPUSCROLL, write x 2
+static inline void
+ppu_write_scroll(ppu_t *ppu, uint8_t value)
+{
+  if (ppu->w == 0) {
+    ppu->t = (ppu->t & ~0x001f) | (value >> 3);
+    ppu->fine_x = value & 7;
+  } else {
+    ppu->t = (ppu->t & ~0x73e0) | ((value & 0x07) << 12) | ((value & 0xf8) << 2);
+  }
+  ppu->w ^= 1;
+}
+
+static inline void
+ppu_increment_pc(ppu_t *ppu)
+{
+  if (ppu->regs[0] >> 2 & 1)
+    ppu->pc += 32;
+  else
+    ppu->pc += 1;
+}
+
+// CPU $2007, PPUDATA, read
+static inline uint8_t
+ppu_read_data(ppu_t *ppu)
+{
+  uint16_t addr = ppu->pc & 0x3fff;
+  uint8_t res;
+
+  /* Reads are delayed by one through a buffer, except for the palette */
+  if (addr >= 0x3f00) {
+    res = *ppu_palette(ppu, addr);
+    ppu->read_buffer = *ppu_nametable(ppu, addr);
+  } else if (addr < 0x2000) {
+    res = ppu->read_buffer;
+    ppu->read_buffer = ppu->chr_map[addr >> 10][addr & 0x3ff];
+  } else {
+    res = ppu->read_buffer;
+    ppu->read_buffer = *ppu_nametable(ppu, addr);
+  }
+  ppu_increment_pc(ppu);
+  return res;
 }
 
 // CPU $2007, PPUDATA, write
@@ -98,12 +234,20 @@ ppu_write_data(ppu_t *ppu,
   //printf("ppudata[%04X] = $%02X\n", ppu->pc & 0x3fff, value);
 
   /* Valid addresses are $0000-$3FFF; higher addresses will be mirrored down. */
-  ppu->mem[ppu->pc & 0x3fff] = value;
-
-  if (ppu->regs[0] >> 2 & 1)
-    ppu->pc += 32;
-  else
-    ppu->pc += 1;
+  uint16_t addr = ppu->pc & 0x3fff;
+  if (addr < 0x2000) {
+    /* CHR-RAM, the decoded tile is stale now. CHR-ROM ignores writes. */
+    uint8_t *page = ppu->chr_write[addr >> 10];
+    if (page != NULL) {
+      page[addr & 0x3ff] = value;
+      ppu_invalidate_tiles(ppu, addr, 1);
+    }
+  } else if (addr < 0x3f00) {
+    *ppu_nametable(ppu, addr) = value;
+  } else {
+    *ppu_palette(ppu, addr) = value;
+  }
+  ppu_increment_pc(ppu);
 }
 
 /* addresses are in CPU address space (0x2000..0x3fff) */
@@ -112,70 +256,38 @@ ppu_write(ppu_t   *ppu,
 	  uint16_t addr,
 	  uint8_t  value)
 {
-  uint8_t regno = addr & ~0x2ff0; // There are only 8 registers, so mask out
-  ppu->regs[regno] = value;
+  uint8_t regno = addr & 7; // There are only 8 registers, so mask out
+  uint8_t old = ppu->regs[regno];
+  if (regno != 0x2)
+    ppu->regs[regno] = value;
   switch(regno) {
-  case 0x0: { // CPU $2000, PPUCTRL, write
-#if 0
-    uint16_t base;
-    //printf("PPU Control register #1: $%02X\n", value);
-    switch(value & ~0xfd) {
-    case 0:
-      base = 0x2000;
-      break;
-    case 1:
-      base = 0x2400;
-      break;
-    case 2:
-      base = 0x2800;
-      break;
-    case 3:
-      base = 0x2C00;
-      break;
-    }
-#endif
-#if 0
-    printf("  - base nametable: $%04X\n", base);
-    printf("  - increment: %d\n",
-	   value >> 2 & 1 ? 32 : 1);
-    printf("  - bg pattern table: $%04X\n",
-	   value >> 4 & 1 ? 0x1000 : 0);
-    printf("  - NMI at start of vblank: %s\n",
-	   value >> 7 & 1 ? "yes" : "no");
-#endif
+  case 0x0: // CPU $2000, PPUCTRL, write
+    /* Enabling NMI during vblank triggers it immediately */
+    if ((value & 0x80) && !(old & 0x80) && (ppu->regs[2] & 0x80))
+      cpu_nmi(ppu->emu->cpu);
+    /* Base nametable */
+    ppu->t = (ppu->t & ~0x0c00) | ((value & 0x3) << 10);
     break;
-  }
   case 0x1: // CPU $2001, PPUMASK, write
-#if 1
-    printf("PPU Control register #2: $%02X\n", value);
-    printf("  - Display: %s\n",
-	   value & 1 ? "mono" : "color");
-    printf("  - Background clipping: %s\n",
-	   value >> 1 & 1 ? "no clipping" : "not in leftmost 8");
-    printf("  - Sprite clipping: %s\n",
-	   value >> 2 & 1 ? "no clipping" : "not in leftmost 8");
-    printf("  - Background visibility: %s\n",
-	   value >> 3 & 1 ? "Display" : "hidden");
-    printf("  - Sprite visibility: %s\n",
-	   value >> 4 & 1 ? "Display" : "hidden");
-    printf("  - Background color: %d (0=black, 1=red, 2=blue, 4=green)\n",
-	   value >> 5);
-#endif
+    break;
+  case 0x2: // PPUSTATUS, read only
     break;
   case 0x3: // OAMADDR
-    printf("FIXME: Implement OAMADDR($%02X)\n", value);
+    ppu->oam_addr = value;
     break;
   case 0x4: // OAMDATA
-    printf("FIXME: Implement OAMDATA($%02X)\n", value);
+    ppu->oam[ppu->oam_addr++] = value;
     break;
   case 0x5: // PPUSCROLL
-    printf("FIXME: Implement PPUSCROLL($%02X)\n", value);
+    ppu_write_scroll(ppu, value);
     break;
   case 0x6:
     ppu_prepare_write_data(ppu, value);
+    ppu_vram_a12(ppu);
     break;
   case 0x7:
     ppu_write_data(ppu, value);
+    ppu_vram_a12(ppu);
     break;
   default:
     assert(0);
@@ -183,109 +295,505 @@ ppu_write(ppu_t   *ppu,
   }
 }
 
+/* CPU $4014, copies a page of CPU memory to OAM starting at OAMADDR */
+void
+ppu_oam_dma(ppu_t         *ppu,
+	    const uint8_t *src)
+{
+  uint8_t start = ppu->oam_addr;
+
+  memcpy(&ppu->oam[start], src, 256 - start);
+  memcpy(ppu->oam, src + (256 - start), start);
+}
+
 /* Read CPU $2000-$2007 memory registers and copies */
 uint8_t
 ppu_read(ppu_t   *ppu,
 	 uint16_t addr)
 {
   uint8_t res;
-  uint8_t regno = addr & ~0x2ff0;
-  res = ppu->regs[regno];
-#if 0
-  printf("ppu[%x]: ticks=%d scaline=%d -> $%02X\n", 0x2000 + regno, ppu->ticks,
-  	 ppu->scanline, res);
-#endif
+  uint8_t regno = addr & 7;
+  switch (regno) {
+  case 0x2: // PPUSTATUS, reading clears vblank and the write latch
+    res = ppu->regs[2];
+    ppu->regs[2] &= ~0x80;
+    ppu->w = 0;
+    break;
+  case 0x4: // OAMDATA, the unimplemented attribute bits read back as 0
+    res = ppu->oam[ppu->oam_addr];
+    if ((ppu->oam_addr & 3) == 2)
+      res &= 0xe3;
+    break;
+  case 0x7:
+    res = ppu_read_data(ppu);
+    ppu_vram_a12(ppu);
+    break;
+  default:
+    res = ppu->regs[regno];
+    break;
+  }
   return res;
 }
 
+static bool
+ppu_rendering_enabled(ppu_t *ppu)
+{
+  return (ppu->regs[1] & 0x18) != 0;
+}
+
+/* Number of dots in the current scanline, the pre-render line is one
+ * dot shorter on odd frames when rendering is enabled */
+static int
+ppu_scanline_length(ppu_t *ppu)
+{
+  if (ppu->scanline == -1 && (ppu->framecount & 1) &&
+      ppu_rendering_enabled(ppu))
+    return TICKS_PER_SCANLINE - 1;
+  return TICKS_PER_SCANLINE;
+}
+
 void
 ppu_scanline(ppu_t *ppu)
 {
   //printf("PPU: scanline: %d\n", ppu->scanline);
+  /* Dot 321 on, the first tiles of the next line are fetched */
+  if (ppu->scanline < HEIGHT && ppu_rendering_enabled(ppu))
+    ppu_set_a12(ppu, ppu->regs[0] & 0x10);
   ppu->scanline++;
   if (ppu->scanline == 240) {
-    SDL_RenderPresent(renderer);
-  } else if (ppu->scanline == SCANLINE_START_NMI) {
-    ppu->regs[2] |= 0x80;
+    if (!ppu->hidden) {
+      /* A frame moves the subcarrier on by a third of a cycle, and the
+       * short odd frames by two thirds, while rendering is enabled */
+      ppu->emu->video->frame->phase = (ppu->framecount & 1) * 4;
+      if (ppu->emu->capture)
+        capture_frame(ppu->emu->capture, ppu->emu->video->frame);
+      video_present(ppu->emu->video);
+    }
+    ppu->framecount++;
   } else if (ppu->scanline == SCANLINE_END_FRAME - 1) {
     ppu->scanline = -1;
   }
 }
 
-void
-ppu_cycle(ppu_t *ppu)
+/* Dot 1 of a scanline, vblank starts and ends here */
+static void
+ppu_dot1(ppu_t *ppu)
 {
-  ppu->ticks++;
-  if (ppu->ticks == TICKS_PER_SCANLINE) {
-    ppu->ticks = 0;
-    ppu_scanline(ppu);
-  } else if (ppu->scanline == -1 && ppu->ticks == 1) {
+  if (ppu->scanline == SCANLINE_START_NMI) {
+    ppu->regs[2] |= 0x80;
+    if (ppu->regs[0] & 0x80)
+      cpu_nmi(ppu->emu->cpu);
+  } else if (ppu->scanline == -1) {
     ppu->regs[2] = 0;
-    SDL_RenderClear(renderer);
+  }
+}
+
+/* Moves the VRAM address to the next tile, wrapping around into the
+ * horizontally adjacent nametable */
+static inline uint16_t
+ppu_increment_x(uint16_t v)
+{
+  if ((v & 0x001f) == 31)
+    return (v & ~0x001f) ^ 0x0400;
+  return v + 1;
+}
 
-#if 1
-    printf("PPU frame: #%d\n", ppu->framecount);
+/* Moves the VRAM address to the next pixel row, wrapping around into
+ * the vertically adjacent nametable after row 29 */
+static inline uint16_t
+ppu_increment_y(uint16_t v)
+{
+  if ((v & 0x7000) != 0x7000)
+    return v + 0x1000;
 
-    printf("=====================================================\n");
-  int addr = 0x2000;
-  for (int y = 0; y < 16; y++) {
-    printf("%02X: ", addr);
-    for (int i = 0; i < 16; i++) {
-      printf("%02X ", ppu->mem[addr + i]);
-    }
-    printf("\n");
-    addr += 16;
+  v &= ~0x7000;
+  uint16_t y = (v & 0x03e0) >> 5;
+  if (y == 29) {
+    y = 0;
+    v ^= 0x0800;
+  } else if (y == 31) {
+    y = 0;
+  } else {
+    y++;
   }
-#endif
-    ppu->framecount++;
+  return (v & ~0x03e0) | (y << 5);
+}
+
+/* Fetches the 33 tiles covering a scanline, the extra one is needed
+ * when fine x scrolling is used, and copies their pre-decoded rows */
+static void
+ppu_render_background(ppu_t *ppu, uint8_t *out)
+{
+  uint8_t pixels[33 * 8];
+  uint16_t v = ppu->pc;
+  const uint8_t *tiles = ppu->tiles + ((v >> 12) & 7) * 8;
+
+  if (ppu->regs[0] & 0x10)
+    tiles += 256 * RENDER_TILE_SIZE;
+
+  for (int i = 0; i < 33; i++) {
+    uint8_t tile = *ppu_nametable(ppu, v);
+    uint8_t at = *ppu_nametable(ppu, 0x23c0 | (v & 0x0c00) |
+                                ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+    uint64_t row;
+
+    memcpy(&row, tiles + tile * RENDER_TILE_SIZE, sizeof(row));
+    row = render_row_palette(row, (at >> (((v >> 4) & 4) | (v & 2))) & 3);
+    memcpy(pixels + i * 8, &row, sizeof(row));
+    v = ppu_increment_x(v);
   }
 
-#if 0
-  int pindex = 0;
-  for (int x = 0; x < 8; x++) {
-    for (int y = 0; y < 8; y++) {
-      SDL_SetRenderDrawColor(renderer,
-                             palette[pindex] >> 16,
-                             palette[pindex] >> 8,
-                             palette[pindex] & 0xff,
-                             255);
-      SDL_RenderDrawPoint(renderer, x, y);
+  memcpy(out, pixels + ppu->fine_x, WIDTH);
+}
+
+/* Finds the sprites on the current line and draws the first eight of
+ * them over the background. Sprites are drawn one line below their Y
+ * coordinate, so nothing is shown on line 0. */
+static void
+ppu_render_sprites(ppu_t *ppu, uint8_t *line)
+{
+  /* Sprite palette index, priority and sprite 0 per pixel, with
+   * room for sprites starting at the right edge */
+  uint8_t sprites[WIDTH + 8];
+  uint8_t behind[WIDTH + 8];
+  uint8_t zero[WIDTH + 8];
+  uint8_t height = (ppu->regs[0] & 0x20) ? 16 : 8;
+  int first = WIDTH, last = 0;
+
+  if (ppu->scanline == 0)
+    return;
+
+  uint8_t y = ppu->scanline - 1;
+  uint64_t mask = render_sprites_in_range(ppu->oam, y, height);
+  if (!mask)
+    return;
+
+  /* Sprite overflow, without the diagonal OAM scan bug of the hardware */
+  if (__builtin_popcountll(mask) > 8)
+    ppu->regs[2] |= 0x20;
+
+  memset(sprites, 0, sizeof(sprites));
+  for (int n = 0; n < 8 && mask; n++, mask &= mask - 1) {
+    int i = __builtin_ctzll(mask);
+    const uint8_t *sprite = &ppu->oam[i * 4];
+    uint8_t attr = sprite[2];
+    int x = sprite[3];
+    int row = y - sprite[0];
+    int tile;
+
+    if (attr & 0x80)
+      row = height - 1 - row;
+    if (height == 16) {
+      tile = ((sprite[1] & 1) << 8) | (sprite[1] & 0xfe);
+      if (row >= 8) {
+        tile++;
+        row -= 8;
+      }
+    } else {
+      tile = ((ppu->regs[0] & 0x08) << 5) | sprite[1];
     }
+
+    uint64_t pixels;
+    memcpy(&pixels, ppu->tiles + tile * RENDER_TILE_SIZE + row * 8,
+           sizeof(pixels));
+    if (attr & 0x40)
+      pixels = __builtin_bswap64(pixels);
+    pixels = render_row_palette(pixels, (attr & 3) + 4);
+
+    /* Lower sprite indexes win, a pixel is only taken when free */
+    for (int j = 0; j < 8; j++, pixels >>= 8) {
+      uint8_t p = pixels & 0xff;
+      if ((p & 3) && !sprites[x + j]) {
+        sprites[x + j] = p;
+        behind[x + j] = attr & 0x20;
+        zero[x + j] = (i == 0);
+      }
+    }
+    if (x < first)
+      first = x;
+    if (x + 8 > last)
+      last = x + 8;
+  }
+
+  /* Sprite clipping in the leftmost 8 pixels */
+  if (!(ppu->regs[1] & 0x04) && first < 8) {
+    memset(sprites, 0, 8);
+    first = 8;
+  }
+  if (last > WIDTH)
+    last = WIDTH;
+
+  for (int x = first; x < last; x++) {
+    if (!sprites[x])
+      continue;
+    bool opaque = (line[x] & 3) != 0;
+    /* Sprite 0 hit, never on the last pixel */
+    if (zero[x] && opaque && x != 255)
+      ppu->regs[2] |= 0x40;
+    if (!opaque || !behind[x])
+      line[x] = sprites[x];
   }
-#endif
 }
 
-bool
-ppu_nmi_is_enabled(ppu_t *ppu)
+/* Whether sprite 0 can still hit on the current line, the only use of
+ * the background in hidden frames */
+static bool
+ppu_sprite0_pending(ppu_t *ppu)
 {
-  return ppu->regs[0] >> 7 & 1;
+  uint8_t height = (ppu->regs[0] & 0x20) ? 16 : 8;
+  uint8_t y = ppu->scanline - 1;
+
+  if (ppu->scanline == 0 || (ppu->regs[2] & 0x40) ||
+      !(ppu->regs[1] & 0x10))
+    return false;
+  return y >= ppu->oam[0] && y - ppu->oam[0] < height;
 }
 
-void
-ppu_nmi_disable(ppu_t *ppu)
+static void
+ppu_render_scanline(ppu_t *ppu)
 {
-  ppu->regs[0] &= ~(1 << 7);
+  video_frame_t *frame = ppu->emu->video->frame;
+  uint8_t *pixels = frame->colors + ppu->scanline * WIDTH;
+  uint8_t colors[32];
+  uint8_t line[WIDTH];
+
+  if (unlikely(ppu->tiles_any_dirty))
+    ppu_update_tiles(ppu);
+
+  /* With rendering off the whole line is the backdrop color */
+  if (!(ppu->regs[1] & 0x18)) {
+    if (likely(!ppu->hidden)) {
+      frame->masks[ppu->scanline] = ppu->regs[1];
+      memset(pixels, ppu->palette[0] & 0x3f, WIDTH);
+    }
+    return;
+  }
+
+  if ((ppu->regs[1] & 0x08) &&
+      (likely(!ppu->hidden) || ppu_sprite0_pending(ppu))) {
+    ppu_render_background(ppu, line);
+    /* Background clipping in the leftmost 8 pixels */
+    if (!(ppu->regs[1] & 0x02))
+      memset(line, 0, 8);
+  } else {
+    memset(line, 0, sizeof(line));
+  }
+
+  if (ppu->regs[1] & 0x10)
+    ppu_render_sprites(ppu, line);
+  if (unlikely(ppu->hidden))
+    return;
+
+  /* Transparent pixels of all palettes show the backdrop color. The
+   * colors are turned into pixels once the frame is shown, with the
+   * greyscale and emphasis of each line. */
+  for (int i = 0; i < 32; i++)
+    colors[i] = ppu->palette[(i & 3) ? i : 0] & 0x3f;
+  frame->masks[ppu->scanline] = ppu->regs[1];
+  for (int x = 0; x < WIDTH; x++) {
+    pixels[x] = colors[line[x]];
+  }
 }
 
+/* Dot 257 of a scanline, the visible part has been fetched and the
+ * VRAM address moves on to the next line */
+static void
+ppu_dot257(ppu_t *ppu)
+{
+  if (ppu->scanline >= 0 && ppu->scanline < HEIGHT)
+    ppu_render_scanline(ppu);
+
+  if (ppu->scanline < HEIGHT && ppu_rendering_enabled(ppu)) {
+    ppu->pc = ppu_increment_y(ppu->pc);
+    ppu->pc = (ppu->pc & ~0x041f) | (ppu->t & 0x041f);
+    /* The pre-render line reloads the vertical position too */
+    if (ppu->scanline == -1)
+      ppu->pc = (ppu->pc & ~0x7be0) | (ppu->t & 0x7be0);
+    /* Sprite patterns are fetched from dot 257, 8x16 sprites fetch
+     * from $1000 for unused slots */
+    ppu_set_a12(ppu, ppu->regs[0] & 0x28);
+  }
+}
+
+/* Advances the PPU by a number of dots. Things only happen at dot 1,
+ * dot 257 and the end of a scanline, so whole spans are skipped at
+ * once. */
 void
 ppu_run(ppu_t *ppu,
 	int cycles)
 {
-  SDL_Event e;
-  bool quit = false;
+  ppu->clock += (uint64_t)cycles * MASTER_PPU_DIVIDER;
 
-  while (SDL_PollEvent(&e)) {
-    //If user closes the window
-    if (e.type == SDL_QUIT) {
-      quit = true;
+  while (cycles > 0) {
+    int stop;
+    if (ppu->ticks < 1)
+      stop = 1;
+    else if (ppu->ticks < 257)
+      stop = 257;
+    else
+      stop = ppu_scanline_length(ppu);
+    int n = stop - ppu->ticks;
+    if (n > cycles)
+      n = cycles;
+    ppu->ticks += n;
+    cycles -= n;
+
+    if (ppu->ticks == 1) {
+      ppu_dot1(ppu);
+    } else if (ppu->ticks == 257) {
+      ppu_dot257(ppu);
+    } else if (ppu->ticks == stop) {
+      ppu->ticks = 0;
+      ppu_scanline(ppu);
     }
   }
+}
+
+/* Runs the PPU up to a point in time of the master clock */
+void
+ppu_catch_up(ppu_t   *ppu,
+	     uint64_t clock)
+{
+  if (clock > ppu->clock) {
+    ppu_run(ppu, (clock - ppu->clock) / MASTER_PPU_DIVIDER);
+  }
+}
+
+/* Dots from a position in the frame until a point of the frame,
+ * wrapping around through the pre-render line */
+static int
+ppu_dots_from(int now, int scanline, int dot)
+{
+  int then = (scanline + 1) * TICKS_PER_SCANLINE + dot;
+
+  if (then <= now)
+    then += SCANLINE_END_FRAME * TICKS_PER_SCANLINE;
+  return then - now;
+}
+
+static int
+ppu_dots_until(ppu_t *ppu, int scanline, int dot)
+{
+  return ppu_dots_from((ppu->scanline + 1) * TICKS_PER_SCANLINE + ppu->ticks,
+                       scanline, dot);
+}
+
+/* Scanline and dot the PPU will be at by a master clock time, without
+ * running it. The short pre-render line of odd frames is ignored. */
+void
+ppu_position(ppu_t   *ppu,
+             uint64_t clock,
+             int     *scanline,
+             int     *dot)
+{
+  uint64_t pos = (ppu->scanline + 1) * TICKS_PER_SCANLINE + ppu->ticks;
+
+  if (clock > ppu->clock)
+    pos += (clock - ppu->clock) / MASTER_PPU_DIVIDER;
+  pos %= SCANLINE_END_FRAME * TICKS_PER_SCANLINE;
+  *scanline = pos / TICKS_PER_SCANLINE - 1;
+  *dot = pos % TICKS_PER_SCANLINE;
+}
+
+/* Master clock time before which PPUSTATUS reads as it does at clock,
+ * as long as nothing writes to the PPU. Vblank starts and ends at dot
+ * 1, sprite 0 hit and overflow are found at dot 257 of visible lines.
+ * clock may be somewhat before the PPU clock. One dot is kept as margin
+ * for the short pre-render line of odd frames. */
+uint64_t
+ppu_status_until(ppu_t   *ppu,
+                 uint64_t clock)
+{
+  const int64_t frame = SCANLINE_END_FRAME * TICKS_PER_SCANLINE;
+  int64_t dots, pos;
+  int scanline, dot, next, until;
+
+  /* Dots from the PPU clock to the last dot boundary before clock */
+  if (clock >= ppu->clock)
+    dots = (clock - ppu->clock) / MASTER_PPU_DIVIDER;
+  else
+    dots = -(int64_t)((ppu->clock - clock + MASTER_PPU_DIVIDER - 1) /
+                      MASTER_PPU_DIVIDER);
+  pos = ((ppu->scanline + 1) * TICKS_PER_SCANLINE + ppu->ticks + dots) % frame;
+  if (pos < 0)
+    pos += frame;
+  scanline = pos / TICKS_PER_SCANLINE - 1;
+  dot = pos % TICKS_PER_SCANLINE;
+
+  until = ppu_dots_from(pos, SCANLINE_START_NMI, 1);
+  if (ppu_dots_from(pos, -1, 1) < until)
+    until = ppu_dots_from(pos, -1, 1);
+  if ((ppu->regs[1] & 0x10) && (ppu->regs[2] & 0x60) != 0x60) {
+    next = scanline >= 0 && dot < 257 ? scanline : scanline + 1;
+    if (next >= HEIGHT)
+      next = 0;
+    if (ppu_dots_from(pos, next, 257) < until)
+      until = ppu_dots_from(pos, next, 257);
+  }
+  return ppu->clock + (dots + until - 1) * MASTER_PPU_DIVIDER;
+}
+
+/* Master clock time of the next vblank, when NMI may be raised. When
+ * the mapper counts scanlines the next A12 edge is an event too, so
+ * its IRQ is raised on time. */
+uint64_t
+ppu_next_event(ppu_t *ppu)
+{
+  int dots = ppu_dots_until(ppu, SCANLINE_START_NMI, 1);
 
-  if (quit) {
-    exit(0);
+  if (mapper_wants_a12(ppu->emu->mapper) && ppu_rendering_enabled(ppu)) {
+    int edge;
+    if (ppu->scanline >= HEIGHT)
+      edge = ppu_dots_until(ppu, -1, 257);
+    else if (ppu->ticks < 257)
+      edge = ppu_dots_until(ppu, ppu->scanline, 257);
+    else
+      edge = ppu_dots_until(ppu, ppu->scanline + 1, 0);
+    if (edge < dots)
+      dots = edge;
   }
+  return ppu->clock + (uint64_t)dots * MASTER_PPU_DIVIDER;
+}
 
-  for (int i = 0; i < cycles; i++) {
-    ppu_cycle(ppu);
+/* Saves or loads the registers, VRAM and OAM. The decoded tiles are
+ * rebuilt from the pattern tables on load. */
+void
+ppu_state(ppu_t   *ppu,
+	  state_t *s)
+{
+  STATE_FIELD(s, ppu->clock);
+  STATE_FIELD(s, ppu->ticks);
+  STATE_FIELD(s, ppu->scanline);
+  STATE_FIELD(s, ppu->regs);
+  if (s->loading) {
+    ines_t *cart = ppu->emu->cart;
+    bool four = cart != NULL && cart->mirroring == INES_MIRROR_FOUR;
+    uint8_t mirroring = ppu->mirroring;
+
+    /* The four-screen VRAM is only saved for carts that have it */
+    STATE_FIELD(s, mirroring);
+    if (mirroring > PPU_MIRROR_SINGLE_UPPER ||
+        (mirroring == PPU_MIRROR_FOUR) != four) {
+      s->invalid = true;
+      return;
+    }
+    ppu_set_mirroring(ppu, mirroring);
+  } else {
+    STATE_FIELD(s, ppu->mirroring);
   }
+  STATE_FIELD(s, ppu->vram);
+  if (ppu->mirroring == PPU_MIRROR_FOUR)
+    state_bytes(s, ppu->four_screen, 0x800);
+  STATE_FIELD(s, ppu->palette);
+  STATE_FIELD(s, ppu->pc);
+  STATE_FIELD(s, ppu->t);
+  STATE_FIELD(s, ppu->fine_x);
+  STATE_FIELD(s, ppu->w);
+  STATE_FIELD(s, ppu->read_buffer);
+  STATE_FIELD(s, ppu->oam);
+  STATE_FIELD(s, ppu->oam_addr);
+  STATE_FIELD(s, ppu->framecount);
+  STATE_FIELD(s, ppu->a12);
+  if (s->loading)
+    ppu_invalidate_tiles(ppu, 0x0000, 0x2000);
 }
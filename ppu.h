@@ -6,20 +6,45 @@
 
 #include "types.h"
 
+/* Nametable mirroring, the first three match the iNES header */
+#define PPU_MIRROR_HORIZONTAL   0
+#define PPU_MIRROR_VERTICAL     1
+#define PPU_MIRROR_FOUR         2
+#define PPU_MIRROR_SINGLE_LOWER 3
+#define PPU_MIRROR_SINGLE_UPPER 4
+
 ppu_t* ppu_create(emu_t *emu);
-void ppu_map(ppu_t   *ppu,
-	     uint16_t dest,
-	     const uint8_t *src,
-	     uint16_t  size);
+void ppu_destroy(ppu_t *ppu);
+void ppu_map_chr(ppu_t         *ppu,
+		 uint16_t       dest,
+		 const uint8_t *src,
+		 uint32_t       size);
+void ppu_map_chr_ram(ppu_t   *ppu,
+		     uint16_t dest,
+		     uint8_t *src,
+		     uint32_t size);
+void ppu_set_mirroring(ppu_t *ppu,
+		       int    mirroring);
 void ppu_write(ppu_t   *ppu,
 	       uint16_t addr,
 	       uint8_t  value);
+void ppu_oam_dma(ppu_t         *ppu,
+		 const uint8_t *src);
 uint8_t ppu_read(ppu_t   *ppu,
 		 uint16_t addr);
-bool ppu_nmi_is_enabled(ppu_t *ppu);
-void ppu_nmi_disable(ppu_t *ppu);
 void ppu_run(ppu_t *ppu,
 	     int cycles);
+void ppu_catch_up(ppu_t   *ppu,
+		  uint64_t clock);
+uint64_t ppu_next_event(ppu_t *ppu);
+uint64_t ppu_status_until(ppu_t   *ppu,
+			  uint64_t clock);
+void ppu_position(ppu_t   *ppu,
+		  uint64_t clock,
+		  int     *scanline,
+		  int     *dot);
+void ppu_state(ppu_t   *ppu,
+	       state_t *s);
 
 
 #endif /* __PPU_H__ */
@@ -0,0 +1,514 @@
+/* Guest profiler */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "emu.h"
+#include "ines.h"
+#include "opcodes.h"
+#include "ppu.h"
+#include "prof.h"
+
+/* Keys of PCs and functions: CPU addresses outside of PRG-ROM, offsets
+ * into it above PROF_ROM, and the entry points without an address */
+#define PROF_ROM   0x10000
+#define PROF_RESET 0xfffffffd
+#define PROF_NMI   0xfffffffe
+#define PROF_IRQ   0xffffffff
+
+/* Sizes of the hash tables, powers of two */
+#define PROF_FUNCTIONS 4096
+#define PROF_NODES     65536
+
+/* Deepest call stack followed, deeper calls are counted to the caller */
+#define PROF_STACK_DEPTH 64
+
+enum {
+  PROF_PRE_RENDER,
+  PROF_VISIBLE,
+  PROF_POST_RENDER,
+  PROF_VBLANK,
+  PROF_REGIONS
+};
+
+static const char *prof_region_names[PROF_REGIONS] = {
+  "pre-render", "visible", "post-render", "vblank",
+};
+
+/* First line after each region, counted from the pre-render line */
+static const int prof_region_ends[PROF_REGIONS] = { 1, 241, 242, 262 };
+
+static const char *prof_mode_names[] = {
+  "imp", "acc", "imm", "zp", "zp,x", "zp,y", "abs", "abs,x", "abs,y",
+  "ind", "(zp,x)", "(zp),y", "rel",
+};
+
+typedef struct {
+  uint64_t cycles;
+  uint32_t count;
+  /* CPU address it was last run at, for PRG-ROM */
+  uint16_t addr;
+} prof_site_t;
+
+typedef struct {
+  bool used;
+  uint32_t key;
+  uint16_t addr;
+  uint64_t calls;
+  uint64_t inclusive;
+  uint64_t exclusive;
+} prof_function_t;
+
+/* A function as called along one path from the root, the tree of
+ * those gives the folded stacks */
+typedef struct {
+  bool used;
+  uint32_t parent;
+  uint32_t key;
+  uint16_t addr;
+  /* Exclusive cycles along this path */
+  uint64_t cycles;
+} prof_node_t;
+
+typedef struct {
+  uint32_t node;
+  prof_function_t *function;
+  /* Cycles at the call and spent in calls made from here */
+  uint64_t entry;
+  uint64_t children;
+  /* Stack pointer after the return address was pushed */
+  uint8_t sp;
+} prof_frame_t;
+
+struct prof_t {
+  emu_t *emu;
+  const uint8_t *prg;
+  uint32_t prg_size;
+
+  uint64_t opcode_count[256];
+  uint64_t opcode_cycles[256];
+  prof_site_t ram[0x10000];
+  prof_site_t *rom;
+
+  prof_function_t *functions;
+  prof_node_t *nodes;
+  prof_frame_t stack[PROF_STACK_DEPTH];
+  int depth;
+
+  int region;
+  /* CPU cycle at which the PPU leaves the region */
+  uint64_t region_end;
+  uint64_t frame_cycles[PROF_REGIONS];
+  uint64_t region_cycles[PROF_REGIONS];
+  uint64_t region_max[PROF_REGIONS];
+  uint64_t frames;
+
+  uint64_t instructions;
+  uint64_t cycles;
+};
+
+prof_t*
+prof_create(emu_t *emu)
+{
+  prof_t *prof = (prof_t*)calloc(sizeof(prof_t), 1);
+
+  prof->emu = emu;
+  if (emu->cart) {
+    prof->prg = emu->cart->prg;
+    prof->prg_size = emu->cart->prg_size;
+  }
+  prof->rom = (prof_site_t*)calloc(sizeof(prof_site_t), prof->prg_size + 1);
+  prof->functions = (prof_function_t*)calloc(sizeof(prof_function_t),
+                                             PROF_FUNCTIONS);
+  prof->nodes = (prof_node_t*)calloc(sizeof(prof_node_t), PROF_NODES);
+
+  /* Everything not called from somewhere runs from reset */
+  prof->nodes[0].used = true;
+  prof->nodes[0].key = PROF_RESET;
+  prof->stack[0].entry = emu->cpu->cycles;
+  prof->stack[0].sp = emu->cpu->sp;
+  prof->depth = 1;
+  return prof;
+}
+
+void
+prof_destroy(prof_t *prof)
+{
+  free(prof->rom);
+  free(prof->functions);
+  free(prof->nodes);
+  free(prof);
+}
+
+static uint32_t
+prof_key(prof_t *prof, cpu_t *cpu, uint16_t addr)
+{
+  const uint8_t *page = cpu->read_map[addr >> 8];
+
+  if (page != NULL && page >= prof->prg && page < prof->prg + prof->prg_size)
+    return PROF_ROM + (page - prof->prg) + (addr & 0xff);
+  return addr;
+}
+
+static uint32_t
+prof_hash(uint32_t a, uint32_t b)
+{
+  uint32_t h = a * 0x9e3779b1u ^ b * 0x85ebca77u;
+  return h ^ h >> 15;
+}
+
+/* NULL once the table is full */
+static prof_function_t*
+prof_function(prof_t *prof, uint32_t key, uint16_t addr)
+{
+  uint32_t i = prof_hash(key, 0);
+
+  for (int n = 0; n < PROF_FUNCTIONS; n++, i++) {
+    prof_function_t *f = &prof->functions[i & (PROF_FUNCTIONS - 1)];
+    if (!f->used) {
+      f->used = true;
+      f->key = key;
+      f->addr = addr;
+      return f;
+    }
+    if (f->key == key)
+      return f;
+  }
+  return NULL;
+}
+
+/* The parent itself once the table is full */
+static uint32_t
+prof_node(prof_t *prof, uint32_t parent, uint32_t key, uint16_t addr)
+{
+  uint32_t i = prof_hash(key, parent);
+
+  for (int n = 0; n < PROF_NODES; n++, i++) {
+    prof_node_t *node = &prof->nodes[i & (PROF_NODES - 1)];
+    if (!node->used) {
+      node->used = true;
+      node->parent = parent;
+      node->key = key;
+      node->addr = addr;
+      return i & (PROF_NODES - 1);
+    }
+    if (node->parent == parent && node->key == key)
+      return i & (PROF_NODES - 1);
+  }
+  return parent;
+}
+
+static void
+prof_call(prof_t *prof, cpu_t *cpu, uint32_t key, uint64_t entry)
+{
+  prof_frame_t *frame;
+
+  if (prof->depth == PROF_STACK_DEPTH)
+    return;
+  frame = &prof->stack[prof->depth++];
+  frame->node = prof_node(prof, frame[-1].node, key, cpu->pc);
+  frame->function = prof_function(prof, key, cpu->pc);
+  frame->entry = entry;
+  frame->children = 0;
+  frame->sp = cpu->sp;
+  if (frame->function)
+    frame->function->calls++;
+}
+
+/* Pops the frame the return at sp came back from, with any frames above
+ * it left by code that did not return the usual way */
+static void
+prof_return(prof_t *prof, cpu_t *cpu, uint8_t sp)
+{
+  int depth = prof->depth;
+
+  while (depth > 1 && prof->stack[depth - 1].sp != sp)
+    depth--;
+  if (depth == 1)
+    return;
+  while (prof->depth >= depth) {
+    prof_frame_t *frame = &prof->stack[--prof->depth];
+    uint64_t inclusive = cpu->cycles - frame->entry;
+    if (frame->function) {
+      frame->function->inclusive += inclusive;
+      frame->function->exclusive += inclusive - frame->children;
+    }
+    frame[-1].children += inclusive;
+  }
+}
+
+/* Counts cycles to the region of the PPU, a frame ends when the
+ * pre-render line starts */
+static void
+prof_region(prof_t *prof, cpu_t *cpu, uint64_t cycles)
+{
+  if (unlikely(cpu->cycles >= prof->region_end)) {
+    int scanline, dot, line, region = 0;
+    ppu_position(cpu->emu->ppu, emu_clock(cpu->emu), &scanline, &dot);
+    line = scanline + 1;
+    while (line >= prof_region_ends[region])
+      region++;
+    if (region == PROF_PRE_RENDER && prof->region != PROF_PRE_RENDER) {
+      for (int r = 0; r < PROF_REGIONS; r++) {
+        prof->region_cycles[r] += prof->frame_cycles[r];
+        if (prof->frame_cycles[r] > prof->region_max[r])
+          prof->region_max[r] = prof->frame_cycles[r];
+        prof->frame_cycles[r] = 0;
+      }
+      prof->frames++;
+    }
+    prof->region = region;
+    prof->region_end = cpu->cycles +
+      ((prof_region_ends[region] - line) * 341 - dot) * MASTER_PPU_DIVIDER /
+      MASTER_CPU_DIVIDER + 1;
+  }
+  prof->frame_cycles[prof->region] += cycles;
+}
+
+void
+prof_instruction(prof_t  *prof,
+                 cpu_t   *cpu,
+                 uint16_t pc,
+                 uint8_t  opcode,
+                 uint64_t start)
+{
+  uint64_t cycles = cpu->cycles - start;
+  uint32_t key = prof_key(prof, cpu, pc);
+  prof_site_t *site;
+
+  if (key >= PROF_ROM) {
+    site = &prof->rom[key - PROF_ROM];
+    site->addr = pc;
+  } else {
+    site = &prof->ram[key];
+  }
+  site->count++;
+  site->cycles += cycles;
+  prof->opcode_count[opcode]++;
+  prof->opcode_cycles[opcode] += cycles;
+  prof->instructions++;
+  prof->cycles += cycles;
+  prof->nodes[prof->stack[prof->depth - 1].node].cycles += cycles;
+  prof_region(prof, cpu, cycles);
+
+  switch (opcode) {
+  case 0x20: /* JSR */
+    prof_call(prof, cpu, prof_key(prof, cpu, cpu->pc), start);
+    break;
+  case 0x00: /* BRK */
+    prof_call(prof, cpu, PROF_IRQ, start);
+    break;
+  case 0x60: /* RTS */
+    prof_return(prof, cpu, cpu->sp - 2);
+    break;
+  case 0x40: /* RTI */
+    prof_return(prof, cpu, cpu->sp - 3);
+    break;
+  }
+}
+
+void
+prof_interrupt(prof_t *prof,
+               cpu_t  *cpu,
+               bool    nmi)
+{
+  prof->cycles += 7;
+  prof_region(prof, cpu, 7);
+  prof_call(prof, cpu, nmi ? PROF_NMI : PROF_IRQ, cpu->cycles - 7);
+  prof->nodes[prof->stack[prof->depth - 1].node].cycles += 7;
+}
+
+/* Names PCs and functions like $C123, with the 8Kb bank as in $C123@05
+ * when PRG-ROM is banked */
+static const char*
+prof_label(prof_t *prof, uint32_t key, uint16_t addr, char *buf, size_t size)
+{
+  switch (key) {
+  case PROF_RESET:
+    return "reset";
+  case PROF_NMI:
+    return "nmi";
+  case PROF_IRQ:
+    return "irq";
+  }
+  if (key >= PROF_ROM && prof->prg_size > 0x8000)
+    snprintf(buf, size, "$%04X@%02X", addr, (key - PROF_ROM) / 0x2000);
+  else
+    snprintf(buf, size, "$%04X", addr);
+  return buf;
+}
+
+typedef struct {
+  uint32_t key;
+  const prof_site_t *site;
+} prof_pc_t;
+
+static int
+prof_compare_pcs(const void *a, const void *b)
+{
+  uint64_t x = ((const prof_pc_t*)a)->site->cycles;
+  uint64_t y = ((const prof_pc_t*)b)->site->cycles;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int
+prof_compare_functions(const void *a, const void *b)
+{
+  uint64_t x = (*(prof_function_t* const*)a)->inclusive;
+  uint64_t y = (*(prof_function_t* const*)b)->inclusive;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void
+prof_write_pcs(prof_t *prof, FILE *f)
+{
+  prof_pc_t *pcs = (prof_pc_t*)calloc(sizeof(prof_pc_t),
+                                      0x10000 + prof->prg_size);
+  size_t count = 0;
+  char buf[16];
+
+  for (uint32_t i = 0; i < 0x10000; i++) {
+    if (prof->ram[i].count) {
+      pcs[count].key = i;
+      pcs[count++].site = &prof->ram[i];
+    }
+  }
+  for (uint32_t i = 0; i < prof->prg_size; i++) {
+    if (prof->rom[i].count) {
+      pcs[count].key = PROF_ROM + i;
+      pcs[count++].site = &prof->rom[i];
+    }
+  }
+  qsort(pcs, count, sizeof(prof_pc_t), prof_compare_pcs);
+
+  fprintf(f, "  \"pcs\": [\n");
+  for (size_t i = 0; i < count; i++) {
+    uint32_t key = pcs[i].key;
+    uint16_t addr = key >= PROF_ROM ? pcs[i].site->addr : key;
+    fprintf(f, "    {\"label\": \"%s\", \"address\": %u, ",
+            prof_label(prof, key, addr, buf, sizeof(buf)), addr);
+    if (key >= PROF_ROM)
+      fprintf(f, "\"prg\": %u, ", key - PROF_ROM);
+    else
+      fprintf(f, "\"prg\": null, ");
+    fprintf(f, "\"count\": %u, \"cycles\": %llu}%s\n",
+            pcs[i].site->count, (unsigned long long)pcs[i].site->cycles,
+            i + 1 < count ? "," : "");
+  }
+  fprintf(f, "  ],\n");
+  free(pcs);
+}
+
+static void
+prof_write_functions(prof_t *prof, FILE *f)
+{
+  prof_function_t **functions = (prof_function_t**)
+    calloc(sizeof(prof_function_t*), PROF_FUNCTIONS);
+  size_t count = 0;
+  char buf[16];
+
+  for (int i = 0; i < PROF_FUNCTIONS; i++) {
+    if (prof->functions[i].used)
+      functions[count++] = &prof->functions[i];
+  }
+  qsort(functions, count, sizeof(prof_function_t*), prof_compare_functions);
+
+  fprintf(f, "  \"functions\": [\n");
+  for (size_t i = 0; i < count; i++) {
+    prof_function_t *func = functions[i];
+    fprintf(f, "    {\"label\": \"%s\", \"calls\": %llu, "
+            "\"inclusive\": %llu, \"exclusive\": %llu}%s\n",
+            prof_label(prof, func->key, func->addr, buf, sizeof(buf)),
+            (unsigned long long)func->calls,
+            (unsigned long long)func->inclusive,
+            (unsigned long long)func->exclusive,
+            i + 1 < count ? "," : "");
+  }
+  fprintf(f, "  ],\n");
+  free(functions);
+}
+
+int
+prof_write_json(prof_t     *prof,
+                const char *filename)
+{
+  FILE *f = fopen(filename, "w");
+  bool first = true;
+
+  if (f == NULL) {
+    perror(filename);
+    return -1;
+  }
+  fprintf(f, "{\n");
+  fprintf(f, "  \"frames\": %llu,\n", (unsigned long long)prof->frames);
+  fprintf(f, "  \"instructions\": %llu,\n",
+          (unsigned long long)prof->instructions);
+  fprintf(f, "  \"cycles\": %llu,\n", (unsigned long long)prof->cycles);
+
+  fprintf(f, "  \"opcodes\": [\n");
+  for (int i = 0; i < 256; i++) {
+    if (prof->opcode_count[i] == 0)
+      continue;
+    fprintf(f, "%s    {\"opcode\": %d, \"name\": \"%s\", \"mode\": \"%s\", "
+            "\"count\": %llu, \"cycles\": %llu}",
+            first ? "" : ",\n", i, cpu_opcodes[i].name,
+            prof_mode_names[cpu_opcodes[i].mode],
+            (unsigned long long)prof->opcode_count[i],
+            (unsigned long long)prof->opcode_cycles[i]);
+    first = false;
+  }
+  fprintf(f, "\n  ],\n");
+
+  prof_write_pcs(prof, f);
+  prof_write_functions(prof, f);
+
+  /* Totals include the frame in progress, averages and maxima only
+   * the completed ones */
+  fprintf(f, "  \"regions\": [\n");
+  for (int r = 0; r < PROF_REGIONS; r++) {
+    fprintf(f, "    {\"name\": \"%s\", \"cycles\": %llu, "
+            "\"average\": %.1f, \"max\": %llu}%s\n",
+            prof_region_names[r],
+            (unsigned long long)(prof->region_cycles[r] +
+                                 prof->frame_cycles[r]),
+            prof->frames ? (double)prof->region_cycles[r] / prof->frames : 0.0,
+            (unsigned long long)prof->region_max[r],
+            r + 1 < PROF_REGIONS ? "," : "");
+  }
+  fprintf(f, "  ]\n");
+  fprintf(f, "}\n");
+  return fclose(f);
+}
+
+static void
+prof_write_path(prof_t *prof, FILE *f, uint32_t index)
+{
+  const prof_node_t *node = &prof->nodes[index];
+  char buf[16];
+
+  if (index != 0) {
+    prof_write_path(prof, f, node->parent);
+    fputc(';', f);
+  }
+  fputs(prof_label(prof, node->key, node->addr, buf, sizeof(buf)), f);
+}
+
+int
+prof_write_folded(prof_t     *prof,
+                  const char *filename)
+{
+  FILE *f = fopen(filename, "w");
+
+  if (f == NULL) {
+    perror(filename);
+    return -1;
+  }
+  for (uint32_t i = 0; i < PROF_NODES; i++) {
+    if (!prof->nodes[i].used || prof->nodes[i].cycles == 0)
+      continue;
+    prof_write_path(prof, f, i);
+    fprintf(f, " %llu\n", (unsigned long long)prof->nodes[i].cycles);
+  }
+  return fclose(f);
+}
@@ -0,0 +1,37 @@
+#ifndef __PROF_H__
+#define __PROF_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "types.h"
+
+/* Guest profiler. Counts the instructions and cycles of every opcode
+ * and of every PC, the latter per PRG-ROM offset so banked code is told
+ * apart. Calls are followed on a shadow stack from JSR, RTS, RTI and
+ * interrupts to give the inclusive and exclusive time of subroutines,
+ * and the time of every frame is split by the scanline region the PPU
+ * was in. Only counters are updated, so it can stay on for long runs.
+ *
+ * Idle loop skipping and the JIT are bypassed while profiling. */
+
+prof_t* prof_create(emu_t *emu);
+void prof_destroy(prof_t *prof);
+/* Called after an instruction that started at start cycles */
+void prof_instruction(prof_t  *prof,
+		      cpu_t   *cpu,
+		      uint16_t pc,
+		      uint8_t  opcode,
+		      uint64_t start);
+/* Called after an NMI or IRQ was taken */
+void prof_interrupt(prof_t *prof,
+		    cpu_t  *cpu,
+		    bool    nmi);
+/* Writes the counters as JSON */
+int prof_write_json(prof_t     *prof,
+		    const char *filename);
+/* Writes cycles per call path in the folded format of flamegraph.pl */
+int prof_write_folded(prof_t     *prof,
+		      const char *filename);
+
+#endif /* __PROF_H__ */
@@ -0,0 +1,187 @@
+/* Pixel level helpers of the PPU renderer
+ *
+ * A tile is stored in CHR as two bitplanes of 8 bytes each, one byte
+ * per row with the leftmost pixel in the most significant bit. Decoding
+ * interleaves them into one byte per pixel, which is vectorized with
+ * SSE2 when available.
+ */
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RENDER_X86 1
+#endif
+
+#include "render.h"
+
+/* Spreads the 8 bits of a bitplane into 8 bytes of 0 or 1, leftmost
+ * pixel (bit 7) in the lowest byte */
+static inline uint64_t
+render_spread(uint8_t plane)
+{
+  uint64_t r = (plane * 0x0101010101010101ULL) & 0x0102040810204080ULL;
+  return ((r + 0x7f7f7f7f7f7f7f7fULL) & 0x8080808080808080ULL) >> 7;
+}
+
+#ifdef __SSE2__
+/* Decodes one tile, both bitplanes are loaded at once and each byte is
+ * replicated 8 times so that two rows fit in a register */
+static inline void
+render_decode_tile(const uint8_t *chr, uint8_t *out)
+{
+  const __m128i bits = _mm_set_epi8(0x01, 0x02, 0x04, 0x08,
+                                    0x10, 0x20, 0x40, (char)0x80,
+                                    0x01, 0x02, 0x04, 0x08,
+                                    0x10, 0x20, 0x40, (char)0x80);
+  const __m128i one = _mm_set1_epi8(1);
+  const __m128i two = _mm_set1_epi8(2);
+  __m128i planes = _mm_loadu_si128((const __m128i*)chr);
+  __m128i a0 = _mm_unpacklo_epi8(planes, planes);
+  __m128i a1 = _mm_unpackhi_epi8(planes, planes);
+  /* Rows 0-3 and 4-7 of the low plane in b[0..1], high plane in b[2..3] */
+  __m128i b[4] = {
+    _mm_unpacklo_epi16(a0, a0), _mm_unpackhi_epi16(a0, a0),
+    _mm_unpacklo_epi16(a1, a1), _mm_unpackhi_epi16(a1, a1),
+  };
+  __m128i lo[4] = {
+    _mm_unpacklo_epi32(b[0], b[0]), _mm_unpackhi_epi32(b[0], b[0]),
+    _mm_unpacklo_epi32(b[1], b[1]), _mm_unpackhi_epi32(b[1], b[1]),
+  };
+  __m128i hi[4] = {
+    _mm_unpacklo_epi32(b[2], b[2]), _mm_unpackhi_epi32(b[2], b[2]),
+    _mm_unpacklo_epi32(b[3], b[3]), _mm_unpackhi_epi32(b[3], b[3]),
+  };
+
+  for (int i = 0; i < 4; i++) {
+    __m128i pl = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lo[i], bits), bits),
+                               one);
+    __m128i ph = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(hi[i], bits), bits),
+                               two);
+    _mm_storeu_si128((__m128i*)(out + i * 16), _mm_or_si128(pl, ph));
+  }
+}
+#else
+static inline void
+render_decode_tile(const uint8_t *chr, uint8_t *out)
+{
+  for (int row = 0; row < 8; row++) {
+    uint64_t px = render_spread(chr[row]) | render_spread(chr[row + 8]) << 1;
+    memcpy(out + row * 8, &px, sizeof(px));
+  }
+}
+#endif
+
+#ifdef __SSE2__
+/* Gathers the Y coordinates of 16 sprites, the first byte of each */
+static inline __m128i
+render_oam_y(const uint8_t *oam)
+{
+  const __m128i mask = _mm_set1_epi32(0xff);
+  __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i*)oam), mask);
+  __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i*)(oam + 16)), mask);
+  __m128i c = _mm_and_si128(_mm_loadu_si128((const __m128i*)(oam + 32)), mask);
+  __m128i d = _mm_and_si128(_mm_loadu_si128((const __m128i*)(oam + 48)), mask);
+  return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+}
+#endif
+
+/* Evaluates all 64 sprites against a line at once, bit n of the result
+ * is set when sprite n covers it: Y <= line < Y + height */
+uint64_t
+render_sprites_in_range(const uint8_t *oam,
+                        uint8_t        line,
+                        uint8_t        height)
+{
+  uint64_t mask = 0;
+
+#ifdef __SSE2__
+  const __m128i l = _mm_set1_epi8(line);
+  const __m128i h = _mm_set1_epi8(height - 1);
+  for (int i = 0; i < 4; i++) {
+    __m128i y = render_oam_y(oam + i * 64);
+    __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(y, l), l);
+    __m128i d = _mm_sub_epi8(l, y);
+    __m128i in = _mm_and_si128(above, _mm_cmpeq_epi8(_mm_min_epu8(d, h), d));
+    mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(in) << (i * 16);
+  }
+#else
+  for (int i = 0; i < 64; i++) {
+    if (line >= oam[i * 4] && line - oam[i * 4] < height)
+      mask |= 1ULL << i;
+  }
+#endif
+  return mask;
+}
+
+/* Decodes count tiles of CHR data, 16 bytes each, into RENDER_TILE_SIZE
+ * bytes each: one byte per pixel holding the 2 bit color, row by row */
+void
+render_decode_pattern(const uint8_t *chr,
+                      uint8_t       *out,
+                      int            count)
+{
+  for (int i = 0; i < count; i++) {
+    render_decode_tile(chr + i * 16, out + i * RENDER_TILE_SIZE);
+  }
+}
+
+static void
+render_convert_line(const uint8_t  *colors,
+                    const uint32_t *palette,
+                    uint8_t         grey,
+                    uint32_t       *out,
+                    int             width)
+{
+  for (int x = 0; x < width; x++)
+    out[x] = palette[colors[x] & grey];
+}
+
+#ifdef RENDER_X86
+/* Eight pixels per gather */
+__attribute__((target("avx2")))
+static void
+render_convert_line_avx2(const uint8_t  *colors,
+                         const uint32_t *palette,
+                         uint8_t         grey,
+                         uint32_t       *out,
+                         int             width)
+{
+  const __m256i mask = _mm256_set1_epi32(grey);
+  int x = 0;
+
+  for (; x + 8 <= width; x += 8) {
+    __m128i c = _mm_loadl_epi64((const __m128i*)(colors + x));
+    __m256i i = _mm256_and_si256(_mm256_cvtepu8_epi32(c), mask);
+    __m256i p = _mm256_i32gather_epi32((const int*)palette, i, 4);
+    _mm256_storeu_si256((__m256i*)(out + x), p);
+  }
+  render_convert_line(colors + x, palette, grey, out + x, width - x);
+}
+#endif
+
+void
+render_convert(const uint8_t  *colors,
+               const uint8_t  *masks,
+               const uint32_t  palettes[512],
+               uint32_t       *out,
+               int             pitch,
+               int             width,
+               int             height)
+{
+  void (*convert)(const uint8_t*, const uint32_t*, uint8_t, uint32_t*, int) =
+    render_convert_line;
+
+#ifdef RENDER_X86
+  if (__builtin_cpu_supports("avx2"))
+    convert = render_convert_line_avx2;
+#endif
+  for (int y = 0; y < height; y++) {
+    /* Greyscale keeps only the brightness column of the color */
+    uint8_t grey = (masks[y] & 0x01) ? 0x30 : 0x3f;
+    convert(colors + y * width, palettes + ((masks[y] >> 5) << 6), grey,
+            out + y * pitch, width);
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef __RENDER_H__
+#define __RENDER_H__
+
+#include <stdint.h>
+
+/* Size of a decoded tile, 8x8 pixels of one byte */
+#define RENDER_TILE_SIZE 64
+
+void render_decode_pattern(const uint8_t *chr,
+			   uint8_t       *out,
+			   int            count);
+uint64_t render_sprites_in_range(const uint8_t *oam,
+				 uint8_t        line,
+				 uint8_t        height);
+/* Converts width x height pixels of 6 bit NES colors to ARGB8888 with
+ * the PPUMASK bits of each line: greyscale (bit 0) and the emphasis
+ * (bits 5-7), which picks one of eight 64 entry palettes. pitch is the
+ * distance between lines of out, in pixels. */
+void render_convert(const uint8_t  *colors,
+		    const uint8_t  *masks,
+		    const uint32_t  palettes[512],
+		    uint32_t       *out,
+		    int             pitch,
+		    int             width,
+		    int             height);
+
+/* Adds the palette number to the 8 opaque pixels of a decoded tile
+ * row, transparent pixels stay 0 */
+static inline uint64_t
+render_row_palette(uint64_t row, uint8_t palette)
+{
+  uint64_t opaque = (row | row >> 1) & 0x0101010101010101ULL;
+  return row | opaque * (uint64_t)(palette << 2);
+}
+
+#endif /* __RENDER_H__ */
@@ -0,0 +1,143 @@
+/* Rewind ring buffer of delta compressed savestates */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+#include "rewind.h"
+#include "state.h"
+
+/* Smallest entry expected, to size the index: a delta of all zeroes
+ * still takes about one byte per 255 */
+#define REWIND_MIN_ENTRY 64
+
+rewind_t*
+rewind_create(emu_t *emu,
+              size_t capacity)
+{
+  rewind_t *rw;
+
+  rw = (rewind_t*)calloc(sizeof(rewind_t), 1);
+  rw->emu = emu;
+  rw->state_size = state_size(emu);
+  rw->current = (uint8_t*)calloc(rw->state_size, 1);
+  rw->scratch = (uint8_t*)calloc(rw->state_size, 1);
+  rw->packed = (uint8_t*)malloc(LZ_BOUND(rw->state_size));
+  rw->capacity = capacity;
+  rw->buf = (uint8_t*)malloc(capacity);
+  rw->max_entries = capacity / REWIND_MIN_ENTRY + 1;
+  rw->entries = (rewind_entry_t*)calloc(sizeof(rewind_entry_t),
+                                        rw->max_entries);
+  return rw;
+}
+
+void
+rewind_destroy(rewind_t *rw)
+{
+  free(rw->current);
+  free(rw->scratch);
+  free(rw->packed);
+  free(rw->buf);
+  free(rw->entries);
+  free(rw);
+}
+
+void
+rewind_clear(rewind_t *rw)
+{
+  memset(rw->current, 0, rw->state_size);
+  rw->write = 0;
+  rw->first = 0;
+  rw->count = 0;
+}
+
+static inline rewind_entry_t*
+rewind_entry(rewind_t *rw, uint32_t i)
+{
+  return &rw->entries[(rw->first + i) % rw->max_entries];
+}
+
+static inline void
+rewind_xor(uint8_t *dst, const uint8_t *src, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    dst[i] ^= src[i];
+}
+
+static void
+rewind_drop_oldest(rewind_t *rw)
+{
+  rw->first = (rw->first + 1) % rw->max_entries;
+  if (--rw->count == 0)
+    rw->write = 0;
+}
+
+/* Entries are laid out in order after the write position, so making
+ * room means dropping the oldest until the new one no longer overlaps */
+static bool
+rewind_overlaps(rewind_t *rw, size_t size)
+{
+  rewind_entry_t *oldest = rewind_entry(rw, 0);
+  return oldest->offset < rw->write + size &&
+    rw->write < oldest->offset + oldest->size;
+}
+
+void
+rewind_push(rewind_t *rw)
+{
+  size_t size;
+  uint8_t *tmp;
+
+  state_save(rw->emu, rw->scratch, rw->state_size);
+  /* current becomes the delta, and scratch the newest state */
+  rewind_xor(rw->current, rw->scratch, rw->state_size);
+  size = lz_compress(rw->current, rw->state_size, rw->packed,
+                     LZ_BOUND(rw->state_size));
+  tmp = rw->current;
+  rw->current = rw->scratch;
+  rw->scratch = tmp;
+
+  if (size > rw->capacity) {
+    /* Does not fit at all, the history restarts from here */
+    rw->count = 0;
+    rw->write = 0;
+    return;
+  }
+
+  if (rw->write + size > rw->capacity)
+    rw->write = 0;
+  while (rw->count > 0 &&
+         (rw->count == rw->max_entries || rewind_overlaps(rw, size)))
+    rewind_drop_oldest(rw);
+
+  rewind_entry_t *entry = rewind_entry(rw, rw->count++);
+  entry->offset = rw->write;
+  entry->size = size;
+  memcpy(rw->buf + rw->write, rw->packed, size);
+  rw->write += size;
+}
+
+bool
+rewind_pop(rewind_t *rw)
+{
+  rewind_entry_t *entry;
+
+  if (rw->count == 0)
+    return false;
+
+  state_load(rw->emu, rw->current, rw->state_size);
+
+  /* Step current back to the state before it */
+  entry = rewind_entry(rw, rw->count - 1);
+  if (lz_decompress(rw->buf + entry->offset, entry->size, rw->scratch,
+                    rw->state_size) != rw->state_size) {
+    rewind_clear(rw);
+    return true;
+  }
+  rewind_xor(rw->current, rw->scratch, rw->state_size);
+  rw->write = entry->offset;
+  if (--rw->count == 0)
+    rw->write = 0;
+  return true;
+}
@@ -0,0 +1,46 @@
+#ifndef __REWIND_H__
+#define __REWIND_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+
+/* Rewind history of savestates. Only the newest state is kept in full,
+ * every entry is the LZ compressed XOR of a state and the one before
+ * it, which is mostly zeroes between consecutive frames. The oldest
+ * entries are dropped when the buffer is full. */
+
+typedef struct {
+  uint32_t offset;
+  uint32_t size;
+} rewind_entry_t;
+
+struct rewind_t {
+  emu_t *emu;
+  size_t state_size;
+  /* Newest state pushed */
+  uint8_t *current;
+  uint8_t *scratch;
+  uint8_t *packed;
+  /* Ring of compressed deltas and their index, oldest first */
+  uint8_t *buf;
+  size_t capacity;
+  size_t write;
+  rewind_entry_t *entries;
+  uint32_t max_entries;
+  uint32_t first;
+  uint32_t count;
+};
+
+rewind_t* rewind_create(emu_t *emu,
+			size_t capacity);
+void rewind_destroy(rewind_t *rw);
+/* Records the current state of the emulator */
+void rewind_push(rewind_t *rw);
+/* Restores the newest recorded state and drops it from the history,
+ * returns false when there is none left */
+bool rewind_pop(rewind_t *rw);
+void rewind_clear(rewind_t *rw);
+
+#endif /* __REWIND_H__ */
@@ -0,0 +1,90 @@
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Lock-free ring of audio samples between exactly one producer and
+ * one consumer thread. Each side only writes its own index, the other
+ * one is read with acquire semantics so the samples it covers are
+ * visible. The indices run freely and are masked on access. */
+typedef struct {
+  int16_t *buf;
+  /* Power of two */
+  uint32_t size;
+  /* Written by the producer and the consumer, kept on separate cache
+   * lines so the two threads do not contend */
+  __attribute__((aligned(64))) uint32_t head;
+  __attribute__((aligned(64))) uint32_t tail;
+} ring_t;
+
+static inline void
+ring_init(ring_t *ring, uint32_t size)
+{
+  uint32_t n = 1;
+
+  while (n < size)
+    n <<= 1;
+  ring->buf = (int16_t*)calloc(sizeof(int16_t), n);
+  ring->size = n;
+  ring->head = ring->tail = 0;
+}
+
+static inline void
+ring_free(ring_t *ring)
+{
+  free(ring->buf);
+  ring->buf = NULL;
+}
+
+/* Samples queued, exact on the consumer side and a lower bound of the
+ * free space on the producer side */
+static inline uint32_t
+ring_count(ring_t *ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+    __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* Producer side, returns the number of samples queued */
+static inline uint32_t
+ring_write(ring_t *ring, const int16_t *src, uint32_t count)
+{
+  uint32_t head = ring->head;
+  uint32_t space = ring->size -
+    (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+  uint32_t first;
+
+  if (count > space)
+    count = space;
+  first = ring->size - (head & (ring->size - 1));
+  if (first > count)
+    first = count;
+  memcpy(ring->buf + (head & (ring->size - 1)), src, first * sizeof(int16_t));
+  memcpy(ring->buf, src + first, (count - first) * sizeof(int16_t));
+  __atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+/* Consumer side, returns the number of samples taken */
+static inline uint32_t
+ring_read(ring_t *ring, int16_t *dst, uint32_t count)
+{
+  uint32_t tail = ring->tail;
+  uint32_t avail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+  uint32_t first;
+
+  if (count > avail)
+    count = avail;
+  first = ring->size - (tail & (ring->size - 1));
+  if (first > count)
+    first = count;
+  memcpy(dst, ring->buf + (tail & (ring->size - 1)), first * sizeof(int16_t));
+  memcpy(dst + first, ring->buf, (count - first) * sizeof(int16_t));
+  __atomic_store_n(&ring->tail, tail + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+#endif /* __RING_H__ */
@@ -0,0 +1,308 @@
+/* ROM library index */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ines.h"
+#include "romdb.h"
+
+static_assert(sizeof(romdb_entry_t) == 112, "romdb entries are on disk");
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t count;
+  uint32_t strings_size;
+} romdb_header_t;
+
+/* Entry numbers sorted by CRC-32, for lookups by content */
+typedef struct {
+  uint32_t crc32;
+  uint32_t index;
+} romdb_key_t;
+
+struct romdb_t {
+  romdb_entry_t *entries;
+  size_t count;
+  size_t size;
+  char *strings;
+  size_t strings_size;
+  size_t strings_capacity;
+  /* Built on first use */
+  romdb_key_t *by_crc;
+};
+
+romdb_t*
+romdb_create(void)
+{
+  return (romdb_t*)calloc(sizeof(romdb_t), 1);
+}
+
+void
+romdb_destroy(romdb_t *db)
+{
+  free(db->entries);
+  free(db->strings);
+  free(db->by_crc);
+  free(db);
+}
+
+romdb_t*
+romdb_load(const char *filename)
+{
+  romdb_header_t header;
+  romdb_t *db;
+  FILE *f;
+
+  f = fopen(filename, "rb");
+  if (f == NULL)
+    return NULL;
+  if (fread(&header, sizeof(header), 1, f) != 1 ||
+      memcmp(header.magic, ROMDB_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != ROMDB_VERSION) {
+    fprintf(stderr, "Invalid ROM index: %s\n", filename);
+    fclose(f);
+    return NULL;
+  }
+
+  db = romdb_create();
+  db->count = db->size = header.count;
+  db->strings_size = db->strings_capacity = header.strings_size;
+  db->entries = (romdb_entry_t*)malloc(sizeof(romdb_entry_t) * db->size + 1);
+  db->strings = (char*)malloc(db->strings_capacity + 1);
+  if (fread(db->entries, sizeof(romdb_entry_t), db->count, f) != db->count ||
+      fread(db->strings, 1, db->strings_size, f) != db->strings_size) {
+    fprintf(stderr, "Truncated ROM index: %s\n", filename);
+    fclose(f);
+    romdb_destroy(db);
+    return NULL;
+  }
+  fclose(f);
+
+  /* Paths must stay inside of the string table, and the mirroring is
+   * handed to the PPU as it would come from a header */
+  db->strings[db->strings_size] = '\0';
+  for (size_t i = 0; i < db->count; i++) {
+    if (db->entries[i].mirroring > INES_MIRROR_FOUR) {
+      fprintf(stderr, "Corrupt ROM index: %s\n", filename);
+      romdb_destroy(db);
+      return NULL;
+    }
+    if (db->entries[i].path >= db->strings_size)
+      db->entries[i].path = db->strings_size;
+  }
+  return db;
+}
+
+/* Written next to the old index and renamed over it, a crash never
+ * leaves a partial index behind */
+int
+romdb_save(romdb_t    *db,
+           const char *filename)
+{
+  romdb_header_t header;
+  char tmp[4096];
+  FILE *f;
+  int ret = 0;
+
+  memcpy(header.magic, ROMDB_MAGIC, sizeof(header.magic));
+  header.version = ROMDB_VERSION;
+  header.count = db->count;
+  header.strings_size = db->strings_size;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+  f = fopen(tmp, "wb");
+  if (f == NULL) {
+    perror(tmp);
+    return -1;
+  }
+  if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+      fwrite(db->entries, sizeof(romdb_entry_t), db->count, f) != db->count ||
+      fwrite(db->strings, 1, db->strings_size, f) != db->strings_size)
+    ret = -1;
+  if (fclose(f) != 0)
+    ret = -1;
+  if (ret == 0 && rename(tmp, filename) != 0)
+    ret = -1;
+  if (ret != 0) {
+    perror(filename);
+    remove(tmp);
+  }
+  return ret;
+}
+
+romdb_entry_t*
+romdb_add(romdb_t    *db,
+          const char *path)
+{
+  size_t len = strlen(path) + 1;
+  romdb_entry_t *entry;
+
+  if (db->count == db->size) {
+    db->size = db->size ? db->size * 2 : 256;
+    db->entries = (romdb_entry_t*)realloc(db->entries,
+                                          sizeof(romdb_entry_t) * db->size);
+  }
+  if (db->strings_size + len > db->strings_capacity) {
+    db->strings_capacity = (db->strings_size + len) * 2;
+    db->strings = (char*)realloc(db->strings, db->strings_capacity + 1);
+  }
+
+  entry = &db->entries[db->count++];
+  memset(entry, 0, sizeof(*entry));
+  entry->path = db->strings_size;
+  memcpy(db->strings + db->strings_size, path, len);
+  db->strings_size += len;
+  free(db->by_crc);
+  db->by_crc = NULL;
+  return entry;
+}
+
+size_t
+romdb_count(romdb_t *db)
+{
+  return db->count;
+}
+
+romdb_entry_t*
+romdb_entry(romdb_t *db,
+            size_t   index)
+{
+  return &db->entries[index];
+}
+
+const char*
+romdb_path(romdb_t             *db,
+           const romdb_entry_t *entry)
+{
+  return db->strings + entry->path;
+}
+
+const romdb_entry_t*
+romdb_find_path(romdb_t    *db,
+                const char *path)
+{
+  size_t lo = 0, hi = db->count;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    int cmp = strcmp(romdb_path(db, &db->entries[mid]), path);
+    if (cmp == 0)
+      return &db->entries[mid];
+    if (cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+void
+romdb_hash(romdb_entry_t *entry,
+           ines_t        *cart)
+{
+  entry->flags = (cart->nes2 ? ROMDB_NES2 : 0) |
+    (cart->battery ? ROMDB_BATTERY : 0) |
+    (cart->trainer ? ROMDB_TRAINER : 0);
+  entry->mapper = cart->mapper;
+  entry->submapper = cart->submapper;
+  entry->mirroring = cart->mirroring;
+  entry->region = cart->region;
+  entry->prg_size = cart->prg_size;
+  entry->chr_size = cart->chr_size;
+  entry->prg_ram_size = cart->prg_ram_size;
+  entry->prg_nvram_size = cart->prg_nvram_size;
+  entry->chr_ram_size = cart->chr_ram_size;
+  entry->chr_nvram_size = cart->chr_nvram_size;
+
+  /* CHR follows PRG in the file, so the CRC of both continues the
+   * one of PRG */
+  entry->prg_crc32 = crc32_update(0, cart->prg, cart->prg_size);
+  entry->chr_crc32 = crc32_update(0, cart->chr, cart->chr_size);
+  entry->crc32 = crc32_update(entry->prg_crc32, cart->chr, cart->chr_size);
+  sha1(cart->prg, cart->prg_size, entry->prg_sha1);
+  sha1(cart->chr, cart->chr_size, entry->chr_sha1);
+}
+
+static int
+romdb_key_compare(const void *a, const void *b)
+{
+  const romdb_key_t *ka = (const romdb_key_t*)a;
+  const romdb_key_t *kb = (const romdb_key_t*)b;
+
+  if (ka->crc32 != kb->crc32)
+    return ka->crc32 < kb->crc32 ? -1 : 1;
+  return ka->index < kb->index ? -1 : ka->index > kb->index;
+}
+
+/* The most trusted entry with this content: corrections first, then
+ * NES 2.0 headers. Plain iNES entries tell nothing new. */
+static const romdb_entry_t*
+romdb_find_crc(romdb_t *db, uint32_t crc32, uint32_t prg_size,
+               uint32_t chr_size)
+{
+  const romdb_entry_t *best = NULL;
+  size_t lo = 0, hi = db->count;
+
+  if (db->by_crc == NULL) {
+    db->by_crc = (romdb_key_t*)malloc(sizeof(romdb_key_t) * db->count + 1);
+    for (size_t i = 0; i < db->count; i++) {
+      db->by_crc[i].crc32 = db->entries[i].crc32;
+      db->by_crc[i].index = i;
+    }
+    qsort(db->by_crc, db->count, sizeof(romdb_key_t), romdb_key_compare);
+  }
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (db->by_crc[mid].crc32 < crc32)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (; lo < db->count && db->by_crc[lo].crc32 == crc32; lo++) {
+    const romdb_entry_t *entry = &db->entries[db->by_crc[lo].index];
+    if (entry->prg_size != prg_size || entry->chr_size != chr_size)
+      continue;
+    if (entry->flags & ROMDB_CORRECTED)
+      return entry;
+    if (best == NULL && (entry->flags & ROMDB_NES2))
+      best = entry;
+  }
+  return best;
+}
+
+bool
+romdb_fix(romdb_t *db,
+          ines_t  *cart)
+{
+  const romdb_entry_t *entry;
+  uint32_t crc;
+  bool changed;
+
+  crc = crc32_update(0, cart->prg, cart->prg_size + cart->chr_size);
+  entry = romdb_find_crc(db, crc, cart->prg_size, cart->chr_size);
+  if (entry == NULL)
+    return false;
+
+  changed = cart->mapper != entry->mapper ||
+    cart->submapper != entry->submapper ||
+    cart->mirroring != entry->mirroring ||
+    cart->region != entry->region ||
+    cart->battery != ((entry->flags & ROMDB_BATTERY) != 0) ||
+    cart->prg_ram_size != entry->prg_ram_size ||
+    cart->prg_nvram_size != entry->prg_nvram_size ||
+    cart->chr_ram_size != entry->chr_ram_size ||
+    cart->chr_nvram_size != entry->chr_nvram_size;
+  cart->mapper = entry->mapper;
+  cart->submapper = entry->submapper;
+  cart->mirroring = entry->mirroring;
+  cart->region = entry->region;
+  cart->battery = (entry->flags & ROMDB_BATTERY) != 0;
+  cart->prg_ram_size = entry->prg_ram_size;
+  cart->prg_nvram_size = entry->prg_nvram_size;
+  cart->chr_ram_size = entry->chr_ram_size;
+  cart->chr_nvram_size = entry->chr_nvram_size;
+  return changed;
+}
@@ -0,0 +1,80 @@
+#ifndef __ROMDB_H__
+#define __ROMDB_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hash.h"
+#include "types.h"
+
+/* ROM library index, written by nes-index. A header, the entries
+ * sorted by path and a string table with the paths. */
+#define ROMDB_MAGIC "NESI"
+#define ROMDB_VERSION 1
+
+/* Entry flags */
+#define ROMDB_NES2      0x01
+#define ROMDB_BATTERY   0x02
+#define ROMDB_TRAINER   0x04
+/* The header fields come from a correction, not from the file */
+#define ROMDB_CORRECTED 0x08
+
+typedef struct {
+  /* Offset of the path in the string table */
+  uint32_t path;
+  uint32_t flags;
+  /* File size and modification time in nanoseconds, an entry is only
+   * hashed again once they change */
+  uint64_t size;
+  int64_t mtime;
+  /* Header, decoded as by ines_load */
+  uint16_t mapper;
+  uint8_t submapper;
+  uint8_t mirroring;
+  uint8_t region;
+  uint8_t reserved[3];
+  uint32_t prg_size;
+  uint32_t chr_size;
+  uint32_t prg_ram_size;
+  uint32_t prg_nvram_size;
+  uint32_t chr_ram_size;
+  uint32_t chr_nvram_size;
+  /* CRC-32 of PRG and CHR together, the key of ROM databases */
+  uint32_t crc32;
+  uint32_t prg_crc32;
+  uint32_t chr_crc32;
+  uint8_t prg_sha1[SHA1_SIZE];
+  uint8_t chr_sha1[SHA1_SIZE];
+} romdb_entry_t;
+
+typedef struct romdb_t romdb_t;
+
+romdb_t* romdb_create(void);
+/* Returns NULL when the file is missing or invalid */
+romdb_t* romdb_load(const char *filename);
+int romdb_save(romdb_t    *db,
+	       const char *filename);
+void romdb_destroy(romdb_t *db);
+
+/* Entries are added in path order, pointers stay valid until the
+ * next romdb_add */
+romdb_entry_t* romdb_add(romdb_t    *db,
+			 const char *path);
+size_t romdb_count(romdb_t *db);
+romdb_entry_t* romdb_entry(romdb_t *db,
+			   size_t   index);
+const char* romdb_path(romdb_t             *db,
+		       const romdb_entry_t *entry);
+const romdb_entry_t* romdb_find_path(romdb_t    *db,
+				     const char *path);
+
+/* Fills in the header fields and hashes of a loaded ROM */
+void romdb_hash(romdb_entry_t *entry,
+		ines_t        *cart);
+/* Corrects the header of a cartridge from an entry with the same
+ * content that is known to be right, either a correction or a NES 2.0
+ * header. Returns true when anything changed. */
+bool romdb_fix(romdb_t *db,
+	       ines_t  *cart);
+
+#endif /* __ROMDB_H__ */
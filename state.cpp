@@ -0,0 +1,140 @@
+/* Savestates of the whole machine */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "apu.h"
+#include "cpu.h"
+#include "input.h"
+#include "mapper.h"
+#include "ppu.h"
+#include "state.h"
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  /* Size of the device state that follows */
+  uint32_t size;
+} state_header_t;
+
+static void
+state_devices(emu_t *emu, state_t *s)
+{
+  cpu_state(emu->cpu, s);
+  ppu_state(emu->ppu, s);
+  apu_state(emu->apu, s);
+  input_state(emu->input, s);
+  state_bytes(s, emu->prg_ram, 0x2000);
+  state_bytes(s, emu->chr_ram, emu->chr_ram_size);
+  if (emu->mapper)
+    mapper_state(emu->mapper, s);
+}
+
+size_t
+state_size(emu_t *emu)
+{
+  state_t s = { NULL, 0, 0, false, false };
+  state_devices(emu, &s);
+  return sizeof(state_header_t) + s.pos;
+}
+
+size_t
+state_save(emu_t   *emu,
+           uint8_t *buf,
+           size_t   size)
+{
+  size_t total = state_size(emu);
+  state_header_t header;
+  state_t s = { buf + sizeof(header), total - sizeof(header), 0, false,
+                false };
+
+  if (size < total)
+    return 0;
+
+  memcpy(header.magic, STATE_MAGIC, sizeof(header.magic));
+  header.version = STATE_VERSION;
+  header.size = s.size;
+  memcpy(buf, &header, sizeof(header));
+  state_devices(emu, &s);
+  return total;
+}
+
+int
+state_load(emu_t         *emu,
+           const uint8_t *buf,
+           size_t         size)
+{
+  size_t total = state_size(emu);
+  state_header_t header;
+
+  if (size != total)
+    return -1;
+  memcpy(&header, buf, sizeof(header));
+  if (memcmp(header.magic, STATE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != STATE_VERSION ||
+      header.size != total - sizeof(header))
+    return -1;
+
+  /* Only read from, loading never writes to the buffer. Devices can
+   * still find values they cannot take, the machine as it was is kept
+   * aside to be put back then. */
+  uint8_t *backup = (uint8_t*)malloc(header.size);
+  state_t s = { (uint8_t*)buf + sizeof(header), header.size, 0, true, false };
+  state_t b = { backup, header.size, 0, false, false };
+  state_devices(emu, &b);
+  state_devices(emu, &s);
+  if (s.invalid) {
+    b.pos = 0;
+    b.loading = true;
+    state_devices(emu, &b);
+  }
+  free(backup);
+  return s.invalid ? -1 : 0;
+}
+
+int
+state_save_file(emu_t      *emu,
+                const char *filename)
+{
+  size_t size = state_size(emu);
+  uint8_t *buf = (uint8_t*)malloc(size);
+  FILE *f;
+  int ret = -1;
+
+  state_save(emu, buf, size);
+  f = fopen(filename, "wb");
+  if (f == NULL) {
+    perror("Cannot write state");
+  } else {
+    if (fwrite(buf, 1, size, f) == size)
+      ret = 0;
+    if (fclose(f) != 0)
+      ret = -1;
+  }
+  free(buf);
+  return ret;
+}
+
+int
+state_load_file(emu_t      *emu,
+                const char *filename)
+{
+  size_t size = state_size(emu);
+  uint8_t *buf = (uint8_t*)malloc(size + 1);
+  FILE *f;
+  int ret = -1;
+
+  f = fopen(filename, "rb");
+  if (f == NULL) {
+    perror("Cannot read state");
+  } else {
+    /* One byte more to catch files that are too long */
+    if (fread(buf, 1, size + 1, f) == size)
+      ret = state_load(emu, buf, size);
+    if (ret != 0)
+      printf("Invalid state file: %s\n", filename);
+    fclose(f);
+  }
+  free(buf);
+  return ret;
+}
@@ -0,0 +1,58 @@
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "types.h"
+
+/* Savestates are a header followed by the raw state of each device.
+ * The same function of a device describes its state for saving and
+ * loading, so the two can never disagree on the layout. Bump
+ * STATE_VERSION whenever the layout changes. */
+#define STATE_MAGIC "NESS"
+#define STATE_VERSION 6
+
+struct state_t {
+  /* NULL to only measure the size */
+  uint8_t *buf;
+  size_t size;
+  size_t pos;
+  bool loading;
+  /* Set by a device that finds a value it cannot load, the bytes that
+   * follow are then skipped */
+  bool invalid;
+};
+
+static inline void
+state_bytes(state_t *s, void *data, size_t size)
+{
+  if (s->buf != NULL && !s->invalid) {
+    if (s->loading)
+      memcpy(data, s->buf + s->pos, size);
+    else
+      memcpy(s->buf + s->pos, data, size);
+  }
+  s->pos += size;
+}
+
+#define STATE_FIELD(s, field) state_bytes((s), &(field), sizeof(field))
+
+size_t state_size(emu_t *emu);
+/* Returns the number of bytes written, 0 if buf is too small */
+size_t state_save(emu_t   *emu,
+		  uint8_t *buf,
+		  size_t   size);
+/* Returns 0 on success, -1 when the state is not of this version
+ * or machine or holds values it cannot take, in which case the
+ * emulator is left untouched */
+int state_load(emu_t         *emu,
+	       const uint8_t *buf,
+	       size_t         size);
+int state_save_file(emu_t      *emu,
+		    const char *filename);
+int state_load_file(emu_t      *emu,
+		    const char *filename);
+
+#endif /* __STATE_H__ */
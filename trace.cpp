@@ -0,0 +1,308 @@
+/* Binary instruction trace */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "opcodes.h"
+#include "ppu.h"
+#include "trace.h"
+
+static_assert(sizeof(trace_record_t) == 32, "trace records are on disk");
+static_assert(sizeof(trace_header_t) == 64, "trace header is on disk");
+
+static trace_t*
+trace_map(int fd, size_t size, bool writable)
+{
+  trace_t *trace;
+  void *map;
+
+  map = mmap(0, size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+             MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    perror("Cannot map trace");
+    return NULL;
+  }
+  trace = (trace_t*)calloc(sizeof(trace_t), 1);
+  trace->fd = fd;
+  trace->map_size = size;
+  trace->header = (trace_header_t*)map;
+  trace->records = (trace_record_t*)(trace->header + 1);
+  return trace;
+}
+
+trace_t*
+trace_create(const char *filename,
+             uint32_t    capacity)
+{
+  trace_t *trace;
+  uint32_t n = 1;
+  size_t size;
+
+  while (n < capacity && n < 0x80000000)
+    n <<= 1;
+  size = sizeof(trace_header_t) + (size_t)n * sizeof(trace_record_t);
+
+  if (filename == NULL) {
+    trace = (trace_t*)calloc(sizeof(trace_t), 1);
+    trace->fd = -1;
+    trace->header = (trace_header_t*)calloc(size, 1);
+    trace->records = (trace_record_t*)(trace->header + 1);
+  } else {
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+      perror("Cannot create trace");
+      return NULL;
+    }
+    if (ftruncate(fd, size) != 0) {
+      perror("Cannot create trace");
+      close(fd);
+      return NULL;
+    }
+    trace = trace_map(fd, size, true);
+    if (trace == NULL) {
+      close(fd);
+      return NULL;
+    }
+  }
+
+  memcpy(trace->header->magic, TRACE_MAGIC, sizeof(trace->header->magic));
+  trace->header->version = TRACE_VERSION;
+  trace->header->record_size = sizeof(trace_record_t);
+  trace->header->capacity = n;
+  trace->mask = n - 1;
+  return trace;
+}
+
+trace_t*
+trace_open(const char *filename)
+{
+  trace_header_t header;
+  trace_t *trace;
+  struct stat st;
+  int fd;
+
+  fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    perror("Cannot open trace");
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(header) ||
+      pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION ||
+      header.record_size != sizeof(trace_record_t) ||
+      header.capacity == 0 || (header.capacity & (header.capacity - 1)) ||
+      (size_t)st.st_size < sizeof(header) +
+      (size_t)header.capacity * sizeof(trace_record_t)) {
+    fprintf(stderr, "Invalid trace file: %s\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  trace = trace_map(fd, st.st_size, false);
+  if (trace == NULL) {
+    close(fd);
+    return NULL;
+  }
+  trace->mask = header.capacity - 1;
+  trace->head = __atomic_load_n(&trace->header->head, __ATOMIC_ACQUIRE);
+  return trace;
+}
+
+void
+trace_destroy(trace_t *trace)
+{
+  if (trace->fd == -1) {
+    free(trace->header);
+  } else {
+    munmap(trace->header, trace->map_size);
+    close(trace->fd);
+  }
+  free(trace);
+}
+
+/* Reads memory for the trace, registers are left alone as reading
+ * them has side effects */
+static inline uint8_t
+trace_peek(cpu_t *cpu, uint16_t addr)
+{
+  const uint8_t *page = cpu->read_map[addr >> 8];
+  return page ? page[addr & 0xff] : 0xff;
+}
+
+static inline uint16_t
+trace_peek16(cpu_t *cpu, uint16_t addr, uint16_t next)
+{
+  return trace_peek(cpu, addr) | trace_peek(cpu, next) << 8;
+}
+
+void
+trace_instruction(trace_t *trace,
+                  cpu_t   *cpu)
+{
+  trace_record_t *r = &trace->records[trace->head & trace->mask];
+  uint16_t pc = cpu->pc;
+  const cpu_opcode_t *op;
+  uint16_t m, addr = 0;
+  int scanline, dot;
+
+  r->cycles = cpu->cycles;
+  r->pc = pc;
+  r->bytes[0] = trace_peek(cpu, pc);
+  r->bytes[1] = trace_peek(cpu, pc + 1);
+  r->bytes[2] = trace_peek(cpu, pc + 2);
+  r->a = cpu->a;
+  r->x = cpu->x;
+  r->y = cpu->y;
+  /* As pushed by PHP but without the B flag, like nestest.log */
+  r->p = (cpu_get_p(cpu) & ~0x10) | 0x20;
+  r->sp = cpu->sp;
+  ppu_position(cpu->emu->ppu, cpu->cycles * MASTER_CPU_DIVIDER, &scanline,
+               &dot);
+  r->scanline = scanline;
+  r->dot = dot;
+
+  op = &cpu_opcodes[r->bytes[0]];
+  m = r->bytes[1] | r->bytes[2] << 8;
+  switch (op->mode) {
+  case MODE_ZP0: addr = m & 0xff; break;
+  case MODE_ZPX: addr = (m + cpu->x) & 0xff; break;
+  case MODE_ZPY: addr = (m + cpu->y) & 0xff; break;
+  case MODE_ABS: addr = m; break;
+  case MODE_ABX: addr = m + cpu->x; break;
+  case MODE_ABY: addr = m + cpu->y; break;
+  case MODE_IND:
+    /* The pointer does not carry into the high byte */
+    addr = trace_peek16(cpu, m, (m & 0xff00) | ((m + 1) & 0xff));
+    break;
+  case MODE_IZX: {
+    uint8_t ptr = m + cpu->x;
+    addr = trace_peek16(cpu, ptr, (uint8_t)(ptr + 1));
+    break;
+  }
+  case MODE_IZY: {
+    uint8_t ptr = m;
+    addr = trace_peek16(cpu, ptr, (uint8_t)(ptr + 1)) + cpu->y;
+    break;
+  }
+  case MODE_REL: addr = pc + 2 + (int8_t)r->bytes[1]; break;
+  }
+  r->addr = addr;
+  r->value = trace_peek(cpu, addr);
+
+  trace->head++;
+  __atomic_store_n(&trace->header->head, trace->head, __ATOMIC_RELEASE);
+}
+
+uint64_t
+trace_count(trace_t *trace)
+{
+  return trace->head < trace->mask + 1ULL ? trace->head : trace->mask + 1ULL;
+}
+
+const trace_record_t*
+trace_get(trace_t  *trace,
+          uint64_t  index)
+{
+  uint64_t first = trace->head - trace_count(trace);
+  return &trace->records[(first + index) & trace->mask];
+}
+
+/* Unofficial opcodes are marked with a star in nestest.log */
+static bool
+trace_unofficial(uint8_t opcode)
+{
+  static const char *names[] = {
+    "SLO", "RLA", "SRE", "RRA", "SAX", "LAX", "DCP", "ISB", "ANC", "ALR",
+    "ARR", "XAA", "LXA", "AXS", "SHA", "SHX", "SHY", "TAS", "LAS", "JAM",
+  };
+  const char *name = cpu_opcodes[opcode].name;
+
+  if (strcmp(name, "NOP") == 0)
+    return opcode != 0xea;
+  if (strcmp(name, "SBC") == 0)
+    return opcode == 0xeb;
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(name, names[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+int
+trace_format(const trace_record_t *r,
+             char                 *buf,
+             size_t                size)
+{
+  const cpu_opcode_t *op = &cpu_opcodes[r->bytes[0]];
+  int n = 1 + cpu_mode_size[op->mode];
+  uint8_t zp = r->bytes[1];
+  uint16_t m = r->bytes[1] | r->bytes[2] << 8;
+  bool jump = r->bytes[0] == 0x4c || r->bytes[0] == 0x20;
+  char bytes[10] = "";
+  char asm_[40];
+  int len;
+
+  for (int i = 0, pos = 0; i < n; i++) {
+    pos += snprintf(bytes + pos, sizeof(bytes) - pos, "%s%02X", i ? " " : "",
+                    r->bytes[i]);
+  }
+
+  len = snprintf(asm_, sizeof(asm_), "%c%s", trace_unofficial(r->bytes[0]) ?
+                 '*' : ' ', op->name);
+  switch (op->mode) {
+  case MODE_IMP:
+    break;
+  case MODE_ACC:
+    snprintf(asm_ + len, sizeof(asm_) - len, " A");
+    break;
+  case MODE_IMM:
+    snprintf(asm_ + len, sizeof(asm_) - len, " #$%02X", zp);
+    break;
+  case MODE_ZP0:
+    snprintf(asm_ + len, sizeof(asm_) - len, " $%02X = %02X", zp, r->value);
+    break;
+  case MODE_ZPX:
+  case MODE_ZPY:
+    snprintf(asm_ + len, sizeof(asm_) - len, " $%02X,%c @ %02X = %02X", zp,
+             op->mode == MODE_ZPX ? 'X' : 'Y', r->addr, r->value);
+    break;
+  case MODE_ABS:
+    if (jump)
+      snprintf(asm_ + len, sizeof(asm_) - len, " $%04X", m);
+    else
+      snprintf(asm_ + len, sizeof(asm_) - len, " $%04X = %02X", m, r->value);
+    break;
+  case MODE_ABX:
+  case MODE_ABY:
+    snprintf(asm_ + len, sizeof(asm_) - len, " $%04X,%c @ %04X = %02X", m,
+             op->mode == MODE_ABX ? 'X' : 'Y', r->addr, r->value);
+    break;
+  case MODE_IND:
+    snprintf(asm_ + len, sizeof(asm_) - len, " ($%04X) = %04X", m, r->addr);
+    break;
+  case MODE_IZX:
+    snprintf(asm_ + len, sizeof(asm_) - len, " ($%02X,X) @ %02X = %04X = %02X",
+             zp, (uint8_t)(zp + r->x), r->addr, r->value);
+    break;
+  case MODE_IZY:
+    snprintf(asm_ + len, sizeof(asm_) - len, " ($%02X),Y = %04X @ %04X = %02X",
+             zp, (uint16_t)(r->addr - r->y), r->addr, r->value);
+    break;
+  case MODE_REL:
+    snprintf(asm_ + len, sizeof(asm_) - len, " $%04X", r->addr);
+    break;
+  }
+
+  return snprintf(buf, size, "%04X  %-8s %-33sA:%02X X:%02X Y:%02X P:%02X "
+                  "SP:%02X PPU:%3d,%3d CYC:%llu", r->pc, bytes, asm_, r->a,
+                  r->x, r->y, r->p, r->sp,
+                  r->scanline < 0 ? r->scanline + 262 : r->scanline, r->dot,
+                  (unsigned long long)r->cycles);
+}
@@ -0,0 +1,77 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "types.h"
+
+/* Instruction trace: a ring of fixed size records of the CPU state
+ * before each instruction, in memory or in a memory mapped file that
+ * survives a crash. The emulator is the only writer; readers see the
+ * records up to the published head. nes-trace decodes them into the
+ * log format of nestest. */
+#define TRACE_MAGIC "NEST"
+#define TRACE_VERSION 1
+
+typedef struct {
+  uint64_t cycles;
+  uint16_t pc;
+  /* Effective address of the operand and the byte there, $FF when
+   * the address is a register that cannot be read without effects */
+  uint16_t addr;
+  int16_t scanline;
+  uint16_t dot;
+  uint8_t bytes[3];
+  uint8_t value;
+  uint8_t a;
+  uint8_t x;
+  uint8_t y;
+  uint8_t p;
+  uint8_t sp;
+  uint8_t reserved[7];
+} trace_record_t;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t record_size;
+  /* Records in the ring, a power of two */
+  uint32_t capacity;
+  /* Records written so far, the ring holds the last capacity of them */
+  uint64_t head;
+  uint8_t reserved[40];
+} trace_header_t;
+
+struct trace_t {
+  trace_header_t *header;
+  trace_record_t *records;
+  uint64_t head;
+  uint32_t mask;
+  size_t map_size;
+  /* Backed by a file, -1 when in memory */
+  int fd;
+};
+
+/* capacity is rounded up to a power of two. Without a filename the
+ * ring is kept in memory. */
+trace_t* trace_create(const char *filename,
+		      uint32_t    capacity);
+/* Maps a trace file read-only */
+trace_t* trace_open(const char *filename);
+void trace_destroy(trace_t *trace);
+
+/* Records the instruction at the PC, called by the CPU when tracing */
+void trace_instruction(trace_t *trace,
+		       cpu_t   *cpu);
+
+/* Number of records in the ring and the nth oldest of them */
+uint64_t trace_count(trace_t *trace);
+const trace_record_t* trace_get(trace_t  *trace,
+				uint64_t  index);
+/* Formats a record as a line of nestest.log */
+int trace_format(const trace_record_t *record,
+		 char                 *buf,
+		 size_t                size);
+
+#endif /* __TRACE_H__ */
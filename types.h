@@ -1,20 +1,83 @@
 #ifndef __TYPES_H__
 #define __TYPES_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
 typedef struct emu_t emu_t;
 typedef struct cpu_t cpu_t;
 typedef struct ppu_t ppu_t;
+typedef struct apu_t apu_t;
+typedef struct video_t video_t;
+typedef struct audio_t audio_t;
+typedef struct input_t input_t;
+typedef struct movie_t movie_t;
+typedef struct capture_t capture_t;
+typedef struct state_t state_t;
+typedef struct ines_t ines_t;
+typedef struct mapper_t mapper_t;
+typedef struct romdb_t romdb_t;
+typedef struct trace_t trace_t;
+typedef struct jit_t jit_t;
+typedef struct idle_t idle_t;
+typedef struct prof_t prof_t;
+typedef struct rewind_t rewind_t;
 
 struct emu_t {
   cpu_t *cpu;
   ppu_t *ppu;
+  apu_t *apu;
+  video_t *video;
+  /* Sound output, NULL to not synthesize any */
+  audio_t *audio;
+  /* Controller ports, and the movie they are recorded to or played
+   * back from, NULL if none */
+  input_t *input;
+  movie_t *movie;
+  /* Shown frames are also written here, NULL if not */
+  capture_t *capture;
+  /* Cartridge and its board, NULL until one is loaded */
+  ines_t *cart;
+  mapper_t *mapper;
+  /* 8Kb of cartridge RAM at $6000-$7FFF */
+  uint8_t *prg_ram;
+  /* Pattern table RAM of boards without CHR-ROM, at least 8Kb */
+  uint8_t *chr_ram;
+  uint32_t chr_ram_size;
+  /* ROM index to correct bad headers with, optional */
+  romdb_t *romdb;
+  /* Frames run ahead of each one emulated to show its future, 0 for
+   * none, and the savestate they are undone with */
+  uint32_t runahead;
+  uint8_t *runahead_state;
+  size_t runahead_size;
+  /* States of the frames run, stepped back through while the host
+   * holds rewind. NULL to keep none. */
+  rewind_t *rewind;
 };
 
+/* Memory mapped I/O handlers of a CPU page */
+typedef uint8_t (*cpu_read_fn)(void *opaque, uint16_t addr);
+typedef void (*cpu_write_fn)(void *opaque, uint16_t addr, uint8_t value);
+
+typedef struct {
+  cpu_read_fn read;
+  cpu_write_fn write;
+  void *opaque;
+} cpu_io_t;
+
 struct cpu_t {
-  /* Memory, 16bit addresses */
-  uint8_t *mem;
+  /* Memory map, one entry per 256 byte page. A page with a host
+   * pointer is accessed directly, otherwise through its io handlers */
+  const uint8_t *read_map[256];
+  uint8_t *write_map[256];
+  cpu_io_t io[256];
+
+  /* 2Kb of internal RAM, mirrored up to $1FFF */
+  uint8_t ram[0x800];
 
   /* Program Counter */
   uint16_t pc;
@@ -46,11 +109,40 @@ struct cpu_t {
   /* Instruction counter */
   uint32_t instructions;
 
+  /* Cycles executed since power on */
+  uint64_t cycles;
+
+  /* cpu_run() returns once cycles reaches the deadline */
+  uint64_t deadline;
+
+  /* Pending NMI, edge triggered */
+  uint8_t nmi;
+
+  /* IRQ line, one bit per source, level triggered */
+  uint8_t irq;
+
+  /* Set when a JAM opcode halted the processor */
+  bool jammed;
+
+  /* Instruction trace, NULL when not tracing */
+  trace_t *trace;
+
+  /* Guest profiler, NULL when not profiling */
+  prof_t *prof;
+
+  /* Dynamic recompiler, NULL when interpreting */
+  jit_t *jit;
+
+  /* Idle loop detection, NULL when disabled */
+  idle_t *idle;
+
   emu_t *emu;
 
 };
 
 struct ppu_t {
+  /* Master clock time the PPU has been run up to */
+  uint64_t clock;
   int ticks;
   int scanline;
   // 0x2000: -w PPUCTRL
@@ -62,10 +154,47 @@ struct ppu_t {
   // 0x2006: -w PPUADDR
   // 0x2007: rw PPUDATA
   uint8_t regs[8];
-  // 8Kb of VRAM;
-  uint8_t *mem;
+  /* The 2Kb of VRAM inside the console, two nametables */
+  uint8_t vram[0x800];
+  /* The other two nametables of four screen boards, on the cartridge */
+  uint8_t *four_screen;
+  /* $3F00-$3F1F, $3F10, $3F14, $3F18 and $3F1C are the same bytes as
+   * $3F00, $3F04, $3F08 and $3F0C */
+  uint8_t palette[32];
+  /* Pattern tables in 1Kb pages, pointing at CHR-ROM or CHR-RAM.
+   * Writes only go through to pages mapped in chr_write. */
+  const uint8_t *chr_map[8];
+  uint8_t *chr_write[8];
+  /* Memory behind each of the four nametables of the address space,
+   * $3000-$3EFF wraps around to them. Follows mirroring. */
+  uint8_t *nametables[4];
+  uint8_t mirroring;
+  /* Level of address line 12, watched by MMC3 */
+  bool a12;
+  /* Current VRAM address, also the scroll position while rendering */
   uint16_t pc;
+  /* Temporary VRAM address, the scroll position of the next frame */
+  uint16_t t;
+  /* Fine x scroll, 0-7 */
+  uint8_t fine_x;
+  /* Write toggle of PPUSCROLL and PPUADDR */
+  uint8_t w;
+  /* PPUDATA read buffer */
+  uint8_t read_buffer;
+  /* Object attribute memory, 64 sprites of 4 bytes: Y, tile,
+   * attributes and X */
+  uint8_t oam[256];
+  uint8_t oam_addr;
+  /* The 512 tiles of the pattern tables decoded to one byte per pixel,
+   * RENDER_TILE_SIZE bytes each */
+  uint8_t *tiles;
+  /* Tiles that changed since they were decoded, one bit each */
+  uint64_t tiles_dirty[512 / 64];
+  bool tiles_any_dirty;
   uint16_t framecount;
+  /* Frames are not shown, only what the CPU can see of rendering is
+   * done: sprite overflow and sprite 0 hits */
+  bool hidden;
   emu_t *emu;
 };
 
@@ -0,0 +1,174 @@
+/* Video output, dispatches to the selected presentation backend */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "video.h"
+
+/* Set in video_t.latest while the frame there has not been taken */
+#define VIDEO_FRESH 0x80000000
+
+/* How much each emphasis bit darkens the other two channels */
+#define VIDEO_EMPHASIS_ATTENUATION 0.816328
+
+static const uint32_t palette[] = {
+  0x666666, 0x002a88, 0x1412a7, 0x3b00a4,
+  0x5c007e, 0x6e0040, 0x6c0600, 0x561d00,
+  0x333500, 0x0b4800, 0x005200, 0x004f08,
+  0x00404d, 0x000000, 0x000000, 0x000000,
+  0xadadad, 0x155fd9, 0x4240ff, 0x7527fe,
+  0xa01acc, 0xb71e7b, 0xb53120, 0x994e00,
+  0x6b6d00, 0x388700, 0x0c9300, 0x008f32,
+  0x007c8d, 0x000000, 0x000000, 0x000000,
+  0xfffeff, 0x64b0ff, 0x9290ff, 0xc676ff,
+  0xf36aff, 0xfe6ecc, 0xfe8170, 0xea9e22,
+  0xbcbe00, 0x88d800, 0x5ce430, 0x45e082,
+  0x48cdde, 0x4f4f4f, 0x000000, 0x000000,
+  0xfffeff, 0xc0dfff, 0xd3d2ff, 0xe8c8ff,
+  0xfbc2ff, 0xfec4ea, 0xfeccc5, 0xf7d8a5,
+  0xe4e594, 0xcfef96, 0xbdf4ab, 0xb3f3cc,
+  0xb5ebf2, 0xb8b8b8, 0x000000, 0x000000,
+};
+
+/* The palette under each setting of the PPUMASK emphasis bits: red,
+ * green and blue from the lowest bit up. Each one that is set darkens
+ * the channels of the other two. */
+static void
+video_init_palettes(uint32_t *palettes)
+{
+    for (int e = 0; e < 8; e++) {
+      for (int i = 0; i < 64; i++) {
+        uint32_t p = 0xff000000;
+        for (int c = 0; c < 3; c++) {
+          double v = (palette[i] >> (16 - c * 8)) & 0xff;
+          for (int b = 0; b < 3; b++) {
+            if ((e & (1 << b)) && b != c)
+              v *= VIDEO_EMPHASIS_ATTENUATION;
+          }
+          p |= (uint32_t)(v + 0.5) << (16 - c * 8);
+        }
+        palettes[e * 64 + i] = p;
+      }
+    }
+}
+
+/* The first one is the default */
+static const video_backend_t *backends[] = {
+#ifdef HAVE_SDL
+  &video_sdl_backend,
+#endif
+  &video_null_backend,
+  NULL,
+};
+
+video_t*
+video_create(const char *name,
+             const char *filter)
+{
+    const video_backend_t *backend = NULL;
+    video_t *video;
+
+    for (int i = 0; backends[i] != NULL; i++) {
+      if (name == NULL || strcmp(backends[i]->name, name) == 0) {
+        backend = backends[i];
+        break;
+      }
+    }
+    if (backend == NULL) {
+      printf("Unknown video backend: %s\n", name);
+      return NULL;
+    }
+
+    video = (video_t*)calloc(sizeof(video_t), 1);
+    video->backend = backend;
+    for (int i = 0; i < VIDEO_BUFFERS; i++)
+      video->buffers[i] = (video_frame_t*)calloc(sizeof(video_frame_t), 1);
+    video_init_palettes(video->palettes);
+    video->back = 0;
+    video->frame = video->buffers[0];
+    video->latest = 1;
+    video->front = 2;
+    video->filter = filter_create(video, filter);
+    if (video->filter == NULL || !backend->init(video)) {
+      if (video->filter)
+        filter_destroy(video->filter);
+      for (int i = 0; i < VIDEO_BUFFERS; i++)
+        free(video->buffers[i]);
+      free(video);
+      return NULL;
+    }
+    return video;
+}
+
+void
+video_present(video_t *video)
+{
+    uint32_t old = __atomic_exchange_n(&video->latest,
+                                       video->back | VIDEO_FRESH,
+                                       __ATOMIC_ACQ_REL);
+
+    /* A frame the presenter never took is dropped and rendered over */
+    video->back = old & ~VIDEO_FRESH;
+    video->frame = video->buffers[video->back];
+    video->frames++;
+    video->backend->present(video);
+}
+
+const video_frame_t*
+video_latest(video_t *video)
+{
+    uint32_t latest;
+
+    if (!(__atomic_load_n(&video->latest, __ATOMIC_ACQUIRE) & VIDEO_FRESH))
+      return NULL;
+    latest = __atomic_exchange_n(&video->latest, video->front,
+                                 __ATOMIC_ACQ_REL);
+    video->front = latest & ~VIDEO_FRESH;
+    return video->buffers[video->front];
+}
+
+void
+video_run(video_t *video,
+          void   (*fn)(void *opaque),
+          void    *opaque)
+{
+    video->backend->run(video, fn, opaque);
+}
+
+bool
+video_poll(video_t *video)
+{
+    return video->backend->poll(video);
+}
+
+uint8_t
+video_buttons(video_t *video)
+{
+    return __atomic_load_n(&video->buttons, __ATOMIC_RELAXED);
+}
+
+bool
+video_rewinding(video_t *video)
+{
+    return __atomic_load_n(&video->rewinding, __ATOMIC_RELAXED);
+}
+
+void
+video_destroy(video_t *video)
+{
+    video->backend->destroy(video);
+    filter_destroy(video->filter);
+    for (int i = 0; i < VIDEO_BUFFERS; i++)
+      free(video->buffers[i]);
+    free(video);
+}
+
+void
+video_list_backends(void)
+{
+    for (int i = 0; backends[i] != NULL; i++) {
+      printf("                       %s%s\n", backends[i]->name, i == 0 ? " (default)" : "");
+    }
+}
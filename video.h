@@ -0,0 +1,97 @@
+#ifndef __VIDEO_H__
+#define __VIDEO_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define VIDEO_WIDTH 256
+#define VIDEO_HEIGHT 240
+
+/* Frames are triple buffered, the emulator renders into one while the
+ * presenter shows another and the third holds the latest finished one */
+#define VIDEO_BUFFERS 3
+
+typedef struct video_t video_t;
+typedef struct filter_t filter_t;
+
+/* A frame as the PPU renders it, one byte per pixel. Turning it into
+ * pixels is left to whoever shows or stores it, off the emulator. */
+typedef struct {
+  /* 6 bit NES colors */
+  uint8_t colors[VIDEO_WIDTH * VIDEO_HEIGHT];
+  /* PPUMASK of each line, for greyscale and color emphasis */
+  uint8_t masks[VIDEO_HEIGHT];
+  /* Phase of the color subcarrier at the first pixel, 0, 4 or 8 of
+   * its 12, for the NTSC filter */
+  uint8_t phase;
+} video_frame_t;
+
+/* A presentation backend, frames are rendered by the PPU into the
+ * frame of video_t and handed to the backend once complete. present
+ * is called on the emulator thread after the frame has been published
+ * and must not block, the backend takes it with video_latest(), from
+ * any one thread, and turns it into pixels with the filter.
+ *
+ * init, run and destroy are called on the main thread. run calls the
+ * emulator, on a thread of its own if the backend needs the main one,
+ * and returns once it does. */
+typedef struct {
+  const char *name;
+  bool (*init)(video_t *video);
+  void (*run)(video_t *video, void (*fn)(void *opaque), void *opaque);
+  void (*present)(video_t *video);
+  /* Returns false when the user asked to quit */
+  bool (*poll)(video_t *video);
+  void (*destroy)(video_t *video);
+} video_backend_t;
+
+struct video_t {
+  const video_backend_t *backend;
+  /* Backend private data */
+  void *priv;
+  /* The frame being rendered into */
+  video_frame_t *frame;
+  uint64_t frames;
+  video_frame_t *buffers[VIDEO_BUFFERS];
+  /* Index of frame in buffers, only touched by the emulator */
+  uint32_t back;
+  /* Index of the latest finished frame, with VIDEO_FRESH set until it
+   * is taken. Swapped atomically between the two threads. */
+  uint32_t latest;
+  /* Only touched by the presenter */
+  uint32_t front;
+  /* Buttons of controller 1 held on the host, the INPUT_* bits. Set by
+   * the backend from any thread. */
+  uint8_t buttons;
+  /* Set by the backend while rewind is held on the host */
+  bool rewinding;
+  /* ARGB8888 of the 64 colors under each of the 8 emphasis settings */
+  uint32_t palettes[512];
+  /* For the backend to show frames with */
+  filter_t *filter;
+};
+
+extern const video_backend_t video_null_backend;
+#ifdef HAVE_SDL
+extern const video_backend_t video_sdl_backend;
+#endif
+
+/* With the filter called filter, the default if NULL */
+video_t* video_create(const char *name,
+		      const char *filter);
+/* Runs fn with opaque as the emulator, see video_backend_t */
+void video_run(video_t *video,
+	       void   (*fn)(void *opaque),
+	       void    *opaque);
+/* Publishes the frame and moves frame to a free buffer */
+void video_present(video_t *video);
+/* The latest published frame if there is a new one since the last
+ * call, NULL otherwise. Valid until the next call. */
+const video_frame_t* video_latest(video_t *video);
+bool video_poll(video_t *video);
+uint8_t video_buttons(video_t *video);
+bool video_rewinding(video_t *video);
+void video_destroy(video_t *video);
+void video_list_backends(void);
+
+#endif /* __VIDEO_H__ */
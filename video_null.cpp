@@ -0,0 +1,43 @@
+/* Headless video backend, frames stay in the in-memory framebuffer
+ * and nothing is displayed or polled */
+
+#include "video.h"
+
+static bool
+video_null_init(video_t *video __attribute__((unused)))
+{
+    return true;
+}
+
+static void
+video_null_run(video_t *video __attribute__((unused)),
+               void   (*fn)(void *opaque),
+               void    *opaque)
+{
+    fn(opaque);
+}
+
+static void
+video_null_present(video_t *video __attribute__((unused)))
+{
+}
+
+static bool
+video_null_poll(video_t *video __attribute__((unused)))
+{
+    return true;
+}
+
+static void
+video_null_destroy(video_t *video __attribute__((unused)))
+{
+}
+
+const video_backend_t video_null_backend = {
+  "null",
+  video_null_init,
+  video_null_run,
+  video_null_present,
+  video_null_poll,
+  video_null_destroy,
+};
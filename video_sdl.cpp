@@ -0,0 +1,237 @@
+/* SDL2 video backend, presents frames in a window. SDL wants the
+ * window, the renderer and the events on the main thread, so the main
+ * thread stays with them and the emulator runs on a thread of its own
+ * that never waits for the display: it publishes finished frames with
+ * video_present() and reads the quit flag and buttons the main thread
+ * leaves. The main thread also runs the filter, into the texture. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+
+#include "filter.h"
+#include "input.h"
+#include "video.h"
+
+/* Longest the main thread sleeps without a new frame, events are still
+ * polled this often when the emulator is paused or slow */
+#define VIDEO_SDL_IDLE_MS 10
+
+typedef struct {
+  SDL_Window *win;
+  SDL_Renderer *renderer;
+  SDL_Texture *texture;
+  /* The emulator, run by video_sdl_run() */
+  SDL_Thread *thread;
+  void (*fn)(void *opaque);
+  void *opaque;
+  /* Posted for each published frame, and once the emulator returns */
+  SDL_sem *frame;
+  /* Set once the emulator returned */
+  bool done;
+  /* Set by the main thread when the window is closed */
+  bool quit;
+} video_sdl_t;
+
+static bool
+video_sdl_setup(video_sdl_t *sdl, int width, int height)
+{
+    sdl->win = SDL_CreateWindow("nes",
+                                SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                width, height, SDL_WINDOW_SHOWN);
+    if (sdl->win == NULL) {
+      printf("Unable to create SDL window: %s\n", SDL_GetError());
+      return false;
+    }
+
+    /* Any renderer will do, the accelerated ones wait for vsync in the
+     * main thread instead of burning a core */
+    sdl->renderer = SDL_CreateRenderer(sdl->win, -1,
+                                       SDL_RENDERER_PRESENTVSYNC);
+    if (sdl->renderer == NULL) {
+      printf("Unable to create SDL renderer: %s\n", SDL_GetError());
+      return false;
+    }
+
+    sdl->texture = SDL_CreateTexture(sdl->renderer,
+                                     SDL_PIXELFORMAT_ARGB8888,
+                                     SDL_TEXTUREACCESS_STREAMING,
+                                     width, height);
+    if (sdl->texture == NULL) {
+      printf("Unable to create SDL texture: %s\n", SDL_GetError());
+      return false;
+    }
+    SDL_RenderClear(sdl->renderer);
+    SDL_RenderPresent(sdl->renderer);
+    return true;
+}
+
+/* Controller 1 on the keyboard */
+static const struct {
+  SDL_Keycode key;
+  uint8_t button;
+} video_sdl_keys[] = {
+  { SDLK_x, INPUT_A },
+  { SDLK_z, INPUT_B },
+  { SDLK_RSHIFT, INPUT_SELECT },
+  { SDLK_RETURN, INPUT_START },
+  { SDLK_UP, INPUT_UP },
+  { SDLK_DOWN, INPUT_DOWN },
+  { SDLK_LEFT, INPUT_LEFT },
+  { SDLK_RIGHT, INPUT_RIGHT },
+};
+
+static void
+video_sdl_key(video_t *video, SDL_Keycode key, bool down)
+{
+    size_t n = sizeof(video_sdl_keys) / sizeof(video_sdl_keys[0]);
+
+    if (key == SDLK_BACKSPACE)
+      __atomic_store_n(&video->rewinding, down, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < n; i++) {
+      if (video_sdl_keys[i].key != key)
+        continue;
+      if (down)
+        __atomic_or_fetch(&video->buttons, video_sdl_keys[i].button,
+                          __ATOMIC_RELAXED);
+      else
+        __atomic_and_fetch(&video->buttons, ~video_sdl_keys[i].button,
+                           __ATOMIC_RELAXED);
+    }
+}
+
+static int
+video_sdl_emulator(void *opaque)
+{
+    video_t *video = (video_t*)opaque;
+    video_sdl_t *sdl = (video_sdl_t*)video->priv;
+
+    sdl->fn(sdl->opaque);
+    __atomic_store_n(&sdl->done, true, __ATOMIC_RELEASE);
+    SDL_SemPost(sdl->frame);
+    return 0;
+}
+
+/* Shows frames and handles events until the emulator returns */
+static void
+video_sdl_run(video_t *video,
+              void   (*fn)(void *opaque),
+              void    *opaque)
+{
+    video_sdl_t *sdl = (video_sdl_t*)video->priv;
+
+    sdl->fn = fn;
+    sdl->opaque = opaque;
+    sdl->done = false;
+    sdl->thread = SDL_CreateThread(video_sdl_emulator, "emulator", video);
+    if (sdl->thread == NULL) {
+      printf("Unable to create SDL thread: %s\n", SDL_GetError());
+      /* The emulator still runs, without a window to show it in */
+      fn(opaque);
+      return;
+    }
+
+    while (!__atomic_load_n(&sdl->done, __ATOMIC_ACQUIRE)) {
+      const video_frame_t *frame;
+      void *pixels;
+      int pitch;
+      SDL_Event e;
+
+      SDL_SemWaitTimeout(sdl->frame, VIDEO_SDL_IDLE_MS);
+      while (SDL_PollEvent(&e)) {
+        //If user closes the window
+        if (e.type == SDL_QUIT) {
+          __atomic_store_n(&sdl->quit, true, __ATOMIC_RELEASE);
+        } else if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+          video_sdl_key(video, e.key.keysym.sym, e.type == SDL_KEYDOWN);
+        }
+      }
+
+      /* Frames published since the last vsync are skipped, only the
+       * latest one is shown */
+      frame = video_latest(video);
+      if (frame == NULL)
+        continue;
+      if (SDL_LockTexture(sdl->texture, NULL, &pixels, &pitch) != 0)
+        continue;
+      filter_run(video->filter, frame, (uint32_t*)pixels,
+                 pitch / sizeof(uint32_t));
+      SDL_UnlockTexture(sdl->texture);
+      SDL_RenderClear(sdl->renderer);
+      SDL_RenderCopy(sdl->renderer, sdl->texture, NULL, NULL);
+      SDL_RenderPresent(sdl->renderer);
+    }
+
+    SDL_WaitThread(sdl->thread, NULL);
+    sdl->thread = NULL;
+}
+
+static void
+video_sdl_destroy(video_t *video)
+{
+    video_sdl_t *sdl = (video_sdl_t*)video->priv;
+
+    if (sdl->texture != NULL)
+      SDL_DestroyTexture(sdl->texture);
+    if (sdl->renderer != NULL)
+      SDL_DestroyRenderer(sdl->renderer);
+    if (sdl->win != NULL)
+      SDL_DestroyWindow(sdl->win);
+    if (sdl->frame != NULL)
+      SDL_DestroySemaphore(sdl->frame);
+    SDL_QuitSubSystem(SDL_INIT_VIDEO);
+    free(sdl);
+}
+
+static bool
+video_sdl_init(video_t *video)
+{
+    video_sdl_t *sdl;
+
+    if (SDL_InitSubSystem(SDL_INIT_VIDEO) != 0) {
+      printf("Unable to initialize SDL: %s\n", SDL_GetError());
+      return false;
+    }
+
+    sdl = (video_sdl_t*)calloc(sizeof(video_sdl_t), 1);
+    video->priv = sdl;
+    sdl->frame = SDL_CreateSemaphore(0);
+    if (sdl->frame == NULL) {
+      printf("Unable to create SDL semaphore: %s\n", SDL_GetError());
+      video_sdl_destroy(video);
+      return false;
+    }
+    if (!video_sdl_setup(sdl, filter_width(video->filter),
+                         filter_height(video->filter))) {
+      video_sdl_destroy(video);
+      return false;
+    }
+    return true;
+}
+
+static void
+video_sdl_present(video_t *video)
+{
+    video_sdl_t *sdl = (video_sdl_t*)video->priv;
+
+    /* Only wakes the main thread up when it is idle */
+    if (SDL_SemValue(sdl->frame) == 0)
+      SDL_SemPost(sdl->frame);
+}
+
+static bool
+video_sdl_poll(video_t *video)
+{
+    video_sdl_t *sdl = (video_sdl_t*)video->priv;
+
+    return !__atomic_load_n(&sdl->quit, __ATOMIC_ACQUIRE);
+}
+
+const video_backend_t video_sdl_backend = {
+  "sdl",
+  video_sdl_init,
+  video_sdl_run,
+  video_sdl_present,
+  video_sdl_poll,
+  video_sdl_destroy,
+};